@@ -0,0 +1,39 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// search query over and over for the given seconds while another thread keeps inserting and
+// removing names, then print the search latency percentiles and the rate of changes applied.
+// searches run on snapshots if use_snapshot, otherwise on fsbuf itself under its lock.
+void bench_search_under_changes(fs_buf* fsbuf, const char* query, int seconds, int use_snapshot);
+
+// save filename packed (see save_packed_fs_buf) to filename.packed, then load and walk both files
+// rounds times and print their bytes per entry and the entries loaded and walked per millisecond.
+void bench_packed_file(const char* filename, int rounds);
+
+// match query against all the names of fsbuf rounds times with every find_str kernel the cpu
+// supports, and print their speed next to the one of only measuring the names, and the time of
+// a whole search with each of them.
+void bench_find_str(fs_buf* fsbuf, const char* query, int rounds);
+
+// a tree of count names made of common chinese words, polyphones among them, for bench_pinyin.
+// it has the same names every time.
+fs_buf* new_pinyin_corpus(uint32_t count);
+
+// build the pinyin table of fsbuf, then search the initials and the readings of common words
+// (or query) rounds times with and without the table, and print the time of each search.
+void bench_pinyin(fs_buf* fsbuf, const char* query, int rounds);
+
+// search the regex query (or a few common ones) in fsbuf rounds times with and without the literal
+// they contain (see get_regex_literal) checked first, and print the time of each search.
+void bench_regex(fs_buf* fsbuf, const char* query, int rounds);
+
+// search the glob query (or a few common ones) in fsbuf rounds times, ignoring case, and print the
+// time of each search next to the one of the same regex and of the literal the glob contains.
+void bench_glob(fs_buf* fsbuf, const char* query, int rounds);
+
+// search the terms of query (or of a few common ones) in fsbuf with RULE_SEARCH_KEYWORDS rounds times,
+// ignoring case, and print the time of each search next to the one of searching its terms one by one.
+void bench_keywords(fs_buf* fsbuf, const char* query, int rounds);
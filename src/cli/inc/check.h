@@ -0,0 +1,12 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// match count random globs, regexes and keyword queries (made from seed) with random names, and compare
+// compile_glob with fnmatch and compile_keywords with strstr, and check that every name a POSIX regex
+// matches has the literal get_regex_literal finds in it. then search a tree with their rules and compare
+// it with matching all its names, or with the regexes in a group, which have no literal. the queries at
+// the bounds of keyword_query are checked too. return 1 if any of them differ.
+int check_matchers(unsigned int seed, uint32_t count);
@@ -0,0 +1,524 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fs_buf.h"
+#include "walkdir.h"
+#include "strmatch.h"
+#include "regex_literal.h"
+#include "glob_match.h"
+#include "bench.h"
+
+#define MAX_FOLDERS		1024
+#define BATCH_SIZE		64
+#define MAX_RESULTS		100
+
+typedef struct __change_stream__ {
+	fs_buf *fsbuf;
+	char **folders;
+	uint32_t folder_count;
+	volatile int stop;
+	uint64_t applied;
+} change_stream;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// the folders the changes go to, spread over the whole tree
+static uint32_t pick_folders(fs_buf *fsbuf, char **folders)
+{
+	uint32_t dir_count = 0, count = 0;
+	for (uint32_t off = first_name(fsbuf); off < get_tail(fsbuf); off = next_name(fsbuf, off))
+		if (*get_name(fsbuf, off) && !is_file(fsbuf, off))
+			dir_count++;
+
+	uint32_t step = dir_count / MAX_FOLDERS + 1, n = 0;
+	char path[PATH_MAX];
+	for (uint32_t off = first_name(fsbuf); off < get_tail(fsbuf) && count < MAX_FOLDERS; off = next_name(fsbuf, off)) {
+		if (*get_name(fsbuf, off) == 0 || is_file(fsbuf, off) || n++ % step)
+			continue;
+		folders[count++] = strdup(get_path_by_name_off(fsbuf, off, path, sizeof(path)));
+	}
+	return count;
+}
+
+// insert a batch of names into random folders, then remove them again, until stopped
+static void *apply_changes(void *param)
+{
+	change_stream *stream = (change_stream *)param;
+	char paths[BATCH_SIZE][PATH_MAX];
+	fs_op ops[BATCH_SIZE];
+	int results[BATCH_SIZE];
+	uint32_t round = 0;
+
+	while (!stream->stop) {
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			const char *folder = stream->folders[rand() % stream->folder_count];
+			snprintf(paths[i], PATH_MAX, "%s/.bench_%u_%d", folder, round, i);
+			ops[i] = (fs_op){ FS_OP_INSERT, 0, paths[i], 0 };
+		}
+		apply_fs_changes(stream->fsbuf, ops, BATCH_SIZE, results);
+
+		for (int i = 0; i < BATCH_SIZE; i++)
+			ops[i].op = FS_OP_REMOVE;
+		apply_fs_changes(stream->fsbuf, ops, BATCH_SIZE, results);
+
+		stream->applied += BATCH_SIZE * 2;
+		round++;
+	}
+	return 0;
+}
+
+void bench_search_under_changes(fs_buf *fsbuf, const char *query, int seconds, int use_snapshot)
+{
+	char *folders[MAX_FOLDERS];
+	change_stream stream = { fsbuf, folders, pick_folders(fsbuf, folders), 0, 0 };
+	if (stream.folder_count == 0) {
+		printf("no folder to change\n");
+		return;
+	}
+
+	pthread_t writer;
+	if (pthread_create(&writer, 0, apply_changes, &stream) != 0) {
+		printf("failed to start the writer\n");
+		return;
+	}
+
+	uint32_t capacity = 1024, count = 0;
+	uint64_t *latencies = malloc(capacity * sizeof(uint64_t));
+	uint64_t start = now_us(), end = start + seconds * 1000000ull;
+	uint32_t results[MAX_RESULTS];
+	while (latencies && now_us() < end) {
+		uint64_t t = now_us();
+		fs_buf *target = use_snapshot ? snapshot_fs_buf(fsbuf) : fsbuf;
+		uint32_t start_off = first_name(target), result_count = MAX_RESULTS;
+		parallelsearch_files(target, &start_off, get_tail(target), results, &result_count, 0, query);
+		if (target != fsbuf)
+			free_fs_buf(target);
+
+		if (count == capacity) {
+			capacity *= 2;
+			uint64_t *p = realloc(latencies, capacity * sizeof(uint64_t));
+			if (p == 0)
+				break;
+			latencies = p;
+		}
+		latencies[count++] = now_us() - t;
+	}
+
+	stream.stop = 1;
+	pthread_join(writer, 0);
+	uint64_t dur = now_us() - start;
+
+	if (count) {
+		qsort(latencies, count, sizeof(uint64_t), compare_u64);
+		printf("%s: %'u searches, p50: %'lu us, p99: %'lu us, max: %'lu us, changes: %'lu/s\n",
+			use_snapshot ? "snapshot" : "locked", count, latencies[count / 2], latencies[count * 99 / 100],
+			latencies[count - 1], stream.applied * 1000000 / dur);
+	}
+
+	free(latencies);
+	for (uint32_t i = 0; i < stream.folder_count; i++)
+		free(folders[i]);
+}
+
+// walk all the records like a search does, counting the files and folders
+static void walk_fs_buf(fs_buf *fsbuf, uint32_t *file_count, uint32_t *dir_count)
+{
+	*file_count = *dir_count = 0;
+	for (uint32_t off = first_name(fsbuf); off < get_tail(fsbuf); off = next_name(fsbuf, off)) {
+		if (*get_name(fsbuf, off) == 0)
+			continue;
+		if (is_file(fsbuf, off))
+			(*file_count)++;
+		else
+			(*dir_count)++;
+	}
+}
+
+static void bench_load(const char *name, const char *filename, int rounds)
+{
+	struct stat st;
+	if (stat(filename, &st) != 0) {
+		printf("%s: no file %s\n", name, filename);
+		return;
+	}
+
+	uint64_t load_us = 0, walk_us = 0;
+	uint32_t file_count = 0, dir_count = 0;
+	for (int i = 0; i < rounds; i++) {
+		fs_buf *fsbuf = 0;
+		uint64_t t = now_us();
+		int r = load_fs_buf(&fsbuf, filename);
+		load_us += now_us() - t;
+		if (r != 0) {
+			printf("%s: load %s failed: %d\n", name, filename, r);
+			return;
+		}
+
+		t = now_us();
+		walk_fs_buf(fsbuf, &file_count, &dir_count);
+		walk_us += now_us() - t;
+		free_fs_buf(fsbuf);
+	}
+
+	uint64_t entries = (uint64_t)file_count + dir_count;
+	load_us = load_us / rounds + 1;
+	walk_us = walk_us / rounds + 1;
+	printf("%s: %'ld bytes, %.2f bytes per entry (%'u files, %'u dirs), load: %'lu us (%'lu entries/ms), walk: %'lu us (%'lu entries/ms)\n",
+		name, (long)st.st_size, entries ? (double)st.st_size / entries : 0.0, file_count, dir_count,
+		load_us, entries * 1000 / load_us, walk_us, entries * 1000 / walk_us);
+}
+
+void bench_packed_file(const char *filename, int rounds)
+{
+	fs_buf *fsbuf = 0;
+	int r = load_fs_buf(&fsbuf, filename);
+	if (r != 0) {
+		printf("load linear file tree file %s failed: %d\n", filename, r);
+		return;
+	}
+
+	char packed_filename[PATH_MAX];
+	snprintf(packed_filename, sizeof(packed_filename), "%s.packed", filename);
+	r = save_packed_fs_buf(fsbuf, packed_filename);
+	free_fs_buf(fsbuf);
+	if (r != 0) {
+		printf("save packed file %s failed: %d\n", packed_filename, r);
+		return;
+	}
+
+	bench_load("fixed tags", filename, rounds);
+	bench_load("packed tags", packed_filename, rounds);
+}
+
+// time a walk over all the names, matching query with the current find_str kernel if query, or
+// only measuring the names if not, which is as fast as matching can be. return the names matched
+static uint32_t walk_names(fs_buf *fsbuf, const char *query, int icase, uint64_t *bytes, uint64_t *us)
+{
+	size_t query_len = query ? strlen(query) : 0;
+	uint32_t matches = 0;
+	uint64_t t = now_us();
+	*bytes = 0;
+	for (uint32_t off = first_name(fsbuf); off < get_tail(fsbuf); off = next_name(fsbuf, off)) {
+		const char *name = get_name(fsbuf, off);
+		if (query)
+			matches += find_str(name, query, query_len, icase) != 0;
+		*bytes += strlen(name) + 1;
+	}
+	*us = now_us() - t + 1;
+	return matches;
+}
+
+void bench_find_str(fs_buf *fsbuf, const char *query, int rounds)
+{
+	static const char *kernel_names[] = { "avx2", "sse2", "neon", "lsx", "scalar" };
+	const char *default_kernel = get_find_str_kernel();
+	uint32_t name_count = 0;
+	for (uint32_t off = first_name(fsbuf); off < get_tail(fsbuf); off = next_name(fsbuf, off))
+		name_count++;
+
+	uint64_t bytes = 0, us, floor_us = 0;
+	for (int i = 0; i < rounds; i++) {
+		walk_names(fsbuf, 0, 0, &bytes, &us);
+		floor_us += us;
+	}
+	floor_us /= rounds;
+	printf("strlen: %'u names, %'lu bytes, %'lu us (%'lu MB/s, %.1f ns/name)\n", name_count, bytes, floor_us,
+		bytes / floor_us, floor_us * 1000.0 / (name_count + 1));
+
+	for (uint32_t k = 0; k < sizeof(kernel_names) / sizeof(kernel_names[0]); k++) {
+		if (set_find_str_kernel(kernel_names[k]) != 0)
+			continue;
+
+		for (int icase = 0; icase < 2; icase++) {
+			uint64_t walk_us = 0;
+			uint32_t matches = 0;
+			for (int i = 0; i < rounds; i++) {
+				matches = walk_names(fsbuf, query, icase, &bytes, &us);
+				walk_us += us;
+			}
+			walk_us /= rounds;
+			printf("%s%s: %'u matches, walk: %'lu us (%'lu MB/s, %.1f ns/name)\n", kernel_names[k],
+				icase ? " icase" : "", matches, walk_us, bytes / walk_us, walk_us * 1000.0 / (name_count + 1));
+		}
+
+		// and the whole search, on all the threads
+		uint64_t search_us = 0;
+		uint32_t results[MAX_RESULTS];
+		for (int i = 0; i < rounds; i++) {
+			uint32_t start_off = first_name(fsbuf), result_count = MAX_RESULTS;
+			uint64_t t = now_us();
+			parallelsearch_files(fsbuf, &start_off, get_tail(fsbuf), results, &result_count, 0, query);
+			search_us += now_us() - t;
+		}
+		printf("%s search: %'lu us\n", kernel_names[k], search_us / rounds);
+	}
+
+	set_find_str_kernel(default_kernel);
+}
+
+// the words the names of new_pinyin_corpus are made of, with polyphones like 行, 重, 乐 and 长
+static const char *corpus_words[] = {
+	"我的", "文件", "文档", "银行", "重庆", "音乐", "长城", "报告", "照片", "行长", "会计", "工作",
+	"总结", "项目", "计划", "数据", "备份", "下载", "视频", "朋友", "重要", "快乐", "成长", "发票",
+};
+static const char *corpus_exts[] = { ".txt", ".doc", ".pdf", ".jpg", ".mp3", "" };
+
+#define CORPUS_WORDS	(sizeof(corpus_words) / sizeof(corpus_words[0]))
+#define CORPUS_EXTS		(sizeof(corpus_exts) / sizeof(corpus_exts[0]))
+#define CORPUS_FOLDER_SIZE	256
+
+// a name of 2 or 3 words, a number and an extension, the same ones for the same seed
+static void corpus_name(unsigned int *seed, char *name, size_t size, int is_dir)
+{
+	int len = 0, words = 2 + rand_r(seed) % 2;
+	for (int i = 0; i < words; i++)
+		len += snprintf(name + len, size - len, "%s", corpus_words[rand_r(seed) % CORPUS_WORDS]);
+	snprintf(name + len, size - len, "%d%s", rand_r(seed) % 1000, is_dir ? "" : corpus_exts[rand_r(seed) % CORPUS_EXTS]);
+}
+
+fs_buf *new_pinyin_corpus(uint32_t count)
+{
+	// the tree of a folder with an empty one, the names are inserted into that.
+	// an empty tree has no block for them yet.
+	char dir[] = "/tmp/pinyin_corpus_XXXXXX", root[PATH_MAX], top[PATH_MAX];
+	if (mkdtemp(dir) == 0)
+		return 0;
+	snprintf(root, sizeof(root), "%s/", dir);
+	snprintf(top, sizeof(top), "%s/corpus", dir);
+	fs_buf *fsbuf = mkdir(top, 0755) == 0 ? new_fs_buf(1 << 22, root) : 0;
+	int r = fsbuf ? build_fstree(fsbuf, 0, 0, 0) : 1;
+	rmdir(top);
+	rmdir(dir);
+	if (r != 0) {
+		if (fsbuf)
+			free_fs_buf(fsbuf);
+		return 0;
+	}
+
+	unsigned int seed = 2024;
+	char folder[PATH_MAX], path[PATH_MAX], name[NAME_MAX];
+	fs_change change;
+	for (uint32_t i = 0; i < count; i++) {
+		if (i % CORPUS_FOLDER_SIZE == 0) {
+			corpus_name(&seed, name, sizeof(name), 1);
+			// a path cut short would be put in the wrong folder
+			if (snprintf(folder, sizeof(folder), "%s/%s_%u", top, name, i / CORPUS_FOLDER_SIZE) >= (int)sizeof(folder) ||
+				insert_path(fsbuf, folder, 1, &change) != 0)
+				break;
+			continue;
+		}
+		corpus_name(&seed, name, sizeof(name), 0);
+		if (snprintf(path, sizeof(path), "%s/%s_%u", folder, name, i) >= (int)sizeof(path) ||
+			insert_path(fsbuf, path, 0, &change) != 0)
+			break;
+	}
+	return fsbuf;
+}
+
+// the average time of a whole search of query in fsbuf with rule over rounds
+static uint64_t time_search(fs_buf *fsbuf, const char *query, search_rule *rule, int rounds, uint32_t *matches)
+{
+	uint32_t results[MAX_RESULTS];
+	uint64_t us = 0;
+	for (int i = 0; i < rounds; i++) {
+		uint32_t start_off = first_name(fsbuf);
+		*matches = MAX_RESULTS;
+		uint64_t t = now_us();
+		parallelsearch_files(fsbuf, &start_off, get_tail(fsbuf), results, matches, rule, query);
+		us += now_us() - t;
+	}
+	return us / rounds;
+}
+
+static uint64_t time_pinyin_search(fs_buf *fsbuf, const char *query, int icase, int rounds, uint32_t *matches)
+{
+	search_rule pinyin = { RULE_SEARCH_PINYIN, "1", 0 }, ignore_case = { RULE_SEARCH_ICASE, "1", &pinyin };
+	return time_search(fsbuf, query, icase ? &ignore_case : &pinyin, rounds, matches);
+}
+
+void bench_pinyin(fs_buf *fsbuf, const char *query, int rounds)
+{
+	static const char *default_queries[] = {
+		"wdwj", "wodewenjian", "yinhang", "yinxing", "yh", "chongqing", "cq", "yinyue", "yl", "hangzhang", "bgao",
+	};
+	const char **queries = query ? &query : default_queries;
+	uint32_t query_count = query ? 1 : sizeof(default_queries) / sizeof(default_queries[0]);
+
+	// a snapshot taken before the table is built has none, its searches convert the names
+	fs_buf *converting = snapshot_fs_buf(fsbuf);
+	uint64_t t = now_us();
+	if (converting == 0 || build_pinyin_table(fsbuf) != 0) {
+		printf("out of memory\n");
+		if (converting)
+			free_fs_buf(converting);
+		return;
+	}
+	printf("build pinyin table: %'lu us\n", now_us() - t);
+	fs_buf *indexed = snapshot_fs_buf(fsbuf);
+	if (indexed == 0) {
+		printf("out of memory\n");
+		free_fs_buf(converting);
+		return;
+	}
+
+	for (uint32_t i = 0; i < query_count; i++) {
+		for (int icase = 0; icase < 2; icase++) {
+			uint32_t converted_matches, matches;
+			uint64_t convert_us = time_pinyin_search(converting, queries[i], icase, rounds, &converted_matches);
+			uint64_t table_us = time_pinyin_search(indexed, queries[i], icase, rounds, &matches);
+			printf("%s%s: %'u matches, convert: %'lu us, table: %'lu us (%.1fx)%s\n", queries[i], icase ? " icase" : "",
+				matches, convert_us, table_us, (double)convert_us / (table_us + 1),
+				matches == converted_matches ? "" : ", the matches differ");
+		}
+	}
+
+	free_fs_buf(indexed);
+	free_fs_buf(converting);
+}
+
+void bench_regex(fs_buf *fsbuf, const char *query, int rounds)
+{
+	static const char *default_queries[] = {
+		"report.*2024\\.pdf", "^IMG_\\d+", "\\.so\\.[0-9]+$", "^lib.*-dev", "[0-9]{4}-[0-9]{2}", "test_.*\\.py$",
+		"\\.(jpe?g|png)$",
+	};
+	const char **queries = query ? &query : default_queries;
+	uint32_t query_count = query ? 1 : sizeof(default_queries) / sizeof(default_queries[0]);
+
+	search_rule regex = { RULE_SEARCH_REGX, "1", 0 };
+	for (uint32_t i = 0; i < query_count; i++) {
+		char literal[NAME_MAX + 1], plain[PATH_MAX];
+		get_regex_literal(queries[i], literal, sizeof(literal));
+		// the same pattern in a group, which get_regex_literal passes over
+		snprintf(plain, sizeof(plain), "(?:%s)", queries[i]);
+
+		uint32_t matches, plain_matches;
+		uint64_t filtered_us = time_search(fsbuf, queries[i], &regex, rounds, &matches);
+		uint64_t plain_us = time_search(fsbuf, plain, &regex, rounds, &plain_matches);
+		printf("%s: literal \"%s\", %'u matches, prefiltered: %'lu us, regex only: %'lu us (%.1fx)%s\n", queries[i],
+			literal, matches, filtered_us, plain_us, (double)plain_us / (filtered_us + 1),
+			matches == plain_matches ? "" : ", the matches differ");
+	}
+}
+
+// the regex matching the same whole names as the glob, but for the chars beyond ASCII it takes byte by byte
+static void glob_to_regex(const char *glob, char *regex, size_t size)
+{
+	char *end = regex + size - 8;
+	*regex++ = '^';
+	for (const char *p = glob; *p && regex < end; p++) {
+		int negate = p[0] == '[' && (p[1] == '!' || p[1] == '^');
+		// a ']' right at the start of a set is one of its chars
+		const char *close = *p == '[' && p[1] && p[1 + negate] ? strchr(p + 2 + negate, ']') : 0;
+		if (*p == '*') {
+			*regex++ = '.';
+			*regex++ = '*';
+		} else if (*p == '?') {
+			*regex++ = '.';
+		} else if (close) {
+			// the set is copied as it is, with its '!' made a '^'
+			*regex++ = '[';
+			if (negate) {
+				*regex++ = '^';
+				p++;
+			}
+			for (p++; p < close && regex < end; p++)
+				*regex++ = *p;
+			*regex++ = ']';
+		} else {
+			if (*p == '\\' && p[1])
+				p++;
+			if (strchr("\\^$.|?*+()[]{}", *p))
+				*regex++ = '\\';
+			*regex++ = *p;
+		}
+	}
+	*regex++ = '$';
+	*regex = 0;
+}
+
+void bench_glob(fs_buf *fsbuf, const char *query, int rounds)
+{
+	static const char *default_queries[] = {
+		"*.mp4", "IMG_????.jpg", "[Rr]eport*", "*.so.[0-9]*", "lib*-dev*", "*.[ch]", "test_*.py", "*[0-9][0-9][0-9][0-9]-[0-9][0-9]*",
+	};
+	const char **queries = query ? &query : default_queries;
+	uint32_t query_count = query ? 1 : sizeof(default_queries) / sizeof(default_queries[0]);
+
+	// the regexes always ignore case, and so do the globs here
+	search_rule glob_case = { RULE_SEARCH_GLOB, "1", 0 }, glob = { RULE_SEARCH_ICASE, "1", &glob_case };
+	search_rule regex = { RULE_SEARCH_REGX, "1", 0 };
+	for (uint32_t i = 0; i < query_count; i++) {
+		char pattern[PATH_MAX];
+		glob_to_regex(queries[i], pattern, sizeof(pattern));
+		glob_pattern compiled;
+		compile_glob(&compiled, queries[i], 1);
+
+		uint32_t matches, regex_matches, literal_matches;
+		uint64_t glob_us = time_search(fsbuf, queries[i], &glob, rounds, &matches);
+		uint64_t regex_us = time_search(fsbuf, pattern, &regex, rounds, &regex_matches);
+		// searching the literal of the glob alone is about as fast as it gets
+		search_rule ignore_case = { RULE_SEARCH_ICASE, "1", 0 };
+		uint64_t literal_us = compiled.literal_len ?
+			time_search(fsbuf, compiled.literal, &ignore_case, rounds, &literal_matches) : 0;
+		printf("%s: %'u matches, glob: %'lu us, regex %s: %'lu us (%.1fx)", queries[i], matches, glob_us, pattern,
+			regex_us, (double)regex_us / (glob_us + 1));
+		if (compiled.literal_len)
+			printf(", literal \"%s\": %'lu us", compiled.literal, literal_us);
+		printf("%s%s\n", compiled.fallback ? ", fnmatch" : "",
+			matches == regex_matches ? "" : ", the matches differ");
+	}
+}
+
+void bench_keywords(fs_buf *fsbuf, const char *query, int rounds)
+{
+	static const char *default_queries[] = {
+		"lib dev", "test .py -cache", "report|invoice 2023|2024", "png -icon -thumb", ".so 1|2|3", "a e i o u",
+	};
+	const char **queries = query ? &query : default_queries;
+	uint32_t query_count = query ? 1 : sizeof(default_queries) / sizeof(default_queries[0]);
+
+	search_rule ignore_case = { RULE_SEARCH_ICASE, "1", 0 };
+	search_rule keywords_case = { RULE_SEARCH_KEYWORDS, "1", 0 }, keywords = { RULE_SEARCH_ICASE, "1", &keywords_case };
+	for (uint32_t i = 0; i < query_count; i++) {
+		uint32_t matches;
+		uint64_t keywords_us = time_search(fsbuf, queries[i], &keywords, rounds, &matches);
+
+		// what a client does without the rule: one search per term, then it combines their results
+		char terms[NAME_MAX + 1];
+		snprintf(terms, sizeof(terms), "%s", queries[i]);
+		uint64_t terms_us = 0;
+		uint32_t term_count = 0, term_matches;
+		for (char *term = strtok(terms, " |"); term; term = strtok(0, " |")) {
+			if (term[0] == '-' && term[1])
+				term++;
+			terms_us += time_search(fsbuf, term, &ignore_case, rounds, &term_matches);
+			term_count++;
+		}
+		printf("%s: %'u matches, keywords: %'lu us, %u searches of one term: %'lu us (%.1fx)\n", queries[i], matches,
+			keywords_us, term_count, terms_us, (double)terms_us / (keywords_us + 1));
+	}
+}
@@ -0,0 +1,447 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <regex.h>
+
+#include "fs_buf.h"
+#include "regex_literal.h"
+#include "glob_match.h"
+#include "keyword_match.h"
+#include "bench.h"
+#include "check.h"
+
+#define MAX_FAILURES	10
+#define CHECK_NAMES		4000
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+// the chars of the names and of the globs matched with them, those beyond ASCII among them
+static const char *name_chars[] = {
+	"a", "A", "b", "é", "z", ".", "*", "?", "[", "]", "!", "-", "\\", "^", "中", "x",
+};
+
+// the pieces of the regexes, which mean the same with PCRE and POSIX extended regexes
+static const char *regex_atoms[] = {
+	"a", "b", "A", "x", "z", "-", "\\.", ".", "[ab]", "[^a]", "[a-z]", "^", "$", "(", ")", "|",
+};
+static const char *regex_quantifiers[] = { "*", "+", "?", "{2}", "{1,2}" };
+
+// the chars of the terms of the keyword queries, the separators among them are quoted
+static const char *keyword_chars[] = { "a", "b", "A", "é", " ", "|", "-", ".", "c", "B" };
+
+static void random_text(unsigned int *seed, const char **chars, uint32_t char_count, int len, char *text)
+{
+	*text = 0;
+	for (int i = 0; i < len; i++)
+		strcat(text, chars[rand_r(seed) % char_count]);
+}
+
+// each char beyond ASCII becomes one control byte, so that fnmatch takes it as one char in any locale
+static void map_glob_chars(const char *s, char *d)
+{
+	while (*s) {
+		if (strncmp(s, "é", 2) == 0) {
+			*d++ = 1;
+			s += 2;
+		} else if (strncmp(s, "中", 3) == 0) {
+			*d++ = 2;
+			s += 3;
+		} else {
+			*d++ = *s++;
+		}
+	}
+	*d = 0;
+}
+
+// a name the glob matches more likely than a random one: its stars, '?' and sets become random chars
+static void name_for_glob(unsigned int *seed, const char *glob, char *name)
+{
+	*name = 0;
+	for (const char *p = glob; *p; p++) {
+		if (*p == '*') {
+			for (int i = rand_r(seed) % 3; i > 0; i--)
+				strcat(name, name_chars[rand_r(seed) % ARRAY_SIZE(name_chars)]);
+		} else if (*p == '?' || *p == '[') {
+			strcat(name, name_chars[rand_r(seed) % ARRAY_SIZE(name_chars)]);
+		} else {
+			if (*p == '\\' && p[1])
+				p++;
+			size_t len = strlen(name);
+			name[len] = *p;
+			name[len + 1] = 0;
+		}
+	}
+}
+
+static int check_globs(unsigned int seed, uint32_t count)
+{
+	uint32_t failed = 0, matches = 0, fallbacks = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		char glob[NAME_MAX], name[NAME_MAX];
+		random_text(&seed, name_chars, ARRAY_SIZE(name_chars), rand_r(&seed) % 10, glob);
+		int icase = rand_r(&seed) % 2;
+		glob_pattern compiled;
+		compile_glob(&compiled, glob, icase);
+		fallbacks += compiled.fallback != 0;
+
+		for (int j = 0; j < 4; j++) {
+			if (j == 0)
+				random_text(&seed, name_chars, ARRAY_SIZE(name_chars), rand_r(&seed) % 9, name);
+			else
+				name_for_glob(&seed, glob, name);
+
+			// the fallback is fnmatch itself, it takes the chars beyond ASCII as the locale has them
+			char mapped_glob[NAME_MAX], mapped_name[NAME_MAX];
+			map_glob_chars(glob, mapped_glob);
+			map_glob_chars(name, mapped_name);
+			int flags = icase ? FNM_CASEFOLD : 0;
+			int expected = compiled.fallback ? fnmatch(glob, name, flags) == 0 : fnmatch(mapped_glob, mapped_name, flags) == 0;
+			int matched = match_glob(&compiled, name) != 0;
+			matches += matched;
+			if (matched != expected && failed++ < MAX_FAILURES)
+				printf("glob \"%s\" name \"%s\" icase %d: fnmatch %d, match_glob %d\n", glob, name, icase, expected, matched);
+		}
+	}
+	printf("globs: %'u, matches: %'u, fnmatch fallbacks: %'u, failed: %'u\n", count, matches, fallbacks, failed);
+	return failed != 0;
+}
+
+// atoms, each followed by a quantifier at times. PCRE takes two quantifiers in a row for another one.
+static void random_regex(unsigned int *seed, char *regex)
+{
+	*regex = 0;
+	for (int i = rand_r(seed) % 8; i >= 0; i--) {
+		strcat(regex, regex_atoms[rand_r(seed) % ARRAY_SIZE(regex_atoms)]);
+		if (rand_r(seed) % 3 == 0)
+			strcat(regex, regex_quantifiers[rand_r(seed) % ARRAY_SIZE(regex_quantifiers)]);
+	}
+}
+
+// the literal of a regex has to be in every name it matches, here with a POSIX regex standing for PCRE
+static int check_regex_literals(unsigned int seed, uint32_t count)
+{
+	uint32_t failed = 0, compiled_count = 0, literals = 0, matches = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		char pattern[NAME_MAX], literal[NAME_MAX + 1], name[NAME_MAX];
+		random_regex(&seed, pattern);
+		int icase = rand_r(&seed) % 2;
+		regex_t compiled;
+		if (regcomp(&compiled, pattern, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0)) != 0)
+			continue;
+		compiled_count++;
+		size_t literal_len = get_regex_literal(pattern, literal, sizeof(literal));
+		literals += literal_len != 0;
+
+		for (int j = 0; j < 8; j++) {
+			// the literal spliced into a random name, as the names without it don't tell anything
+			random_text(&seed, name_chars, ARRAY_SIZE(name_chars), rand_r(&seed) % 6, name);
+			if (literal_len && j % 2)
+				strcat(name, literal);
+			strcat(name, name_chars[rand_r(&seed) % ARRAY_SIZE(name_chars)]);
+			if (regexec(&compiled, name, 0, 0, 0) != 0)
+				continue;
+			matches++;
+			int found = literal_len == 0 || (icase ? strcasestr(name, literal) : strstr(name, literal)) != 0;
+			if (!found && failed++ < MAX_FAILURES)
+				printf("regex \"%s\" icase %d matches \"%s\", which doesn't have its literal \"%s\"\n", pattern, icase,
+					name, literal);
+		}
+		regfree(&compiled);
+	}
+	printf("regexes: %'u, with literals: %'u, matches: %'u, failed: %'u\n", compiled_count, literals, matches, failed);
+	return failed != 0;
+}
+
+// a query of up to 3 groups of up to 3 terms, some of them excluded. the terms are in terms[group][term],
+// the text of the query in query.
+typedef struct __random_query__ {
+	char terms[3][3][16];
+	int term_counts[3];
+	int excluded[3];
+	int group_count;
+	char query[NAME_MAX];
+} random_query;
+
+static void random_keywords(unsigned int *seed, random_query *q)
+{
+	static const char *separators[] = { "|", " |", "| ", " | " };
+	q->group_count = rand_r(seed) % 4;
+	q->query[0] = 0;
+	for (int g = 0; g < q->group_count; g++) {
+		q->term_counts[g] = 1 + rand_r(seed) % 3;
+		q->excluded[g] = rand_r(seed) % 3 == 0;
+		if (g)
+			strcat(q->query, rand_r(seed) % 2 ? " " : "  ");
+		if (q->excluded[g])
+			strcat(q->query, "-");
+		for (int t = 0; t < q->term_counts[g]; t++) {
+			char *term = q->terms[g][t];
+			random_text(seed, keyword_chars, rand_r(seed) % 2 ? ARRAY_SIZE(keyword_chars) : 4, 1 + rand_r(seed) % 3, term);
+			if (t)
+				strcat(q->query, separators[rand_r(seed) % ARRAY_SIZE(separators)]);
+			// the terms with separators are quoted, and so are some others
+			int quoted = strpbrk(term, " |") != 0 || (t == 0 && term[0] == '-') || rand_r(seed) % 5 == 0;
+			if (quoted)
+				strcat(q->query, "\"");
+			strcat(q->query, term);
+			if (quoted)
+				strcat(q->query, "\"");
+		}
+	}
+}
+
+static int match_random_query(const random_query *q, const char *name, int icase)
+{
+	for (int g = 0; g < q->group_count; g++) {
+		int found = 0;
+		for (int t = 0; t < q->term_counts[g]; t++)
+			found |= (icase ? strcasestr(name, q->terms[g][t]) : strstr(name, q->terms[g][t])) != 0;
+		if (found == q->excluded[g])
+			return 0;
+	}
+	return 1;
+}
+
+// queries at the bounds of keyword_query: a term repeated past MAX_KEYWORDS is one group, and more
+// distinct groups than MAX_KEYWORDS are refused instead of overrunning groups
+static int check_keyword_bounds(void)
+{
+	char query[MAX_KEYWORDS * 8];
+	keyword_query keywords;
+	int failed = 0;
+
+	query[0] = 0;
+	for (int i = 0; i <= MAX_KEYWORDS; i++)
+		strcat(query, "a ");
+	failed |= compile_keywords(&keywords, query, 1) != 0 || keywords.group_count != 1 ||
+		!match_keywords(&keywords, "data") || match_keywords(&keywords, "txt");
+	free_keywords(&keywords);
+
+	failed |= compile_keywords(&keywords, "lib|so so|lib lib -so|lib", 0) != 0 || keywords.group_count != 2;
+	free_keywords(&keywords);
+
+	// the pairs of 12 terms, 66 groups of 12 distinct terms
+	char *p = query;
+	for (int i = 0; i < 12; i++)
+		for (int j = i + 1; j < 12; j++)
+			p += sprintf(p, "%c|%c ", 'a' + i, 'a' + j);
+	failed |= compile_keywords(&keywords, query, 0) != 2;
+	free_keywords(&keywords);
+
+	// the first 64 of them are just in bounds
+	query[MAX_KEYWORDS * 4] = 0;
+	failed |= compile_keywords(&keywords, query, 0) != 0 || keywords.group_count != MAX_KEYWORDS ||
+		!match_keywords(&keywords, "abcdefghijkl") || match_keywords(&keywords, "abcdefghil");
+	free_keywords(&keywords);
+
+	printf("keyword bounds: %s\n", failed ? "failed" : "ok");
+	return failed;
+}
+
+static int check_keywords(unsigned int seed, uint32_t count)
+{
+	uint32_t failed = 0, matches = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		random_query q;
+		random_keywords(&seed, &q);
+		int icase = rand_r(&seed) % 2;
+		keyword_query keywords;
+		if (compile_keywords(&keywords, q.query, icase) != 0) {
+			if (failed++ < MAX_FAILURES)
+				printf("keywords \"%s\" not compiled\n", q.query);
+			continue;
+		}
+
+		for (int j = 0; j < 6; j++) {
+			char name[NAME_MAX];
+			random_text(&seed, keyword_chars, ARRAY_SIZE(keyword_chars), 1 + rand_r(&seed) % 10, name);
+			// the terms of the groups spliced together, with some of their letters in the other case
+			if (j >= 3 && q.group_count) {
+				name[0] = 0;
+				for (int g = 0; g < q.group_count; g++) {
+					strcat(name, q.terms[g][rand_r(&seed) % q.term_counts[g]]);
+					if (rand_r(&seed) % 2)
+						strcat(name, keyword_chars[rand_r(&seed) % ARRAY_SIZE(keyword_chars)]);
+				}
+			}
+			if (j == 5)
+				for (char *c = name; *c; c++)
+					if (*c >= 'a' && *c <= 'z' && rand_r(&seed) % 2)
+						*c ^= 0x20;
+
+			int expected = match_random_query(&q, name, icase);
+			int matched = match_keywords(&keywords, name) != 0;
+			matches += matched;
+			if (matched != expected && failed++ < MAX_FAILURES)
+				printf("keywords \"%s\" name \"%s\" icase %d: strstr %d, match_keywords %d\n", q.query, name, icase,
+					expected, matched);
+		}
+		free_keywords(&keywords);
+	}
+	printf("keyword queries: %'u, matches: %'u, failed: %'u\n", count, matches, failed);
+	return failed != 0;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// all the records of fsbuf matching query with rule, in offset order
+static uint32_t search_all(fs_buf *fsbuf, search_rule *rule, const char *query, uint32_t *results, uint32_t capacity)
+{
+	uint32_t start_off = first_name(fsbuf), count = capacity;
+	parallelsearch_files(fsbuf, &start_off, get_tail(fsbuf), results, &count, rule, query);
+	qsort(results, count, sizeof(uint32_t), compare_u32);
+	return count;
+}
+
+typedef int (*match_fn)(const void *compiled, const char *name);
+
+static int match_compiled_glob(const void *compiled, const char *name)
+{
+	return match_glob((const glob_pattern *)compiled, name);
+}
+
+static int match_compiled_keywords(const void *compiled, const char *name)
+{
+	return match_keywords((const keyword_query *)compiled, name);
+}
+
+// the records of fsbuf whose names match, in offset order
+static uint32_t walk_matches(fs_buf *fsbuf, match_fn match, const void *compiled, uint32_t *results)
+{
+	uint32_t count = 0;
+	for (uint32_t off = first_name(fsbuf); off < get_tail(fsbuf); off = next_name(fsbuf, off)) {
+		const char *name = get_name(fsbuf, off);
+		if (*name && match(compiled, name))
+			results[count++] = off;
+	}
+	return count;
+}
+
+static int same_results(const char *kind, const char *query, const uint32_t *results, uint32_t count,
+	const uint32_t *expected, uint32_t expected_count, uint32_t *failed)
+{
+	if (count == expected_count && memcmp(results, expected, count * sizeof(uint32_t)) == 0)
+		return 1;
+	if ((*failed)++ < MAX_FAILURES)
+		printf("%s \"%s\": %'u results, %'u expected\n", kind, query, count, expected_count);
+	return 0;
+}
+
+// the names of the corpus and random ones of name_chars in a few folders of it
+static fs_buf *new_check_tree(unsigned int *seed)
+{
+	fs_buf *fsbuf = new_pinyin_corpus(CHECK_NAMES);
+	if (fsbuf == 0)
+		return 0;
+
+	char folder[PATH_MAX], path[PATH_MAX], name[NAME_MAX];
+	fs_change change;
+	for (uint32_t i = 0; i < CHECK_NAMES; i++) {
+		if (i % 500 == 0)
+			snprintf(folder, sizeof(folder), "%scorpus/check_%u", get_root_path(fsbuf), i / 500);
+		random_text(seed, name_chars, ARRAY_SIZE(name_chars), 1 + rand_r(seed) % 8, name);
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", folder, name) < (int)sizeof(path))
+			insert_path(fsbuf, path, rand_r(seed) % 8 == 0, &change);
+	}
+	return fsbuf;
+}
+
+// whole searches with the rules, which look for the literals of the queries first and cut the records
+// into chunks, find the same records as matching every name of the tree
+static int check_searches(unsigned int seed, uint32_t count)
+{
+	fs_buf *fsbuf = new_check_tree(&seed);
+	uint32_t record_count = 0;
+	for (uint32_t off = fsbuf ? first_name(fsbuf) : 0; fsbuf && off < get_tail(fsbuf); off = next_name(fsbuf, off))
+		record_count++;
+	uint32_t *results = malloc((record_count + 1) * sizeof(uint32_t));
+	uint32_t *expected = malloc((record_count + 1) * sizeof(uint32_t));
+	if (fsbuf == 0 || results == 0 || expected == 0) {
+		printf("out of memory\n");
+		free(results);
+		free(expected);
+		if (fsbuf)
+			free_fs_buf(fsbuf);
+		return 1;
+	}
+
+	uint32_t failed = 0, matches = 0, searches = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		int icase = rand_r(&seed) % 2;
+		search_rule ignore_case = { RULE_SEARCH_ICASE, "1", 0 };
+		search_rule glob = { RULE_SEARCH_GLOB, "1", icase ? &ignore_case : 0 };
+		search_rule keywords = { RULE_SEARCH_KEYWORDS, "1", icase ? &ignore_case : 0 };
+		search_rule regex = { RULE_SEARCH_REGX, "1", 0 };
+
+		char query[NAME_MAX];
+		random_text(&seed, name_chars, ARRAY_SIZE(name_chars), 1 + rand_r(&seed) % 6, query);
+		glob_pattern compiled_glob;
+		compile_glob(&compiled_glob, query, icase);
+		uint32_t n = search_all(fsbuf, &glob, query, results, record_count + 1);
+		matches += n;
+		searches++;
+		same_results("glob", query, results, n, expected,
+			walk_matches(fsbuf, match_compiled_glob, &compiled_glob, expected), &failed);
+
+		random_query q;
+		random_keywords(&seed, &q);
+		keyword_query compiled_keywords;
+		if (compile_keywords(&compiled_keywords, q.query, icase) == 0) {
+			n = search_all(fsbuf, &keywords, q.query, results, record_count + 1);
+			matches += n;
+			searches++;
+		searches++;
+			same_results("keywords", q.query, results, n, expected,
+				walk_matches(fsbuf, match_compiled_keywords, &compiled_keywords, expected), &failed);
+			free_keywords(&compiled_keywords);
+		}
+
+		// the pattern in a group has no literal (see get_regex_literal), so it runs on every name. a
+		// group could make a broken pattern whole, e.g. )a(
+		char pattern[NAME_MAX], plain[NAME_MAX + 8];
+		regex_t compiled;
+		random_regex(&seed, pattern);
+		if (regcomp(&compiled, pattern, REG_EXTENDED | REG_NOSUB) != 0)
+			continue;
+		regfree(&compiled);
+		snprintf(plain, sizeof(plain), "(?:%s)", pattern);
+		n = search_all(fsbuf, &regex, pattern, results, record_count + 1);
+		matches += n;
+		searches++;
+		same_results("regex", pattern, results, n, expected, search_all(fsbuf, &regex, plain, expected, record_count + 1),
+			&failed);
+	}
+	printf("searches: %'u, records: %'u, matches: %'u, failed: %'u\n", searches, record_count, matches, failed);
+
+	free(results);
+	free(expected);
+	free_fs_buf(fsbuf);
+	return failed != 0;
+}
+
+int check_matchers(unsigned int seed, uint32_t count)
+{
+	int failed = check_keyword_bounds();
+	failed |= check_globs(seed, count);
+	failed |= check_regex_literals(seed, count);
+	failed |= check_keywords(seed, count);
+	// a whole search takes about as long as matching a few thousand names
+	failed |= check_searches(seed, count / 1000 + 1);
+	return failed;
+}
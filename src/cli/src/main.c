@@ -20,8 +20,9 @@
 #include "monitor_vfs.h"
 #include "stats.h"
 #include "console_test.h"
+#include "bench.h"
+#include "check.h"
 
-#define FSBUF_SIZE		(1<<24)
 #define FSBUF_FILE		".lft"
 #define INDEX_COUNT		131071
 #define INDEX_FILE		".fsi"
@@ -43,9 +44,12 @@ static int report_progress(uint32_t file_count, uint32_t dir_count, const char*
 static int scan(int argc, char* argv[])
 {
 	char dir[NAME_MAX] = ".";
-	int opt, use_index = 0, merge_partition = 0;
-	while ((opt = getopt(argc, argv, "d:im")) != -1) {
+	int opt, use_index = 0, merge_partition = 0, intern_count = 0, front_code = 0, fold = 0;
+	while ((opt = getopt(argc, argv, "cd:imn:u")) != -1) {
 		switch(opt) {
+		case 'c':
+			front_code = 1;
+			break;
 		case 'd':
 			strcpy(dir, optarg);
 			break;
@@ -55,6 +59,12 @@ static int scan(int argc, char* argv[])
 		case 'm':
 			merge_partition = 1;
 			break;
+		case 'n':
+			intern_count = atoi(optarg);
+			break;
+		case 'u':
+			fold = 1;
+			break;
 		default:
 			printf("unknown options: %c\n", opt);
 			return 1;
@@ -68,7 +78,8 @@ static int scan(int argc, char* argv[])
 			path[strlen(path)] = '/';
 	}
 
-	fs_buf* fsbuf = new_fs_buf(FSBUF_SIZE, argc <= optind ? "/" : path);
+	const char* root = argc <= optind ? "/" : path;
+	fs_buf* fsbuf = new_fs_buf(get_fs_buf_capacity(root), root);
 
 	// walk dir to make indice
 	struct timeval s, e;
@@ -79,6 +90,32 @@ static int scan(int argc, char* argv[])
 	uint64_t dur = (e.tv_usec + e.tv_sec*1000000) - (s.tv_usec + s.tv_sec*1000000);
 	printf("scan dur: %'lu ms\n", dur/1000);
 
+	if (intern_count) {
+		uint32_t tail = get_tail(fsbuf);
+		gettimeofday(&s, 0);
+		int r = intern_fs_buf(fsbuf, intern_count);
+		gettimeofday(&e, 0);
+		dur = (e.tv_usec + e.tv_sec*1000000) - (s.tv_usec + s.tv_sec*1000000);
+		printf("intern fsbuf: %d, %'u -> %'u bytes, dur: %'lu ms\n", r, tail, get_tail(fsbuf), dur/1000);
+	}
+
+	if (front_code) {
+		uint32_t tail = get_tail(fsbuf);
+		gettimeofday(&s, 0);
+		int r = front_code_fs_buf(fsbuf);
+		gettimeofday(&e, 0);
+		dur = (e.tv_usec + e.tv_sec*1000000) - (s.tv_usec + s.tv_sec*1000000);
+		printf("front code fsbuf: %d, %'u -> %'u bytes, dur: %'lu ms\n", r, tail, get_tail(fsbuf), dur/1000);
+	}
+
+	if (fold) {
+		gettimeofday(&s, 0);
+		int r = fold_fs_buf(fsbuf);
+		gettimeofday(&e, 0);
+		dur = (e.tv_usec + e.tv_sec*1000000) - (s.tv_usec + s.tv_sec*1000000);
+		printf("fold fsbuf: %d, dur: %'lu ms\n", r, dur/1000);
+	}
+
 	gettimeofday(&s, 0);
 	char fullpath[PATH_MAX];
 	sprintf(fullpath, "%s/%s", dir, FSBUF_FILE);
@@ -199,6 +236,204 @@ static int get_parts(int argc, char*argv[])
 	return 0;
 }
 
+static int bench(int argc, char* argv[])
+{
+	char fullpath[PATH_MAX] = FSBUF_FILE;
+	char query[NAME_MAX] = "a";
+	int seconds = 10, opt;
+
+	while ((opt = getopt(argc, argv, "f:q:t:")) != -1) {
+		switch(opt) {
+		case 'f':
+			strcpy(fullpath, optarg);
+			break;
+		case 'q':
+			snprintf(query, sizeof(query), "%s", optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			printf("unknown options: %c\n", opt);
+			return 1;
+		}
+	}
+
+	fs_buf* fsbuf = 0;
+	int r = load_fs_buf(&fsbuf, fullpath);
+	if (r != 0) {
+		printf("load linear file tree file %s failed: %d\n", fullpath, r);
+		return 2;
+	}
+	build_kids_indexes(fsbuf);
+
+	bench_search_under_changes(fsbuf, query, seconds, 0);
+	bench_search_under_changes(fsbuf, query, seconds, 1);
+
+	free_fs_buf(fsbuf);
+	return 0;
+}
+
+static int pack(int argc, char* argv[])
+{
+	char fullpath[PATH_MAX] = FSBUF_FILE;
+	int rounds = 10, opt;
+
+	while ((opt = getopt(argc, argv, "f:r:")) != -1) {
+		switch(opt) {
+		case 'f':
+			strcpy(fullpath, optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			printf("unknown options: %c\n", opt);
+			return 1;
+		}
+	}
+
+	if (rounds <= 0)
+		rounds = 1;
+	bench_packed_file(fullpath, rounds);
+	return 0;
+}
+
+typedef void (*bench_fn)(fs_buf* fsbuf, const char* query, int rounds);
+
+// the options of the benches of a query: load $lftfile and run bench with $query, or with
+// default_query if it is not given, #rounds times
+static int bench_query(int argc, char* argv[], const char* default_query, bench_fn bench)
+{
+	char fullpath[PATH_MAX] = FSBUF_FILE;
+	char query[NAME_MAX] = "";
+	int rounds = 10, opt;
+
+	while ((opt = getopt(argc, argv, "f:q:r:")) != -1) {
+		switch(opt) {
+		case 'f':
+			strcpy(fullpath, optarg);
+			break;
+		case 'q':
+			snprintf(query, sizeof(query), "%s", optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			printf("unknown options: %c\n", opt);
+			return 1;
+		}
+	}
+
+	fs_buf* fsbuf = 0;
+	int r = load_fs_buf(&fsbuf, fullpath);
+	if (r != 0) {
+		printf("load linear file tree file %s failed: %d\n", fullpath, r);
+		return 2;
+	}
+
+	if (rounds <= 0)
+		rounds = 1;
+	bench(fsbuf, *query ? query : default_query, rounds);
+
+	free_fs_buf(fsbuf);
+	return 0;
+}
+
+static int findstr(int argc, char* argv[])
+{
+	return bench_query(argc, argv, "a", bench_find_str);
+}
+
+static int pinyin(int argc, char* argv[])
+{
+	char fullpath[PATH_MAX] = FSBUF_FILE;
+	char query[NAME_MAX] = "";
+	int rounds = 10, opt;
+	uint32_t generate = 0;
+
+	while ((opt = getopt(argc, argv, "f:g:q:r:")) != -1) {
+		switch(opt) {
+		case 'f':
+			strcpy(fullpath, optarg);
+			break;
+		case 'g':
+			generate = strtoul(optarg, 0, 10);
+			break;
+		case 'q':
+			snprintf(query, sizeof(query), "%s", optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			printf("unknown options: %c\n", opt);
+			return 1;
+		}
+	}
+
+	fs_buf* fsbuf = 0;
+	if (generate) {
+		fsbuf = new_pinyin_corpus(generate);
+		if (fsbuf == 0) {
+			printf("generate %u names failed\n", generate);
+			return 2;
+		}
+	} else {
+		int r = load_fs_buf(&fsbuf, fullpath);
+		if (r != 0) {
+			printf("load linear file tree file %s failed: %d\n", fullpath, r);
+			return 2;
+		}
+	}
+
+	if (rounds <= 0)
+		rounds = 1;
+	bench_pinyin(fsbuf, *query ? query : 0, rounds);
+
+	free_fs_buf(fsbuf);
+	return 0;
+}
+
+static int regex(int argc, char* argv[])
+{
+	return bench_query(argc, argv, 0, bench_regex);
+}
+
+static int glob(int argc, char* argv[])
+{
+	return bench_query(argc, argv, 0, bench_glob);
+}
+
+static int keywords(int argc, char* argv[])
+{
+	return bench_query(argc, argv, 0, bench_keywords);
+}
+
+static int check(int argc, char* argv[])
+{
+	unsigned int seed = 1;
+	uint32_t count = 100000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch(opt) {
+		case 'n':
+			count = strtoul(optarg, 0, 10);
+			break;
+		case 's':
+			seed = strtoul(optarg, 0, 10);
+			break;
+		default:
+			printf("unknown options: %c\n", opt);
+			return 1;
+		}
+	}
+
+	return check_matchers(seed, count);
+}
+
 static int help(int argc, char* argv[]);
 
 typedef int (*cmd_fn)(int argc, char* argv[]);
@@ -210,9 +445,17 @@ struct {
 	const char* desc;
 } commands[] = {
 	{"help", help, 0, "Print this help information"},
-	{"scan", scan, "[-d $dir] [-i] [-m] [$root]", "Scan directories $root (default to /), merge all partitions (if -m), make indice(if -i), save data to $dir and test search"},
+	{"scan", scan, "[-d $dir] [-i] [-m] [-n #count] [-c] [-u] [$root]", "Scan directories $root (default to /), merge all partitions (if -m), make indice(if -i), put the names occurring #count times into a dictionary (if -n), front code the names sharing prefixes with their siblings (if -c), keep the names case folded for case-insensitive searches (if -u), save data to $dir and test search"},
 	{"load", load, "[-d $dir] [-f $lftfile] [-l #load_policy]", "Load previously saved indice from $dir all into memory or load xx.lft index file if -l 0 or none into memory if -l 1 and test search"},
 	{"partitions", get_parts, 0, "Get partitions"},
+	{"bench", bench, "[-f $lftfile] [-q $query] [-t #seconds]", "Search $query in $lftfile for #seconds while names are inserted and removed, with and without snapshots"},
+	{"pack", pack, "[-f $lftfile] [-r #rounds]", "Save $lftfile with packed tags to $lftfile.packed, and compare the bytes per entry and the load and walk speed of both #rounds times"},
+	{"findstr", findstr, "[-f $lftfile] [-q $query] [-r #rounds]", "Match $query against all the names in $lftfile #rounds times with each substring kernel the cpu supports, and compare their speed"},
+	{"pinyin", pinyin, "[-f $lftfile] [-g #count] [-q $query] [-r #rounds]", "Search the pinyin of common chinese words (or $query) in $lftfile, or in #count generated chinese names (if -g), #rounds times with and without the pinyin table, and compare their speed"},
+	{"regex", regex, "[-f $lftfile] [-q $query] [-r #rounds]", "Search the regex $query (or a few common ones) in $lftfile #rounds times with and without checking the literal every match contains first, and compare their speed"},
+	{"glob", glob, "[-f $lftfile] [-q $query] [-r #rounds]", "Search the glob $query (or a few common ones) in $lftfile #rounds times, and compare its speed with the same regex and the literal it contains"},
+	{"keywords", keywords, "[-f $lftfile] [-q $query] [-r #rounds]", "Search the terms of $query (or of a few common ones) in $lftfile #rounds times in one pass, and compare its speed with searching the terms one by one"},
+	{"check", check, "[-n #count] [-s #seed]", "Match #count random globs, regexes and keyword queries made from #seed with random names, compare the globs with fnmatch and the keywords with strstr and check that the names the regexes match have their literals, then compare searches of a tree with their rules with matching all its names"},
 	{0, 0, 0, 0}
 };
 
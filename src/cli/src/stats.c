@@ -57,4 +57,10 @@ void collect_print_statistics(fs_buf* fsbuf, fs_index* fsi)
 	total_alloced += mem;
 	printf("file-count: %'lu, mem: %'lu (%'lu KB), fs-buf-off: %'u, keywords: %'u, indice: %'u\n",
 		files_count, total_alloced, total_alloced >> 10, get_tail(fsbuf), keywords, offsets);
+	printf("fs-buf reserved: %'u KB, used: %'u KB\n", get_capacity(fsbuf) >> 10, get_tail(fsbuf) >> 10);
+
+	fs_buf_info info;
+	get_fs_buf_info(fsbuf, &info);
+	printf("fs-buf version: %u, generation: %u, build-time: %ld, fs-uuid: %s\n",
+		info.version, info.generation, (long)info.build_time, info.fs_uuid[0] ? info.fs_uuid : "-");
 }
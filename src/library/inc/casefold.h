@@ -0,0 +1,14 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+
+// write the size bytes of UTF-8 at src to dst (which may be src) with the Unicode simple case
+// folding applied, e.g. "Ä", "Σ", "Д" and "Ａ" become "ä", "σ", "д" and "ａ". every character
+// keeps its number of bytes, so the few foldings that would change it (like the Kelvin sign to "k")
+// are left out, and so are the bytes that are not valid UTF-8. two names match ignoring case
+// if their folded bytes match.
+void fold_utf8(char* dst, const char* src, size_t size);
@@ -22,6 +22,34 @@ typedef struct __fs_change__ {
 	int delta;
 } fs_change;
 
+/* operations of apply_fs_changes */
+#define FS_OP_INSERT	1
+#define FS_OP_REMOVE	2
+#define FS_OP_RENAME	3
+
+typedef struct __fs_op__ {
+	uint8_t op;
+	// only used by FS_OP_INSERT
+	uint8_t is_dir;
+	const char *path;
+	// only used by FS_OP_RENAME
+	const char *dst_path;
+} fs_op;
+
+// what a saved fs_buf records about itself, see read_fs_buf_info
+typedef struct __fs_buf_info__ {
+	// 1 for files saved without it, the other fields are 0 then
+	uint32_t version;
+	// bumped by every save_fs_buf
+	uint32_t generation;
+	// when the tree was built from the file system, in seconds since the epoch
+	int64_t build_time;
+	// uuid of the file system the tree was built from, empty if unknown
+	char fs_uuid[40];
+	uint32_t file_count;
+	uint32_t dir_count;
+} fs_buf_info;
+
 /* the search rule defines */
 #define RULE_NONE 0x00 //not use
 /* 0x01-0x3F: search related defines */
@@ -37,6 +65,12 @@ typedef struct __fs_change__ {
 #define RULE_SEARCH_ENDOFF 0x05
 // search pinyin index.
 #define RULE_SEARCH_PINYIN 0x06
+// match the whole name with the query as a shell glob (*.mp4, IMG_????.jpg, [Rr]eport*), see
+// glob_match.h. it is used instead of RULE_SEARCH_REGX, and the pinyin is not matched with it.
+#define RULE_SEARCH_GLOB 0x07
+// match the query as terms separated by spaces (invoice 2023|2024 -draft), see keyword_match.h.
+// it is used instead of RULE_SEARCH_REGX, and the pinyin is not matched with it.
+#define RULE_SEARCH_KEYWORDS 0x08
 
 /* 0x40-0x7F: exclude these results */
 // exclude the substring in the name of the directory or file: SUB_S startwith; SUB_D endwith.
@@ -59,6 +93,7 @@ typedef struct __search_rule__
 	struct __search_rule__ *next;
 } search_rule;
 
+// bytes reserved for the data, the used ones are those before get_tail
 uint32_t get_capacity(fs_buf* fsbuf);
 uint32_t first_name(fs_buf* fsbuf);
 const char* get_root_path(fs_buf* fsbuf);
@@ -67,7 +102,37 @@ uint32_t get_tail(fs_buf* fsbuf);
 // thread-unsafe
 char* get_name(fs_buf* fsbuf, uint32_t name_off);
 fs_buf* new_fs_buf(uint32_t capacity, const char* root_path);
+// same as new_fs_buf, but with 8-byte dir tags: it may grow up to 4 GB instead of 1 GB.
+// a fs_buf from new_fs_buf is widened by itself when a change would take it near 1 GB.
+fs_buf* new_wide_fs_buf(uint32_t capacity, const char* root_path);
+int is_wide_fs_buf(fs_buf* fsbuf);
 void free_fs_buf(fs_buf* fsbuf);
+// give the room left after tail back to the system, e.g. after removing large folders.
+// it keeps a few MB for the next changes, and does nothing if there is not much more.
+int trim_fs_buf(fs_buf* fsbuf);
+// move the names occurring at least min_count times into a dictionary shared by the records,
+// e.g. right after building a tree with many copies of the same folders. the dictionary is kept
+// by save_fs_buf, and each of its names is matched once per search. it does nothing if the
+// fs_buf is interned already or it would save less than a tenth of the data.
+int intern_fs_buf(fs_buf* fsbuf, uint32_t min_count);
+int is_interned_fs_buf(fs_buf* fsbuf);
+// store each name that shares a long prefix with the sibling before it (e.g. IMG_20240101_...)
+// as the length of that prefix and the rest of the name, in runs of at most 16 names that are
+// decoded from their first one. the names inserted later are stored in full. kept by save_fs_buf.
+int front_code_fs_buf(fs_buf* fsbuf);
+int is_front_coded_fs_buf(fs_buf* fsbuf);
+// keep the names case folded (see fold_utf8) in a column as large as the data, so that a search
+// with RULE_SEARCH_ICASE compares the folded query with them byte for byte: as fast as one that
+// respects case, and it ignores the case of the letters beyond ASCII too. the column is kept up to
+// date by the changes and saved with the fs_buf. return 1 if out of memory.
+int fold_fs_buf(fs_buf* fsbuf);
+int is_folded_fs_buf(fs_buf* fsbuf);
+// keep the pinyin of the names with chinese words in a table sorted by offset, so that a search with
+// RULE_SEARCH_PINYIN matches it instead of converting every name. a word matches any of its common
+// readings (e.g. chongqing for 重庆) in full or by its first letters (wdwj for 我的文件). it is
+// kept up to date by the changes, but not saved: build it again after loading. return 1 if out of memory.
+int build_pinyin_table(fs_buf* fsbuf);
+int has_pinyin_table(fs_buf* fsbuf);
 
 int is_file(fs_buf* fsbuf, uint32_t name_off);
 // thread-unsafe
@@ -75,12 +140,48 @@ uint32_t next_name(fs_buf* fsbuf, uint32_t name_off);
 
 char* get_path_by_name_off(fs_buf* fsbuf, uint32_t name_off, char *path, uint32_t path_size);
 
+// the file gets a header with the info of fsbuf and a checksum for every run of about 64 KB
+// of sibling blocks, see read_fs_buf_info and check_fs_buf
 int save_fs_buf(fs_buf* fsbuf, const char* filename);
+// same as save_fs_buf, but the dir tags take 1 byte and the parent tags none in the file, as
+// their offsets follow from the order of the folders. it saves 3 bytes (7 if wide) per folder
+// and 4 (8) more per folder with kids, e.g. for trees of many small folders like maildirs. a
+// packed file is unpacked by load_fs_buf, and map_fs_buf has to read it the same way.
+int save_packed_fs_buf(fs_buf* fsbuf, const char* filename);
+// return 8 if the header of the file is broken
 int load_fs_buf(fs_buf** pfsbuf, const char* filename);
+// same as load_fs_buf, but maps the file privately instead of reading it,
+// the mapping is copied to the heap when the fs_buf is modified for the first time
+int map_fs_buf(fs_buf** pfsbuf, const char* filename);
+// read the header of a saved fs_buf without loading it, with the same return values as load_fs_buf.
+// it is valid if 0 is returned, the info of a file saved without a header has version 1.
+int read_fs_buf_info(const char* filename, fs_buf_info* info);
+void get_fs_buf_info(fs_buf* fsbuf, fs_buf_info* info);
+// verify the checksums of a loaded fs_buf before anything changes it, e.g. right after loading.
+// the sibling blocks of broken runs are cut out together with their subtrees, and the folders
+// they belonged to are emptied and put into folders (at most *folder_count of them), so they
+// can be scanned again (see rescan_fstree). return 0 if done, 1 if there's nothing to verify
+// (saved without checksums or changed since loading), 2 if the root folder is broken, 3 if too
+// many folders are broken, 4 if out of memory. it is better to build the fs_buf again then.
+int check_fs_buf(fs_buf* fsbuf, uint32_t* folders, uint32_t* folder_count);
+// a read-only view of fsbuf as it is now, for long searches: the changes made to fsbuf afterwards
+// don't block on it or show up in it. the first change after it is taken copies the data once.
+// free it with free_fs_buf.
+fs_buf* snapshot_fs_buf(fs_buf* fsbuf);
+// hash the kids of all large folders in parallel, e.g. right after loading a fs_buf. otherwise
+// a large folder is hashed when a name is inserted into it for the first time. the hash also
+// records where the folder's block ends, so get_path_by_name_off doesn't walk its kids.
+// a fs_buf built by walking a tree also gets the extents of its subtrees here, they are kept
+// up to date and saved with it, so that get_path_range doesn't walk the subtree.
+int build_kids_indexes(fs_buf* fsbuf);
 
 int insert_path(fs_buf* fsbuf, const char *path, int is_dir, fs_change* change);
 int remove_path(fs_buf* fsbuf, const char *path, fs_change* changes, uint32_t* change_count);
 int rename_path(fs_buf* fsbuf, const char* src_path, const char* dst_path, fs_change* changes, uint32_t* change_count);
+// apply count operations in order under one lock, e.g. a burst of file system events.
+// the names inserted into the same folder one after another take room in its block at once.
+// results[i] gets what insert_path/remove_path/rename_path would have returned for ops[i].
+void apply_fs_changes(fs_buf* fsbuf, const fs_op* ops, uint32_t count, int* results);
 
 void get_path_range(fs_buf *fsbuf, const char *path, uint32_t *path_off, uint32_t *start_off, uint32_t *end_off);
 
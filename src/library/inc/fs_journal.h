@@ -0,0 +1,34 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+
+#include "fs_buf.h"
+
+/* journal operations, one record per applied change */
+#define FS_JOURNAL_INSERT	1
+#define FS_JOURNAL_REMOVE	2
+#define FS_JOURNAL_RENAME	3
+
+typedef struct __fs_journal__ fs_journal;
+
+// open the change journal of the base image lft_file, a journal written against another
+// base image (e.g. the .lft was saved again after the journal was written) is reset.
+int open_fs_journal(fs_journal** pjournal, const char* filename, const char* lft_file);
+void close_fs_journal(fs_journal* journal);
+
+// dst_path is only used by FS_JOURNAL_RENAME
+int append_fs_journal(fs_journal* journal, uint8_t op, const char* path, const char* dst_path, int is_dir);
+// make the appended records durable
+int sync_fs_journal(fs_journal* journal);
+// drop all records, lft_file must be the base image that now contains them
+int reset_fs_journal(fs_journal* journal, const char* lft_file);
+uint32_t get_fs_journal_size(fs_journal* journal);
+
+// apply the records of the journal to fsbuf loaded from lft_file, a torn record at the end is ignored.
+// return 0 on success, 1-3 if the journal is missing, unreadable or belongs to another base image,
+// 4 if a record could not be applied (fsbuf then holds only the records before it).
+int replay_fs_journal(fs_buf* fsbuf, const char* filename, const char* lft_file, uint32_t* count);
@@ -0,0 +1,42 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the chars of a glob, without its stars, that compile_glob turns into masks. a char beyond ASCII
+// counts once per byte.
+#define MAX_GLOB_CHARS	63
+
+// a shell glob matched with a whole name: '*' for any chars, '?' for one char, [abc], [a-z] and
+// [!abc] (or [^abc]) for one char of or out of a set, and '\' to take the next char as it is.
+// it is matched byte by byte in one pass: bit k of the state is set while the name so far
+// matches the first k chars of the glob, and a star lets its bit stay set for any byte.
+typedef struct __glob_pattern__ {
+	// bit k+1 is set in masks[c] if the byte c matches the k-th char of the glob
+	uint64_t masks[256];
+	// the bits that stay set for any byte, those right before a star
+	uint64_t stars;
+	// the bits that stay set for the trailing bytes of a UTF-8 char, those after a '?' or a set
+	// that match chars beyond ASCII, as they match the first byte of a char
+	uint64_t trails;
+	// the bit of a whole match
+	uint64_t match;
+	// the longest run of chars every match contains, looked for with find_str first. with the
+	// fallback, it is the longest one before the part of the glob that doesn't fit
+	char literal[MAX_GLOB_CHARS + 1];
+	size_t literal_len;
+	int icase;
+	// the glob is matched with fnmatch if it has more chars than the masks take, sets with chars
+	// beyond ASCII or classes like [:digit:], which don't fit into a byte, or a '[' not closed
+	const char *fallback;
+} glob_pattern;
+
+// compile the glob pattern, which is kept by glob for the fallback. ASCII letters match either
+// case if icase, fold the glob and match it with the folded names to ignore the case of the others.
+void compile_glob(glob_pattern* glob, const char* pattern, int icase);
+// whether the whole name matches the glob, the name is taken as UTF-8
+int match_glob(const glob_pattern* glob, const char* name);
@@ -0,0 +1,45 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the distinct terms and groups of a query and the states of the automaton matching them
+#define MAX_KEYWORDS		64
+#define MAX_KEYWORD_STATES	1024
+
+// a query of terms separated by spaces, e.g. invoice 2023 -draft: a name matches if it has all the
+// terms, one of those joined by '|' (invoice|bill 2023), and none of those after a '-' (-draft|tmp).
+// the text in double quotes is taken as it is, e.g. "my file" or "-v".
+// all the terms are matched in one pass over a name with an Aho-Corasick automaton, which steps
+// on the classes of the bytes (those of no term share one) and records the terms it has passed.
+typedef struct __keyword_query__ {
+	// the class of each byte, and the next state for each state and class: state * class_count
+	// shifted left by one, with the low bit set if the state finds some terms
+	uint8_t classes[256];
+	uint32_t class_count;
+	uint32_t *next;
+	// the terms found when the automaton reaches each state
+	uint64_t *found;
+	uint32_t state_count;
+	// the terms of each group separated by spaces, a name needs one of each
+	uint64_t groups[MAX_KEYWORDS];
+	uint32_t group_count;
+	// the terms of all the groups after a '-', a name needs none of them
+	uint64_t excluded;
+	// the longest term that is a group by itself, looked for with find_str first
+	char literal[256];
+	size_t literal_len;
+	int icase;
+} keyword_query;
+
+// compile the query, ASCII letters match either case if icase. fold the query and match it with the
+// folded names to ignore the case of the others. return 1 if out of memory, 2 if it has too many
+// terms or groups or they are too long. free it with free_keywords.
+int compile_keywords(keyword_query* keywords, const char* query, int icase);
+void free_keywords(keyword_query* keywords);
+// whether the name matches the query, a query without any term matches every name
+int match_keywords(const keyword_query* keywords, const char* name);
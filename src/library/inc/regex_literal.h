@@ -0,0 +1,14 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+
+// the longest run of bytes that every match of the regex pattern contains, e.g. ".pdf" for
+// "report.*2024\.pdf" and "IMG_" for "^IMG_\d+", so that the names without it can be passed
+// over with find_str before running the regex. it is copied into literal (size bytes, terminated)
+// and its length returned. 0 if the pattern has no such run, e.g. with alternatives at the top
+// level, or uses syntax that is not followed here (option settings, \Q...\E, backreferences).
+size_t get_regex_literal(const char* pattern, char* literal, size_t size);
@@ -0,0 +1,18 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+
+// the first occurrence of needle (needle_len bytes, followed by its terminator) in the
+// terminated haystack, or 0. ASCII letters match either case if icase, like strcasestr.
+// the haystack is scanned once, looking for the terminator and the matches in the same loads.
+const char* find_str(const char* haystack, const char* needle, size_t needle_len, int icase);
+
+// the kernel find_str uses: "avx2", "sse2", "neon", "lsx" or "scalar".
+// the fastest one the cpu supports is picked when the library is loaded
+const char* get_find_str_kernel(void);
+// make find_str use the named kernel, e.g. to compare them. return 1 if the cpu doesn't support it
+int set_find_str_kernel(const char* name);
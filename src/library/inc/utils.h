@@ -30,5 +30,6 @@ int wchar_t_to_utf8(const wchar_t* input, char* output, size_t output_bytes);
 
 int read_file(int fd, char* head, uint32_t size);
 int write_file(int fd, char* head, uint32_t size);
+uint64_t xxhash64(const void* data, size_t size, uint64_t seed);
 
 char* find_matching_dir_by_cache(const char *mount_dir, const char *search_dir);
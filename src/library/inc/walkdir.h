@@ -18,4 +18,18 @@ typedef struct __partition__ {
 typedef int (*progress_callback_fn)(uint32_t file_count, uint32_t dir_count, const char* cur_dir, const char *cur_file, void* param);
 
 int get_partitions(int* part_count, partition* parts);
+// a capacity for new_fs_buf that holds the files of the file system root_path is on,
+// from its count of used inodes. it's only a start, the fs_buf grows as needed.
+uint32_t get_fs_buf_capacity(const char* root_path);
+// return 1 if cancelled by pcf, 2 if fsbuf is full (a narrow fs_buf can be rebuilt with new_wide_fs_buf)
 int build_fstree(fs_buf* fsbuf, int merge_partition, progress_callback_fn pcf, void *param);
+// like build_fstree, but the folders in excludes are left empty, e.g. the ones indexed in fs_bufs of
+// their own. they are absolute paths without a trailing /, the array ends with a null pointer
+int build_fstree_excluding(fs_buf* fsbuf, int merge_partition, const char* const* excludes,
+						   progress_callback_fn pcf, void *param);
+// uuid of the file system path is on, from /dev/disk/by-uuid. it is empty if there is none.
+int get_fs_uuid(const char* path, char* uuid, uint32_t size);
+// insert the files under path (a folder in fsbuf) that are missing, e.g. the ones cut out by check_fs_buf.
+// return 2 if fsbuf is full or out of memory
+int rescan_fstree(fs_buf* fsbuf, const char* path);
+int rescan_fstree_excluding(fs_buf* fsbuf, const char* path, const char* const* excludes);
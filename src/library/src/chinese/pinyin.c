@@ -26,170 +26,130 @@ char *right_trim(char *str)
     return str;
 }
 
-void utf8_to_pinyin(const char *in, char *out)
+// the bytes of the UTF-8 char at words, 0 for a byte no char starts with
+static int char_size(const char *words)
+{
+    unsigned char chr = *words;
+    if(chr < 0x80)
+        return 1;
+    if((chr & 0xE0) == 0xC0)
+        return 2;
+    if((chr & 0xF0) == 0xE0)
+        return 3;
+    if((chr & 0xF8) == 0xF0)
+        return 4;
+    if((chr & 0xFC) == 0xF8)
+        return 5;
+    if((chr & 0xFE) == 0xFC)
+        return 6;
+    return 0;
+}
+
+const char *word_pinyin(int code, int *len)
+{
+    if(code < PINYIN_UNICODE_START || code > PINYIN_UNICODE_END)
+        return NULL;
+
+    const char *pinyin = basic_dict + (code - PINYIN_UNICODE_START) * MAX_PINYIN_LEN;
+    for(*len = MAX_PINYIN_LEN; *len > 0 && pinyin[*len - 1] == ' '; (*len)--);
+    return pinyin;
+}
+
+// the pinyin of the char at words in basic_dict, without the whitespace after it, or NULL
+static const char *char_pinyin(const char *words, int *len)
+{
+    if(char_size(words) != 3 || *(words + 1) == '\0' || *(words + 2) == '\0')
+        return NULL;
+
+    int tmp = (((int)(*words & 0x0F)) << 12) | (((int)(*(words+1) & 0x3F)) << 6) | (*(words+2) & 0x3F);
+    return word_pinyin(tmp, len);
+}
+
+// append the pinyin of in to first (the first letters) and full (the whole words), if they are
+// not NULL. the chars without pinyin are appended as they are, a byte no char starts with ends it.
+// the ends are looked for once, so that it takes linear time.
+static void append_pinyin(const char *in, char *first, char *full)
 {
-    int start = PINYIN_UNICODE_START;
+    if(first != NULL)
+        first += strlen(first);
+    if(full != NULL)
+        full += strlen(full);
+
     const char* words = in;
-    char buf[MAX_PINYIN_LEN + 1];
     while(*words != '\0')
     {
-        memset(buf, 0, MAX_PINYIN_LEN + 1);
-        if((*words >> 7) == 0)
+        int len;
+        const char *pinyin = char_pinyin(words, &len);
+        if(pinyin != NULL)
         {
-            strncat(out, words, 1);
-            words++;
-        }
-        else if((*words & 0xE0) == 0xC0)
-        {
-            strncat(out, words, 2);
-            words += 2;
-        }
-        else if((*words & 0xF0) == 0xE0)
-        {
-            if(*(words + 1) != '\0' && *(words + 2) != '\0')
+            if(first != NULL)
+                *first++ = *pinyin; // append the first char of word
+            if(full != NULL)
             {
-                int tmp = (((int)(*words & 0x0F)) << 12) | (((int)(*(words+1) & 0x3F)) << 6) | (*(words+2) & 0x3F);
-                if(tmp >= start && tmp <= PINYIN_UNICODE_END)
-                {
-                    int offset = (tmp - start) * MAX_PINYIN_LEN;
-                    strncpy(buf, basic_dict + offset, MAX_PINYIN_LEN);
-                    right_trim(buf); //remove white spaces at the end
-                    strcat(out, buf);
-                    words += 3;
-                }
-                else
-                {
-                    strncat(out, words, 3);
-                    words += 3;
-                }
-            }
-            else
-            {
-                strncat(out, words, 3);
-                words += 3;
+                memcpy(full, pinyin, len); // append the full word
+                full += len;
             }
+            words += 3;
+            continue;
         }
-        else if((*words & 0xF8) == 0xF0)
-        {
-            strncat(out, words, 4);
-            words += 4;
-        }
-        else if((*words & 0xFC) == 0xF8)
-        {
-            strncat(out, words, 5);
-            words += 5;
-        }
-        else if((*words & 0xFE) == 0xFC)
+
+        int size = char_size(words);
+        int broken = size == 0;
+        for(size = broken ? 1 : size; size > 0 && *words != '\0'; size--, words++)
         {
-            strncat(out, words, 6);
-            words += 6;
+            if(first != NULL)
+                *first++ = *words;
+            if(full != NULL)
+                *full++ = *words;
         }
-        else
-        {
-            strncat(out, words, 1);
-            words++;
+        if(broken)
             break;
-        }
     }
+
+    if(first != NULL)
+        *first = '\0';
+    if(full != NULL)
+        *full = '\0';
+}
+
+void utf8_to_pinyin(const char *in, char *out)
+{
+    append_pinyin(in, NULL, out);
 }
 
 void convert_all_pinyin(const char *in, char *first, char *full)
 {
-    int start = PINYIN_UNICODE_START;
-    const char* words = in;
-    char buf[MAX_PINYIN_LEN + 1];
-    while(*words != '\0')
-    {
-        memset(buf, 0, MAX_PINYIN_LEN + 1);
-        if((*words >> 7) == 0)
-        {
-            strncat(first, words, 1);
-            strncat(full, words, 1);
-            words++;
-        }
-        else if((*words & 0xE0) == 0xC0)
-        {
-            strncat(first, words, 2);
-            strncat(full, words, 2);
-            words += 2;
-        }
-        else if((*words & 0xF0) == 0xE0)
-        {
-            if(*(words + 1) != '\0' && *(words + 2) != '\0')
-            {
-                int tmp = (((int)(*words & 0x0F)) << 12) | (((int)(*(words+1) & 0x3F)) << 6) | (*(words+2) & 0x3F);
-                if(tmp >= start && tmp <= PINYIN_UNICODE_END)
-                {
-                    int offset = (tmp - start) * MAX_PINYIN_LEN;
-                    strncpy(buf, basic_dict + offset, MAX_PINYIN_LEN);
-                    right_trim(buf); //remove white spaces at the end
-                    strncat(first, buf, 1); // append the first char of word
-                    strcat(full, buf); // append the full word
-                    words += 3;
-                }
-                else
-                {
-                    strncat(first, words, 3);
-                    strncat(full, words, 3);
-                    words += 3;
-                }
-            }
-            else
-            {
-                strncat(first, words, 3);
-                strncat(full, words, 3);
-                words += 3;
-            }
-        }
-        else if((*words & 0xF8) == 0xF0)
-        {
-            strncat(first, words, 4);
-            strncat(full, words, 4);
-            words += 4;
-        }
-        else if((*words & 0xFC) == 0xF8)
-        {
-            strncat(first, words, 5);
-            strncat(full, words, 5);
-            words += 5;
-        }
-        else if((*words & 0xFE) == 0xFC)
-        {
-            strncat(first, words, 6);
-            strncat(full, words, 6);
-            words += 6;
-        }
-        else
-        {
-            strncat(first, words, 1);
-            strncat(full, words, 1);
-            words++;
-            break;
-        }
-    }
+    append_pinyin(in, first, full);
 }
 
-char* cat_pinyin(const char *in)
+int get_pinyin(const char *in, char *out)
 {
     if (in == NULL || !is_text_utf8(in, strlen(in)))
-        return NULL;
+        return false;
 
-    const int first_len = 255; //NAME_MAX;
-    char pinyin_first[first_len];
-    memset(pinyin_first, 0, first_len);
     const int max_len = 1530; //NAME_MAX * MAX_PINYIN_LEN;
-    char pinyin_full[max_len];
-    memset(pinyin_full, 0, max_len);
+    char pinyin_full[max_len + 1];
 
-    char *cat_chars = calloc(first_len + max_len + 1, sizeof(char));
+    *out = '\0';
+    pinyin_full[0] = '\0';
+    convert_all_pinyin(in, out, pinyin_full);
+    size_t first_len = strlen(out);
+    out[first_len] = '|';
+    strcpy(out + first_len + 1, pinyin_full);
+    return true;
+}
+
+char* cat_pinyin(const char *in)
+{
+    char *cat_chars = malloc(MAX_CAT_PINYIN_LEN);
     if (cat_chars == NULL)
         return NULL;
 
-    convert_all_pinyin(in, pinyin_first, pinyin_full);
-    strcpy(cat_chars, pinyin_first);
-    *(cat_chars + strlen(pinyin_first)) = '|';
-    strcpy(cat_chars + strlen(pinyin_first) + 1, pinyin_full);
-
+    if (!get_pinyin(in, cat_chars))
+    {
+        free(cat_chars);
+        return NULL;
+    }
     return cat_chars;
 }
 
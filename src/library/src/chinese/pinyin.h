@@ -16,11 +16,17 @@
 #define MAX_PINYIN_LEN 6
 
 #define DICT_MAX_LEN (MAX_PINYIN_WORD * MAX_PINYIN_LEN + 1)
+// the first and full words of a name of NAME_MAX bytes, cat with '|'
+#define MAX_CAT_PINYIN_LEN (255 + 1 + 1530 + 1)
 
 void utf8_to_pinyin(const char *in, char *out);
 void convert_all_pinyin(const char *in, char *first, char *full);
 // cat first and full words with '|' and return, need be freed in its invoker
 char* cat_pinyin(const char *in);
+// same as cat_pinyin, but into out of MAX_CAT_PINYIN_LEN bytes. return 0 if in is not UTF-8
+int get_pinyin(const char *in, char *out);
+// the pinyin of the chinese word code in the basic map and its length, NULL if it is not in it
+const char *word_pinyin(int code, int *len);
 int is_text_utf8(const char* str, long length);
 
 #endif // PINYIN_H_INCLUDED
@@ -0,0 +1,447 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pinyin.h"
+#include "pinyin_match.h"
+
+// every syllable of the readings, sorted
+static const char *const syllables[] = {
+	"a", "ai", "an", "ang", "ao", "ba", "bai", "ban", "bang", "bao", "bei", "ben", "beng", "bi",
+	"bian", "biao", "bie", "bin", "bing", "bo", "bu", "ca", "cai", "can", "cang", "cao", "ce",
+	"cen", "ceng", "cha", "chai", "chan", "chang", "chao", "che", "chen", "cheng", "chi", "chong",
+	"chou", "chu", "chuai", "chuan", "chuang", "chui", "chun", "chuo", "ci", "cong", "cou", "cu",
+	"cuan", "cui", "cun", "cuo", "da", "dai", "dan", "dang", "dao", "de", "dei", "den", "deng",
+	"di", "dia", "dian", "diao", "die", "ding", "diu", "dong", "dou", "du", "duan", "dui", "dun",
+	"duo", "e", "en", "eng", "er", "fa", "fan", "fang", "fei", "fen", "feng", "fiao", "fo", "fou",
+	"fu", "ga", "gai", "gan", "gang", "gao", "ge", "gei", "gen", "geng", "gong", "gou", "gu",
+	"gua", "guai", "guan", "guang", "gui", "gun", "guo", "ha", "hai", "han", "hang", "hao", "he",
+	"hei", "hen", "heng", "ho", "hong", "hou", "hu", "hua", "huai", "huan", "huang", "hui", "hun",
+	"huo", "ji", "jia", "jian", "jiang", "jiao", "jie", "jin", "jing", "jiong", "jiu", "ju",
+	"juan", "jue", "jun", "ka", "kai", "kan", "kang", "kao", "ke", "ken", "keng", "kong", "kou",
+	"ku", "kua", "kuai", "kuan", "kuang", "kui", "kun", "kuo", "la", "lai", "lan", "lang", "lao",
+	"le", "lei", "leng", "li", "lia", "lian", "liang", "liao", "lie", "lin", "ling", "liu", "lo",
+	"long", "lou", "lu", "luan", "lun", "luo", "lv", "lve", "m", "ma", "mai", "man", "mang", "mao",
+	"me", "mei", "men", "meng", "mi", "mian", "miao", "mie", "min", "ming", "miu", "mo", "mou",
+	"mu", "n", "na", "nai", "nan", "nang", "nao", "ne", "nei", "nen", "ni", "nian", "niang",
+	"niao", "nie", "nin", "ning", "niu", "nong", "nou", "nu", "nuan", "nuo", "nv", "nve", "o",
+	"ou", "pa", "pai", "pan", "pang", "pao", "pei", "pen", "peng", "pi", "pian", "piao", "pie",
+	"pin", "ping", "po", "pou", "pu", "qi", "qia", "qian", "qiang", "qiao", "qie", "qin", "qing",
+	"qiong", "qiu", "qu", "quan", "que", "qun", "ra", "ran", "rang", "rao", "re", "ren", "reng",
+	"ri", "rong", "rou", "ru", "ruan", "rui", "run", "ruo", "sa", "sai", "san", "sang", "sao",
+	"se", "sha", "shai", "shan", "shang", "shao", "she", "shei", "shen", "sheng", "shi", "shou",
+	"shu", "shua", "shuai", "shuan", "shuang", "shui", "shuo", "si", "song", "sou", "su", "suan",
+	"sui", "sun", "suo", "ta", "tai", "tan", "tang", "tao", "te", "teng", "ti", "tian", "tiao",
+	"tie", "ting", "tong", "tou", "tu", "tuan", "tui", "tun", "tuo", "wa", "wai", "wan", "wang",
+	"wei", "wen", "weng", "wo", "wu", "xi", "xia", "xian", "xiang", "xiao", "xie", "xin", "xing",
+	"xiong", "xiu", "xu", "xuan", "xue", "xun", "ya", "yan", "yang", "yao", "ye", "yen", "yi",
+	"yin", "ying", "yo", "yong", "you", "yu", "yuan", "yue", "yun", "za", "zai", "zan", "zang",
+	"zao", "ze", "zei", "zen", "zeng", "zha", "zhai", "zhan", "zhang", "zhao", "zhe", "zhei",
+	"zhen", "zheng", "zhi", "zhong", "zhou", "zhu", "zhua", "zhuai", "zhuan", "zhuang", "zhui",
+	"zhun", "zhuo", "zi", "zong", "zou", "zu", "zuan", "zui", "zun", "zuo",
+};
+
+// the readings of the common polyphones besides the one in basic_dict, sorted by code
+static const struct {
+	uint16_t code;
+	const char *readings;
+} polyphones[] = {
+	{ 0x4E50, "yue" }, // 乐
+	{ 0x4E58, "sheng" }, // 乘
+	{ 0x4E86, "le" }, // 了
+	{ 0x4EB2, "qing" }, // 亲
+	{ 0x4EC0, "shen" }, // 什
+	{ 0x4ED4, "zi" }, // 仔
+	{ 0x4F1A, "kuai" }, // 会
+	{ 0x4F20, "zhuan" }, // 传
+	{ 0x4F2F, "bai" }, // 伯
+	{ 0x4F3A, "ci" }, // 伺
+	{ 0x4F3C, "shi" }, // 似
+	{ 0x4F5B, "fu" }, // 佛
+	{ 0x4FBF, "pian" }, // 便
+	{ 0x4FE9, "liang" }, // 俩
+	{ 0x51AF, "ping" }, // 冯
+	{ 0x5239, "cha" }, // 刹
+	{ 0x524A, "xue" }, // 削
+	{ 0x5265, "bao" }, // 剥
+	{ 0x52B2, "jing" }, // 劲
+	{ 0x52D2, "lei" }, // 勒
+	{ 0x5319, "shi" }, // 匙
+	{ 0x533A, "ou" }, // 区
+	{ 0x5355, "shan chan" }, // 单
+	{ 0x5361, "qia" }, // 卡
+	{ 0x53A6, "sha" }, // 厦
+	{ 0x53C2, "shen cen" }, // 参
+	{ 0x53E8, "tao" }, // 叨
+	{ 0x53F6, "xie" }, // 叶
+	{ 0x5408, "ge" }, // 合
+	{ 0x5413, "he" }, // 吓
+	{ 0x5426, "pi" }, // 否
+	{ 0x5457, "bei" }, // 呗
+	{ 0x5458, "yun" }, // 员
+	{ 0x5462, "ni" }, // 呢
+	{ 0x548C, "huo hu" }, // 和
+	{ 0x5496, "ga" }, // 咖
+	{ 0x54AF, "ge ka" }, // 咯
+	{ 0x54BD, "ye" }, // 咽
+	{ 0x54E6, "o e" }, // 哦
+	{ 0x54EA, "nei" }, // 哪
+	{ 0x55EF, "en" }, // 嗯
+	{ 0x5632, "zhao" }, // 嘲
+	{ 0x56E4, "tun" }, // 囤
+	{ 0x5708, "juan" }, // 圈
+	{ 0x5730, "de" }, // 地
+	{ 0x57CB, "man" }, // 埋
+	{ 0x5821, "bu pu" }, // 堡
+	{ 0x585E, "se" }, // 塞
+	{ 0x58F3, "qiao" }, // 壳
+	{ 0x5927, "dai" }, // 大
+	{ 0x5939, "ga" }, // 夹
+	{ 0x5947, "ji" }, // 奇
+	{ 0x5BBF, "xiu" }, // 宿
+	{ 0x5C06, "qiang" }, // 将
+	{ 0x5C09, "yu" }, // 尉
+	{ 0x5C3E, "yi" }, // 尾
+	{ 0x5C4F, "bing" }, // 屏
+	{ 0x5C5E, "shu" }, // 属
+	{ 0x5DEE, "chai ci" }, // 差
+	{ 0x5DF7, "hang" }, // 巷
+	{ 0x5E62, "chuang" }, // 幢
+	{ 0x5EA6, "duo" }, // 度
+	{ 0x5F04, "long" }, // 弄
+	{ 0x5F39, "tan" }, // 弹
+	{ 0x5F3A, "jiang" }, // 强
+	{ 0x5F97, "dei" }, // 得
+	{ 0x6076, "wu" }, // 恶
+	{ 0x6241, "pian" }, // 扁
+	{ 0x624E, "za" }, // 扎
+	{ 0x625B, "gang" }, // 扛
+	{ 0x6298, "she" }, // 折
+	{ 0x62B9, "ma" }, // 抹
+	{ 0x62D3, "ta" }, // 拓
+	{ 0x62D7, "niu" }, // 拗
+	{ 0x62E9, "zhai" }, // 择
+	{ 0x63D0, "di" }, // 提
+	{ 0x64AE, "zuo" }, // 撮
+	{ 0x6512, "cuan" }, // 攒
+	{ 0x6570, "shuo" }, // 数
+	{ 0x66B4, "pu" }, // 暴
+	{ 0x66DD, "bao" }, // 曝
+	{ 0x66FE, "ceng" }, // 曾
+	{ 0x671D, "zhao" }, // 朝
+	{ 0x671F, "ji" }, // 期
+	{ 0x6734, "piao" }, // 朴
+	{ 0x67CF, "bo" }, // 柏
+	{ 0x67E5, "zha" }, // 查
+	{ 0x6821, "jiao" }, // 校
+	{ 0x6A21, "mu" }, // 模
+	{ 0x6B96, "shi" }, // 殖
+	{ 0x6C88, "chen" }, // 沈
+	{ 0x6CA1, "mo" }, // 没
+	{ 0x6CCC, "bi" }, // 泌
+	{ 0x6F84, "deng" }, // 澄
+	{ 0x719F, "shou" }, // 熟
+	{ 0x722A, "zhao" }, // 爪
+	{ 0x7387, "shuai" }, // 率
+	{ 0x755C, "chu" }, // 畜
+	{ 0x756A, "pan" }, // 番
+	{ 0x7684, "di" }, // 的
+	{ 0x76D6, "ge" }, // 盖
+	{ 0x76DB, "cheng" }, // 盛
+	{ 0x7701, "xing" }, // 省
+	{ 0x7740, "zhe zhao" }, // 着
+	{ 0x77F3, "dan" }, // 石
+	{ 0x7985, "shan" }, // 禅
+	{ 0x79D8, "bi" }, // 秘
+	{ 0x79F0, "cheng" }, // 称
+	{ 0x7C98, "nian" }, // 粘
+	{ 0x7CFB, "ji" }, // 系
+	{ 0x7EA2, "gong" }, // 红
+	{ 0x7EA4, "qian" }, // 纤
+	{ 0x7ED9, "ji" }, // 给
+	{ 0x7EF0, "chao" }, // 绰
+	{ 0x7EFF, "lu" }, // 绿
+	{ 0x7F2A, "miao mou" }, // 缪
+	{ 0x8109, "mo" }, // 脉
+	{ 0x812F, "pu" }, // 脯
+	{ 0x81ED, "xiu" }, // 臭
+	{ 0x8272, "shai" }, // 色
+	{ 0x827E, "yi" }, // 艾
+	{ 0x8304, "jia" }, // 茄
+	{ 0x843D, "la lao" }, // 落
+	{ 0x8457, "zhe zhuo" }, // 著
+	{ 0x8543, "bo" }, // 蕃
+	{ 0x8584, "bao" }, // 薄
+	{ 0x85CF, "zang" }, // 藏
+	{ 0x8840, "xie" }, // 血
+	{ 0x884C, "hang" }, // 行
+	{ 0x89C9, "jiao" }, // 觉
+	{ 0x89D2, "jue" }, // 角
+	{ 0x89E3, "xie" }, // 解
+	{ 0x8BC6, "zhi" }, // 识
+	{ 0x8BF4, "shuo" }, // 说
+	{ 0x8C01, "shei" }, // 谁
+	{ 0x8C03, "tiao" }, // 调
+	{ 0x8C37, "yu" }, // 谷
+	{ 0x8F66, "ju" }, // 车
+	{ 0x8F9F, "pi" }, // 辟
+	{ 0x8FD8, "hai" }, // 还
+	{ 0x8FD9, "zhei" }, // 这
+	{ 0x90A3, "nei" }, // 那
+	{ 0x90FD, "du" }, // 都
+	{ 0x91CD, "chong" }, // 重
+	{ 0x94A5, "yao" }, // 钥
+	{ 0x957F, "zhang" }, // 长
+	{ 0x963F, "e" }, // 阿
+	{ 0x964D, "xiang" }, // 降
+	{ 0x96C0, "qiao" }, // 雀
+	{ 0x9732, "lu" }, // 露
+	{ 0x9888, "geng" }, // 颈
+	{ 0x98A4, "zhan" }, // 颤
+	{ 0x9E1F, "diao" }, // 鸟
+	{ 0x9F9F, "jun qiu" }, // 龟
+};
+
+#define SYLLABLE_COUNT	(sizeof(syllables) / sizeof(syllables[0]))
+#define POLYPHONE_COUNT	(sizeof(polyphones) / sizeof(polyphones[0]))
+// in word_syllables, for the words without a syllable
+#define NO_SYLLABLE		0xFFFF
+// in word_syllables, for the words with more readings in polyphones
+#define POLYPHONE_FLAG	0x8000
+
+// the syllable of the reading of each word in basic_dict, with POLYPHONE_FLAG if it has more
+static uint16_t word_syllables[MAX_PINYIN_WORD];
+// the syllables of the readings in polyphones
+static uint16_t polyphone_syllables[POLYPHONE_COUNT][MAX_WORD_READINGS - 1];
+static uint8_t polyphone_counts[POLYPHONE_COUNT];
+
+// the syllable spelled by len bytes at s, or -1
+static int find_syllable(const char *s, size_t len)
+{
+	uint32_t low = 0, high = SYLLABLE_COUNT;
+	while (low < high)
+	{
+		uint32_t mid = (low + high) / 2;
+		int cmp = strncmp(syllables[mid], s, len);
+		if (cmp == 0 && syllables[mid][len] != '\0')
+			cmp = 1;
+		if (cmp < 0)
+			low = mid + 1;
+		else if (cmp > 0)
+			high = mid;
+		else
+			return mid;
+	}
+	return -1;
+}
+
+static int find_polyphone(uint32_t code)
+{
+	uint32_t low = 0, high = POLYPHONE_COUNT;
+	while (low < high)
+	{
+		uint32_t mid = (low + high) / 2;
+		if (polyphones[mid].code < code)
+			low = mid + 1;
+		else if (polyphones[mid].code > code)
+			high = mid;
+		else
+			return mid;
+	}
+	return -1;
+}
+
+__attribute__((constructor)) static void init_pinyin_tokens(void)
+{
+	for (uint32_t i = 0; i < MAX_PINYIN_WORD; i++)
+	{
+		int len;
+		const char *pinyin = word_pinyin(PINYIN_UNICODE_START + i, &len);
+		int id = pinyin ? find_syllable(pinyin, len) : -1;
+		word_syllables[i] = id < 0 ? NO_SYLLABLE : id;
+	}
+
+	for (uint32_t i = 0; i < POLYPHONE_COUNT; i++)
+	{
+		uint32_t word = polyphones[i].code - PINYIN_UNICODE_START;
+		if (word_syllables[word] == NO_SYLLABLE)
+			continue;
+
+		for (const char *p = polyphones[i].readings; *p && polyphone_counts[i] < MAX_WORD_READINGS - 1;)
+		{
+			size_t len = strcspn(p, " ");
+			int id = find_syllable(p, len);
+			if (id >= 0)
+				polyphone_syllables[i][polyphone_counts[i]++] = id;
+			p += len + (p[len] == ' ');
+		}
+		if (polyphone_counts[i])
+			word_syllables[word] |= POLYPHONE_FLAG;
+	}
+}
+
+// the bytes of the char at s, not counting its terminator
+static inline uint32_t char_len(const char *s)
+{
+	uint8_t c = *s;
+	uint32_t size = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 :
+		(c & 0xF8) == 0xF0 ? 4 : (c & 0xFC) == 0xF8 ? 5 : (c & 0xFE) == 0xFC ? 6 : 1;
+	for (uint32_t i = 1; i < size; i++)
+		if (s[i] == '\0')
+			return i;
+	return size;
+}
+
+// the index in word_syllables of the char of size bytes at s, or -1 if it is not a chinese word
+static inline int word_index(const char *s, uint32_t size)
+{
+	if (size != 3)
+		return -1;
+
+	uint32_t code = ((uint32_t)(s[0] & 0x0F) << 12) | ((uint32_t)(s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+	if (code < PINYIN_UNICODE_START || code > PINYIN_UNICODE_END ||
+		word_syllables[code - PINYIN_UNICODE_START] == NO_SYLLABLE)
+		return -1;
+	return code - PINYIN_UNICODE_START;
+}
+
+// a syllable takes 2 bytes with the high bit set, so that the tokens have no 0 but their terminator
+static inline char *put_syllable(char *p, uint32_t id)
+{
+	*p++ = 0x80 | (id >> 7);
+	*p++ = 0x80 | (id & 0x7F);
+	return p;
+}
+
+static inline uint32_t get_syllable(const char *p)
+{
+	return ((uint32_t)(p[0] & 0x7F) << 7) | (p[1] & 0x7F);
+}
+
+int get_pinyin_tokens(const char *name, char *out)
+{
+	int has_words = 0;
+	char *p = out;
+	// room for a word and its readings, names longer than NAME_MAX are cut short
+	const char *end = out + MAX_PINYIN_TOKENS_LEN - 1 - (3 + 1 + 2 * MAX_WORD_READINGS);
+	for (const char *s = name; *s && p <= end;)
+	{
+		uint32_t size = char_len(s);
+		int word = word_index(s, size);
+		memcpy(p, s, size);
+		p += size;
+		s += size;
+		if (word < 0)
+			continue;
+
+		has_words = 1;
+		uint16_t id = word_syllables[word];
+		int polyphone = id & POLYPHONE_FLAG ? find_polyphone(word + PINYIN_UNICODE_START) : -1;
+		uint32_t count = polyphone < 0 ? 0 : polyphone_counts[polyphone];
+		*p++ = 1 + count;
+		p = put_syllable(p, id & ~POLYPHONE_FLAG);
+		for (uint32_t i = 0; i < count; i++)
+			p = put_syllable(p, polyphone_syllables[polyphone][i]);
+	}
+	*p = '\0';
+	return has_words;
+}
+
+int init_pinyin_query(pinyin_query *pq, const char *query, size_t query_len, int icase)
+{
+	if (query_len > MAX_PINYIN_QUERY_LEN)
+		return 1;
+
+	memset(pq->masks, 0, sizeof(pq->masks));
+	pq->len = query_len;
+	for (uint32_t i = 0; i < query_len; i++)
+	{
+		uint8_t c = query[i];
+		pq->masks[c] |= 1ULL << (i + 1);
+		if (icase && (c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+			pq->masks[c ^ 0x20] |= 1ULL << (i + 1);
+	}
+	return 0;
+}
+
+int match_pinyin_tokens(const char *tokens, const pinyin_query *pq)
+{
+	if (pq->len == 0)
+		return 1;
+
+	const uint64_t *masks = pq->masks, done = 1ULL << pq->len;
+	// bit i is set if the first i bytes of the query match the tokens before the current one, bit 0
+	// always. a byte moves the bits on by one, and keeps those where the query has it next.
+	uint64_t from = 1;
+
+	for (const char *s = tokens; *s;)
+	{
+		uint32_t size = char_len(s);
+		uint64_t to = from;
+		for (uint32_t i = 0; i < size; i++)
+			to = (to << 1) & masks[(uint8_t)s[i]];
+		s += size;
+
+		if (word_index(s - size, size) >= 0)
+		{
+			// a reading matches the query bytes it starts with, down to its first letter
+			uint32_t readings = (uint8_t)*s++;
+			for (uint32_t r = 0; r < readings; r++, s += 2)
+			{
+				uint64_t bits = from;
+				for (const char *letter = syllables[get_syllable(s)]; bits && *letter; letter++)
+				{
+					bits = (bits << 1) & masks[(uint8_t)*letter];
+					to |= bits;
+				}
+			}
+		}
+
+		if (to & done)
+			return 1;
+		from = to | 1;
+	}
+	return 0;
+}
+
+void format_pinyin_tokens(const char *tokens, char *out)
+{
+	char *first = out;
+	// the first letters take one byte for each word, as long as the tokens without the readings
+	uint32_t first_len = 0;
+	for (const char *s = tokens; *s;)
+	{
+		uint32_t size = char_len(s);
+		uint32_t readings = word_index(s, size) < 0 ? 0 : (uint8_t)s[size];
+		first_len += readings ? 1 : size;
+		s += size + (readings ? 1 + 2 * readings : 0);
+	}
+
+	char *full = out + first_len + 1;
+	for (const char *s = tokens; *s;)
+	{
+		uint32_t size = char_len(s);
+		uint32_t readings = word_index(s, size) < 0 ? 0 : (uint8_t)s[size];
+		if (readings)
+		{
+			uint32_t id = get_syllable(s + size + 1);
+			*first++ = syllables[id][0];
+			size_t len = strlen(syllables[id]);
+			memcpy(full, syllables[id], len);
+			full += len;
+		}
+		else
+		{
+			memcpy(first, s, size);
+			first += size;
+			memcpy(full, s, size);
+			full += size;
+		}
+		s += size + (readings ? 1 + 2 * readings : 0);
+	}
+	*first = '|';
+	*full = '\0';
+}
@@ -0,0 +1,39 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the readings a chinese word may have, see get_pinyin_tokens
+#define MAX_WORD_READINGS	4
+// the tokens of a name of NAME_MAX bytes: each chinese word takes 3 bytes of it, and 1 more for the
+// count of its readings and 2 for each reading
+#define MAX_PINYIN_TOKENS_LEN	(255 / 3 * (3 + 1 + 2 * MAX_WORD_READINGS) + 1)
+// the longest query match_pinyin_tokens looks for, a bit for each of its bytes
+#define MAX_PINYIN_QUERY_LEN	63
+
+// a query compiled for match_pinyin_tokens, once for all the names
+typedef struct __pinyin_query__ {
+	// bit i + 1 of masks[c] is set if the i-th byte of the query is c
+	uint64_t masks[256];
+	uint32_t len;
+} pinyin_query;
+
+// write the tokens of name into out of MAX_PINYIN_TOKENS_LEN bytes: the chars of name as they are, each
+// chinese word followed by the count of its readings and their syllables, so that out stays terminated.
+// polyphones like 重 (zhong, chong) or 行 (xing, hang) get all their common readings.
+// return 0 if name has no chinese words, out is of no use then.
+int get_pinyin_tokens(const char *name, char *out);
+// compile query (query_len bytes) for match_pinyin_tokens. ASCII letters match either case if icase.
+// return 1 if it is longer than MAX_PINYIN_QUERY_LEN.
+int init_pinyin_query(pinyin_query *pq, const char *query, size_t query_len, int icase);
+// whether the query occurs in the tokens: a chinese word matches any of its readings in full or cut
+// short down to the first letter, e.g. wdwj, wodewenjian and wodwj all match 我的文件, or itself.
+// the other chars match as they are.
+int match_pinyin_tokens(const char *tokens, const pinyin_query *pq);
+// write the first letters and the full pinyin of the tokens into out of MAX_CAT_PINYIN_LEN bytes, cat
+// with '|' like get_pinyin, taking the first reading of each word
+void format_pinyin_tokens(const char *tokens, char *out);
@@ -3,25 +3,43 @@
 //
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+// for mremap
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <time.h>
 // #include <regex.h>
 #include <limits.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
 #include "fs_buf.h"
+#include "walkdir.h"
 #include "utils.h"
 #include "thread_pool.h"
+#include "strmatch.h"
+#include "casefold.h"
+#include "regex_literal.h"
+#include "glob_match.h"
+#include "keyword_match.h"
 #include "chinese/pinyin.h"
+#include "chinese/pinyin_match.h"
 
 #define DATA_START 8
+// the version of the files save_fs_buf writes, version 1 files have no header
+#define FS_BUF_VERSION 2
+// the version of the files save_packed_fs_buf writes, see pack_fs_buf
+#define FS_BUF_PACKED_VERSION 3
 #define FS_NEW_BLK_SIZE (1 << 20)
 
 // fs-tags below are all for little endian archs, such as x86/loongson
@@ -29,10 +47,69 @@
 #define FS_TAG_BITS 2
 #define FS_TAG_MASK ((1 << FS_TAG_BITS) - 1)
 #define MAX_FSBUF_SIZE (1 << (8 * sizeof(uint32_t) - FS_TAG_BITS))
+// a wide fs_buf has 8-byte dir/parent tags, so it is only limited by the 32-bit name offsets of the API
+#define MAX_WIDE_FSBUF_SIZE ((uint32_t)(0 - FS_NEW_BLK_SIZE))
+// a fs_buf this close to MAX_FSBUF_SIZE is widened before the next change
+#define WIDEN_MARGIN (MAX_FSBUF_SIZE / 16)
 
 #define FS_TAG_FILE 0
 #define FS_TAG_DIR 1
-
+// padding: an empty name followed by a 1-byte (PAD) or 4-byte (PAD_LONG) tag holding the size of
+// the whole padding. it only ever follows the parent tag of a sibling block (or other padding),
+// so code walking a sibling block never meets it, and next_name skips it.
+#define FS_TAG_PAD 2
+#define FS_TAG_PAD_LONG 3
+#define MIN_PAD_SIZE 2
+#define MAX_SHORT_PAD_SIZE ((1 << (8 - FS_TAG_BITS)) - 1)
+
+// free space reserved after a sibling block when it has to be grown by moving the data after it,
+// so that the following insertions into the same folder only move its parent tag
+#define MIN_BLOCK_SLACK 128
+#define MAX_BLOCK_SLACK (64 << 10)
+
+// paddings are squeezed out once they take a quarter of the buffer, and always before saving
+#ifndef MIN_COMPACT_PAD_SIZE
+#define MIN_COMPACT_PAD_SIZE (1 << 20)
+#endif
+
+// the data of larger fs_bufs is backed by transparent huge pages where the kernel allows it
+#ifndef MIN_HUGEPAGE_SIZE
+#define MIN_HUGEPAGE_SIZE (64 << 20)
+#endif
+
+// trim_fs_buf leaves this much room after tail, and does nothing unless it frees as much again
+#ifndef MIN_TRIM_SIZE
+#define MIN_TRIM_SIZE (4 << 20)
+#endif
+
+// folders with at least this many kids get a hashed kids index
+#ifndef MIN_INDEXED_KIDS
+#define MIN_INDEXED_KIDS 512
+#endif
+
+// a record naming a dictionary entry (see intern_fs_buf) holds NAME_REF and the id of the entry
+// in base-254 digits, each plus 2 and the lowest first, so the record is still a C string.
+// names can't contain '/', so no name starts like that.
+#define NAME_REF '/'
+#define MAX_REF_SIZE 5
+#define MAX_DICT_COUNT (254 * 254 * 254)
+
+// a front coded record (see front_code_fs_buf) holds NAME_REF, FRONT_CODED, the length of the prefix
+// its name shares with the record before it, the distance back to the full record starting its run
+// in 2 base-255 digits (each plus 1, the lowest first) and the rest of its name
+#define FRONT_CODED 1
+#define FRONT_HEADER_SIZE 5
+// the records of a run are decoded from its first one, which is restarted this often
+#define FRONT_RUN_LENGTH 16
+
+// counters of the names hashed into them while looking for names worth interning
+#define NAME_COUNTER_BITS 22
+
+// a saved fs_buf has a checksum for every run of sibling blocks this large, so that a damaged
+// run can be cut out and scanned again instead of building the whole tree again
+#ifndef CHECKSUM_CHUNK_SIZE
+#define CHECKSUM_CHUNK_SIZE (64 << 10)
+#endif
 
 #define streq(a, b) (strcmp(a, b) == 0)
 #define strneq(a, b, n) (strncmp(a, b, n) == 0)
@@ -40,12 +117,157 @@
 #define strstartwith(a, b) (strncmp(a, b, strlen(b)) == 0)
 #define strendwith(a, b) (strncmp(a + strlen(a) - strlen(b), b, strlen(b)) == 0)
 
+// hashed kids of a large folder, so that path lookups, insertions and walks up to the parent
+// (get_folder_tail_offset) don't scan its sibling block
+typedef struct __kids_slot__ {
+	uint32_t hash;
+	// name offset - kids offset + 1, 0 means an empty slot
+	uint32_t rel_off;
+} kids_slot;
+
+typedef struct __kids_index__ {
+	uint32_t kids_off;
+	// offset of the parent tag ending the sibling block
+	uint32_t tail_off;
+	uint32_t count;
+	uint32_t mask;
+	kids_slot *slots;
+} kids_index;
+
+// a sibling block and the blocks of the subtrees of its folders, which follow it in tree order:
+// the subtree ends where the first block after them starts (or at tail)
+typedef struct __block_extent__ {
+	uint32_t kids_off;
+	// number of blocks nested in it
+	uint32_t nested;
+} block_extent;
+
+// the data of a fs_buf pinned by snapshots (see snapshot_fs_buf), freed by the last one letting go
+typedef struct __fs_share__ {
+	// one held by the fs_buf while it still works on the data, and one by every snapshot
+	uint32_t refs;
+	// size of the mapping head points to, and fold if the fs_buf is folded
+	uint32_t size;
+	char *head;
+	char *fold;
+	// the extent table as it was when the data was shared, the fs_buf copies it on its next change
+	block_extent *extents;
+} fs_share;
+
+// flags of fs_buf_header
+#define FS_BUF_FRONT_CODED 1
+#define FS_BUF_EXTENTS 2
+#define FS_BUF_FOLDED 4
+
+// saved after the data of a fs_buf at an 8-byte boundary, followed by the dictionary, the chunk table,
+// the fold column (FS_BUF_FOLDED, see write_fold) and the extent table (FS_BUF_EXTENTS), which takes
+// the rest of the file
+typedef struct __fs_buf_header__ {
+	fs_buf_info info;
+	uint32_t chunk_count;
+	// size of the names of the dictionary, 0 if the fs_buf is not interned
+	uint32_t dict_size;
+	uint32_t flags;
+	// size of the data once unpacked, only set in packed files
+	uint32_t data_size;
+	// of the header with checksum 0, the dictionary and the chunk table
+	uint64_t checksum;
+} fs_buf_header;
+
+// a run of whole sibling blocks ending at end_off, it starts where the one before ends.
+// the first one starts at DATA_START, so it covers the root path too.
+typedef struct __fs_chunk__ {
+	uint32_t end_off;
+	uint32_t reserved;
+	// seeded with the start offset, so a run hashes differently elsewhere. the bytes of the fold
+	// column (FS_BUF_FOLDED) are hashed after the data, seeded with its hash.
+	uint64_t hash;
+} fs_chunk;
+
+// the names shared by the records of an interned fs_buf. it doesn't change once built, so
+// snapshots take a reference to it and the last one frees it.
+typedef struct __fs_dict__ {
+	uint32_t refs;
+	uint32_t count;
+	// the names one after another by id
+	char *names;
+	// the same names folded (see fold_utf8), at the same offsets
+	char *folded;
+	uint32_t size;
+	// offset of every name in names
+	uint32_t *offs;
+	// open addressing of id + 1 by hash_name, to intern the names inserted later
+	uint32_t *slots;
+	uint32_t mask;
+} fs_dict;
+
+// the pinyin tokens of a name with chinese words (see get_pinyin_tokens), at pinyin_off in the pool
+typedef struct __pinyin_entry__ {
+	uint32_t name_off;
+	uint32_t pinyin_off;
+} pinyin_entry;
+
+// the pinyin of the names with chinese words sorted by name_off, so that a pinyin search converts no
+// names (see build_pinyin_table). snapshots take a reference to it, and the first change after that
+// works on a copy (see unshare_fs_buf).
+typedef struct __pinyin_table__ {
+	uint32_t refs;
+	pinyin_entry *entries;
+	uint32_t count;
+	uint32_t capacity;
+	// the tokens of the entries one after another
+	char *pool;
+	uint32_t pool_size;
+	uint32_t pool_capacity;
+	// bytes of the pool of the entries dropped since, it is packed when it fills up
+	uint32_t dead_size;
+} pinyin_table;
+
+// the free space of a fs_buf is kept as a gap at the last edit point instead of after tail,
+// so a mutation only moves the bytes between the last edit point and this one. names are
+// addressed by logical offsets, the bytes at and after gap_start are stored past the gap.
+// the gap always sits between two records (names, parent tags or paddings), so a record never straddles it.
 struct __fs_buf__
 {
+	// a mapping of capacity bytes, see alloc_data
 	char *head;
+	// the fold column, 0 unless folded (see fold_fs_buf): a mapping of capacity bytes like head, with the
+	// gap at the same place, that holds the folded name of each record at its offset (see fold_record).
+	// the rest of it is not kept up to date, the records are always read from head.
+	char *fold;
 	uint32_t capacity;
 	uint32_t tail;
+	uint32_t gap_start;
 	uint32_t first_name_off;
+	// bytes of padding, may over count, compact_fs_buf finds the real ones
+	uint32_t pad_size;
+	// size of the private file mapping head points to, 0 means head is an anonymous mapping
+	uint32_t mapped_size;
+	// set once a snapshot shares head, the next change then works on a copy (see unshare_fs_buf)
+	fs_share *share;
+	// size of dir/parent tags and long paddings, sizeof(uint32_t) or sizeof(uint64_t) (wide)
+	uint32_t tag_size;
+	// kids indexes sorted by kids_off, they follow the blocks when data moves (see open_range,
+	// remove_range and set_padding), and are dropped when everything moves (compact, widen)
+	kids_index **indexes;
+	uint32_t index_count;
+	uint32_t index_capacity;
+	// extents of all blocks sorted by kids_off, so that get_tree_end_offset doesn't walk the subtree.
+	// kept up to date like the kids indexes and saved with the data, 0 until built (see build_extents)
+	block_extent *extents;
+	uint32_t extent_count;
+	uint32_t extent_capacity;
+	// pinyin of the names with chinese words, kept up to date like the extents. 0 until built, it is
+	// not saved with the data.
+	pinyin_table *pinyins;
+	fs_buf_info info;
+	// chunk table of the file the fs_buf was loaded from, dropped by the first change (see check_fs_buf)
+	fs_chunk *chunks;
+	uint32_t chunk_count;
+	// names shared by the records, 0 unless interned
+	fs_dict *dict;
+	// whether the names are front coded when the records are rewritten, see front_code_fs_buf
+	int front_coded;
 	pthread_rwlock_t lock;
 };
 
@@ -74,14 +296,21 @@ enum compare_lang {
 // take the string comparator related parameters into one pointer, it will be parsed in the callback funcation.
 typedef struct compare_query_s {
 	void *query;
+	size_t query_len;
 	bool icase;
+	// the query is folded and compared with the folded names byte for byte, see fold_fs_buf
+	bool folded;
 	uint8_t lang;
+	// the query compiled for the pinyin tokens of the names, 0 if it is a regex or too long for them
+	pinyin_query *pinyin;
 } compare_query_t;
 
 typedef struct search_context_s {
 	fs_buf *fsbuf;
 	comparator_fn compara_fn;
+	// grown as the results are found, up to req_results of them
 	uint32_t *results;
+	uint32_t results_size;
 	void *query;
 	search_rule *search_rules;
 	uint32_t num_results;
@@ -89,350 +318,3154 @@ typedef struct search_context_s {
 	uint32_t start_pos;
 	uint32_t end_pos;
 	int max_count;
+	// the chunk searched, it stops once the chunks before *stop_chunk have max_count results, see search_chunks_t
+	uint32_t chunk;
+	const uint32_t *stop_chunk;
+	bool no_memory;
+	// whether the dictionary entries match the query, by id: 0 unknown, 1 no, 2 yes
+	uint8_t *dict_matches;
+	// whether the names are matched from the fold column
+	bool folded;
+	// the pinyin of the names, matched with pinyin_fn instead of converting them, if the query has LANG_PINYIN
+	const pinyin_table *pinyins;
+	comparator_fn pinyin_fn;
 } search_thread_context_t;
 
+// the range of a search cut into chunks that meet at records. the threads take them in order until
+// none is left, so a thread done with a chunk of few or short names goes on with those the others
+// haven't got to, and they are all busy until the end. with max_count, the chunks after those that
+// have max_count results together aren't searched, or stop if they are.
+typedef struct search_chunks_s {
+	fs_buf *fsbuf;
+	void *(*search_fn)(void *);
+	search_thread_context_t **contexts;
+	uint32_t count;
+	uint32_t start_off;
+	uint32_t end_off;
+	uint32_t size;
+	int max_count;
+	// the next chunk to take, and the first one not needed any more
+	uint32_t next;
+	uint32_t stop;
+	// the chunks done, and the results of those done in a row from the first one
+	pthread_mutex_t lock;
+	bool *done;
+	uint32_t done_count;
+	uint32_t done_results;
+} search_chunks_t;
+
+// the chunks of a search per thread, the larger ones are cut into chunks of at least SEARCH_CHUNK_SIZE bytes
+#define SEARCH_CHUNKS_PER_THREAD	16
+#define SEARCH_CHUNK_SIZE			(64 << 10)
+
 static FsearchThreadPool *search_pool;
 
-// Linear File Tree
+// Linear File Tree, followed by the version (0 means 1)
 static const char fsbuf_magic[] = "LFT";
+// Linear File Tree, Wide
+static const char wide_fsbuf_magic[] = "LFW";
 
-__attribute__((visibility("default"))) fs_buf *new_fs_buf(uint32_t capacity, const char *root_path)
-{
-	if (capacity > MAX_FSBUF_SIZE || root_path == 0)
-		return 0;
-
-	if (strlen(root_path) + FS_NEW_BLK_SIZE > capacity)
-		return 0;
-
-	if (root_path[0] != '/' || root_path[strlen(root_path) - 1] != '/')
-		return 0;
-
-	fs_buf *fsbuf = malloc(sizeof(fs_buf));
-	if (fsbuf == 0)
-		return 0;
-
-	if (pthread_rwlock_init(&fsbuf->lock, 0) != 0)
-	{
-		free(fsbuf);
-		return 0;
-	}
+#define IS_WIDE(fsbuf) ((fsbuf)->tag_size == sizeof(uint64_t))
+#define MAX_SIZE(fsbuf) (IS_WIDE(fsbuf) ? MAX_WIDE_FSBUF_SIZE : MAX_FSBUF_SIZE)
 
-	fsbuf->capacity = capacity;
-	fsbuf->head = malloc(capacity);
-	if (fsbuf->head == 0)
-	{
-		pthread_rwlock_destroy(&fsbuf->lock);
-		free(fsbuf);
-		return 0;
+static uint32_t hash_name(const char *name, uint32_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (uint32_t i = 0; i < len; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
 	}
+	return hash;
+}
 
-	// first DATA_START bytes left for serialization magic & size
-	strcpy(fsbuf->head + DATA_START, root_path);
-	fsbuf->first_name_off = fsbuf->tail = DATA_START + strlen(root_path) + 1;
-	return fsbuf;
+static uint32_t decode_ref(const char *name)
+{
+	uint32_t id = 0, base = 1;
+	for (const uint8_t *p = (const uint8_t *)name + 1; *p; p++, base *= 254)
+		id += (*p - 2) * base;
+	return id;
 }
 
-__attribute__((visibility("default"))) void free_fs_buf(fs_buf *fsbuf)
+// write the record name of a dictionary entry to ref, it takes MAX_REF_SIZE bytes at most
+static void encode_ref(uint32_t id, char *ref)
 {
-	if (0 == fsbuf)
-		return;
+	*ref++ = NAME_REF;
+	do
+	{
+		*ref++ = id % 254 + 2;
+		id /= 254;
+	} while (id);
+	*ref = 0;
+}
 
-	if (fsbuf->head)
-		free(fsbuf->head);
+static inline int is_front_coded(const char *record)
+{
+	return record[0] == NAME_REF && record[1] == FRONT_CODED;
+}
 
-	pthread_rwlock_destroy(&fsbuf->lock);
-	free(fsbuf);
+static inline uint32_t get_front_prefix(const char *record)
+{
+	return (uint8_t)record[2];
 }
 
-__attribute__((visibility("default"))) uint32_t get_capacity(fs_buf *fsbuf)
+static inline uint32_t get_front_distance(const char *record)
 {
-	return fsbuf->capacity;
+	return ((uint8_t)record[3] - 1) + ((uint8_t)record[4] - 1) * 255;
 }
 
-__attribute__((visibility("default"))) const char *get_root_path(fs_buf *fsbuf)
+static inline void set_front_distance(char *record, uint32_t distance)
 {
-	return fsbuf->head + DATA_START;
+	record[3] = distance % 255 + 1;
+	record[4] = distance / 255 + 1;
 }
 
-__attribute__((visibility("default"))) uint32_t get_tail(fs_buf *fsbuf)
+// write the front coded record of a name sharing prefix bytes with the record before it
+static void encode_front(char *record, uint32_t prefix, uint32_t distance, const char *suffix)
 {
-	return fsbuf->tail;
+	record[0] = NAME_REF;
+	record[1] = FRONT_CODED;
+	record[2] = prefix;
+	set_front_distance(record, distance);
+	strcpy(record + FRONT_HEADER_SIZE, suffix);
 }
 
-__attribute__((visibility("default"))) uint32_t first_name(fs_buf *fsbuf)
+static void copy_name(char *buf, const char *name)
 {
-	return fsbuf->first_name_off;
+	uint32_t len = strnlen(name, NAME_MAX);
+	memcpy(buf, name, len);
+	buf[len] = 0;
 }
 
-__attribute__((visibility("default"))) char *get_name(fs_buf *fsbuf, uint32_t name_off)
+// the start of the UTF-8 character of name at off. a front coded prefix ends there, so that the
+// suffix of the folded name is as long as the one of the name (see fold_record).
+static inline uint32_t get_char_boundary(const char *name, uint32_t off)
 {
-	return fsbuf->head + name_off;
+	while (off && (name[off] & 0xC0) == 0x80)
+		off--;
+	return off;
 }
 
-static int add_capacity(fs_buf *fsbuf, uint32_t size)
+// turn the name before a front coded record in buf into its name, the suffix is the one of the
+// record or the one the fold column keeps for it
+static void apply_front_code(char *buf, const char *record, const char *suffix)
 {
-	uint32_t alloc_size = size / FS_NEW_BLK_SIZE;
-	alloc_size = alloc_size * FS_NEW_BLK_SIZE;
-	if (alloc_size < size)
-		alloc_size += FS_NEW_BLK_SIZE;
-	if (fsbuf->capacity + alloc_size > MAX_FSBUF_SIZE)
-		return 1;
+	uint32_t prefix = MIN(get_front_prefix(record), strlen(buf));
+	uint32_t len = strnlen(suffix, NAME_MAX - prefix);
+	memcpy(buf + prefix, suffix, len);
+	buf[prefix + len] = 0;
+}
 
-	char *p = realloc(fsbuf->head, fsbuf->capacity + alloc_size);
-	if (p == 0) // TODO alert here
-		return 1;
+// the name a record holds, which is in the dictionary if the record refers to it.
+// a front coded record is left as it is, see decode_name.
+static inline const char *resolve_name(const fs_dict *dict, const char *name)
+{
+	if (*name != NAME_REF || dict == 0 || name[1] == FRONT_CODED)
+		return name;
 
-	fsbuf->head = p;
-	fsbuf->capacity += alloc_size;
-	return 0;
+	// a broken record is left as it is, it can't be found by name then
+	uint32_t id = decode_ref(name);
+	return id < dict->count ? dict->names + dict->offs[id] : name;
 }
 
-static void set_parent_offset(fs_buf *fsbuf, uint32_t name_off, uint32_t parent_off)
+// id + 1 of name in the dictionary, 0 if it's not there
+static uint32_t find_dict_name(const fs_dict *dict, const char *name)
 {
-	// set empty string
-	*(fsbuf->head + name_off) = 0;
-	// set parent tag
-	uint32_t *tag = (uint32_t *)(fsbuf->head + name_off + 1);
-	// internally we use relative offset w.r.t. to the tag (not the name)
-	// and note that parent is always ahead
-	// 0 means root
-	if (parent_off > 0)
-		parent_off = name_off + 1 - parent_off;
-	*tag = (parent_off << FS_TAG_BITS) + FS_TAG_DIR;
+	for (uint32_t i = hash_name(name, strlen(name)) & dict->mask; dict->slots[i]; i = (i + 1) & dict->mask)
+	{
+		if (streq(dict->names + dict->offs[dict->slots[i] - 1], name))
+			return dict->slots[i];
+	}
+	return 0;
 }
 
-static int insert_new_name(fs_buf *fsbuf, uint32_t off, char *name, int is_dir, int create_parent_tag)
+static void release_dict(fs_dict *dict)
 {
-	uint32_t tag_size = is_dir ? sizeof(uint32_t) : 1;
-	uint32_t extra_size = strlen(name) + 1 + tag_size + (create_parent_tag ? 1 + sizeof(uint32_t) : 0);
+	if (dict == 0 || __sync_sub_and_fetch(&dict->refs, 1) != 0)
+		return;
 
-	if (extra_size + fsbuf->tail >= fsbuf->capacity)
-		if (add_capacity(fsbuf, extra_size) != 0)
-			return ERR_NO_MEM;
+	free(dict->names);
+	free(dict->folded);
+	free(dict->offs);
+	free(dict->slots);
+	free(dict);
+}
 
-	if (fsbuf->tail > off)
-		memmove(fsbuf->head + off + extra_size, fsbuf->head + off, fsbuf->tail - off);
+// a dictionary of the names, which it takes over. they must all be different.
+static fs_dict *new_dict(char *names, uint32_t size)
+{
+	fs_dict *dict = calloc(1, sizeof(fs_dict));
+	if (dict == 0)
+	{
+		free(names);
+		return 0;
+	}
 
-	strcpy(fsbuf->head + off, name);
-	off += strlen(name) + 1;
+	dict->refs = 1;
+	dict->names = names;
+	dict->size = size;
+	for (uint32_t off = 0; off < size; off++)
+		dict->count += names[off] == 0;
+
+	uint32_t slot_count = 1;
+	while (slot_count < dict->count * 2)
+		slot_count *= 2;
+	dict->mask = slot_count - 1;
+	dict->folded = malloc(MAX(size, 1));
+	dict->offs = malloc(MAX(dict->count, 1) * sizeof(uint32_t));
+	dict->slots = calloc(slot_count, sizeof(uint32_t));
+	if (dict->folded == 0 || dict->offs == 0 || dict->slots == 0 || dict->count > MAX_DICT_COUNT || (size && names[size - 1]))
+	{
+		release_dict(dict);
+		return 0;
+	}
 
-	if (is_dir)
+	for (uint32_t id = 0, off = 0; id < dict->count; off += strlen(names + off) + 1, id++)
 	{
-		uint32_t *tag = (uint32_t *)(fsbuf->head + off);
-		*tag = FS_TAG_DIR;
+		dict->offs[id] = off;
+		uint32_t i = hash_name(names + off, strlen(names + off)) & dict->mask;
+		while (dict->slots[i])
+			i = (i + 1) & dict->mask;
+		dict->slots[i] = id + 1;
 	}
-	else
+	fold_utf8(dict->folded, names, size);
+	return dict;
+}
+
+// the record to store for name: a reference to it if it's in the dictionary, or name itself
+static const char *store_name(fs_buf *fsbuf, const char *name, char *ref)
+{
+	uint32_t id = fsbuf->dict ? find_dict_name(fsbuf->dict, name) : 0;
+	if (id == 0)
+		return name;
+
+	encode_ref(id - 1, ref);
+	return ref;
+}
+
+// position of the first index with kids_off not before off
+static uint32_t find_kids_index(fs_buf *fsbuf, uint32_t off)
+{
+	uint32_t lo = 0, hi = fsbuf->index_count;
+	while (lo < hi)
 	{
-		*(fsbuf->head + off) = FS_TAG_FILE;
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (fsbuf->indexes[mid]->kids_off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
 
-	fsbuf->tail += extra_size;
-	return 0;
+static kids_index *get_kids_index(fs_buf *fsbuf, uint32_t kids_off)
+{
+	uint32_t i = find_kids_index(fsbuf, kids_off);
+	return i < fsbuf->index_count && fsbuf->indexes[i]->kids_off == kids_off ? fsbuf->indexes[i] : 0;
 }
 
-int append_new_name(fs_buf *fsbuf, char *name, int is_dir)
+static void free_kids_index(kids_index *index)
 {
-	pthread_rwlock_wrlock(&fsbuf->lock);
-	int r = insert_new_name(fsbuf, fsbuf->tail, name, is_dir, 0);
-	pthread_rwlock_unlock(&fsbuf->lock);
-	return r;
+	free(index->slots);
+	free(index);
 }
 
-int append_parent(fs_buf *fsbuf, uint32_t parent_off)
+static void free_kids_indexes(fs_buf *fsbuf)
 {
-	pthread_rwlock_wrlock(&fsbuf->lock);
-	if (sizeof(uint32_t) + 1 + fsbuf->tail >= fsbuf->capacity)
-		if (add_capacity(fsbuf, 1 + sizeof(uint32_t)) != 0)
-		{
-			pthread_rwlock_unlock(&fsbuf->lock);
-			return ERR_NO_MEM;
-		}
+	for (uint32_t i = 0; i < fsbuf->index_count; i++)
+		free_kids_index(fsbuf->indexes[i]);
+	fsbuf->index_count = 0;
+}
 
-	set_parent_offset(fsbuf, fsbuf->tail, parent_off);
-	fsbuf->tail += 1 + sizeof(uint32_t);
-	pthread_rwlock_unlock(&fsbuf->lock);
-	return 0;
+// the blocks starting at or after off moved by delta
+static void shift_kids_indexes(fs_buf *fsbuf, uint32_t off, int64_t delta)
+{
+	for (uint32_t i = find_kids_index(fsbuf, off); i < fsbuf->index_count; i++)
+	{
+		fsbuf->indexes[i]->kids_off += delta;
+		fsbuf->indexes[i]->tail_off += delta;
+	}
 }
 
-static int do_is_file(fs_buf *fsbuf, uint32_t name_off)
+// the blocks starting in [off, off + size) are gone
+static void drop_kids_indexes(fs_buf *fsbuf, uint32_t off, uint32_t size)
 {
-	return *(fsbuf->head + name_off + strlen(fsbuf->head + name_off) + 1) == FS_TAG_FILE;
+	uint32_t start = find_kids_index(fsbuf, off), end = start;
+	while (end < fsbuf->index_count && fsbuf->indexes[end]->kids_off < off + size)
+		free_kids_index(fsbuf->indexes[end++]);
+	if (end == start)
+		return;
+
+	memmove(fsbuf->indexes + start, fsbuf->indexes + end, (fsbuf->index_count - end) * sizeof(kids_index *));
+	fsbuf->index_count -= end - start;
 }
 
-__attribute__((visibility("default"))) int is_file(fs_buf *fsbuf, uint32_t name_off)
+// position of the first extent with kids_off not before off
+static uint32_t find_extent(fs_buf *fsbuf, uint32_t off)
 {
-	pthread_rwlock_rdlock(&fsbuf->lock);
-	int r = do_is_file(fsbuf, name_off);
-	pthread_rwlock_unlock(&fsbuf->lock);
-	return r;
+	uint32_t lo = 0, hi = fsbuf->extent_count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (fsbuf->extents[mid].kids_off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
-__attribute__((visibility("default"))) uint32_t next_name(fs_buf *fsbuf, uint32_t name_off)
+static uint32_t get_extent_end(fs_buf *fsbuf, uint32_t i)
 {
-	uint32_t tag_off = name_off + strlen(fsbuf->head + name_off) + 1;
-	return *(fsbuf->head + tag_off) == FS_TAG_FILE ? tag_off + 1 : tag_off + sizeof(uint32_t);
+	uint32_t next = i + 1 + fsbuf->extents[i].nested;
+	return next < fsbuf->extent_count ? fsbuf->extents[next].kids_off : fsbuf->tail;
 }
 
-static void do_set_kids_off(fs_buf *fsbuf, uint32_t name_off, uint32_t kids_off)
+static void free_extents(fs_buf *fsbuf)
 {
-	// we don't check if the name is a dir here
-	uint32_t *tag = (uint32_t *)(fsbuf->head + name_off + strlen(fsbuf->head + name_off) + 1);
-	// internally we use relative offset w.r.t. to the tag (not the name)
-	// and note that kid is always after parent
-	if (kids_off != 0)
-		kids_off = kids_off - (name_off + strlen(fsbuf->head + name_off) + 1);
-	*tag = (kids_off << FS_TAG_BITS) + FS_TAG_DIR;
+	// the one snapshots share is freed with the share
+	if (fsbuf->share == 0 || fsbuf->extents != fsbuf->share->extents)
+		free(fsbuf->extents);
+	fsbuf->extents = 0;
+	fsbuf->extent_count = fsbuf->extent_capacity = 0;
 }
 
-void set_kids_off(fs_buf *fsbuf, uint32_t name_off, uint32_t kids_off)
+static void shift_extents(fs_buf *fsbuf, uint32_t off, int64_t delta)
 {
-	pthread_rwlock_wrlock(&fsbuf->lock);
-	do_set_kids_off(fsbuf, name_off, kids_off);
-	pthread_rwlock_unlock(&fsbuf->lock);
+	for (uint32_t i = fsbuf->extents ? find_extent(fsbuf, off) : 0; i < fsbuf->extent_count; i++)
+		fsbuf->extents[i].kids_off += delta;
 }
 
-static uint32_t get_reloff_by_tag(fs_buf *fsbuf, uint32_t tag_off)
+static uint32_t get_parent_offset(fs_buf *fsbuf, uint32_t name_off);
+
+// position of the extent of the block holding folder_off, then of the one holding its parent and
+// so on: these are the blocks whose subtrees folder_off is in. -1 after the root block.
+static uint32_t get_outer_extent(fs_buf *fsbuf, uint32_t folder_off)
 {
-	uint32_t *tag = (uint32_t *)(fsbuf->head + tag_off);
-	return (*tag - (*tag & FS_TAG_MASK)) >> FS_TAG_BITS;
+	return folder_off ? find_extent(fsbuf, folder_off + 1) - 1 : (uint32_t)-1;
 }
 
-static char *do_get_path_by_name_off(fs_buf *fsbuf, uint32_t name_off, char *path, uint32_t path_size)
+static uint32_t get_next_outer_extent(fs_buf *fsbuf, uint32_t i)
 {
-	// dst用于存储文件路径，从后往前写入整个文件全路径，-1是为了保证末尾存在'\0'字符
-	char *src = fsbuf->head + name_off, *dst = path + path_size - strlen(src) - 1;
-	strcpy(dst, src);
-	while (1)
+	return get_outer_extent(fsbuf, get_parent_offset(fsbuf, fsbuf->extents[i].kids_off));
+}
+
+// the blocks in [off, off + size) are gone, the ones they were nested in lose them
+static void drop_extents(fs_buf *fsbuf, uint32_t off, uint32_t size)
+{
+	if (fsbuf->extents == 0)
+		return;
+
+	uint32_t start = find_extent(fsbuf, off), end = find_extent(fsbuf, off + size);
+	if (start == end)
+		return;
+
+	// the blocks nested around the first one, walked up by their parent tags which are still there
+	for (uint32_t i = start ? get_next_outer_extent(fsbuf, start) : (uint32_t)-1; i != (uint32_t)-1;
+		i = get_next_outer_extent(fsbuf, i))
+		fsbuf->extents[i].nested -= MIN(i + 1 + fsbuf->extents[i].nested, end) - start;
+	memmove(fsbuf->extents + start, fsbuf->extents + end, (fsbuf->extent_count - end) * sizeof(block_extent));
+	fsbuf->extent_count -= end - start;
+}
+
+// a new block at kids_off holds the kids of folder_off, it is nested in the blocks folder_off is in
+static void add_extent(fs_buf *fsbuf, uint32_t kids_off, uint32_t folder_off)
+{
+	if (fsbuf->extents == 0)
+		return;
+
+	if (fsbuf->extent_count == fsbuf->extent_capacity)
 	{
-		if (*src != 0)
+		uint32_t capacity = fsbuf->extent_capacity * 2;
+		block_extent *extents = realloc(fsbuf->extents, capacity * sizeof(block_extent));
+		if (extents == 0)
 		{
-			src = fsbuf->head + next_name(fsbuf, src - fsbuf->head);
-			continue;
+			free_extents(fsbuf);
+			return;
 		}
+		fsbuf->extents = extents;
+		fsbuf->extent_capacity = capacity;
+	}
 
-		src++;
-		uint32_t rel_off = get_reloff_by_tag(fsbuf, src - fsbuf->head);
-		// we have reached the root
-		if (rel_off == 0)
-			break;
+	for (uint32_t j = get_outer_extent(fsbuf, folder_off); j != (uint32_t)-1; j = get_next_outer_extent(fsbuf, j))
+		fsbuf->extents[j].nested++;
+	uint32_t i = find_extent(fsbuf, kids_off);
+	memmove(fsbuf->extents + i + 1, fsbuf->extents + i, (fsbuf->extent_count - i) * sizeof(block_extent));
+	fsbuf->extents[i] = (block_extent){ kids_off, 0 };
+	fsbuf->extent_count++;
+}
 
-		src = src - rel_off;
-		dbg_msg("name: %s, offset: %'ld\n", src, src - fsbuf->head);
-		dst--;
-		*dst = '/';
-		dst -= strlen(src);
-		memcpy(dst, src, strlen(src));
+// position of the first pinyin entry with name_off not before off
+static uint32_t find_pinyin(const pinyin_table *table, uint32_t off)
+{
+	uint32_t lo = 0, hi = table->count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (table->entries[mid].name_off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-
-	dst -= (fsbuf->first_name_off - DATA_START - 1);
-	memcpy(dst, fsbuf->head + DATA_START, fsbuf->first_name_off - DATA_START - 1);
-	return dst;
+	return lo;
 }
 
-__attribute__((visibility("default"))) char *get_path_by_name_off(fs_buf *fsbuf, uint32_t name_off, char *path, uint32_t path_size)
+static void release_pinyins(pinyin_table *table)
 {
-	pthread_rwlock_rdlock(&fsbuf->lock);
-	char *dst = do_get_path_by_name_off(fsbuf, name_off, path, path_size);
-	pthread_rwlock_unlock(&fsbuf->lock);
-	return dst;
+	if (table == 0 || __sync_sub_and_fetch(&table->refs, 1) != 0)
+		return;
+
+	free(table->entries);
+	free(table->pool);
+	free(table);
 }
 
-__attribute__((visibility("default"))) int save_fs_buf(fs_buf *fsbuf, const char *filename)
+// stop keeping the pinyin table, e.g. if it can't grow. searches convert the names themselves then.
+static void free_pinyins(fs_buf *fsbuf)
 {
-	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd < 0)
-		return 1;
+	release_pinyins(fsbuf->pinyins);
+	fsbuf->pinyins = 0;
+}
 
-	pthread_rwlock_rdlock(&fsbuf->lock);
-	memcpy(fsbuf->head, fsbuf_magic, strlen(fsbuf_magic) + 1);
-	memcpy(fsbuf->head + strlen(fsbuf_magic) + 1, &fsbuf->tail, sizeof(fsbuf->tail));
+static pinyin_table *copy_pinyins(const pinyin_table *table)
+{
+	pinyin_table *copy = malloc(sizeof(pinyin_table));
+	if (copy == 0)
+		return 0;
 
-	if (write_file(fd, fsbuf->head, fsbuf->tail) != 0)
+	*copy = *table;
+	copy->refs = 1;
+	copy->capacity = MAX(table->count, 1);
+	copy->pool_capacity = MAX(table->pool_size, 1);
+	copy->entries = malloc(copy->capacity * sizeof(pinyin_entry));
+	copy->pool = malloc(copy->pool_capacity);
+	if (copy->entries == 0 || copy->pool == 0)
 	{
-		pthread_rwlock_unlock(&fsbuf->lock);
-		close(fd);
-		return 2;
+		release_pinyins(copy);
+		return 0;
 	}
-	pthread_rwlock_unlock(&fsbuf->lock);
 
-	close(fd);
-	return 0;
+	memcpy(copy->entries, table->entries, table->count * sizeof(pinyin_entry));
+	memcpy(copy->pool, table->pool, table->pool_size);
+	return copy;
 }
 
-__attribute__((visibility("default"))) int load_fs_buf(fs_buf **pfsbuf, const char *filename)
+// the names in [start, end) moved by delta
+static void shift_pinyins(fs_buf *fsbuf, uint32_t start, uint32_t end, int64_t delta)
 {
-	int fd = open(filename, O_RDONLY);
-	if (fd < 0)
+	pinyin_table *table = fsbuf->pinyins;
+	if (table == 0)
+		return;
+
+	for (uint32_t i = find_pinyin(table, start); i < table->count && table->entries[i].name_off < end; i++)
+		table->entries[i].name_off += delta;
+}
+
+// the names in [off, off + size) are gone
+static void drop_pinyins(fs_buf *fsbuf, uint32_t off, uint32_t size)
+{
+	pinyin_table *table = fsbuf->pinyins;
+	if (table == 0)
+		return;
+
+	uint32_t start = find_pinyin(table, off), end = find_pinyin(table, off + size);
+	for (uint32_t i = start; i < end; i++)
+		table->dead_size += strlen(table->pool + table->entries[i].pinyin_off) + 1;
+	memmove(table->entries + start, table->entries + end, (table->count - end) * sizeof(pinyin_entry));
+	table->count -= end - start;
+}
+
+// move the pinyin of the entries to a new pool of capacity bytes, leaving the dead ones behind
+static int pack_pinyins(pinyin_table *table, uint32_t capacity)
+{
+	char *pool = malloc(capacity);
+	if (pool == 0)
 		return 1;
 
-	char magic[4];
-	if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, fsbuf_magic, sizeof(magic)) != 0)
+	uint32_t size = 0;
+	for (uint32_t i = 0; i < table->count; i++)
 	{
-		close(fd);
-		return 2;
+		const char *pinyin = table->pool + table->entries[i].pinyin_off;
+		uint32_t len = strlen(pinyin) + 1;
+		memcpy(pool + size, pinyin, len);
+		table->entries[i].pinyin_off = size;
+		size += len;
 	}
 
-	uint32_t size;
-	if (read(fd, &size, sizeof(size)) != sizeof(size) || size < sizeof(uint32_t) * 2 + 5)
-	{
-		close(fd);
-		return 3;
-	}
+	free(table->pool);
+	table->pool = pool;
+	table->pool_size = size;
+	table->pool_capacity = capacity;
+	table->dead_size = 0;
+	return 0;
+}
 
-	fs_buf *fsbuf = malloc(sizeof(fs_buf));
-	if (fsbuf == 0)
+// insert the pinyin of the name at name_off as the i-th entry
+static void put_pinyin(fs_buf *fsbuf, uint32_t i, uint32_t name_off, const char *pinyin)
+{
+	pinyin_table *table = fsbuf->pinyins;
+	uint32_t len = strlen(pinyin) + 1;
+	if (table->count == table->capacity)
 	{
-		close(fd);
-		return 4;
+		uint32_t capacity = MAX(table->capacity * 2, 1024);
+		pinyin_entry *entries = realloc(table->entries, capacity * sizeof(pinyin_entry));
+		if (entries == 0)
+		{
+			free_pinyins(fsbuf);
+			return;
+		}
+		table->entries = entries;
+		table->capacity = capacity;
 	}
 
-	if (pthread_rwlock_init(&fsbuf->lock, 0) != 0)
+	if ((uint64_t)table->pool_size + len > table->pool_capacity)
 	{
-		free(fsbuf);
-		close(fd);
-		return 5;
+		// twice the live bytes, so that it is packed again only after as many more come or go
+		uint64_t capacity = MAX(((uint64_t)table->pool_size - table->dead_size + len) * 2, 64 * 1024);
+		if (capacity > UINT32_MAX || pack_pinyins(table, capacity) != 0)
+		{
+			free_pinyins(fsbuf);
+			return;
+		}
 	}
 
-	fsbuf->head = malloc(size);
-	if (fsbuf->head == 0)
-	{
-		pthread_rwlock_destroy(&fsbuf->lock);
-		free(fsbuf);
-		close(fd);
-		return 6;
-	}
+	memmove(table->entries + i + 1, table->entries + i, (table->count - i) * sizeof(pinyin_entry));
+	table->entries[i] = (pinyin_entry){ name_off, table->pool_size };
+	table->count++;
+	memcpy(table->pool + table->pool_size, pinyin, len);
+	table->pool_size += len;
+}
 
-	posix_fadvise(fd, sizeof(uint32_t) * 2, 0, POSIX_FADV_SEQUENTIAL);
+static void put_kids_slot(kids_index *index, uint32_t hash, uint32_t rel_off)
+{
+	uint32_t i = hash & index->mask;
+	while (index->slots[i].rel_off)
+		i = (i + 1) & index->mask;
+	index->slots[i].hash = hash;
+	index->slots[i].rel_off = rel_off;
+}
 
-	if (read_file(fd, fsbuf->head + sizeof(uint32_t) * 2, size - sizeof(uint32_t) * 2) != 0)
-	{
-		free(fsbuf->head);
-		pthread_rwlock_destroy(&fsbuf->lock);
-		free(fsbuf);
-		close(fd);
-		return 7;
-	}
+// keep the load factor under 1/2
+static int reserve_kids_slots(kids_index *index, uint32_t count)
+{
+	if (count * 2 <= index->mask + 1)
+		return 0;
 
-	close(fd);
+	uint32_t size = 64;
+	while (size < count * 2)
+		size *= 2;
 
-	fsbuf->capacity = fsbuf->tail = size;
-	fsbuf->first_name_off = DATA_START + strlen(fsbuf->head + DATA_START) + 1;
-	*pfsbuf = fsbuf;
-	return 0;
+	kids_slot *slots = calloc(size, sizeof(kids_slot)), *old_slots = index->slots;
+	if (slots == 0)
+		return 1;
+
+	uint32_t old_size = old_slots ? index->mask + 1 : 0;
+	index->slots = slots;
+	index->mask = size - 1;
+	for (uint32_t i = 0; i < old_size; i++)
+		if (old_slots[i].rel_off)
+			put_kids_slot(index, old_slots[i].hash, old_slots[i].rel_off);
+	free(old_slots);
+	return 0;
+}
+
+static void advise_data(char *head, uint32_t size)
+{
+#ifdef MADV_HUGEPAGE
+	if (size >= MIN_HUGEPAGE_SIZE)
+		madvise(head, size, MADV_HUGEPAGE);
+#endif
+}
+
+// the data is kept in anonymous mappings instead of the heap: growing one is a mremap that
+// doesn't copy, its untouched room costs no memory, and trim_fs_buf can give its slack back.
+static char *alloc_data(uint32_t size)
+{
+	char *head = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (head == MAP_FAILED)
+		return 0;
+
+	advise_data(head, size);
+	return head;
+}
+
+static char *resize_data(char *head, uint32_t old_size, uint32_t size)
+{
+	char *p = mremap(head, old_size, size, MREMAP_MAYMOVE);
+	if (p == MAP_FAILED)
+		return 0;
+
+	advise_data(p, size);
+	return p;
+}
+
+static void release_data(char *head, uint32_t size)
+{
+	munmap(head, size);
+}
+
+static void release_share(fs_share *share)
+{
+	if (__sync_sub_and_fetch(&share->refs, 1) != 0)
+		return;
+
+	release_data(share->head, share->size);
+	if (share->fold)
+		release_data(share->fold, share->size);
+	free(share->extents);
+	free(share);
+}
+
+// stop keeping the fold column, e.g. if it can't grow with the data. searches fold the names themselves then.
+static void drop_fold(fs_buf *fsbuf)
+{
+	if (fsbuf->fold && fsbuf->share == 0)
+		release_data(fsbuf->fold, fsbuf->capacity);
+	fsbuf->fold = 0;
+}
+
+static fs_buf *do_new_fs_buf(uint32_t capacity, const char *root_path, uint32_t tag_size)
+{
+	if (capacity > (tag_size == sizeof(uint64_t) ? MAX_WIDE_FSBUF_SIZE : MAX_FSBUF_SIZE) || root_path == 0)
+		return 0;
+
+	if (strlen(root_path) + FS_NEW_BLK_SIZE > capacity)
+		return 0;
+
+	if (root_path[0] != '/' || root_path[strlen(root_path) - 1] != '/')
+		return 0;
+
+	fs_buf *fsbuf = malloc(sizeof(fs_buf));
+	if (fsbuf == 0)
+		return 0;
+
+	if (pthread_rwlock_init(&fsbuf->lock, 0) != 0)
+	{
+		free(fsbuf);
+		return 0;
+	}
+
+	fsbuf->capacity = capacity;
+	fsbuf->mapped_size = 0;
+	fsbuf->share = 0;
+	fsbuf->pad_size = 0;
+	fsbuf->tag_size = tag_size;
+	fsbuf->indexes = 0;
+	fsbuf->index_count = fsbuf->index_capacity = 0;
+	fsbuf->extents = 0;
+	fsbuf->extent_count = fsbuf->extent_capacity = 0;
+	fsbuf->pinyins = 0;
+	fsbuf->chunks = 0;
+	fsbuf->chunk_count = 0;
+	fsbuf->dict = 0;
+	fsbuf->front_coded = 0;
+	fsbuf->fold = 0;
+	memset(&fsbuf->info, 0, sizeof(fsbuf->info));
+	fsbuf->info.version = FS_BUF_VERSION;
+	fsbuf->info.build_time = time(0);
+	get_fs_uuid(root_path, fsbuf->info.fs_uuid, sizeof(fsbuf->info.fs_uuid));
+	fsbuf->head = alloc_data(capacity);
+	if (fsbuf->head == 0)
+	{
+		pthread_rwlock_destroy(&fsbuf->lock);
+		free(fsbuf);
+		return 0;
+	}
+
+	// first DATA_START bytes left for serialization magic & size
+	strcpy(fsbuf->head + DATA_START, root_path);
+	fsbuf->first_name_off = fsbuf->tail = fsbuf->gap_start = DATA_START + strlen(root_path) + 1;
+	return fsbuf;
+}
+
+__attribute__((visibility("default"))) fs_buf *new_fs_buf(uint32_t capacity, const char *root_path)
+{
+	return do_new_fs_buf(capacity, root_path, sizeof(uint32_t));
+}
+
+__attribute__((visibility("default"))) fs_buf *new_wide_fs_buf(uint32_t capacity, const char *root_path)
+{
+	return do_new_fs_buf(capacity, root_path, sizeof(uint64_t));
+}
+
+__attribute__((visibility("default"))) int is_wide_fs_buf(fs_buf *fsbuf)
+{
+	return IS_WIDE(fsbuf);
+}
+
+__attribute__((visibility("default"))) int is_interned_fs_buf(fs_buf *fsbuf)
+{
+	return fsbuf->dict != 0;
+}
+
+__attribute__((visibility("default"))) int is_front_coded_fs_buf(fs_buf *fsbuf)
+{
+	return fsbuf->front_coded;
+}
+
+__attribute__((visibility("default"))) void free_fs_buf(fs_buf *fsbuf)
+{
+	if (0 == fsbuf)
+		return;
+
+	drop_fold(fsbuf);
+	free_extents(fsbuf);
+	if (fsbuf->share)
+		release_share(fsbuf->share);
+	else if (fsbuf->head)
+		release_data(fsbuf->head, fsbuf->capacity);
+
+	free_kids_indexes(fsbuf);
+	free(fsbuf->indexes);
+	release_pinyins(fsbuf->pinyins);
+	free(fsbuf->chunks);
+	release_dict(fsbuf->dict);
+
+	pthread_rwlock_destroy(&fsbuf->lock);
+	free(fsbuf);
+}
+
+__attribute__((visibility("default"))) uint32_t get_capacity(fs_buf *fsbuf)
+{
+	return fsbuf->capacity;
+}
+
+__attribute__((visibility("default"))) const char *get_root_path(fs_buf *fsbuf)
+{
+	return fsbuf->head + DATA_START;
+}
+
+__attribute__((visibility("default"))) uint32_t get_tail(fs_buf *fsbuf)
+{
+	return fsbuf->tail;
+}
+
+__attribute__((visibility("default"))) uint32_t first_name(fs_buf *fsbuf)
+{
+	return fsbuf->first_name_off;
+}
+
+#define GAP_SIZE(fsbuf) ((fsbuf)->capacity - (fsbuf)->tail)
+
+// translate a logical offset to the address of its byte in column, which is head or the fold column
+static inline char *column_ptr(fs_buf *fsbuf, char *column, uint32_t off)
+{
+	return column + (off < fsbuf->gap_start ? off : off + GAP_SIZE(fsbuf));
+}
+
+// translate a logical offset to the address of its byte
+static inline char *fs_ptr(fs_buf *fsbuf, uint32_t off)
+{
+	return column_ptr(fsbuf, fsbuf->head, off);
+}
+
+static inline char *fold_ptr(fs_buf *fsbuf, uint32_t off)
+{
+	return column_ptr(fsbuf, fsbuf->fold, off);
+}
+
+// the name of the record at off like resolve_name, or the folded one if folded is set: the one in
+// the dictionary if the record refers to it, otherwise the one at off in the fold column
+static const char *resolve_column_name(fs_buf *fsbuf, uint32_t off, int folded)
+{
+	const char *record = fs_ptr(fsbuf, off), *name = resolve_name(fsbuf->dict, record);
+	if (!folded)
+		return name;
+	return name == record ? fold_ptr(fsbuf, off) : fsbuf->dict->folded + (name - fsbuf->dict->names);
+}
+
+static inline const char *get_front_suffix(fs_buf *fsbuf, uint32_t off, int folded)
+{
+	return (folded ? fold_ptr(fsbuf, off) : fs_ptr(fsbuf, off)) + FRONT_HEADER_SIZE;
+}
+
+// the name of the record at off (folded if folded is set), a front coded one is decoded into buf
+// (NAME_MAX + 1 bytes) from the first record of its run. the records are always read from head,
+// only the names come from the fold column.
+static const char *decode_column_name(fs_buf *fsbuf, uint32_t off, char *buf, int folded)
+{
+	const char *record = fs_ptr(fsbuf, off);
+	if (!is_front_coded(record))
+		return resolve_column_name(fsbuf, off, folded);
+
+	// a broken record is left as it is
+	uint32_t distance = get_front_distance(record);
+	if (distance == 0 || distance > off - fsbuf->first_name_off)
+		return folded ? fold_ptr(fsbuf, off) : record;
+
+	uint32_t run_off = off - distance;
+	copy_name(buf, resolve_column_name(fsbuf, run_off, folded));
+	for (uint32_t name_off = next_name(fsbuf, run_off); name_off <= off; name_off = next_name(fsbuf, name_off))
+	{
+		record = fs_ptr(fsbuf, name_off);
+		if (is_front_coded(record))
+			apply_front_code(buf, record, get_front_suffix(fsbuf, name_off, folded));
+		else
+			copy_name(buf, resolve_column_name(fsbuf, name_off, folded));
+	}
+	return buf;
+}
+
+static const char *decode_name(fs_buf *fsbuf, uint32_t off, char *buf)
+{
+	return decode_column_name(fsbuf, off, buf, 0);
+}
+
+// decodes the names of the records visited in order, a front coded one from the name before it
+typedef struct __name_cursor__ {
+	fs_buf *fsbuf;
+	// whether the names are read from the fold column
+	int folded;
+	// offset and name of the record visited last
+	uint32_t off;
+	const char *name;
+	char buf[NAME_MAX + 1];
+} name_cursor;
+
+static void init_name_cursor(name_cursor *cursor, fs_buf *fsbuf)
+{
+	cursor->fsbuf = fsbuf;
+	cursor->folded = 0;
+	cursor->off = 0;
+	cursor->name = 0;
+}
+
+// a cursor over the folded names, fsbuf must be folded
+static void init_fold_cursor(name_cursor *cursor, fs_buf *fsbuf)
+{
+	init_name_cursor(cursor, fsbuf);
+	cursor->folded = 1;
+}
+
+static const char *get_cursor_name(name_cursor *cursor, uint32_t off)
+{
+	fs_buf *fsbuf = cursor->fsbuf;
+	const char *record = fs_ptr(fsbuf, off);
+	if (!is_front_coded(record))
+	{
+		cursor->name = resolve_column_name(fsbuf, off, cursor->folded);
+	}
+	else if (cursor->name && next_name(fsbuf, cursor->off) == off)
+	{
+		if (cursor->name != cursor->buf)
+			copy_name(cursor->buf, cursor->name);
+		apply_front_code(cursor->buf, record, get_front_suffix(fsbuf, off, cursor->folded));
+		cursor->name = cursor->buf;
+	}
+	else
+	{
+		cursor->name = decode_column_name(fsbuf, off, cursor->buf, cursor->folded);
+	}
+	cursor->off = off;
+	return cursor->name;
+}
+
+__attribute__((visibility("default"))) char *get_name(fs_buf *fsbuf, uint32_t name_off)
+{
+	static __thread char buf[NAME_MAX + 1];
+	return (char *)decode_name(fsbuf, name_off, buf);
+}
+
+// the name of the record at off was written, keep its pinyin in place of the one it had
+static void add_pinyin(fs_buf *fsbuf, uint32_t off)
+{
+	if (fsbuf->pinyins == 0)
+		return;
+
+	char buf[NAME_MAX + 1], tokens[MAX_PINYIN_TOKENS_LEN];
+	const char *name = decode_name(fsbuf, off, buf);
+	drop_pinyins(fsbuf, off, 1);
+	if (get_pinyin_tokens(name, tokens))
+		put_pinyin(fsbuf, find_pinyin(fsbuf->pinyins, off), off, tokens);
+}
+
+// fill a new pinyin table with the pinyin of the names, in one pass over them
+static int build_pinyins(fs_buf *fsbuf)
+{
+	free_pinyins(fsbuf);
+	fsbuf->pinyins = calloc(1, sizeof(pinyin_table));
+	if (fsbuf->pinyins == 0)
+		return 1;
+
+	fsbuf->pinyins->refs = 1;
+	name_cursor cursor;
+	init_name_cursor(&cursor, fsbuf);
+	char tokens[MAX_PINYIN_TOKENS_LEN];
+	for (uint32_t off = fsbuf->first_name_off; fsbuf->pinyins && off < fsbuf->tail; off = next_name(fsbuf, off))
+	{
+		if (*fs_ptr(fsbuf, off) == 0)
+			continue;
+
+		const char *name = get_cursor_name(&cursor, off);
+		if (get_pinyin_tokens(name, tokens))
+			put_pinyin(fsbuf, fsbuf->pinyins->count, off, tokens);
+	}
+	return fsbuf->pinyins == 0;
+}
+
+static inline uint64_t get_tag(fs_buf *fsbuf, const char *p)
+{
+	return IS_WIDE(fsbuf) ? *(uint64_t *)p : *(uint32_t *)p;
+}
+
+static inline void set_tag(fs_buf *fsbuf, char *p, uint64_t tag)
+{
+	if (IS_WIDE(fsbuf))
+		*(uint64_t *)p = tag;
+	else
+		*(uint32_t *)p = tag;
+}
+
+static int add_capacity(fs_buf *fsbuf, uint32_t size)
+{
+	// grow by half at least, so that building a large tree only remaps it a few times
+	uint64_t alloc_size = MAX(size, fsbuf->capacity / 2);
+	alloc_size = (alloc_size + FS_NEW_BLK_SIZE - 1) / FS_NEW_BLK_SIZE * FS_NEW_BLK_SIZE;
+	if (fsbuf->capacity + alloc_size > MAX_SIZE(fsbuf))
+		alloc_size = MAX_SIZE(fsbuf) - fsbuf->capacity;
+	if (alloc_size < size)
+		return 1;
+
+	char *p = resize_data(fsbuf->head, fsbuf->capacity, fsbuf->capacity + alloc_size);
+	if (p == 0) // TODO alert here
+		return 1;
+
+	// widen the gap, the bytes after it stay at the end
+	uint32_t post_size = fsbuf->tail - fsbuf->gap_start, post_off = fsbuf->gap_start + GAP_SIZE(fsbuf);
+	if (post_size)
+		memmove(p + post_off + alloc_size, p + post_off, post_size);
+
+	fsbuf->head = p;
+	if (fsbuf->fold)
+	{
+		// the fold column grows the same way, or is dropped if it can't
+		char *fold = resize_data(fsbuf->fold, fsbuf->capacity, fsbuf->capacity + alloc_size);
+		if (fold == 0)
+			drop_fold(fsbuf);
+		else if (post_size)
+			memmove(fold + post_off + alloc_size, fold + post_off, post_size);
+		fsbuf->fold = fold;
+	}
+	fsbuf->capacity += alloc_size;
+	return 0;
+}
+
+// memmove size bytes from src to dst in head, and the same ones in the fold column
+static void move_data(fs_buf *fsbuf, char *dst, const char *src, uint32_t size)
+{
+	memmove(dst, src, size);
+	if (fsbuf->fold)
+		memmove(fsbuf->fold + (dst - fsbuf->head), fsbuf->fold + (src - fsbuf->head), size);
+}
+
+static void move_gap(fs_buf *fsbuf, uint32_t off)
+{
+	uint32_t gap_size = GAP_SIZE(fsbuf);
+	if (off < fsbuf->gap_start)
+		move_data(fsbuf, fsbuf->head + off + gap_size, fsbuf->head + off, fsbuf->gap_start - off);
+	else if (off > fsbuf->gap_start)
+		move_data(fsbuf, fsbuf->head + fsbuf->gap_start, fsbuf->head + fsbuf->gap_start + gap_size, off - fsbuf->gap_start);
+	fsbuf->gap_start = off;
+}
+
+// make room for size bytes at off, return the address to fill them in
+static char *open_range(fs_buf *fsbuf, uint32_t off, uint32_t size)
+{
+	if ((uint64_t)size + fsbuf->tail >= fsbuf->capacity)
+		if (add_capacity(fsbuf, size) != 0)
+			return 0;
+
+	move_gap(fsbuf, off);
+	fsbuf->gap_start += size;
+	fsbuf->tail += size;
+	shift_kids_indexes(fsbuf, off, size);
+	shift_extents(fsbuf, off, size);
+	shift_pinyins(fsbuf, off, UINT32_MAX, size);
+	return fsbuf->head + off;
+}
+
+static void remove_range(fs_buf *fsbuf, uint32_t off, uint32_t size)
+{
+	move_gap(fsbuf, off);
+	// before the records go, the extents are dropped by the parent tags
+	drop_extents(fsbuf, off, size);
+	fsbuf->tail -= size;
+	drop_kids_indexes(fsbuf, off, size);
+	shift_kids_indexes(fsbuf, off + size, -(int64_t)size);
+	shift_extents(fsbuf, off + size, -(int64_t)size);
+	drop_pinyins(fsbuf, off, size);
+	shift_pinyins(fsbuf, off + size, UINT32_MAX, -(int64_t)size);
+}
+
+// copy size bytes of column (head or the fold column) from off to dst, without the gap
+static void copy_range(fs_buf *fsbuf, char *column, uint32_t off, uint32_t size, char *dst)
+{
+	if (off < fsbuf->gap_start)
+	{
+		uint32_t pre_size = off + size > fsbuf->gap_start ? fsbuf->gap_start - off : size;
+		memcpy(dst, column + off, pre_size);
+		dst += pre_size;
+		off += pre_size;
+		size -= pre_size;
+	}
+
+	if (size)
+		memcpy(dst, column_ptr(fsbuf, column, off), size);
+}
+
+// a mapped fs_buf is read-only until the first mutation, and so is the data snapshots are
+// reading. either way the mutation moves the data to a copy of its own first.
+static int unshare_fs_buf(fs_buf *fsbuf)
+{
+	// the checksums only hold for the data as it was loaded
+	free(fsbuf->chunks);
+	fsbuf->chunks = 0;
+	fsbuf->chunk_count = 0;
+
+	// snapshots only take references under the read lock, so refs can only drop here
+	pinyin_table *pinyins = fsbuf->pinyins;
+	if (pinyins && __sync_fetch_and_add(&pinyins->refs, 0) > 1)
+	{
+		fsbuf->pinyins = copy_pinyins(pinyins);
+		release_pinyins(pinyins);
+	}
+
+	fs_share *share = fsbuf->share;
+	if (share && __sync_fetch_and_add(&share->refs, 0) == 1)
+	{
+		// the extent table is the fs_buf's alone again
+		if (share->extents != fsbuf->extents)
+			free(share->extents);
+		free(share);
+		fsbuf->share = share = 0;
+	}
+	else if (share && fsbuf->extents && fsbuf->extents == share->extents)
+	{
+		// the snapshots keep reading the shared one, without it the extents are found by walking
+		block_extent *extents = malloc(fsbuf->extent_capacity * sizeof(block_extent));
+		if (extents)
+			memcpy(extents, fsbuf->extents, fsbuf->extent_count * sizeof(block_extent));
+		else
+			fsbuf->extent_count = fsbuf->extent_capacity = 0;
+		fsbuf->extents = extents;
+	}
+
+	if (fsbuf->mapped_size == 0 && share == 0)
+		return 0;
+
+	uint32_t capacity = MIN((uint64_t)fsbuf->tail + FS_NEW_BLK_SIZE, MAX_SIZE(fsbuf));
+	if (capacity < fsbuf->tail)
+		return 1;
+
+	char *head = alloc_data(capacity), *fold = fsbuf->fold ? alloc_data(capacity) : 0;
+	if (head == 0 || (fsbuf->fold && fold == 0))
+	{
+		if (head)
+			release_data(head, capacity);
+		return 1;
+	}
+
+	copy_range(fsbuf, fsbuf->head, 0, fsbuf->tail, head);
+	if (fold)
+		copy_range(fsbuf, fsbuf->fold, 0, fsbuf->tail, fold);
+	if (share)
+	{
+		release_share(share);
+	}
+	else
+	{
+		munmap(fsbuf->head, fsbuf->mapped_size);
+		// the fold column of a mapped fs_buf is read from the file, see read_fold
+		if (fsbuf->fold)
+			release_data(fsbuf->fold, fsbuf->capacity);
+	}
+	fsbuf->head = head;
+	fsbuf->fold = fold;
+	fsbuf->capacity = capacity;
+	fsbuf->gap_start = fsbuf->tail;
+	fsbuf->mapped_size = 0;
+	fsbuf->share = 0;
+	return 0;
+}
+
+static void set_parent_offset(fs_buf *fsbuf, uint32_t name_off, uint32_t parent_off)
+{
+	// set empty string
+	char *name = fs_ptr(fsbuf, name_off);
+	*name = 0;
+	// set parent tag
+	// internally we use relative offset w.r.t. to the tag (not the name)
+	// and note that parent is always ahead
+	// 0 means root
+	if (parent_off > 0)
+		parent_off = name_off + 1 - parent_off;
+	set_tag(fsbuf, name + 1, ((uint64_t)parent_off << FS_TAG_BITS) + FS_TAG_DIR);
+}
+
+static uint32_t get_name_size(fs_buf *fsbuf, const char *name, int is_dir)
+{
+	return strlen(name) + 1 + (is_dir ? fsbuf->tag_size : 1);
+}
+
+static void write_name(fs_buf *fsbuf, char *p, const char *name, int is_dir)
+{
+	strcpy(p, name);
+	p += strlen(name) + 1;
+
+	if (is_dir)
+	{
+		set_tag(fsbuf, p, FS_TAG_DIR);
+	}
+	else
+	{
+		*p = FS_TAG_FILE;
+	}
+}
+
+// write the name of the record at off to the fold column, if there is one. a reference is copied
+// as it is, its folded name is in the dictionary. a front coded record gets the suffix of its folded
+// name, after a copy of its header for decode_column_name to fall back to if it is broken. folding
+// keeps the size of every character, so the suffix only fits if the prefix doesn't split one:
+// return 1 if it does.
+static int fold_record(fs_buf *fsbuf, uint32_t off)
+{
+	if (fsbuf->fold == 0)
+		return 0;
+
+	const char *record = fs_ptr(fsbuf, off);
+	char *p = fold_ptr(fsbuf, off);
+	if (!is_front_coded(record))
+	{
+		if (*record == NAME_REF)
+			strcpy(p, record);
+		else
+			fold_utf8(p, record, strlen(record) + 1);
+		return 0;
+	}
+
+	char buf[NAME_MAX + 1];
+	const char *name = decode_name(fsbuf, off, buf);
+	uint32_t prefix = get_front_prefix(record), len = strlen(name);
+	if (prefix > len || get_char_boundary(name, prefix) != prefix)
+		return 1;
+
+	fold_utf8(buf, name, len + 1);
+	memcpy(p, record, FRONT_HEADER_SIZE);
+	strcpy(p + FRONT_HEADER_SIZE, buf + prefix);
+	return 0;
+}
+
+static int insert_new_name(fs_buf *fsbuf, uint32_t off, const char *name, int is_dir, int create_parent_tag)
+{
+	uint32_t extra_size = get_name_size(fsbuf, name, is_dir) + (create_parent_tag ? 1 + fsbuf->tag_size : 0);
+
+	char *p = open_range(fsbuf, off, extra_size);
+	if (p == 0)
+		return ERR_NO_MEM;
+
+	write_name(fsbuf, p, name, is_dir);
+	fold_record(fsbuf, off);
+	add_pinyin(fsbuf, off);
+	return 0;
+}
+
+// append_new_name, append_parent and set_kids_off build a tree in order, its extents are found
+// once it's done (see build_kids_indexes)
+int append_new_name(fs_buf *fsbuf, char *name, int is_dir)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	free_extents(fsbuf);
+	int r = unshare_fs_buf(fsbuf) ? ERR_NO_MEM : insert_new_name(fsbuf, fsbuf->tail, name, is_dir, 0);
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return r;
+}
+
+int append_parent(fs_buf *fsbuf, uint32_t parent_off)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	free_extents(fsbuf);
+	if (unshare_fs_buf(fsbuf) != 0)
+	{
+		pthread_rwlock_unlock(&fsbuf->lock);
+		return ERR_NO_MEM;
+	}
+
+	uint32_t name_off = fsbuf->tail;
+	if (open_range(fsbuf, name_off, 1 + fsbuf->tag_size) == 0)
+	{
+		pthread_rwlock_unlock(&fsbuf->lock);
+		return ERR_NO_MEM;
+	}
+
+	set_parent_offset(fsbuf, name_off, parent_off);
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return 0;
+}
+
+static int do_is_file(fs_buf *fsbuf, uint32_t name_off)
+{
+	char *name = fs_ptr(fsbuf, name_off);
+	return *(name + strlen(name) + 1) == FS_TAG_FILE;
+}
+
+__attribute__((visibility("default"))) int is_file(fs_buf *fsbuf, uint32_t name_off)
+{
+	pthread_rwlock_rdlock(&fsbuf->lock);
+	int r = do_is_file(fsbuf, name_off);
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return r;
+}
+
+static uint32_t get_pad_size(fs_buf *fsbuf, const char *name)
+{
+	uint8_t tag = *(uint8_t *)(name + 1);
+	if ((tag & FS_TAG_MASK) == FS_TAG_PAD)
+		return tag >> FS_TAG_BITS;
+	return get_tag(fsbuf, name + 1) >> FS_TAG_BITS;
+}
+
+static int is_padding(fs_buf *fsbuf, uint32_t off)
+{
+	char *name = fs_ptr(fsbuf, off);
+	return *name == 0 && (*(uint8_t *)(name + 1) & FS_TAG_MASK) >= FS_TAG_PAD;
+}
+
+__attribute__((visibility("default"))) uint32_t next_name(fs_buf *fsbuf, uint32_t name_off)
+{
+	char *name = fs_ptr(fsbuf, name_off);
+	uint32_t name_size = strlen(name) + 1;
+	uint8_t tag = *(uint8_t *)(name + name_size);
+	if (tag == FS_TAG_FILE)
+		return name_off + name_size + 1;
+	if ((tag & FS_TAG_MASK) == FS_TAG_DIR)
+		return name_off + name_size + fsbuf->tag_size;
+	return name_off + get_pad_size(fsbuf, name);
+}
+
+static void write_padding(fs_buf *fsbuf, char *p, uint32_t size)
+{
+	*p = 0;
+	if (size <= MAX_SHORT_PAD_SIZE)
+		*(uint8_t *)(p + 1) = (size << FS_TAG_BITS) + FS_TAG_PAD;
+	else
+		set_tag(fsbuf, p + 1, ((uint64_t)size << FS_TAG_BITS) + FS_TAG_PAD_LONG);
+}
+
+// turn the records in [off, off + size) into padding
+static void set_padding(fs_buf *fsbuf, uint32_t off, uint32_t size)
+{
+	drop_kids_indexes(fsbuf, off, size);
+	drop_extents(fsbuf, off, size);
+	drop_pinyins(fsbuf, off, size);
+
+	// records never straddle the gap, so both parts are whole records and large enough
+	if (off < fsbuf->gap_start && off + size > fsbuf->gap_start)
+	{
+		uint32_t pre_size = fsbuf->gap_start - off;
+		write_padding(fsbuf, fs_ptr(fsbuf, off), pre_size);
+		off += pre_size;
+		size -= pre_size;
+	}
+
+	write_padding(fsbuf, fs_ptr(fsbuf, off), size);
+	fsbuf->pad_size += size;
+}
+
+// size of the paddings following off
+static uint32_t get_slack_size(fs_buf *fsbuf, uint32_t off)
+{
+	uint32_t size = 0;
+	while (off + size < fsbuf->tail && is_padding(fsbuf, off + size))
+		size += get_pad_size(fsbuf, fs_ptr(fsbuf, off + size));
+	return size;
+}
+
+static void use_slack(fs_buf *fsbuf, uint32_t size)
+{
+	fsbuf->pad_size = fsbuf->pad_size > size ? fsbuf->pad_size - size : 0;
+}
+
+// make [off, off + size) one contiguous piece of memory, the gap may only be moved
+// to its end, which is cheap when the range is small
+static char *pin_range(fs_buf *fsbuf, uint32_t off, uint32_t size)
+{
+	if (off < fsbuf->gap_start && off + size > fsbuf->gap_start)
+		move_gap(fsbuf, off + size);
+	return fs_ptr(fsbuf, off);
+}
+
+static void do_set_kids_off(fs_buf *fsbuf, uint32_t name_off, uint32_t kids_off)
+{
+	// we don't check if the name is a dir here
+	char *name = fs_ptr(fsbuf, name_off);
+	// internally we use relative offset w.r.t. to the tag (not the name)
+	// and note that kid is always after parent
+	if (kids_off != 0)
+		kids_off = kids_off - (name_off + strlen(name) + 1);
+	set_tag(fsbuf, name + strlen(name) + 1, ((uint64_t)kids_off << FS_TAG_BITS) + FS_TAG_DIR);
+}
+
+void set_kids_off(fs_buf *fsbuf, uint32_t name_off, uint32_t kids_off)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	free_extents(fsbuf);
+	if (unshare_fs_buf(fsbuf) == 0)
+		do_set_kids_off(fsbuf, name_off, kids_off);
+	pthread_rwlock_unlock(&fsbuf->lock);
+}
+
+static uint32_t get_reloff_by_tag(fs_buf *fsbuf, uint32_t tag_off)
+{
+	return get_tag(fsbuf, fs_ptr(fsbuf, tag_off)) >> FS_TAG_BITS;
+}
+
+// return 0 means file, no-kid or parent node
+static uint32_t get_kids_offset(fs_buf *fsbuf, uint32_t name_off)
+{
+	if (do_is_file(fsbuf, name_off))
+		return 0;
+
+	uint32_t tag_off = name_off + strlen(fs_ptr(fsbuf, name_off)) + 1;
+	uint32_t rel_off = get_reloff_by_tag(fsbuf, tag_off);
+	if (rel_off == 0)
+		return 0;
+
+	return tag_off + rel_off;
+}
+
+static kids_index *build_kids_index(fs_buf *fsbuf, uint32_t kids_off, uint32_t count)
+{
+	kids_index *index = calloc(1, sizeof(kids_index));
+	if (index == 0 || reserve_kids_slots(index, count) != 0)
+	{
+		free(index);
+		return 0;
+	}
+
+	name_cursor cursor;
+	init_name_cursor(&cursor, fsbuf);
+	uint32_t off = kids_off;
+	for (; off < fsbuf->tail && *fs_ptr(fsbuf, off); off = next_name(fsbuf, off))
+	{
+		const char *name = get_cursor_name(&cursor, off);
+		put_kids_slot(index, hash_name(name, strlen(name)), off - kids_off + 1);
+	}
+	index->kids_off = kids_off;
+	index->tail_off = off;
+	index->count = count;
+	return index;
+}
+
+static int insert_kids_index(fs_buf *fsbuf, kids_index *index)
+{
+	if (fsbuf->index_count == fsbuf->index_capacity)
+	{
+		uint32_t capacity = fsbuf->index_capacity ? fsbuf->index_capacity * 2 : 64;
+		kids_index **indexes = realloc(fsbuf->indexes, capacity * sizeof(kids_index *));
+		if (indexes == 0)
+			return 1;
+		fsbuf->indexes = indexes;
+		fsbuf->index_capacity = capacity;
+	}
+
+	uint32_t i = find_kids_index(fsbuf, index->kids_off);
+	memmove(fsbuf->indexes + i + 1, fsbuf->indexes + i, (fsbuf->index_count - i) * sizeof(kids_index *));
+	fsbuf->indexes[i] = index;
+	fsbuf->index_count++;
+	return 0;
+}
+
+static void index_kids(fs_buf *fsbuf, uint32_t kids_off, uint32_t count)
+{
+	kids_index *index = build_kids_index(fsbuf, kids_off, count);
+	if (index && insert_kids_index(fsbuf, index) != 0)
+		free_kids_index(index);
+}
+
+// offset of the kid named name[0, len) in an indexed sibling block, 0 if none
+static uint32_t lookup_kid(fs_buf *fsbuf, kids_index *index, const char *name, uint32_t len)
+{
+	uint32_t hash = hash_name(name, len);
+	char buf[NAME_MAX + 1];
+	for (uint32_t i = hash & index->mask; index->slots[i].rel_off; i = (i + 1) & index->mask)
+	{
+		if (index->slots[i].hash != hash)
+			continue;
+
+		uint32_t name_off = index->kids_off + index->slots[i].rel_off - 1;
+		const char *kid = decode_name(fsbuf, name_off, buf);
+		if (strncmp(kid, name, len) == 0 && kid[len] == 0)
+			return name_off;
+	}
+	return 0;
+}
+
+// offset of the kid named name[0, len) in the sibling block at kids_off, 0 if none
+static uint32_t find_kid(fs_buf *fsbuf, uint32_t kids_off, const char *name, uint32_t len)
+{
+	if (len == 0)
+		return 0;
+
+	// the indexes of a snapshot only know where the blocks end
+	kids_index *index = get_kids_index(fsbuf, kids_off);
+	if (index && index->slots)
+		return lookup_kid(fsbuf, index, name, len);
+
+	name_cursor cursor;
+	init_name_cursor(&cursor, fsbuf);
+	for (uint32_t off = kids_off; off < fsbuf->tail; off = next_name(fsbuf, off))
+	{
+		const char *kid = fs_ptr(fsbuf, off);
+		if (*kid == 0) // parent-tag met, not found
+			return 0;
+		kid = get_cursor_name(&cursor, off);
+		if (strncmp(kid, name, len) == 0 && kid[len] == 0)
+			return off;
+	}
+	return 0;
+}
+
+// name_size bytes of name_off were inserted before the parent tag of the block at kids_off
+static void kid_inserted(fs_buf *fsbuf, uint32_t kids_off, uint32_t name_off, uint32_t name_size)
+{
+	kids_index *index = get_kids_index(fsbuf, kids_off);
+	if (index == 0)
+		return;
+
+	char buf[NAME_MAX + 1];
+	const char *name = decode_name(fsbuf, name_off, buf);
+	index->tail_off += name_size;
+	if (reserve_kids_slots(index, index->count + 1) != 0)
+	{
+		drop_kids_indexes(fsbuf, kids_off, 1);
+		return;
+	}
+	put_kids_slot(index, hash_name(name, strlen(name)), name_off - kids_off + 1);
+	index->count++;
+}
+
+// the kids after name_off in the block at kids_off moved by delta
+static void kids_moved(fs_buf *fsbuf, uint32_t kids_off, uint32_t name_off, int64_t delta)
+{
+	kids_index *index = get_kids_index(fsbuf, kids_off);
+	if (index == 0)
+		return;
+
+	uint32_t rel_off = name_off - kids_off + 1;
+	for (uint32_t i = 0; i <= index->mask; i++)
+		if (index->slots[i].rel_off > rel_off)
+			index->slots[i].rel_off += delta;
+	index->tail_off += delta;
+}
+
+// name_off of size bytes is about to be cut out of the block at kids_off, the kids after it move ahead
+static void kid_removed(fs_buf *fsbuf, uint32_t kids_off, uint32_t name_off, uint32_t size)
+{
+	kids_index *index = get_kids_index(fsbuf, kids_off);
+	if (index == 0)
+		return;
+
+	char buf[NAME_MAX + 1];
+	const char *name = decode_name(fsbuf, name_off, buf);
+	uint32_t rel_off = name_off - kids_off + 1, mask = index->mask;
+	kids_slot *slots = index->slots;
+	uint32_t i = hash_name(name, strlen(name)) & mask;
+	while (slots[i].rel_off != rel_off)
+	{
+		if (slots[i].rel_off == 0)
+		{
+			drop_kids_indexes(fsbuf, kids_off, 1);
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+
+	// linear probing, move the following slots back unless that takes them before their home
+	for (uint32_t j = (i + 1) & mask; slots[j].rel_off; j = (j + 1) & mask)
+	{
+		if (((j - (slots[j].hash & mask)) & mask) >= ((j - i) & mask))
+		{
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i].rel_off = 0;
+	index->count--;
+	kids_moved(fsbuf, kids_off, name_off, -(int64_t)size);
+}
+
+// the folders whose kids blocks come next in tree order, the first one on top (see pack_fs_buf)
+typedef struct __dir_stack__ {
+	uint32_t *offs;
+	uint32_t count;
+	uint32_t capacity;
+} dir_stack;
+
+static int push_dir(dir_stack *stack, uint32_t off)
+{
+	if (stack->count == stack->capacity)
+	{
+		uint32_t capacity = stack->capacity ? stack->capacity * 2 : 1024;
+		uint32_t *offs = realloc(stack->offs, capacity * sizeof(uint32_t));
+		if (offs == 0)
+			return 1;
+
+		stack->offs = offs;
+		stack->capacity = capacity;
+	}
+	stack->offs[stack->count++] = off;
+	return 0;
+}
+
+// find the extents of all blocks. the blocks still taking nested ones are on a stack meanwhile,
+// their nested holding their tail until a block of a folder outside them comes.
+static int build_extents(fs_buf *fsbuf)
+{
+	free_extents(fsbuf);
+	uint32_t count = 0, capacity = 64;
+	block_extent *extents = malloc(capacity * sizeof(block_extent));
+	dir_stack stack = {0};
+	int r = extents == 0;
+	for (uint32_t off = fsbuf->first_name_off; r == 0 && off < fsbuf->tail;)
+	{
+		uint32_t kids_off = off;
+		while (off < fsbuf->tail && *fs_ptr(fsbuf, off))
+			off = next_name(fsbuf, off);
+
+		uint32_t rel_off = off < fsbuf->tail ? get_reloff_by_tag(fsbuf, off + 1) : 0;
+		uint32_t parent_off = rel_off ? off + 1 - rel_off : 0;
+		while (stack.count)
+		{
+			uint32_t i = stack.offs[stack.count - 1];
+			if (parent_off >= extents[i].kids_off && parent_off < extents[i].nested)
+				break;
+			extents[i].nested = count - i - 1;
+			stack.count--;
+		}
+
+		if (count == capacity)
+		{
+			capacity *= 2;
+			block_extent *p = realloc(extents, capacity * sizeof(block_extent));
+			if (p == 0)
+			{
+				r = 1;
+				break;
+			}
+			extents = p;
+		}
+		extents[count] = (block_extent){ kids_off, off };
+		r = push_dir(&stack, count++);
+
+		// skip the parent tag and the paddings after it
+		if (off < fsbuf->tail)
+			off = next_name(fsbuf, off);
+		while (off < fsbuf->tail && is_padding(fsbuf, off))
+			off = next_name(fsbuf, off);
+	}
+	while (r == 0 && stack.count)
+	{
+		uint32_t i = stack.offs[--stack.count];
+		extents[i].nested = count - i - 1;
+	}
+	free(stack.offs);
+
+	if (r != 0)
+	{
+		free(extents);
+		return 1;
+	}
+	fsbuf->extents = extents;
+	fsbuf->extent_count = count;
+	fsbuf->extent_capacity = capacity;
+	return 0;
+}
+
+typedef struct __index_job__ {
+	fs_buf *fsbuf;
+	// kids offset and kids count of the large folders
+	uint32_t (*blocks)[2];
+	kids_index **indexes;
+	uint32_t count;
+	uint32_t next;
+} index_job;
+
+static void *index_thread(void *param)
+{
+	index_job *job = (index_job *)param;
+	uint32_t i;
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+		job->indexes[i] = build_kids_index(job->fsbuf, job->blocks[i][0], job->blocks[i][1]);
+	return 0;
+}
+
+// hash the kids of all large folders, the fs_buf has no kids indexes
+static int do_build_kids_indexes(fs_buf *fsbuf)
+{
+	// the sibling blocks follow each other, only separated by paddings
+	index_job job = { fsbuf, 0, 0, 0, 0 };
+	uint32_t capacity = 0;
+	for (uint32_t off = fsbuf->first_name_off; off < fsbuf->tail;)
+	{
+		uint32_t kids_off = off, count = 0;
+		for (; off < fsbuf->tail && *fs_ptr(fsbuf, off); off = next_name(fsbuf, off))
+			count++;
+
+		if (count >= MIN_INDEXED_KIDS)
+		{
+			if (job.count == capacity)
+			{
+				capacity = capacity ? capacity * 2 : 64;
+				void *blocks = realloc(job.blocks, capacity * sizeof(job.blocks[0]));
+				if (blocks == 0)
+				{
+					free(job.blocks);
+					return 1;
+				}
+				job.blocks = blocks;
+			}
+			job.blocks[job.count][0] = kids_off;
+			job.blocks[job.count][1] = count;
+			job.count++;
+		}
+
+		// skip the parent tag and the paddings after it
+		if (off < fsbuf->tail)
+			off = next_name(fsbuf, off);
+		while (off < fsbuf->tail && is_padding(fsbuf, off))
+			off = next_name(fsbuf, off);
+	}
+
+	job.indexes = calloc(job.count + 1, sizeof(kids_index *));
+	if (job.indexes && job.count > fsbuf->index_capacity)
+	{
+		kids_index **indexes = realloc(fsbuf->indexes, job.count * sizeof(kids_index *));
+		if (indexes)
+		{
+			fsbuf->indexes = indexes;
+			fsbuf->index_capacity = job.count;
+		}
+	}
+	if (job.indexes == 0 || job.count > fsbuf->index_capacity)
+	{
+		free(job.indexes);
+		free(job.blocks);
+		return 1;
+	}
+
+	long thread_count = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX(job.count, 1));
+	pthread_t threads[thread_count];
+	long started = 0;
+	for (; started < thread_count; started++)
+		if (pthread_create(&threads[started], 0, index_thread, &job) != 0)
+			break;
+	if (started == 0)
+		index_thread(&job);
+	for (long i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+
+	// found in offset order, so already sorted
+	for (uint32_t i = 0; i < job.count; i++)
+		if (job.indexes[i])
+			fsbuf->indexes[fsbuf->index_count++] = job.indexes[i];
+
+	dbg_msg("kids indexes: %'u\n", fsbuf->index_count);
+	free(job.indexes);
+	free(job.blocks);
+	return 0;
+}
+
+__attribute__((visibility("default"))) int build_kids_indexes(fs_buf *fsbuf)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	free_kids_indexes(fsbuf);
+	// a loaded fs_buf may have them already
+	int r = (fsbuf->extents == 0 && build_extents(fsbuf) != 0) || do_build_kids_indexes(fsbuf) != 0;
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return r;
+}
+
+// offset of the parent tag ending the sibling block name_off is in, 0 if none
+static uint32_t get_folder_tail_offset(fs_buf *fsbuf, uint32_t name_off)
+{
+	// the indexed block starting last before name_off holds it, if it reaches that far
+	uint32_t i = find_kids_index(fsbuf, name_off + 1);
+	if (i && fsbuf->indexes[i - 1]->tail_off >= name_off)
+		return fsbuf->indexes[i - 1]->tail_off;
+
+	while (name_off < fsbuf->tail)
+	{
+		if (*fs_ptr(fsbuf, name_off))
+		{
+			name_off = next_name(fsbuf, name_off);
+			continue;
+		}
+
+		return name_off;
+	}
+	return 0;
+}
+
+static char *do_get_path_by_name_off(fs_buf *fsbuf, uint32_t name_off, char *path, uint32_t path_size)
+{
+	// dst用于存储文件路径，从后往前写入整个文件全路径，-1是为了保证末尾存在'\0'字符
+	uint32_t off = name_off;
+	char buf[NAME_MAX + 1];
+	const char *src = decode_name(fsbuf, off, buf);
+	char *dst = path + path_size - strlen(src) - 1;
+	strcpy(dst, src);
+	while (1)
+	{
+		off = get_folder_tail_offset(fsbuf, off) + 1;
+		uint32_t rel_off = get_reloff_by_tag(fsbuf, off);
+		// we have reached the root
+		if (rel_off == 0)
+			break;
+
+		off = off - rel_off;
+		src = decode_name(fsbuf, off, buf);
+		dbg_msg("name: %s, offset: %'u\n", src, off);
+		dst--;
+		*dst = '/';
+		dst -= strlen(src);
+		memcpy(dst, src, strlen(src));
+	}
+
+	dst -= (fsbuf->first_name_off - DATA_START - 1);
+	memcpy(dst, fsbuf->head + DATA_START, fsbuf->first_name_off - DATA_START - 1);
+	return dst;
+}
+
+__attribute__((visibility("default"))) char *get_path_by_name_off(fs_buf *fsbuf, uint32_t name_off, char *path, uint32_t path_size)
+{
+	pthread_rwlock_rdlock(&fsbuf->lock);
+	char *dst = do_get_path_by_name_off(fsbuf, name_off, path, path_size);
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return dst;
+}
+
+typedef struct __pad_run__ {
+	uint32_t off;
+	// size of the paddings in this run and all the runs before it
+	uint32_t removed;
+} pad_run;
+
+// size of the paddings before off
+static uint32_t get_removed_size(pad_run *runs, uint32_t run_count, uint32_t off)
+{
+	uint32_t lo = 0, hi = run_count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (runs[mid].off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? runs[lo - 1].removed : 0;
+}
+
+// drop all paddings, every relative offset spanning a padding shrinks by the padding size
+static int compact_fs_buf(fs_buf *fsbuf)
+{
+	move_gap(fsbuf, fsbuf->tail);
+
+	pad_run *runs = 0;
+	uint32_t run_count = 0, run_capacity = 0, removed = 0, run_end = 0;
+	for (uint32_t off = fsbuf->first_name_off; off < fsbuf->tail;)
+	{
+		uint32_t next = next_name(fsbuf, off);
+		if (is_padding(fsbuf, off))
+		{
+			removed += next - off;
+			if (run_count == 0 || off != run_end)
+			{
+				if (run_count == run_capacity)
+				{
+					run_capacity = run_capacity ? run_capacity * 2 : 1024;
+					pad_run *p = realloc(runs, run_capacity * sizeof(pad_run));
+					if (p == 0)
+					{
+						free(runs);
+						return 1;
+					}
+					runs = p;
+				}
+				runs[run_count++].off = off;
+			}
+			runs[run_count - 1].removed = removed;
+			run_end = next;
+		}
+		off = next;
+	}
+
+	// kids tags point forward and parent tags backward, both only over whole runs
+	char *head = fsbuf->head;
+	for (uint32_t off = fsbuf->first_name_off; run_count && off < fsbuf->tail; off = next_name(fsbuf, off))
+	{
+		if (is_padding(fsbuf, off) || do_is_file(fsbuf, off))
+			continue;
+
+		uint32_t tag_off = off + strlen(head + off) + 1;
+		uint32_t rel_off = get_reloff_by_tag(fsbuf, tag_off);
+		if (rel_off == 0)
+			continue;
+
+		uint32_t shrink = head[off] ?
+			get_removed_size(runs, run_count, tag_off + rel_off) - get_removed_size(runs, run_count, tag_off) :
+			get_removed_size(runs, run_count, tag_off) - get_removed_size(runs, run_count, tag_off - rel_off);
+		set_tag(fsbuf, head + tag_off, ((uint64_t)(rel_off - shrink) << FS_TAG_BITS) + FS_TAG_DIR);
+	}
+
+	uint32_t dst = run_count ? runs[0].off : fsbuf->tail;
+	for (uint32_t i = 0; i < run_count; i++)
+	{
+		uint32_t src = runs[i].off + runs[i].removed - (i ? runs[i - 1].removed : 0);
+		uint32_t end = i + 1 < run_count ? runs[i + 1].off : fsbuf->tail;
+		move_data(fsbuf, head + dst, head + src, end - src);
+		dst += end - src;
+	}
+
+	for (uint32_t i = 0; i < fsbuf->extent_count; i++)
+		fsbuf->extents[i].kids_off -= get_removed_size(runs, run_count, fsbuf->extents[i].kids_off);
+	for (uint32_t i = 0; fsbuf->pinyins && i < fsbuf->pinyins->count; i++)
+		fsbuf->pinyins->entries[i].name_off -= get_removed_size(runs, run_count, fsbuf->pinyins->entries[i].name_off);
+	// the paddings are between the blocks, the kids keep their place in them
+	for (uint32_t i = 0; i < fsbuf->index_count; i++)
+	{
+		kids_index *index = fsbuf->indexes[i];
+		index->kids_off -= get_removed_size(runs, run_count, index->kids_off);
+		index->tail_off -= get_removed_size(runs, run_count, index->tail_off);
+	}
+
+	dbg_msg("compact fs_buf: %'u -> %'u, paddings: %'u\n", fsbuf->tail, dst, removed);
+	free(runs);
+	fsbuf->tail = fsbuf->gap_start = dst;
+	fsbuf->pad_size = 0;
+	return 0;
+}
+
+static void try_compact_fs_buf(fs_buf *fsbuf)
+{
+	// the data is not ours to change if unsharing it failed
+	if (fsbuf->share == 0 && fsbuf->mapped_size == 0 &&
+		fsbuf->pad_size >= MIN_COMPACT_PAD_SIZE && fsbuf->pad_size > (fsbuf->tail - fsbuf->first_name_off) / 4)
+		compact_fs_buf(fsbuf);
+}
+
+__attribute__((visibility("default"))) int trim_fs_buf(fs_buf *fsbuf)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	// a mapped or shared fs_buf is trimmed when it is copied
+	uint64_t capacity = (uint64_t)fsbuf->tail + MIN_TRIM_SIZE;
+	capacity = (capacity + FS_NEW_BLK_SIZE - 1) / FS_NEW_BLK_SIZE * FS_NEW_BLK_SIZE;
+	if (fsbuf->share || fsbuf->mapped_size || capacity + MIN_TRIM_SIZE > fsbuf->capacity)
+	{
+		pthread_rwlock_unlock(&fsbuf->lock);
+		return 0;
+	}
+
+	move_gap(fsbuf, fsbuf->tail);
+	char *p = resize_data(fsbuf->head, fsbuf->capacity, capacity);
+	if (p)
+	{
+		dbg_msg("trim fs_buf: %'u -> %'lu\n", fsbuf->capacity, capacity);
+		fsbuf->head = p;
+		if (fsbuf->fold)
+		{
+			char *fold = resize_data(fsbuf->fold, fsbuf->capacity, capacity);
+			if (fold == 0)
+				drop_fold(fsbuf);
+			fsbuf->fold = fold;
+		}
+		fsbuf->capacity = capacity;
+	}
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return p == 0;
+}
+
+// fill a new fold column with the names of the records. return 1 if out of memory, or if a front
+// coded prefix splits a character (see fold_record), fsbuf is left unfolded then.
+static int build_fold(fs_buf *fsbuf)
+{
+	fsbuf->fold = alloc_data(fsbuf->capacity);
+	if (fsbuf->fold == 0)
+		return 1;
+
+	// the root path is never read from it, but saved with it
+	memcpy(fsbuf->fold + DATA_START, fsbuf->head + DATA_START, fsbuf->first_name_off - DATA_START);
+	for (uint32_t off = fsbuf->first_name_off; off < fsbuf->tail; off = next_name(fsbuf, off))
+	{
+		if (*fs_ptr(fsbuf, off) && fold_record(fsbuf, off) != 0)
+		{
+			drop_fold(fsbuf);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+typedef struct __pending_block__ {
+	// offset of the kids block in the old buffer
+	uint32_t kids_off;
+	// offset of its parent in the new buffer, 0 means root
+	uint32_t parent_off;
+} pending_block;
+
+// encodes the names of a sibling block one after another for rewrite_fs_buf
+typedef struct __name_encoder__ {
+	const fs_dict *dict;
+	int front_code;
+	// records in the current run and their size, 0 at the start of a block
+	uint32_t run_count;
+	uint32_t run_size;
+	char last_name[NAME_MAX + 1];
+	char record[FRONT_HEADER_SIZE + NAME_MAX + 1];
+} name_encoder;
+
+static void init_name_encoder(name_encoder *encoder, const fs_dict *dict, int front_code)
+{
+	encoder->dict = dict;
+	encoder->front_code = front_code;
+	encoder->run_count = 0;
+	encoder->run_size = 0;
+}
+
+// the record to write for name: a reference to dict, the name front coded against the name
+// before it, or the name itself. call end_record with the size of the record after writing it.
+static const char *encode_name(name_encoder *encoder, const char *name)
+{
+	uint32_t id = encoder->dict ? find_dict_name(encoder->dict, name) : 0, prefix = 0;
+	if (id == 0 && encoder->front_code && encoder->run_count && encoder->run_count < FRONT_RUN_LENGTH)
+	{
+		while (name[prefix] && name[prefix] == encoder->last_name[prefix])
+			prefix++;
+		prefix = get_char_boundary(name, prefix);
+	}
+
+	const char *record = encoder->record;
+	if (id)
+		encode_ref(id - 1, encoder->record);
+	else if (prefix > FRONT_HEADER_SIZE)
+		encode_front(encoder->record, prefix, encoder->run_size, name + prefix);
+	else
+		record = name;
+
+	// a full name starts a new run. a reference ends it: it may be shorter than the prefix of the
+	// name after it, which could not take its place when it is removed then (see recode_front_name).
+	if (!is_front_coded(record))
+		encoder->run_count = encoder->run_size = 0;
+	if (id == 0)
+	{
+		encoder->run_count++;
+		copy_name(encoder->last_name, name);
+	}
+	return record;
+}
+
+static void end_record(name_encoder *encoder, uint32_t size)
+{
+	encoder->run_size += size;
+}
+
+// rewrite fsbuf with tags of tag_size, the names in dict (if any) replaced by references to it
+// and the others front coded if front_code is set. the blocks are copied in tree order from the
+// kids offsets, so the paddings are dropped on the way and no offset map is needed.
+static int rewrite_fs_buf(fs_buf *fsbuf, uint32_t tag_size, const fs_dict *dict, int front_code)
+{
+	move_gap(fsbuf, fsbuf->tail);
+	char *head = fsbuf->head;
+	// the records are decoded with the dictionary of fsbuf, and encoded with dict
+	name_cursor cursor;
+	name_encoder encoder;
+	init_name_cursor(&cursor, fsbuf);
+	init_name_encoder(&encoder, dict, front_code);
+
+	uint64_t size = fsbuf->tail + FS_NEW_BLK_SIZE;
+	for (uint32_t off = fsbuf->first_name_off; off < fsbuf->tail; off = next_name(fsbuf, off))
+	{
+		if (is_padding(fsbuf, off))
+		{
+			size -= next_name(fsbuf, off) - off;
+			continue;
+		}
+		if (head[off] == 0)
+		{
+			size += (int64_t)tag_size - fsbuf->tag_size;
+			encoder.run_count = 0;
+			continue;
+		}
+
+		int is_dir = !do_is_file(fsbuf, off);
+		const char *record = encode_name(&encoder, get_cursor_name(&cursor, off));
+		uint32_t record_size = strlen(record) + 1 + (is_dir ? tag_size : 1);
+		end_record(&encoder, record_size);
+		size += (int64_t)record_size - (next_name(fsbuf, off) - off);
+	}
+	if (size > (tag_size == sizeof(uint64_t) ? MAX_WIDE_FSBUF_SIZE : MAX_FSBUF_SIZE))
+		return 1;
+
+	pending_block *blocks = malloc(1024 * sizeof(pending_block));
+	char *new_head = alloc_data(size);
+	if (blocks == 0 || new_head == 0)
+	{
+		free(blocks);
+		if (new_head)
+			release_data(new_head, size);
+		return 1;
+	}
+
+	// only used to write the records, its gap is empty
+	fs_buf rewritten = { .head = new_head, .capacity = size, .tail = size, .gap_start = size, .tag_size = tag_size };
+	memcpy(new_head, head, fsbuf->first_name_off);
+
+	uint32_t dst = fsbuf->first_name_off, block_count = 0, block_capacity = 1024;
+	if (fsbuf->first_name_off < fsbuf->tail)
+		blocks[block_count++] = (pending_block){ fsbuf->first_name_off, 0 };
+	while (block_count)
+	{
+		pending_block block = blocks[--block_count];
+		uint32_t first_kid = block_count;
+		if (block.parent_off)
+			do_set_kids_off(&rewritten, block.parent_off, dst);
+
+		uint32_t off = block.kids_off;
+		encoder.run_count = 0;
+		for (; head[off]; off = next_name(fsbuf, off))
+		{
+			int is_dir = !do_is_file(fsbuf, off);
+			uint32_t kids_off = is_dir ? get_kids_offset(fsbuf, off) : 0;
+			const char *record = encode_name(&encoder, get_cursor_name(&cursor, off));
+			write_name(&rewritten, new_head + dst, record, is_dir);
+			if (kids_off)
+			{
+				if (block_count == block_capacity)
+				{
+					block_capacity *= 2;
+					pending_block *p = realloc(blocks, block_capacity * sizeof(pending_block));
+					if (p == 0)
+					{
+						free(blocks);
+						release_data(new_head, size);
+						return 1;
+					}
+					blocks = p;
+				}
+				blocks[block_count++] = (pending_block){ kids_off, dst };
+			}
+			end_record(&encoder, get_name_size(&rewritten, record, is_dir));
+			dst += get_name_size(&rewritten, record, is_dir);
+		}
+		set_parent_offset(&rewritten, dst, block.parent_off);
+		dst += 1 + rewritten.tag_size;
+
+		// the kids of the first folder come first
+		for (uint32_t i = first_kid, j = block_count; i + 1 < j; i++, j--)
+		{
+			pending_block t = blocks[i];
+			blocks[i] = blocks[j - 1];
+			blocks[j - 1] = t;
+		}
+	}
+
+	dbg_msg("rewrite fs_buf: %'u -> %'u\n", fsbuf->tail, dst);
+	free(blocks);
+	int indexed = fsbuf->index_count != 0;
+	free_kids_indexes(fsbuf);
+	int folded = fsbuf->fold != 0;
+	drop_fold(fsbuf);
+	release_data(head, fsbuf->capacity);
+	fsbuf->head = new_head;
+	fsbuf->capacity = size;
+	fsbuf->tag_size = tag_size;
+	fsbuf->tail = fsbuf->gap_start = dst;
+	fsbuf->pad_size = 0;
+	// the blocks stay in order, but move by all the records before them
+	if (fsbuf->extents)
+		build_extents(fsbuf);
+	// folded again from the new records, it is only dropped if that fails
+	if (folded)
+		build_fold(fsbuf);
+	// the names are the same, but in other places
+	if (fsbuf->pinyins)
+		build_pinyins(fsbuf);
+	// the records took other sizes, so the kids are hashed again
+	if (indexed)
+		do_build_kids_indexes(fsbuf);
+	return 0;
+}
+
+static int widen_fs_buf(fs_buf *fsbuf)
+{
+	return rewrite_fs_buf(fsbuf, sizeof(uint64_t), fsbuf->dict, fsbuf->front_coded);
+}
+
+typedef struct __name_count__ {
+	// offset of the first record with the name
+	uint32_t off;
+	uint32_t hash;
+	uint32_t count;
+} name_count;
+
+static int compare_name_count(const void *p1, const void *p2)
+{
+	const name_count *c1 = p1, *c2 = p2;
+	if (c1->count != c2->count)
+		return c1->count > c2->count ? -1 : 1;
+	return c1->off < c2->off ? -1 : 1;
+}
+
+// the bytes saved by interning a name of len bytes occurring count times with id
+static int64_t get_intern_saving(uint32_t len, uint32_t count, uint32_t id)
+{
+	uint32_t ref_len = id < 254 ? 2 : (id < 254 * 254 ? 3 : 4);
+	return (int64_t)count * ((int64_t)len - ref_len) - (len + 1 + 3 * sizeof(uint32_t));
+}
+
+// count the names occurring at least min_count times, longer than any reference to them
+static name_count *count_names(fs_buf *fsbuf, uint32_t min_count, uint32_t *count)
+{
+	// saturating counters by hash first, so that only the names whose counters reach min_count
+	// (and a few others sharing their counters) get into the table
+	uint32_t counter_mask = (1 << NAME_COUNTER_BITS) - 1;
+	uint8_t *counters = calloc(counter_mask + 1, 1);
+	if (counters == 0)
+		return 0;
+
+	name_cursor cursor;
+	init_name_cursor(&cursor, fsbuf);
+	for (uint32_t off = fsbuf->first_name_off; off < fsbuf->tail; off = next_name(fsbuf, off))
+	{
+		const char *name = get_cursor_name(&cursor, off);
+		uint32_t len = strlen(name);
+		uint8_t *counter = &counters[hash_name(name, len) & counter_mask];
+		if (len >= MAX_REF_SIZE - 1 && *counter < 255)
+			(*counter)++;
+	}
+
+	uint32_t mask = (1 << 16) - 1, used = 0;
+	name_count *table = calloc(mask + 1, sizeof(name_count));
+	char buf[NAME_MAX + 1];
+	init_name_cursor(&cursor, fsbuf);
+	for (uint32_t off = fsbuf->first_name_off; table && off < fsbuf->tail; off = next_name(fsbuf, off))
+	{
+		const char *name = get_cursor_name(&cursor, off);
+		uint32_t len = strlen(name), hash = hash_name(name, len), i = hash & mask;
+		if (len < MAX_REF_SIZE - 1 || counters[hash & counter_mask] < min_count)
+			continue;
+
+		for (; table[i].count; i = (i + 1) & mask)
+		{
+			if (table[i].hash == hash && streq(decode_name(fsbuf, table[i].off, buf), name))
+				break;
+		}
+		if (table[i].count)
+		{
+			table[i].count++;
+			continue;
+		}
+
+		table[i] = (name_count){ off, hash, 1 };
+		if (++used * 2 <= mask)
+			continue;
+
+		// grow the table
+		name_count *old = table;
+		uint32_t old_mask = mask;
+		mask = mask * 2 + 1;
+		table = calloc(mask + 1, sizeof(name_count));
+		for (uint32_t j = 0; table && j <= old_mask; j++)
+		{
+			if (old[j].count == 0)
+				continue;
+			for (i = old[j].hash & mask; table[i].count; i = (i + 1) & mask)
+				;
+			table[i] = old[j];
+		}
+		free(old);
+	}
+	free(counters);
+	if (table == 0)
+		return 0;
+
+	*count = 0;
+	for (uint32_t i = 0; i <= mask; i++)
+	{
+		if (table[i].count >= min_count)
+			table[(*count)++] = table[i];
+	}
+	qsort(table, *count, sizeof(name_count), compare_name_count);
+	return table;
+}
+
+static int do_intern_fs_buf(fs_buf *fsbuf, uint32_t min_count)
+{
+	uint32_t count;
+	name_count *names = count_names(fsbuf, min_count, &count);
+	if (names == 0)
+		return 1;
+
+	// the most frequent names get the shortest ids
+	int64_t saving = 0;
+	uint32_t dict_count = 0, dict_size = 0;
+	char buf[NAME_MAX + 1];
+	for (uint32_t i = 0; i < count && dict_count < MAX_DICT_COUNT; i++)
+	{
+		uint32_t len = strlen(decode_name(fsbuf, names[i].off, buf));
+		int64_t name_saving = get_intern_saving(len, names[i].count, dict_count);
+		if (name_saving <= 0)
+			continue;
+
+		saving += name_saving;
+		dict_size += len + 1;
+		names[dict_count++] = names[i];
+	}
+
+	// not worth the trouble unless it saves a tenth of the data
+	if (saving < (fsbuf->tail - fsbuf->first_name_off) / 10)
+	{
+		dbg_msg("intern fs_buf: %'u names would save %'ld bytes only\n", dict_count, saving);
+		free(names);
+		return 0;
+	}
+
+	char *dict_names = malloc(dict_size);
+	if (dict_names == 0)
+	{
+		free(names);
+		return 1;
+	}
+	for (uint32_t i = 0, off = 0; i < dict_count; i++)
+	{
+		strcpy(dict_names + off, decode_name(fsbuf, names[i].off, buf));
+		off += strlen(dict_names + off) + 1;
+	}
+	free(names);
+
+	fs_dict *dict = new_dict(dict_names, dict_size);
+	if (dict == 0 || rewrite_fs_buf(fsbuf, fsbuf->tag_size, dict, fsbuf->front_coded) != 0)
+	{
+		release_dict(dict);
+		return 1;
+	}
+
+	dbg_msg("intern fs_buf: %'u names, %'u bytes\n", dict_count, dict_size);
+	fsbuf->dict = dict;
+	return 0;
+}
+
+// called with the write lock held before every change
+static int begin_write_fs_buf(fs_buf *fsbuf)
+{
+	if (unshare_fs_buf(fsbuf) != 0)
+		return 1;
+
+	// widen while there is still room for the change, a failure just leaves fsbuf as it was
+	if (!IS_WIDE(fsbuf) && fsbuf->tail > MAX_FSBUF_SIZE - WIDEN_MARGIN)
+		widen_fs_buf(fsbuf);
+	return 0;
+}
+
+__attribute__((visibility("default"))) int intern_fs_buf(fs_buf *fsbuf, uint32_t min_count)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	int r = 0;
+	if (fsbuf->dict == 0)
+		r = begin_write_fs_buf(fsbuf) != 0 ? 1 : do_intern_fs_buf(fsbuf, MAX(min_count, 2));
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return r;
+}
+
+__attribute__((visibility("default"))) int front_code_fs_buf(fs_buf *fsbuf)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	int r = 0;
+	if (!fsbuf->front_coded)
+	{
+		r = begin_write_fs_buf(fsbuf) != 0 || rewrite_fs_buf(fsbuf, fsbuf->tag_size, fsbuf->dict, 1) != 0;
+		fsbuf->front_coded = r == 0;
+	}
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return r;
+}
+
+__attribute__((visibility("default"))) int fold_fs_buf(fs_buf *fsbuf)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	int r = 0;
+	if (fsbuf->fold == 0)
+	{
+		// a fs_buf front coded before the prefixes were kept to whole characters is coded again
+		r = begin_write_fs_buf(fsbuf) != 0;
+		if (r == 0 && build_fold(fsbuf) != 0)
+			r = rewrite_fs_buf(fsbuf, fsbuf->tag_size, fsbuf->dict, fsbuf->front_coded) != 0 || build_fold(fsbuf) != 0;
+	}
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return r;
+}
+
+__attribute__((visibility("default"))) int is_folded_fs_buf(fs_buf *fsbuf)
+{
+	return fsbuf->fold != 0;
+}
+
+__attribute__((visibility("default"))) int build_pinyin_table(fs_buf *fsbuf)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	int r = fsbuf->pinyins ? 0 : build_pinyins(fsbuf);
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return r;
+}
+
+__attribute__((visibility("default"))) int has_pinyin_table(fs_buf *fsbuf)
+{
+	return fsbuf->pinyins != 0;
+}
+
+#define HEADER_OFFSET(size) (((uint64_t)(size) + 7) & ~(uint64_t)7)
+
+static int hash_column(fs_buf *fsbuf, char *column, uint32_t start, uint32_t end, uint64_t seed, uint64_t *hash)
+{
+	if (start >= fsbuf->gap_start || end <= fsbuf->gap_start)
+	{
+		*hash = xxhash64(column_ptr(fsbuf, column, start), end - start, seed);
+		return 0;
+	}
+
+	// only the one chunk around the gap is copied
+	char *p = malloc(end - start);
+	if (p == 0)
+		return 1;
+
+	copy_range(fsbuf, column, start, end - start, p);
+	*hash = xxhash64(p, end - start, seed);
+	free(p);
+	return 0;
+}
+
+static int hash_chunk(fs_buf *fsbuf, uint32_t start, uint32_t end, uint64_t *hash)
+{
+	// the fold column is saved with the data, and checked with it
+	return hash_column(fsbuf, fsbuf->head, start, end, start, hash) != 0 ||
+		(fsbuf->fold && hash_column(fsbuf, fsbuf->fold, start, end, *hash, hash) != 0);
+}
+
+// split the blocks into chunks of about CHECKSUM_CHUNK_SIZE and hash them, counting the names on the way
+static fs_chunk *hash_chunks(fs_buf *fsbuf, fs_buf_header *header)
+{
+	fs_chunk *chunks = malloc(((fsbuf->tail - DATA_START) / CHECKSUM_CHUNK_SIZE + 1) * sizeof(fs_chunk));
+	if (chunks == 0)
+		return 0;
+
+	header->chunk_count = header->info.file_count = header->info.dir_count = 0;
+	uint32_t start = DATA_START, off = fsbuf->first_name_off;
+	while (start < fsbuf->tail && fsbuf->tail > fsbuf->first_name_off)
+	{
+		if (off < fsbuf->tail)
+		{
+			char *name = fs_ptr(fsbuf, off);
+			off = next_name(fsbuf, off);
+			if (*name)
+			{
+				if (*(name + strlen(name) + 1) == FS_TAG_FILE)
+					header->info.file_count++;
+				else
+					header->info.dir_count++;
+				continue;
+			}
+
+			// a parent tag ends the block, the slack after it goes with it
+			off += get_slack_size(fsbuf, off);
+			if (off - start < CHECKSUM_CHUNK_SIZE && off < fsbuf->tail)
+				continue;
+		}
+
+		fs_chunk *chunk = &chunks[header->chunk_count++];
+		chunk->end_off = off;
+		chunk->reserved = 0;
+		if (hash_chunk(fsbuf, start, off, &chunk->hash) != 0)
+		{
+			free(chunks);
+			return 0;
+		}
+		start = off;
+	}
+	return chunks;
+}
+
+static uint64_t hash_header(const fs_buf_header *header, const char *dict_names, const fs_chunk *chunks,
+							const block_extent *extents, uint32_t extent_count)
+{
+	fs_buf_header h = *header;
+	h.checksum = 0;
+	uint64_t hash = xxhash64(&h, sizeof(h), 0);
+	hash = xxhash64(dict_names, header->dict_size, hash);
+	hash = xxhash64(chunks, header->chunk_count * sizeof(fs_chunk), hash);
+	return extent_count ? xxhash64(extents, extent_count * sizeof(block_extent), hash) : hash;
+}
+
+// a packed file has the same records with 1-byte tags, and the parent tags cut down to their
+// empty names. the kids of a folder are always the block right after the subtrees of the folders
+// before it, so the offsets of the tags follow from the order of the blocks and unpack_fs_buf
+// sets them again: the data is then the same as saved, and so are its checksums.
+// an empty folder keeps FS_TAG_DIR, and a folder with kids gets PACKED_TAG_KIDS.
+#define PACKED_TAG_KIDS ((1 << FS_TAG_BITS) | FS_TAG_DIR)
+#define PACK_BUF_SIZE (64 << 10)
+
+typedef struct __pack_writer__ {
+	int fd;
+	// bytes written so far
+	uint32_t size;
+	uint32_t used;
+	char *buf;
+} pack_writer;
+
+// the folders of a block were pushed from base on in order, put the first one on top
+static void end_dir_block(dir_stack *stack, uint32_t base)
+{
+	for (uint32_t i = base, j = stack->count; i + 1 < j; i++, j--)
+	{
+		uint32_t off = stack->offs[i];
+		stack->offs[i] = stack->offs[j - 1];
+		stack->offs[j - 1] = off;
+	}
+}
+
+static int put_packed(pack_writer *writer, const char *p, uint32_t size)
+{
+	if (writer->used + size > PACK_BUF_SIZE)
+	{
+		if (write_file(writer->fd, writer->buf, writer->used) != 0)
+			return 1;
+		writer->used = 0;
+	}
+
+	memcpy(writer->buf + writer->used, p, size);
+	writer->used += size;
+	writer->size += size;
+	return 0;
+}
+
+// write the data of fsbuf packed, return 1 if writing fails or 2 if its blocks are not in the order
+// unpack_fs_buf expects (or paddings are left, their bytes are hashed with the blocks)
+static int pack_fs_buf(fs_buf *fsbuf, pack_writer *writer)
+{
+	dir_stack stack = {0};
+	uint32_t base = 0, off = fsbuf->first_name_off;
+	int r = put_packed(writer, fs_ptr(fsbuf, DATA_START), fsbuf->first_name_off - DATA_START);
+	while (r == 0 && off < fsbuf->tail)
+	{
+		char *name = fs_ptr(fsbuf, off);
+		if (*name == 0)
+		{
+			if (is_padding(fsbuf, off))
+			{
+				r = 2;
+				break;
+			}
+
+			end_dir_block(&stack, base);
+			r = put_packed(writer, name, 1);
+			off = next_name(fsbuf, off);
+			if (off < fsbuf->tail && (stack.count == 0 || get_kids_offset(fsbuf, stack.offs[--stack.count]) != off))
+				r = 2;
+			base = stack.count;
+			continue;
+		}
+
+		uint32_t kids_off = get_kids_offset(fsbuf, off);
+		char tag = do_is_file(fsbuf, off) ? FS_TAG_FILE : kids_off ? PACKED_TAG_KIDS : FS_TAG_DIR;
+		if (put_packed(writer, name, strlen(name) + 1) != 0 || put_packed(writer, &tag, 1) != 0 ||
+			(kids_off && push_dir(&stack, off) != 0))
+			r = 1;
+		off = next_name(fsbuf, off);
+	}
+
+	if (r == 0 && stack.count)
+		r = 2;
+	free(stack.offs);
+	return r;
+}
+
+// unpack the packed_size bytes read to the end of the data of fsbuf in place. a record never
+// gets shorter when unpacked, so the ones written don't reach the ones still to be read unless
+// the data is broken. return 1 if it is, or 4 if out of memory.
+static int unpack_fs_buf(fs_buf *fsbuf, uint32_t packed_size)
+{
+	char *head = fsbuf->head;
+	uint32_t in = fsbuf->tail - packed_size, end = fsbuf->tail, out = DATA_START;
+	uint32_t size = strnlen(head + in, end - in) + 1;
+	if (in + size > end)
+		return 1;
+
+	memmove(head + out, head + in, size);
+	in += size;
+	out += size;
+	fsbuf->first_name_off = out;
+
+	dir_stack stack = {0};
+	uint32_t base = 0, parent_off = 0, block_off = out;
+	int r = 0;
+	while (r == 0 && in < end)
+	{
+		if (head[in] == 0)
+		{
+			// the end of a block, the next one holds the kids of the folder on top
+			in++;
+			if (out == block_off || out + 1 + fsbuf->tag_size > in)
+			{
+				r = 1;
+				break;
+			}
+
+			set_parent_offset(fsbuf, out, parent_off);
+			out += 1 + fsbuf->tag_size;
+			block_off = out;
+			end_dir_block(&stack, base);
+			if (in < end)
+			{
+				if (stack.count == 0)
+				{
+					r = 1;
+					break;
+				}
+				parent_off = stack.offs[--stack.count];
+				do_set_kids_off(fsbuf, parent_off, out);
+			}
+			base = stack.count;
+			continue;
+		}
+
+		size = strnlen(head + in, end - in) + 1;
+		if (in + size >= end)
+		{
+			r = 1;
+			break;
+		}
+
+		char tag = head[in + size];
+		int is_dir = tag != FS_TAG_FILE;
+		uint32_t name_off = in;
+		in += size + 1;
+		if ((is_dir && tag != FS_TAG_DIR && tag != PACKED_TAG_KIDS) || out + size + (is_dir ? fsbuf->tag_size : 1) > in)
+		{
+			r = 1;
+			break;
+		}
+
+		memmove(head + out, head + name_off, size);
+		if (is_dir)
+			set_tag(fsbuf, head + out + size, FS_TAG_DIR);
+		else
+			head[out + size] = FS_TAG_FILE;
+		if (tag == PACKED_TAG_KIDS && push_dir(&stack, out) != 0)
+			r = 4;
+		out += size + (is_dir ? fsbuf->tag_size : 1);
+	}
+
+	if (r == 0 && (out != end || out != block_off || stack.count))
+		r = 1;
+	free(stack.offs);
+	return r;
+}
+
+// the fold column is saved as its bytes from DATA_START to tail, laid out like the data once it is
+// loaded (unpacked), so that read_fold reads it right where it belongs
+static int write_fold(fs_buf *fsbuf, int fd)
+{
+	return write_file(fd, fsbuf->fold + DATA_START, fsbuf->gap_start - DATA_START) != 0 ||
+		write_file(fd, fold_ptr(fsbuf, fsbuf->gap_start), fsbuf->tail - fsbuf->gap_start) != 0;
+}
+
+static int read_fold(fs_buf *fsbuf, int fd, uint64_t fold_off)
+{
+	fsbuf->fold = alloc_data(fsbuf->capacity);
+	if (fsbuf->fold == 0)
+		return 4;
+
+	if (lseek(fd, fold_off, SEEK_SET) != (off_t)fold_off ||
+		read_file(fd, fsbuf->fold + DATA_START, fsbuf->capacity - DATA_START) != 0)
+		return 7;
+	return 0;
+}
+
+static int do_save_fs_buf(fs_buf *fsbuf, const char *filename, int packed)
+{
+	// write a temporary file and rename it over the old one, so that an fs_buf still mapping
+	// the old file keeps its pages and a crash never leaves a truncated .lft behind
+	size_t name_len = strlen(filename);
+	char tmp_name[name_len + sizeof(".tmp")];
+	memcpy(tmp_name, filename, name_len);
+	strcpy(tmp_name + name_len, ".tmp");
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return 1;
+
+	// the paddings are free space, not worth writing
+	if (fsbuf->pad_size)
+	{
+		pthread_rwlock_wrlock(&fsbuf->lock);
+		if (fsbuf->pad_size && unshare_fs_buf(fsbuf) == 0)
+			compact_fs_buf(fsbuf);
+		pthread_rwlock_unlock(&fsbuf->lock);
+	}
+
+	pthread_rwlock_rdlock(&fsbuf->lock);
+	char preamble[DATA_START];
+	const char *magic = IS_WIDE(fsbuf) ? wide_fsbuf_magic : fsbuf_magic;
+	uint32_t version = packed ? FS_BUF_PACKED_VERSION : FS_BUF_VERSION, size = fsbuf->tail;
+	memcpy(preamble, magic, strlen(magic));
+	preamble[strlen(magic)] = version;
+	memcpy(preamble + strlen(magic) + 1, &size, sizeof(size));
+
+	fs_buf_header header = { .info = fsbuf->info };
+	header.info.version = version;
+	header.info.generation++;
+	const char *dict_names = fsbuf->dict ? fsbuf->dict->names : "";
+	header.dict_size = fsbuf->dict ? fsbuf->dict->size : 0;
+	header.flags = (fsbuf->front_coded ? FS_BUF_FRONT_CODED : 0) | (fsbuf->extents ? FS_BUF_EXTENTS : 0) |
+		(fsbuf->fold ? FS_BUF_FOLDED : 0);
+	header.data_size = packed ? fsbuf->tail : 0;
+	fs_chunk *chunks = hash_chunks(fsbuf, &header);
+	if (chunks)
+		header.checksum = hash_header(&header, dict_names, chunks, fsbuf->extents, fsbuf->extent_count);
+
+	// the bytes before and after the gap (or the packed data, whose size is only known at the end),
+	// then the header at an 8-byte boundary and the tables
+	int r = chunks == 0 || write_file(fd, preamble, DATA_START) != 0;
+	if (r == 0 && packed)
+	{
+		pack_writer writer = { .fd = fd, .buf = malloc(PACK_BUF_SIZE) };
+		r = writer.buf == 0 || pack_fs_buf(fsbuf, &writer) != 0 || write_file(fd, writer.buf, writer.used) != 0;
+		size = DATA_START + writer.size;
+		r = r || pwrite(fd, &size, sizeof(size), strlen(magic) + 1) != sizeof(size);
+		free(writer.buf);
+	}
+	else if (r == 0)
+	{
+		r = write_file(fd, fsbuf->head + DATA_START, fsbuf->gap_start - DATA_START) != 0 ||
+			write_file(fd, fs_ptr(fsbuf, fsbuf->gap_start), fsbuf->tail - fsbuf->gap_start) != 0;
+	}
+
+	char padding[8] = {0};
+	if (r != 0 ||
+		write_file(fd, padding, HEADER_OFFSET(size) - size) != 0 ||
+		write_file(fd, (char *)&header, sizeof(header)) != 0 ||
+		write_file(fd, (char *)dict_names, header.dict_size) != 0 ||
+		write_file(fd, (char *)chunks, header.chunk_count * sizeof(fs_chunk)) != 0 ||
+		(fsbuf->fold && write_fold(fsbuf, fd) != 0) ||
+		write_file(fd, (char *)fsbuf->extents, fsbuf->extent_count * sizeof(block_extent)) != 0)
+	{
+		pthread_rwlock_unlock(&fsbuf->lock);
+		free(chunks);
+		close(fd);
+		unlink(tmp_name);
+		return 2;
+	}
+	pthread_rwlock_unlock(&fsbuf->lock);
+	free(chunks);
+
+	if (fsync(fd) != 0 || close(fd) != 0 || rename(tmp_name, filename) != 0)
+	{
+		unlink(tmp_name);
+		return 2;
+	}
+
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	fsbuf->info = header.info;
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return 0;
+}
+
+__attribute__((visibility("default"))) int save_fs_buf(fs_buf *fsbuf, const char *filename)
+{
+	return do_save_fs_buf(fsbuf, filename, 0);
+}
+
+__attribute__((visibility("default"))) int save_packed_fs_buf(fs_buf *fsbuf, const char *filename)
+{
+	return do_save_fs_buf(fsbuf, filename, 1);
+}
+
+static int read_fs_buf_size(int fd, uint32_t *size, uint32_t *tag_size, uint32_t *version)
+{
+	char magic[4];
+	if (read(fd, magic, sizeof(magic)) != sizeof(magic))
+		return 2;
+
+	if (memcmp(magic, fsbuf_magic, strlen(fsbuf_magic)) == 0)
+		*tag_size = sizeof(uint32_t);
+	else if (memcmp(magic, wide_fsbuf_magic, strlen(wide_fsbuf_magic)) == 0)
+		*tag_size = sizeof(uint64_t);
+	else
+		return 2;
+
+	*version = magic[3] ? (uint8_t)magic[3] : 1;
+	if (*version > FS_BUF_PACKED_VERSION)
+		return 2;
+
+	if (read(fd, size, sizeof(*size)) != sizeof(*size) || *size < sizeof(uint32_t) * 2 + 5)
+		return 3;
+
+	return 0;
+}
+
+// whether the extents are sorted and each one's nested ones fit into it
+static int check_extents(const block_extent *extents, uint32_t count, uint32_t size)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (extents[i].kids_off <= DATA_START || extents[i].kids_off >= size ||
+			(i && extents[i].kids_off <= extents[i - 1].kids_off) || extents[i].nested >= count - i)
+			return 1;
+
+		uint32_t end = i + 1 + extents[i].nested;
+		for (uint32_t j = i + 1; j < end; j += 1 + extents[j].nested)
+			if (j + 1 + extents[j].nested > end)
+				return 1;
+	}
+	return 0;
+}
+
+static int check_header(const fs_buf_header *header, const char *dict_names, const fs_chunk *chunks,
+						const block_extent *extents, uint32_t extent_count, uint32_t size, uint32_t version)
+{
+	if (header->checksum != hash_header(header, dict_names, chunks, extents, extent_count) ||
+		header->info.version != version)
+		return 1;
+
+	// the data of a packed file is not longer unpacked
+	if (version == FS_BUF_PACKED_VERSION)
+	{
+		if (header->data_size < size)
+			return 1;
+		size = header->data_size;
+	}
+
+	uint32_t start = DATA_START;
+	for (uint32_t i = 0; i < header->chunk_count; i++)
+	{
+		if (chunks[i].end_off <= start)
+			return 1;
+		start = chunks[i].end_off;
+	}
+	return (header->chunk_count && start != size) || check_extents(extents, extent_count, size) != 0;
+}
+
+// read the header and the tables saved after size bytes of data, the tables are only kept if
+// pchunks is set. version 1 files have none, and files saved before the extents were kept no extents.
+// *pfold_off gets the offset of the fold column, 0 if there is none.
+static int read_fs_buf_header(int fd, uint32_t size, uint32_t version, fs_buf_header *pheader, fs_dict **pdict,
+							  fs_chunk **pchunks, block_extent **pextents, uint32_t *pextent_count, uint64_t *pfold_off)
+{
+	if (pchunks)
+	{
+		*pdict = 0;
+		*pchunks = 0;
+		*pextents = 0;
+		*pextent_count = 0;
+		*pfold_off = 0;
+	}
+
+	if (version == 1)
+	{
+		memset(pheader, 0, sizeof(*pheader));
+		pheader->info.version = 1;
+		return 0;
+	}
+
+	fs_buf_header header;
+	struct stat st;
+	uint64_t header_off = HEADER_OFFSET(size);
+	if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), header_off) != sizeof(header))
+		return 8;
+
+	uint64_t dict_off = header_off + sizeof(header), table_off = dict_off + header.dict_size;
+	uint64_t table_size = (uint64_t)header.chunk_count * sizeof(fs_chunk);
+	// the fold column is as large as the data once unpacked, see write_fold
+	uint64_t fold_off = table_off + table_size, data_size = version == FS_BUF_PACKED_VERSION ? header.data_size : size;
+	uint64_t fold_size = header.flags & FS_BUF_FOLDED ? MAX(data_size, DATA_START) - DATA_START : 0;
+	uint64_t extents_off = fold_off + fold_size, extents_size = (uint64_t)st.st_size - extents_off;
+	if ((uint64_t)st.st_size < extents_off || (!(header.flags & FS_BUF_EXTENTS) && extents_size) ||
+		extents_size % sizeof(block_extent) || extents_size / sizeof(block_extent) > UINT32_MAX)
+		return 8;
+
+	uint32_t extent_count = extents_size / sizeof(block_extent);
+	char *dict_names = malloc(MAX(header.dict_size, 1));
+	fs_chunk *chunks = malloc(MAX(table_size, 1));
+	block_extent *extents = malloc(MAX(extents_size, sizeof(block_extent)));
+	if (dict_names == 0 || chunks == 0 || extents == 0)
+	{
+		free(dict_names);
+		free(chunks);
+		free(extents);
+		return 4;
+	}
+
+	if (pread(fd, dict_names, header.dict_size, dict_off) != (ssize_t)header.dict_size ||
+		pread(fd, chunks, table_size, table_off) != (ssize_t)table_size ||
+		pread(fd, extents, extents_size, extents_off) != (ssize_t)extents_size ||
+		check_header(&header, dict_names, chunks, extents, extent_count, size, version) != 0)
+	{
+		free(dict_names);
+		free(chunks);
+		free(extents);
+		return 8;
+	}
+
+	*pheader = header;
+	pheader->info.fs_uuid[sizeof(pheader->info.fs_uuid) - 1] = 0;
+	if (pchunks == 0)
+	{
+		free(dict_names);
+		free(chunks);
+		free(extents);
+		return 0;
+	}
+
+	if (header.dict_size)
+	{
+		*pdict = new_dict(dict_names, header.dict_size);
+		if (*pdict == 0)
+		{
+			free(chunks);
+			free(extents);
+			return 8;
+		}
+	}
+	else
+	{
+		free(dict_names);
+	}
+	*pchunks = chunks;
+	if (header.flags & FS_BUF_FOLDED)
+		*pfold_off = fold_off;
+	if (header.flags & FS_BUF_EXTENTS)
+	{
+		*pextents = extents;
+		*pextent_count = extent_count;
+	}
+	else
+	{
+		free(extents);
+	}
+	return 0;
+}
+
+__attribute__((visibility("default"))) int read_fs_buf_info(const char *filename, fs_buf_info *info)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	uint32_t size, tag_size, version;
+	fs_buf_header header;
+	int r = read_fs_buf_size(fd, &size, &tag_size, &version);
+	if (r == 0)
+		r = read_fs_buf_header(fd, size, version, &header, 0, 0, 0, 0, 0);
+	if (r == 0)
+		*info = header.info;
+	close(fd);
+	return r;
+}
+
+__attribute__((visibility("default"))) void get_fs_buf_info(fs_buf *fsbuf, fs_buf_info *info)
+{
+	pthread_rwlock_rdlock(&fsbuf->lock);
+	*info = fsbuf->info;
+	pthread_rwlock_unlock(&fsbuf->lock);
+}
+
+static fs_buf *alloc_fs_buf(void)
+{
+	fs_buf *fsbuf = malloc(sizeof(fs_buf));
+	if (fsbuf == 0)
+		return 0;
+
+	if (pthread_rwlock_init(&fsbuf->lock, 0) != 0)
+	{
+		free(fsbuf);
+		return 0;
+	}
+
+	fsbuf->head = 0;
+	fsbuf->mapped_size = 0;
+	fsbuf->share = 0;
+	fsbuf->pad_size = 0;
+	fsbuf->indexes = 0;
+	fsbuf->index_count = fsbuf->index_capacity = 0;
+	fsbuf->extents = 0;
+	fsbuf->extent_count = fsbuf->extent_capacity = 0;
+	fsbuf->pinyins = 0;
+	fsbuf->chunks = 0;
+	fsbuf->chunk_count = 0;
+	fsbuf->dict = 0;
+	fsbuf->front_coded = 0;
+	fsbuf->fold = 0;
+	memset(&fsbuf->info, 0, sizeof(fsbuf->info));
+	return fsbuf;
+}
+
+__attribute__((visibility("default"))) int load_fs_buf(fs_buf **pfsbuf, const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	uint32_t size, tag_size, version;
+	fs_buf_header header;
+	fs_dict *dict;
+	fs_chunk *chunks;
+	block_extent *extents;
+	uint32_t extent_count;
+	uint64_t fold_off;
+	int r = read_fs_buf_size(fd, &size, &tag_size, &version);
+	if (r == 0)
+		r = read_fs_buf_header(fd, size, version, &header, &dict, &chunks, &extents, &extent_count, &fold_off);
+	if (r != 0)
+	{
+		close(fd);
+		return r;
+	}
+
+	fs_buf *fsbuf = alloc_fs_buf();
+	if (fsbuf == 0)
+	{
+		release_dict(dict);
+		free(chunks);
+		free(extents);
+		close(fd);
+		return 4;
+	}
+
+	fsbuf->info = header.info;
+	fsbuf->dict = dict;
+	fsbuf->front_coded = (header.flags & FS_BUF_FRONT_CODED) != 0;
+	fsbuf->chunks = chunks;
+	fsbuf->chunk_count = header.chunk_count;
+	fsbuf->extents = extents;
+	fsbuf->extent_count = extent_count;
+	fsbuf->extent_capacity = MAX(extent_count, 1);
+	// a packed file is read to the end of the data and unpacked there
+	uint32_t data_size = version == FS_BUF_PACKED_VERSION ? header.data_size : size;
+	fsbuf->head = alloc_data(data_size);
+	if (fsbuf->head == 0)
+	{
+		free_fs_buf(fsbuf);
+		close(fd);
+		return 6;
+	}
+
+	posix_fadvise(fd, sizeof(uint32_t) * 2, 0, POSIX_FADV_SEQUENTIAL);
+
+	fsbuf->capacity = fsbuf->tail = fsbuf->gap_start = data_size;
+	fsbuf->tag_size = tag_size;
+	if (read_file(fd, fsbuf->head + data_size - (size - DATA_START), size - DATA_START) != 0)
+	{
+		free_fs_buf(fsbuf);
+		close(fd);
+		return 7;
+	}
+
+	if (fold_off && (r = read_fold(fsbuf, fd, fold_off)) != 0)
+	{
+		free_fs_buf(fsbuf);
+		close(fd);
+		return r == 4 ? 6 : r;
+	}
+
+	close(fd);
+
+	if (version == FS_BUF_PACKED_VERSION)
+	{
+		r = unpack_fs_buf(fsbuf, size - DATA_START);
+		if (r != 0)
+		{
+			free_fs_buf(fsbuf);
+			return r == 4 ? 4 : 3;
+		}
+	}
+	else
+	{
+		fsbuf->first_name_off = DATA_START + strlen(fsbuf->head + DATA_START) + 1;
+	}
+	*pfsbuf = fsbuf;
+	return 0;
+}
+
+__attribute__((visibility("default"))) int map_fs_buf(fs_buf **pfsbuf, const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	uint32_t size, tag_size, version;
+	fs_buf_header header;
+	fs_dict *dict = 0;
+	fs_chunk *chunks = 0;
+	block_extent *extents = 0;
+	uint32_t extent_count = 0;
+	uint64_t fold_off = 0;
+	int r = read_fs_buf_size(fd, &size, &tag_size, &version);
+	// the records of a packed file have to be unpacked, read it instead
+	if (r == 0 && version == FS_BUF_PACKED_VERSION)
+	{
+		close(fd);
+		return load_fs_buf(pfsbuf, filename);
+	}
+
+	struct stat st;
+	if (r == 0 && (fstat(fd, &st) != 0 || st.st_size < size))
+		r = 7;
+	if (r == 0)
+		r = read_fs_buf_header(fd, size, version, &header, &dict, &chunks, &extents, &extent_count, &fold_off);
+	if (r != 0)
+	{
+		close(fd);
+		return r;
+	}
+
+	fs_buf *fsbuf = alloc_fs_buf();
+	if (fsbuf == 0)
+	{
+		release_dict(dict);
+		free(chunks);
+		free(extents);
+		close(fd);
+		return 4;
+	}
+
+	fsbuf->info = header.info;
+	fsbuf->dict = dict;
+	fsbuf->front_coded = (header.flags & FS_BUF_FRONT_CODED) != 0;
+	fsbuf->chunks = chunks;
+	fsbuf->chunk_count = header.chunk_count;
+	fsbuf->extents = extents;
+	fsbuf->extent_count = extent_count;
+	fsbuf->extent_capacity = MAX(extent_count, 1);
+
+	// pages are only read in when searches touch them, and stay clean until unshare_fs_buf
+	char *head = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (head == MAP_FAILED)
+	{
+		free_fs_buf(fsbuf);
+		close(fd);
+		return 6;
+	}
+
+	fsbuf->head = head;
+	fsbuf->mapped_size = size;
+	fsbuf->capacity = fsbuf->tail = fsbuf->gap_start = size;
+	// the fold column is read, its offset in the file is not page aligned
+	r = fold_off ? read_fold(fsbuf, fd, fold_off) : 0;
+	close(fd);
+	if (r != 0)
+	{
+		free_fs_buf(fsbuf);
+		return r == 4 ? 6 : r;
+	}
+	fsbuf->tag_size = tag_size;
+	fsbuf->first_name_off = DATA_START + strnlen(fsbuf->head + DATA_START, size - DATA_START) + 1;
+	if (fsbuf->first_name_off > size)
+	{
+		free_fs_buf(fsbuf);
+		return 3;
+	}
+	*pfsbuf = fsbuf;
+	return 0;
+}
+
+// copy the end offsets of the indexed blocks, the hashes keep changing with the fs_buf
+static void copy_block_tails(fs_buf *snapshot, fs_buf *fsbuf)
+{
+	snapshot->indexes = malloc(MAX(fsbuf->index_count, 1) * sizeof(kids_index *));
+	if (snapshot->indexes == 0)
+		return;
+
+	snapshot->index_capacity = MAX(fsbuf->index_count, 1);
+	for (uint32_t i = 0; i < fsbuf->index_count; i++)
+	{
+		kids_index *index = malloc(sizeof(kids_index));
+		if (index == 0)
+			return;
+
+		*index = *fsbuf->indexes[i];
+		index->slots = 0;
+		snapshot->indexes[snapshot->index_count++] = index;
+	}
 }
 
-// return 0 means file, no-kid or parent node
-static uint32_t get_kids_offset(fs_buf *fsbuf, uint32_t name_off)
+__attribute__((visibility("default"))) fs_buf *snapshot_fs_buf(fs_buf *fsbuf)
 {
-	if (do_is_file(fsbuf, name_off))
+	fs_buf *snapshot = alloc_fs_buf();
+	if (snapshot == 0)
 		return 0;
 
-	uint32_t tag_off = name_off + strlen(fsbuf->head + name_off) + 1;
-	uint32_t rel_off = get_reloff_by_tag(fsbuf, tag_off);
-	if (rel_off == 0)
-		return 0;
+	pthread_rwlock_rdlock(&fsbuf->lock);
+	fs_share *share = fsbuf->share;
+	if (share == 0)
+	{
+		share = malloc(sizeof(fs_share));
+		if (share == 0)
+		{
+			pthread_rwlock_unlock(&fsbuf->lock);
+			pthread_rwlock_destroy(&snapshot->lock);
+			free(snapshot);
+			return 0;
+		}
 
-	return tag_off + rel_off;
+		share->refs = 1;
+		share->head = fsbuf->head;
+		share->fold = fsbuf->fold;
+		share->size = fsbuf->capacity;
+		share->extents = fsbuf->extents;
+		// other readers may be sharing it at the same time
+		if (!__sync_bool_compare_and_swap(&fsbuf->share, 0, share))
+		{
+			free(share);
+			share = fsbuf->share;
+		}
+	}
+	__sync_fetch_and_add(&share->refs, 1);
+
+	snapshot->share = share;
+	snapshot->head = fsbuf->head;
+	snapshot->fold = fsbuf->fold;
+	snapshot->mapped_size = fsbuf->mapped_size;
+	snapshot->capacity = fsbuf->capacity;
+	snapshot->tail = fsbuf->tail;
+	snapshot->gap_start = fsbuf->gap_start;
+	snapshot->first_name_off = fsbuf->first_name_off;
+	snapshot->pad_size = fsbuf->pad_size;
+	snapshot->tag_size = fsbuf->tag_size;
+	snapshot->info = fsbuf->info;
+	snapshot->dict = fsbuf->dict;
+	snapshot->front_coded = fsbuf->front_coded;
+	if (snapshot->dict)
+		__sync_fetch_and_add(&snapshot->dict->refs, 1);
+	snapshot->pinyins = fsbuf->pinyins;
+	if (snapshot->pinyins)
+		__sync_fetch_and_add(&snapshot->pinyins->refs, 1);
+	copy_block_tails(snapshot, fsbuf);
+	if (fsbuf->extents && fsbuf->extents == share->extents)
+	{
+		snapshot->extents = share->extents;
+		snapshot->extent_count = fsbuf->extent_count;
+		snapshot->extent_capacity = fsbuf->extent_capacity;
+	}
+	else if (fsbuf->extents)
+	{
+		// built since the data was shared
+		snapshot->extents = malloc(MAX(fsbuf->extent_count, 1) * sizeof(block_extent));
+		if (snapshot->extents)
+		{
+			memcpy(snapshot->extents, fsbuf->extents, fsbuf->extent_count * sizeof(block_extent));
+			snapshot->extent_count = fsbuf->extent_count;
+			snapshot->extent_capacity = MAX(fsbuf->extent_count, 1);
+		}
+	}
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return snapshot;
 }
 
 // return 0 means not-found, DATA_START means root
@@ -449,29 +3482,19 @@ static uint32_t do_get_path_offset(fs_buf *fsbuf, const char *path)
 	if (*p == 0)
 		return DATA_START;
 
-	uint32_t offset = fsbuf->first_name_off;
-	while (offset < fsbuf->tail)
+	uint32_t kids_off = fsbuf->first_name_off;
+	while (1)
 	{
-		char *name = fsbuf->head + offset;
-		if (*name == 0) // parent-tag met, not found
-			return 0;
+		const char *slash = strchr(p, '/');
+		uint32_t offset = find_kid(fsbuf, kids_off, p, slash ? slash - p : strlen(p));
+		if (offset == 0 || slash == 0)
+			return offset;
 
-		size_t name_len = strlen(name);
-		if (strstr(p, name) == p && (p[name_len] == 0 || p[name_len] == '/'))
-		{
-			if (p[name_len] == 0)
-				return offset;
-			// p[name_len] == '/'
-			uint32_t kids_off = get_kids_offset(fsbuf, offset);
-			if (kids_off == 0)
-				return 0;
-			p += name_len + 1;
-			offset = kids_off;
-		}
-		else
-			offset = next_name(fsbuf, offset);
+		kids_off = get_kids_offset(fsbuf, offset);
+		if (kids_off == 0)
+			return 0;
+		p = slash + 1;
 	}
-	return 0;
 }
 
 static uint32_t get_path_offset(fs_buf *fsbuf, const char *path)
@@ -501,10 +3524,15 @@ static uint32_t get_path_offset(fs_buf *fsbuf, const char *path)
 // recursively get last-kids-off
 static uint32_t get_tree_end_offset(fs_buf *fsbuf, uint32_t start_off)
 {
+	// the next block starts after the paddings following the subtree, the walk stops before them
+	uint32_t i = fsbuf->extents ? find_extent(fsbuf, start_off) : 0;
+	if (i < fsbuf->extent_count && fsbuf->extents[i].kids_off == start_off)
+		return get_extent_end(fsbuf, i);
+
 	uint32_t name_off = start_off, last_kids_off = 0;
 	while (name_off < fsbuf->tail)
 	{
-		if (*(fsbuf->head + name_off))
+		if (*fs_ptr(fsbuf, name_off))
 		{
 			uint32_t kids_off = get_kids_offset(fsbuf, name_off);
 			if (kids_off)
@@ -520,7 +3548,7 @@ static uint32_t get_tree_end_offset(fs_buf *fsbuf, uint32_t start_off)
 			continue;
 		}
 
-		return name_off + 1 + sizeof(uint32_t);
+		return name_off + 1 + fsbuf->tag_size;
 	}
 
 	return fsbuf->tail;
@@ -533,7 +3561,7 @@ static uint32_t get_insert_offset(fs_buf *fsbuf, uint32_t empty_folder_off)
 	uint32_t name_off = empty_folder_off, off = name_off;
 	while (off < fsbuf->tail)
 	{
-		if (*(fsbuf->head + off) == 0)
+		if (*fs_ptr(fsbuf, off) == 0)
 		{
 			uint32_t rel_off = get_reloff_by_tag(fsbuf, off + 1);
 			if (rel_off == 0) // root met
@@ -554,21 +3582,6 @@ static uint32_t get_insert_offset(fs_buf *fsbuf, uint32_t empty_folder_off)
 	return fsbuf->tail;
 }
 
-static uint32_t get_folder_tail_offset(fs_buf *fsbuf, uint32_t name_off)
-{
-	while (name_off < fsbuf->tail)
-	{
-		if (*(fsbuf->head + name_off))
-		{
-			name_off = next_name(fsbuf, name_off);
-			continue;
-		}
-
-		return name_off;
-	}
-	return 0;
-}
-
 static uint32_t get_parent_offset(fs_buf *fsbuf, uint32_t name_off)
 {
 	uint32_t tail = get_folder_tail_offset(fsbuf, name_off);
@@ -598,7 +3611,7 @@ static uint32_t get_1st_sibling_offset(fs_buf *fsbuf, uint32_t name_off)
 		if (kids_off)                                                                            \
 		{                                                                                        \
 			dbg_msg("update offset: delta: %'d, kid-off: %'u -> %'u, parent: [%'u] %s\n", delta, \
-					kids_off, kids_off + delta, off, fsbuf->head + off);                         \
+					kids_off, kids_off + delta, off, fs_ptr(fsbuf, off));                        \
 			kids_off += delta;                                                                   \
 			do_set_kids_off(fsbuf, off, kids_off);                                               \
 			set_parent_offset(fsbuf, get_folder_tail_offset(fsbuf, kids_off), off);              \
@@ -627,7 +3640,7 @@ static void update_offsets(fs_buf *fsbuf, uint32_t start_off, int delta, int upd
 	// recursively update parent's post sibling dirs' offsets
 	while (off && off < fsbuf->tail)
 	{
-		if (*(fsbuf->head + off) == 0)
+		if (*fs_ptr(fsbuf, off) == 0)
 		{
 			uint32_t rel_off = get_reloff_by_tag(fsbuf, off + 1);
 			if (rel_off == 0) // root met
@@ -656,17 +3669,33 @@ static int do_insert_path(fs_buf *fsbuf, const char *path, int is_dir, fs_change
 		return ERR_NO_PATH;
 
 	uint32_t kids_off = DATA_START == parent_off ? fsbuf->first_name_off : get_kids_offset(fsbuf, parent_off);
-	dbg_msg("parent-off: %u, parent-path: %s, kids-off: %u\n", parent_off, fsbuf->head + parent_off, kids_off);
+	uint32_t first_kid_off = kids_off;
+	dbg_msg("parent-off: %u, parent-path: %s, kids-off: %u\n", parent_off, fs_ptr(fsbuf, parent_off), kids_off);
 	// kids_off might be 0 because parent might be an empty folder
 	int empty_folder = kids_off == 0;
-	if (kids_off)
+	kids_index *index = kids_off ? get_kids_index(fsbuf, kids_off) : 0;
+	if (index)
+	{
+		if (lookup_kid(fsbuf, index, last_slash + 1, strlen(last_slash + 1)))
+			return ERR_PATH_EXISTS;
+		kids_off = index->tail_off;
+	}
+	else if (kids_off)
 	{
-		while (kids_off < fsbuf->tail && *(fsbuf->head + kids_off))
+		uint32_t count = 0;
+		name_cursor cursor;
+		init_name_cursor(&cursor, fsbuf);
+		while (kids_off < fsbuf->tail && *fs_ptr(fsbuf, kids_off))
 		{
-			if (strcmp(fsbuf->head + kids_off, last_slash + 1) == 0)
+			if (strcmp(get_cursor_name(&cursor, kids_off), last_slash + 1) == 0)
 				return ERR_PATH_EXISTS;
 			kids_off = next_name(fsbuf, kids_off);
+			count++;
 		}
+
+		// a large folder, the next insertions will not need to scan it
+		if (count >= MIN_INDEXED_KIDS)
+			index_kids(fsbuf, first_kid_off, count);
 	}
 	else
 	{
@@ -674,23 +3703,77 @@ static int do_insert_path(fs_buf *fsbuf, const char *path, int is_dir, fs_change
 	}
 
 	// kids_off points to parent-tag of parent node (empty_folder == 0) or a new node (empty_folder == 1)
-	int result = insert_new_name(fsbuf, kids_off, last_slash + 1, is_dir, empty_folder);
-	if (result)
-		return result;
-
-	change->delta = strlen(last_slash + 1) + 1 + (is_dir ? sizeof(uint32_t) : 1);
+	char ref[MAX_REF_SIZE];
+	const char *name = store_name(fsbuf, last_slash + 1, ref);
+	uint32_t name_size = get_name_size(fsbuf, name, is_dir), tag_size = 1 + fsbuf->tag_size;
+	change->start_off = kids_off;
 	if (empty_folder)
 	{
-		set_parent_offset(fsbuf, kids_off + change->delta, parent_off);
-		change->delta += 1 + sizeof(uint32_t);
+		// new sibling block, with some slack for the kids that usually follow a new folder
+		char *p = open_range(fsbuf, kids_off, name_size + tag_size + MIN_BLOCK_SLACK);
+		if (p == 0)
+			return ERR_NO_MEM;
+
+		write_name(fsbuf, p, name, is_dir);
+		fold_record(fsbuf, kids_off);
+		add_pinyin(fsbuf, kids_off);
+		set_parent_offset(fsbuf, kids_off + name_size, parent_off);
+		set_padding(fsbuf, kids_off + name_size + tag_size, MIN_BLOCK_SLACK);
 		do_set_kids_off(fsbuf, parent_off, kids_off);
+		add_extent(fsbuf, kids_off, parent_off);
+		change->delta = name_size + tag_size + MIN_BLOCK_SLACK;
+	}
+	else if (kids_off < fsbuf->tail)
+	{
+		uint32_t slack = get_slack_size(fsbuf, kids_off + tag_size);
+		change->delta = name_size;
+		if (slack == name_size || slack >= name_size + MIN_PAD_SIZE)
+		{
+			// grow the block into its slack, only the parent tag moves and nothing after the block changes
+			char *p = pin_range(fsbuf, kids_off, tag_size + slack);
+			memmove(p + name_size, p, tag_size);
+			write_name(fsbuf, p, name, is_dir);
+			fold_record(fsbuf, kids_off);
+			add_pinyin(fsbuf, kids_off);
+			if (slack > name_size)
+				write_padding(fsbuf, p + name_size + tag_size, slack - name_size);
+			use_slack(fsbuf, name_size);
+			if (DATA_START != parent_off)
+				set_parent_offset(fsbuf, kids_off + name_size, parent_off);
+			kid_inserted(fsbuf, first_kid_off, kids_off, name_size);
+			return 0;
+		}
+
+		// out of slack, move the data after the block once for this and the following insertions
+		uint32_t block_size = kids_off - first_kid_off;
+		uint32_t reserve = MIN(MAX(block_size / 4, MIN_BLOCK_SLACK), MAX_BLOCK_SLACK);
+		char *p = open_range(fsbuf, kids_off + tag_size, name_size + reserve);
+		if (p == 0)
+			return ERR_NO_MEM;
+
+		p -= tag_size;
+		memmove(p + name_size, p, tag_size);
+		write_name(fsbuf, p, name, is_dir);
+		fold_record(fsbuf, kids_off);
+		add_pinyin(fsbuf, kids_off);
+		set_padding(fsbuf, kids_off + name_size + tag_size, reserve);
+		if (DATA_START != parent_off)
+			set_parent_offset(fsbuf, kids_off + name_size, parent_off);
+		kid_inserted(fsbuf, first_kid_off, kids_off, name_size);
+		change->delta = name_size + reserve;
 	}
-	else if (DATA_START != parent_off)
+	else
 	{
-		uint32_t tail = get_folder_tail_offset(fsbuf, kids_off);
-		set_parent_offset(fsbuf, tail, parent_off);
+		int result = insert_new_name(fsbuf, kids_off, name, is_dir, 0);
+		if (result)
+			return result;
+		// the first name of the root block
+		if (kids_off == first_kid_off)
+			add_extent(fsbuf, kids_off, parent_off);
+		kid_inserted(fsbuf, first_kid_off, kids_off, name_size);
+		change->delta = name_size;
 	}
-	change->start_off = kids_off;
+
 	update_offsets(fsbuf, kids_off, change->delta, 1);
 	return 0;
 }
@@ -698,25 +3781,51 @@ static int do_insert_path(fs_buf *fsbuf, const char *path, int is_dir, fs_change
 __attribute__((visibility("default"))) int insert_path(fs_buf *fsbuf, const char *path, int is_dir, fs_change *change)
 {
 	pthread_rwlock_wrlock(&fsbuf->lock);
-	int r = do_insert_path(fsbuf, path, is_dir, change);
+	int r = begin_write_fs_buf(fsbuf) ? ERR_NO_MEM : do_insert_path(fsbuf, path, is_dir, change);
+	try_compact_fs_buf(fsbuf);
 	pthread_rwlock_unlock(&fsbuf->lock);
 	return r;
 }
 
-#define COPY_TREE(kids_tree, kids_tree_size, tree_start_off, tree_end_off)     \
-	do                                                                         \
-	{                                                                          \
-		if (kids_tree != 0 && kids_tree_size != 0)                             \
-		{                                                                      \
-			*kids_tree_size = tree_end_off - tree_start_off;                   \
-			*kids_tree = malloc(*kids_tree_size);                              \
-			if (*kids_tree == 0)                                               \
-				return ERR_NO_MEM;                                             \
-			memcpy(*kids_tree, fsbuf->head + tree_start_off, *kids_tree_size); \
-		}                                                                      \
-	} while (0);
+// the front coded record at next_off follows name_off, which is about to be removed. write to record
+// what takes their place: the name of next_off coded against the name before name_off, or in full.
+static void recode_front_name(fs_buf *fsbuf, uint32_t name_off, uint32_t next_off, char *record)
+{
+	char name[NAME_MAX + 1], buf[NAME_MAX + 1];
+	copy_name(name, decode_name(fsbuf, next_off, buf));
+
+	// the first record of a run is never front coded, so the record before a front coded one is in its run
+	const char *removed = fs_ptr(fsbuf, name_off);
+	if (is_front_coded(removed))
+	{
+		uint32_t distance = get_front_distance(removed), off = name_off - distance;
+		while (next_name(fsbuf, off) < name_off)
+			off = next_name(fsbuf, off);
+
+		const char *last_name = decode_name(fsbuf, off, buf);
+		uint32_t prefix = 0;
+		while (name[prefix] && name[prefix] == last_name[prefix])
+			prefix++;
+		prefix = get_char_boundary(name, prefix);
+		if (prefix > FRONT_HEADER_SIZE)
+		{
+			encode_front(record, prefix, distance, name + prefix);
+			return;
+		}
+	}
+	strcpy(record, name);
+}
+
+// set the distances of the front coded records following off in its run again
+static void renumber_front_run(fs_buf *fsbuf, uint32_t off)
+{
+	char *record = fs_ptr(fsbuf, off);
+	uint32_t run_off = is_front_coded(record) ? off - get_front_distance(record) : off;
+	for (off = next_name(fsbuf, off); is_front_coded(record = fs_ptr(fsbuf, off)); off = next_name(fsbuf, off))
+		set_front_distance(record, off - run_off);
+}
 
-static int do_remove_path(fs_buf *fsbuf, const char *path, fs_change *changes, uint32_t *change_count, char **kids_tree, uint32_t *kids_tree_size)
+static int do_remove_path(fs_buf *fsbuf, const char *path, fs_change *changes, uint32_t *change_count)
 {
 	uint32_t name_off = get_path_offset(fsbuf, path);
 	if (name_off == 0)
@@ -725,11 +3834,11 @@ static int do_remove_path(fs_buf *fsbuf, const char *path, fs_change *changes, u
 	if (name_off == DATA_START)
 	{ // remove whole tree
 		dbg_msg("remove whole tree: [%d] %s, [%d, %d]\n", name_off, path, fsbuf->first_name_off, fsbuf->tail);
-		COPY_TREE(kids_tree, kids_tree_size, fsbuf->first_name_off, fsbuf->tail);
 		changes[0].start_off = fsbuf->first_name_off;
 		changes[0].delta = fsbuf->first_name_off - fsbuf->tail;
 		*change_count = 1;
-		fsbuf->tail = fsbuf->first_name_off;
+		remove_range(fsbuf, fsbuf->first_name_off, fsbuf->tail - fsbuf->first_name_off);
+		fsbuf->pad_size = 0;
 		return 0;
 	}
 
@@ -740,15 +3849,11 @@ static int do_remove_path(fs_buf *fsbuf, const char *path, fs_change *changes, u
 	{
 		uint32_t tree_end_off = get_tree_end_offset(fsbuf, kids_off);
 		dbg_msg("kids-off: %'u, kids-name: %s, tree-end: %'u, next-name: %s\n",
-				kids_off, fsbuf->head + kids_off, tree_end_off, fsbuf->head + tree_end_off);
-
-		COPY_TREE(kids_tree, kids_tree_size, kids_off, tree_end_off);
+				kids_off, fs_ptr(fsbuf, kids_off), tree_end_off, fs_ptr(fsbuf, tree_end_off));
 
+		// the subtree is contiguous, leave it as padding so nothing after it moves
 		do_set_kids_off(fsbuf, name_off, 0);
-		if (tree_end_off < fsbuf->tail)
-			memmove(fsbuf->head + kids_off, fsbuf->head + tree_end_off, fsbuf->tail - tree_end_off);
-		fsbuf->tail -= (tree_end_off - kids_off);
-		update_offsets(fsbuf, name_off, kids_off - tree_end_off, 0);
+		set_padding(fsbuf, kids_off, tree_end_off - kids_off);
 		changes[0].start_off = kids_off;
 		changes[0].delta = kids_off - tree_end_off;
 		*change_count = 1;
@@ -756,33 +3861,78 @@ static int do_remove_path(fs_buf *fsbuf, const char *path, fs_change *changes, u
 
 	// remove name_off node itself
 	uint32_t parent_off = get_parent_offset(fsbuf, name_off), sibling1 = get_1st_sibling_offset(fsbuf, name_off);
-	uint32_t size = next_name(fsbuf, name_off) - name_off;
-	char *name = fsbuf->head + name_off + size;
+	uint32_t size = next_name(fsbuf, name_off) - name_off, tag_size = 1 + fsbuf->tag_size;
+	char *name = fs_ptr(fsbuf, name_off + size);
 	int only_kid = (*name == 0 && sibling1 == name_off);
-	if (only_kid)
-	{
-		size += 1 + sizeof(uint32_t);
-		if (parent_off)
-			do_set_kids_off(fsbuf, parent_off, 0);
-	}
-	else if (parent_off)
+	if (only_kid && parent_off == 0)
 	{
-		uint32_t tail = get_folder_tail_offset(fsbuf, name_off);
-		set_parent_offset(fsbuf, tail, parent_off + size);
+		// the root folder becomes empty, what is left after its block can only be padding
+		size = fsbuf->tail - name_off;
+		remove_range(fsbuf, name_off, size);
+		fsbuf->pad_size = 0;
 	}
-
-	if (name_off + size < fsbuf->tail)
-		memmove(fsbuf->head + name_off, fsbuf->head + name_off + size, fsbuf->tail - name_off - size);
-	fsbuf->tail -= size;
-	if (only_kid)
+	else if (only_kid)
 	{
-		if (parent_off)
-			update_offsets(fsbuf, parent_off, -size, 0);
+		// the whole sibling block goes
+		size += tag_size;
+		do_set_kids_off(fsbuf, parent_off, 0);
+		set_padding(fsbuf, name_off, size);
 	}
 	else
 	{
-		update_offsets(fsbuf, name_off, -size, 1);
+		// close up the block and leave the freed bytes as slack after its parent tag. a front coded
+		// record after name_off is coded again without it and takes its place.
+		uint32_t tail = get_folder_tail_offset(fsbuf, name_off), block_rest = tail + tag_size - name_off;
+		uint32_t next_off = name_off + size, next_size = 0, recoded_size = 0, next_kids_off = 0;
+		int next_is_dir = 0;
+		char record[FRONT_HEADER_SIZE + NAME_MAX + 1];
+		if (is_front_coded(fs_ptr(fsbuf, next_off)))
+		{
+			next_is_dir = !do_is_file(fsbuf, next_off);
+			next_kids_off = get_kids_offset(fsbuf, next_off);
+			next_size = next_name(fsbuf, next_off) - next_off;
+			recode_front_name(fsbuf, name_off, next_off, record);
+			recoded_size = get_name_size(fsbuf, record, next_is_dir);
+		}
+
+		kid_removed(fsbuf, sibling1, name_off, size);
+		kids_moved(fsbuf, sibling1, name_off, (int64_t)recoded_size - next_size);
+		size += next_size - recoded_size;
+		char *p = pin_range(fsbuf, name_off, block_rest);
+		move_data(fsbuf, p + recoded_size, p + recoded_size + size, block_rest - recoded_size - size);
+		// the pinyin follows the records, the recoded one gets it again below
+		drop_pinyins(fsbuf, name_off, recoded_size + size);
+		shift_pinyins(fsbuf, name_off + recoded_size + size, name_off + block_rest, -(int64_t)size);
+		set_padding(fsbuf, tail + tag_size - size, size);
+		if (recoded_size)
+		{
+			write_name(fsbuf, fs_ptr(fsbuf, name_off), record, next_is_dir);
+			fold_record(fsbuf, name_off);
+			add_pinyin(fsbuf, name_off);
+			if (next_kids_off)
+			{
+				do_set_kids_off(fsbuf, name_off, next_kids_off);
+				set_parent_offset(fsbuf, get_folder_tail_offset(fsbuf, next_kids_off), name_off);
+			}
+			renumber_front_run(fsbuf, name_off);
+		}
+
+		// the siblings after name_off moved but their kids did not
+		for (uint32_t off = name_off + recoded_size; off < tail - size; off = next_name(fsbuf, off))
+		{
+			uint32_t kids_off = get_kids_offset(fsbuf, off);
+			if (kids_off)
+			{
+				kids_off += size;
+				do_set_kids_off(fsbuf, off, kids_off);
+				set_parent_offset(fsbuf, get_folder_tail_offset(fsbuf, kids_off), off);
+			}
+		}
+
+		if (parent_off)
+			set_parent_offset(fsbuf, tail - size, parent_off);
 	}
+
 	changes[*change_count].start_off = name_off;
 	changes[*change_count].delta = -size;
 	*change_count = *change_count + 1;
@@ -792,11 +3942,188 @@ static int do_remove_path(fs_buf *fsbuf, const char *path, fs_change *changes, u
 __attribute__((visibility("default"))) int remove_path(fs_buf *fsbuf, const char *path, fs_change *changes, uint32_t *change_count)
 {
 	pthread_rwlock_wrlock(&fsbuf->lock);
-	int r = do_remove_path(fsbuf, path, changes, change_count, 0, 0);
+	int r = begin_write_fs_buf(fsbuf) ? ERR_NO_MEM : do_remove_path(fsbuf, path, changes, change_count);
+	try_compact_fs_buf(fsbuf);
 	pthread_rwlock_unlock(&fsbuf->lock);
 	return r;
 }
 
+// the shorter side of a rotation goes through a buffer on the stack if it fits into it
+#define ROTATE_BUF_SIZE (16 << 10)
+
+static void swap_bytes(char *a, char *b, uint32_t size)
+{
+	char buf[ROTATE_BUF_SIZE];
+	while (size)
+	{
+		uint32_t n = MIN(size, ROTATE_BUF_SIZE);
+		memcpy(buf, a, n);
+		memcpy(a, b, n);
+		memcpy(b, buf, n);
+		a += n;
+		b += n;
+		size -= n;
+	}
+}
+
+// rotate the size bytes at p left by shift. the longer side only moves once if the shorter one fits
+// into the buffer, otherwise the shorter side is swapped to its place and the rest rotated again.
+static void rotate_bytes(char *p, uint32_t size, uint32_t shift)
+{
+	while (shift && shift < size)
+	{
+		uint32_t rest = size - shift;
+		if (MIN(shift, rest) <= ROTATE_BUF_SIZE)
+		{
+			char buf[ROTATE_BUF_SIZE];
+			if (shift <= rest)
+			{
+				memcpy(buf, p, shift);
+				memmove(p, p + shift, rest);
+				memcpy(p + rest, buf, shift);
+			}
+			else
+			{
+				memcpy(buf, p + shift, rest);
+				memmove(p + rest, p, shift);
+				memcpy(p, buf, rest);
+			}
+			return;
+		}
+
+		if (shift <= rest)
+		{
+			// A B1 B2 with B2 as long as A: swapping A and B2 puts A in place, B2 B1 is left
+			swap_bytes(p, p + rest, shift);
+			size = rest;
+		}
+		else
+		{
+			// A1 A2 B with A1 as long as B: swapping A1 and B puts B in place, A2 A1 is left
+			swap_bytes(p, p + shift, rest);
+			p += rest;
+			size -= rest;
+			shift -= rest;
+		}
+	}
+}
+
+// the blocks in [start, end) trade places with the ones up to off after them, or from off before them,
+// like the records (see move_subtree). the extents nested in them stay nested the same way, and
+// the pinyin of their names goes with them.
+static void move_block_lookups(fs_buf *fsbuf, uint32_t start, uint32_t end, uint32_t off)
+{
+	uint32_t size = end - start, lo = MIN(start, off), hi = MAX(end, off);
+	uint32_t split_off = off > end ? end : start, new_start = off > end ? off - size : off;
+	int64_t mid_delta = off > end ? -(int64_t)size : size;
+
+	uint32_t first = find_kids_index(fsbuf, lo), split = find_kids_index(fsbuf, split_off);
+	uint32_t last = find_kids_index(fsbuf, hi);
+	for (uint32_t i = first; i < last; i++)
+	{
+		int64_t delta = fsbuf->indexes[i]->kids_off >= start && fsbuf->indexes[i]->kids_off < end ?
+			(int64_t)new_start - start : mid_delta;
+		fsbuf->indexes[i]->kids_off += delta;
+		fsbuf->indexes[i]->tail_off += delta;
+	}
+	rotate_bytes((char *)(fsbuf->indexes + first), (last - first) * sizeof(kids_index *), (split - first) * sizeof(kids_index *));
+
+	pinyin_table *table = fsbuf->pinyins;
+	if (table)
+	{
+		first = find_pinyin(table, lo);
+		split = find_pinyin(table, split_off);
+		last = find_pinyin(table, hi);
+		for (uint32_t i = first; i < last; i++)
+			table->entries[i].name_off += table->entries[i].name_off >= start && table->entries[i].name_off < end ?
+				(int64_t)new_start - start : mid_delta;
+		rotate_bytes((char *)(table->entries + first), (last - first) * sizeof(pinyin_entry), (split - first) * sizeof(pinyin_entry));
+	}
+
+	if (fsbuf->extents == 0)
+		return;
+
+	first = find_extent(fsbuf, lo);
+	split = find_extent(fsbuf, split_off);
+	last = find_extent(fsbuf, hi);
+	for (uint32_t i = first; i < last; i++)
+		fsbuf->extents[i].kids_off += fsbuf->extents[i].kids_off >= start && fsbuf->extents[i].kids_off < end ?
+			(int64_t)new_start - start : mid_delta;
+	rotate_bytes((char *)(fsbuf->extents + first), (last - first) * sizeof(block_extent), (split - first) * sizeof(block_extent));
+}
+
+// move the subtree in [start, end), whose folder doesn't point to it any more, to the kids of the empty
+// folder_off outside of it: the records between the subtree and where it goes are rotated with it and
+// move by its size the other way. only the tags of these records can point across, and the parent tag
+// of the first block of the subtree. return where the subtree starts then.
+static uint32_t move_subtree(fs_buf *fsbuf, uint32_t start, uint32_t end, uint32_t folder_off)
+{
+	// the blocks holding the old folder lose the extents of the subtree, those holding folder_off get them
+	uint32_t moved_count = 0;
+	if (fsbuf->extents)
+	{
+		uint32_t first = find_extent(fsbuf, start);
+		moved_count = find_extent(fsbuf, end) - first;
+		for (uint32_t i = get_next_outer_extent(fsbuf, first); i != (uint32_t)-1; i = get_next_outer_extent(fsbuf, i))
+			fsbuf->extents[i].nested -= moved_count;
+	}
+
+	uint32_t off = get_insert_offset(fsbuf, folder_off), new_start = start;
+	if (off != start && off != end)
+	{
+		uint32_t size = end - start, lo = MIN(start, off), hi = MAX(end, off);
+		uint32_t mid_start = off > end ? end : off, mid_end = off > end ? off : start;
+		int64_t mid_delta = off > end ? -(int64_t)size : size;
+		new_start = off > end ? off - size : off;
+		move_block_lookups(fsbuf, start, end, off);
+
+		// the rotated range has to be contiguous, the gap goes to its nearer end
+		if (lo < fsbuf->gap_start && hi > fsbuf->gap_start)
+			move_gap(fsbuf, fsbuf->gap_start - lo < hi - fsbuf->gap_start ? lo : hi);
+		rotate_bytes(fs_ptr(fsbuf, lo), hi - lo, off > end ? size : start - off);
+		if (fsbuf->fold)
+			rotate_bytes(fold_ptr(fsbuf, lo), hi - lo, off > end ? size : start - off);
+
+		for (uint32_t name_off = mid_start + mid_delta; name_off < mid_end + mid_delta; name_off = next_name(fsbuf, name_off))
+		{
+			char *name = fs_ptr(fsbuf, name_off);
+			if (*name == 0)
+			{
+				// a block whose folder is before the moved range
+				uint32_t rel_off = get_reloff_by_tag(fsbuf, name_off + 1), parent_off = name_off - mid_delta + 1 - rel_off;
+				if (is_padding(fsbuf, name_off) || rel_off == 0 || parent_off >= lo)
+					continue;
+
+				set_parent_offset(fsbuf, name_off, parent_off);
+				do_set_kids_off(fsbuf, parent_off, get_kids_offset(fsbuf, parent_off) + mid_delta);
+				continue;
+			}
+
+			// a folder whose kids are after the moved range
+			uint32_t kids_off = get_kids_offset(fsbuf, name_off);
+			if (kids_off == 0 || kids_off - mid_delta < hi)
+				continue;
+
+			kids_off -= mid_delta;
+			do_set_kids_off(fsbuf, name_off, kids_off);
+			set_parent_offset(fsbuf, get_folder_tail_offset(fsbuf, kids_off), name_off);
+		}
+
+		if (folder_off >= mid_start && folder_off < mid_end)
+			folder_off += mid_delta;
+	}
+
+	if (fsbuf->extents)
+	{
+		for (uint32_t i = get_outer_extent(fsbuf, folder_off); i != (uint32_t)-1; i = get_next_outer_extent(fsbuf, i))
+			fsbuf->extents[i].nested += moved_count;
+	}
+
+	do_set_kids_off(fsbuf, folder_off, new_start);
+	set_parent_offset(fsbuf, get_folder_tail_offset(fsbuf, new_start), folder_off);
+	return new_start;
+}
+
 // NOTE: Linux rename syscall for folder can only succeed if dst_path doesnt exist or is empty
 // so dst_path (if a folder) MUST be empty here
 static int do_rename_path(fs_buf *fsbuf, const char *src_path, const char *dst_path, fs_change *changes, uint32_t *change_count)
@@ -817,93 +4144,319 @@ static int do_rename_path(fs_buf *fsbuf, const char *src_path, const char *dst_p
 	if (dst_off != 0 && do_is_file(fsbuf, dst_off) != src_is_file)
 		return ERR_PATH_DIFFER;
 
-	if (dst_off != 0 && !src_is_file && get_kids_offset(fsbuf, dst_off) != 0)
-		return ERR_NOTEMPTY;
+	if (dst_off != 0 && !src_is_file && get_kids_offset(fsbuf, dst_off) != 0)
+		return ERR_NOTEMPTY;
+
+	char *last_slash = strrchr(dst_path, '/');
+	if (last_slash == 0 || strlen(last_slash) == 1)
+		return ERR_NO_PATH;
+
+	*last_slash = 0;
+	uint32_t dst_parent_off = get_path_offset(fsbuf, dst_path);
+	*last_slash = '/';
+	if (dst_parent_off == 0 || (dst_parent_off == DATA_START && do_is_file(fsbuf, dst_parent_off)))
+		return ERR_NO_PATH;
+
+	uint32_t kids_off = src_is_file ? 0 : get_kids_offset(fsbuf, src_off);
+	if (kids_off == 0)
+	{
+		int result = do_remove_path(fsbuf, src_path, changes, change_count);
+		if (result != 0)
+			return result;
+
+		if (dst_off == 0)
+		{
+			// we assume insert_path will always succeed
+			do_insert_path(fsbuf, dst_path, !src_is_file, changes + *change_count);
+			*change_count = *change_count + 1;
+		}
+		return 0;
+	}
+
+	// a folder can't go into its own subtree
+	uint32_t tree_end = get_tree_end_offset(fsbuf, kids_off);
+	if (dst_parent_off == src_off || (dst_parent_off >= kids_off && dst_parent_off < tree_end))
+		return ERR_NESTED;
+
+	// the kids are moved in place from the source folder to the destination one: it is made first,
+	// and the source one is removed once it is empty
+	*change_count = 0;
+	if (dst_off == 0)
+	{
+		if (do_insert_path(fsbuf, dst_path, 1, changes) != 0)
+			return ERR_NO_MEM;
+		*change_count = 1;
+		src_off = get_path_offset(fsbuf, src_path);
+		dst_off = get_path_offset(fsbuf, dst_path);
+		kids_off = get_kids_offset(fsbuf, src_off);
+		tree_end = get_tree_end_offset(fsbuf, kids_off);
+	}
+
+	uint32_t tree_size = tree_end - kids_off;
+	do_set_kids_off(fsbuf, src_off, 0);
+	uint32_t new_kids_off = move_subtree(fsbuf, kids_off, tree_end, dst_off);
+
+	changes[*change_count].start_off = kids_off;
+	changes[*change_count].delta = -tree_size;
+	changes[*change_count + 1].start_off = new_kids_off;
+	changes[*change_count + 1].delta = tree_size;
+	*change_count = *change_count + 2;
+
+	uint32_t remove_count = 0;
+	int result = do_remove_path(fsbuf, src_path, changes + *change_count, &remove_count);
+	*change_count = *change_count + remove_count;
+	return result;
+}
+
+static void do_get_path_range(fs_buf *fsbuf, const char *path, uint32_t *path_off, uint32_t *start_off, uint32_t *end_off)
+{
+	pthread_rwlock_rdlock(&fsbuf->lock);
+	*path_off = get_path_offset(fsbuf, path);
+	if (*path_off != 0)
+	{
+		// 对于此索引数据的根目录没有保存它的目录文件起始信息
+		if (*path_off == DATA_START) {
+			*start_off = first_name(fsbuf);
+			*end_off = get_tail(fsbuf);
+		} else {
+			*start_off = get_kids_offset(fsbuf, *path_off);
+			*end_off = get_tree_end_offset(fsbuf, *start_off);
+		}
+	}
+	pthread_rwlock_unlock(&fsbuf->lock);
+}
+
+__attribute__((visibility("default"))) void get_path_range(fs_buf *fsbuf, const char *path, uint32_t *path_off, uint32_t *start_off, uint32_t *end_off)
+{
+	do_get_path_range(fsbuf, path, path_off, start_off, end_off);
+}
+
+__attribute__((visibility("default"))) int rename_path(fs_buf *fsbuf, const char *src_path, const char *dst_path, fs_change *changes, uint32_t *change_count)
+{
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	int r = begin_write_fs_buf(fsbuf) ? ERR_NO_MEM : do_rename_path(fsbuf, src_path, dst_path, changes, change_count);
+	try_compact_fs_buf(fsbuf);
+	pthread_rwlock_unlock(&fsbuf->lock);
+	return r;
+}
+
+// number of the inserts following ops[0] into the same folder, and the size of their names
+static uint32_t get_insert_run(fs_buf *fsbuf, const fs_op *ops, uint32_t count, uint32_t *size)
+{
+	const char *last_slash = strrchr(ops[0].path, '/');
+	if (last_slash == 0)
+		return 0;
+
+	uint32_t parent_len = last_slash - ops[0].path, n = 1;
+	for (*size = 0; n < count && ops[n].op == FS_OP_INSERT; n++)
+	{
+		const char *name = ops[n].path + parent_len + 1;
+		if (strncmp(ops[n].path, ops[0].path, parent_len + 1) != 0 || *name == 0 || strchr(name, '/'))
+			break;
+		char ref[MAX_REF_SIZE];
+		*size += get_name_size(fsbuf, store_name(fsbuf, name, ref), ops[n].is_dir);
+	}
+	return n - 1;
+}
+
+// make room for size bytes of names in the block of the parent of kid_path at once,
+// so that the insertions into it that follow don't move the data after it one by one
+static void reserve_kids_room(fs_buf *fsbuf, const char *kid_path, uint32_t size)
+{
+	uint32_t parent_len = strrchr(kid_path, '/') - kid_path;
+	char parent_path[parent_len + 1];
+	memcpy(parent_path, kid_path, parent_len);
+	parent_path[parent_len] = 0;
+
+	uint32_t parent_off = get_path_offset(fsbuf, parent_path);
+	if (parent_off == 0 || (DATA_START != parent_off && do_is_file(fsbuf, parent_off)))
+		return;
+
+	uint32_t kids_off = DATA_START == parent_off ? fsbuf->first_name_off : get_kids_offset(fsbuf, parent_off);
+	if (kids_off == 0 || kids_off >= fsbuf->tail)
+		return;
+
+	uint32_t tail = get_folder_tail_offset(fsbuf, kids_off), tag_size = 1 + fsbuf->tag_size;
+	uint32_t slack = get_slack_size(fsbuf, tail + tag_size);
+	if (slack == size || slack >= size + MIN_PAD_SIZE)
+		return;
+
+	uint32_t block_size = tail - kids_off;
+	uint32_t reserve = size - MIN(slack, size) + MIN(MAX(block_size / 4, MIN_BLOCK_SLACK), MAX_BLOCK_SLACK);
+	if (open_range(fsbuf, tail + tag_size, reserve) == 0)
+		return;
+
+	set_padding(fsbuf, tail + tag_size, reserve);
+	update_offsets(fsbuf, tail, reserve, 1);
+}
+
+__attribute__((visibility("default"))) void apply_fs_changes(fs_buf *fsbuf, const fs_op *ops, uint32_t count, int *results)
+{
+	fs_change changes[10];
+	uint32_t run_end = 0;
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (begin_write_fs_buf(fsbuf) != 0)
+		{
+			results[i] = ERR_NO_MEM;
+			continue;
+		}
+
+		uint32_t change_count = 10, size = 0;
+		switch (ops[i].op)
+		{
+		case FS_OP_INSERT:
+			results[i] = do_insert_path(fsbuf, ops[i].path, ops[i].is_dir, changes);
+			// the first insert may create the block, the rest of the run then goes into its slack
+			if (i >= run_end)
+			{
+				run_end = i + 1 + get_insert_run(fsbuf, ops + i, count - i, &size);
+				if (run_end > i + 1)
+					reserve_kids_room(fsbuf, ops[i].path, size);
+			}
+			break;
+		case FS_OP_REMOVE:
+			results[i] = do_remove_path(fsbuf, ops[i].path, changes, &change_count);
+			break;
+		case FS_OP_RENAME:
+			results[i] = do_rename_path(fsbuf, ops[i].path, ops[i].dst_path, changes, &change_count);
+			break;
+		default:
+			results[i] = ERR_NO_PATH;
+			break;
+		}
+	}
+	try_compact_fs_buf(fsbuf);
+	pthread_rwlock_unlock(&fsbuf->lock);
+}
+
+// whether off is in one of the sorted [start, end) ranges
+static int in_ranges(const uint32_t *ranges, uint32_t range_count, uint32_t off)
+{
+	uint32_t lo = 0, hi = range_count;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (ranges[2 * mid + 1] <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < range_count && ranges[2 * lo] <= off;
+}
 
-	char *last_slash = strrchr(dst_path, '/');
-	if (last_slash == 0 || strlen(last_slash) == 1)
-		return ERR_NO_PATH;
+__attribute__((visibility("default"))) int check_fs_buf(fs_buf *fsbuf, uint32_t *folders, uint32_t *folder_count)
+{
+	uint32_t max_count = *folder_count, count = 0;
+	*folder_count = 0;
 
-	*last_slash = 0;
-	uint32_t dst_parent_off = get_path_offset(fsbuf, dst_path);
-	*last_slash = '/';
-	if (dst_parent_off == 0 || (dst_parent_off == DATA_START && do_is_file(fsbuf, dst_parent_off)))
-		return ERR_NO_PATH;
+	pthread_rwlock_wrlock(&fsbuf->lock);
+	if (fsbuf->chunks == 0)
+	{
+		pthread_rwlock_unlock(&fsbuf->lock);
+		return 1;
+	}
 
-	// folder with kids, backup its kids first
-	char *old_kids_tree = 0;
-	uint32_t tree_size = 0;
-	int result = do_remove_path(fsbuf, src_path, changes, change_count, &old_kids_tree, &tree_size);
-	if (result != 0)
-		return result;
+	// the broken chunks as [start, end) pairs, adjacent ones merged
+	uint32_t *ranges = malloc(fsbuf->chunk_count * 2 * sizeof(uint32_t)), range_count = 0;
+	if (ranges == 0)
+	{
+		pthread_rwlock_unlock(&fsbuf->lock);
+		return 4;
+	}
 
-	if (dst_off == 0)
+	uint32_t start = DATA_START;
+	for (uint32_t i = 0; i < fsbuf->chunk_count; i++)
 	{
-		// we assume insert_path will always succeed
-		do_insert_path(fsbuf, dst_path, !src_is_file, changes + *change_count);
-		*change_count = *change_count + 1;
+		uint32_t end = fsbuf->chunks[i].end_off;
+		uint64_t hash;
+		if (hash_chunk(fsbuf, start, end, &hash) != 0 || hash != fsbuf->chunks[i].hash)
+		{
+			dbg_msg("broken chunk: %'u - %'u\n", start, end);
+			if (range_count && ranges[2 * range_count - 1] == start)
+			{
+				ranges[2 * range_count - 1] = end;
+			}
+			else
+			{
+				ranges[2 * range_count] = start;
+				ranges[2 * range_count + 1] = end;
+				range_count++;
+			}
+		}
+		start = end;
 	}
-	// do_remove_path might change dst_off, so we must get it again
-	dst_off = get_path_offset(fsbuf, dst_path);
+	free(fsbuf->chunks);
+	fsbuf->chunks = 0;
+	fsbuf->chunk_count = 0;
+
+	// the first chunk holds the root path and the root block
+	int r = range_count && ranges[0] == DATA_START ? 2 : 0;
 
-	// copy back kids tree, dst_off must point to a folder
-	if (old_kids_tree)
+	// the kids blocks of the names in a range follow it in tree order, cut them out too
+	for (uint32_t i = 0; r == 0 && i < range_count; i++)
 	{
-		dbg_msg("old-kids-tree: %p (%s), size: %'u\n", old_kids_tree, old_kids_tree, tree_size);
-		if (tree_size + fsbuf->tail >= fsbuf->capacity)
-			if (add_capacity(fsbuf, tree_size) != 0)
+		uint32_t *range = ranges + 2 * i;
+		while (range[1] < fsbuf->tail)
+		{
+			if (i + 1 < range_count && range[2] == range[1])
 			{
-				free(old_kids_tree);
-				return ERR_NO_MEM;
+				range[1] = range[3];
+				memmove(range + 2, range + 4, (range_count - i - 2) * 2 * sizeof(uint32_t));
+				range_count--;
+				continue;
 			}
 
-		uint32_t kids_off = get_insert_offset(fsbuf, dst_off);
-		if (fsbuf->tail > kids_off)
-			memmove(fsbuf->head + kids_off + tree_size, fsbuf->head + kids_off, fsbuf->tail - kids_off);
-		memcpy(fsbuf->head + kids_off, old_kids_tree, tree_size);
-		free(old_kids_tree);
-		fsbuf->tail += tree_size;
-		// set kids-off, parent-off & update-offsets
-		do_set_kids_off(fsbuf, dst_off, kids_off);
-		set_parent_offset(fsbuf, get_folder_tail_offset(fsbuf, kids_off), dst_off);
-		update_offsets(fsbuf, kids_off, tree_size, 1);
+			uint32_t tail_off = get_folder_tail_offset(fsbuf, range[1]);
+			uint32_t rel_off = tail_off ? get_reloff_by_tag(fsbuf, tail_off + 1) : 0;
+			if (rel_off == 0 || tail_off + 1 - rel_off < range[0] || tail_off + 1 - rel_off >= range[1])
+				break;
 
-		changes[*change_count].start_off = kids_off;
-		changes[*change_count].delta = tree_size;
-		*change_count = *change_count + 1;
+			range[1] = tail_off + 1 + fsbuf->tag_size;
+			range[1] += get_slack_size(fsbuf, range[1]);
+		}
 	}
 
-	return 0;
-}
+	// the folders outside the ranges owning the blocks in them
+	for (uint32_t off = fsbuf->first_name_off, i = 0; r == 0 && off < fsbuf->tail;)
+	{
+		if (i < range_count && off >= ranges[2 * i])
+		{
+			off = ranges[2 * i + 1];
+			i++;
+			continue;
+		}
 
-static void do_get_path_range(fs_buf *fsbuf, const char *path, uint32_t *path_off, uint32_t *start_off, uint32_t *end_off)
-{
-	pthread_rwlock_rdlock(&fsbuf->lock);
-	*path_off = get_path_offset(fsbuf, path);
-	if (*path_off != 0)
+		uint32_t kids_off = *fs_ptr(fsbuf, off) ? get_kids_offset(fsbuf, off) : 0;
+		if (kids_off && in_ranges(ranges, range_count, kids_off))
+		{
+			if (count == max_count)
+				r = 3;
+			else
+				folders[count++] = off;
+		}
+		off = next_name(fsbuf, off);
+	}
+
+	if (r == 0 && range_count)
 	{
-		// 对于此索引数据的根目录没有保存它的目录文件起始信息
-		if (*path_off == DATA_START) {
-			*start_off = first_name(fsbuf);
-			*end_off = get_tail(fsbuf);
-		} else {
-			*start_off = get_kids_offset(fsbuf, *path_off);
-			*end_off = get_tree_end_offset(fsbuf, *start_off);
+		if (begin_write_fs_buf(fsbuf) != 0)
+		{
+			r = 4;
+		}
+		else
+		{
+			for (uint32_t i = 0; i < count; i++)
+				do_set_kids_off(fsbuf, folders[i], 0);
+			for (uint32_t i = 0; i < range_count; i++)
+				set_padding(fsbuf, ranges[2 * i], ranges[2 * i + 1] - ranges[2 * i]);
 		}
 	}
 	pthread_rwlock_unlock(&fsbuf->lock);
-}
-
-__attribute__((visibility("default"))) void get_path_range(fs_buf *fsbuf, const char *path, uint32_t *path_off, uint32_t *start_off, uint32_t *end_off)
-{
-	do_get_path_range(fsbuf, path, path_off, start_off, end_off);
-}
 
-__attribute__((visibility("default"))) int rename_path(fs_buf *fsbuf, const char *src_path, const char *dst_path, fs_change *changes, uint32_t *change_count)
-{
-	pthread_rwlock_wrlock(&fsbuf->lock);
-	int r = do_rename_path(fsbuf, src_path, dst_path, changes, change_count);
-	pthread_rwlock_unlock(&fsbuf->lock);
+	free(ranges);
+	*folder_count = r == 0 ? count : 0;
 	return r;
 }
 
@@ -914,10 +4467,14 @@ __attribute__((visibility("default"))) void search_files(fs_buf *fsbuf, uint32_t
 	*count = 0;
 	pthread_rwlock_rdlock(&fsbuf->lock);
 	uint32_t name_off = *start_off, min_off = fsbuf->tail > end_off ? end_off : fsbuf->tail;
+	name_cursor cursor;
+	init_name_cursor(&cursor, fsbuf);
 
 	while (name_off < min_off && *count < size)
 	{
-		char *name = fsbuf->head + name_off;
+		char *name = fs_ptr(fsbuf, name_off);
+		if (*name)
+			name = (char *)get_cursor_name(&cursor, name_off);
 
 		if (pcf && (*pcf)(*count, name, pcf_param) != 0) {
 			break;
@@ -957,6 +4514,8 @@ int get_rules(search_rule *rules, int type, search_rule **specrule)
 		case RULE_SEARCH_STARTOFF:
 		case RULE_SEARCH_ENDOFF:
 		case RULE_SEARCH_PINYIN:
+		case RULE_SEARCH_GLOB:
+		case RULE_SEARCH_KEYWORDS:
 			re_rule |= SEARCH_RULE;
 			find = SEARCH_RULE == type;
 			break;
@@ -1119,12 +4678,6 @@ static search_thread_context_t *search_thread_context_new(fs_buf *fsbuf,
 	ctx->compara_fn = comparator;
 	ctx->query = query;
 	ctx->search_rules = rules;
-	ctx->results = calloc(req_results, sizeof (uint32_t));
-	if (ctx->results == NULL) {
-		g_free(ctx);
-		return NULL;
-	}
-
 	ctx->num_results = 0;
 	ctx->req_results = req_results;
 	ctx->start_pos = start_pos;
@@ -1133,13 +4686,42 @@ static search_thread_context_t *search_thread_context_new(fs_buf *fsbuf,
 	return ctx;
 }
 
-static int do_match_str(const char *haystack, const char *needle, bool icase)
+// most chunks have few results, their arrays are grown as they are found
+static inline void save_result(search_thread_context_t *ctx, uint32_t *num_results, uint32_t name_off)
 {
-	if (icase) {
-		return strcasestr(haystack, needle) ? 0 : 1;
-	} else {
-		return strstr(haystack, needle) ? 0 : 1;
+	uint32_t n = *num_results;
+	if (n < ctx->req_results) {
+		if (n == ctx->results_size) {
+			uint32_t size = MIN(MAX(n * 2, 64), ctx->req_results);
+			uint32_t *results = realloc(ctx->results, size * sizeof(uint32_t));
+			if (results == NULL) {
+				ctx->no_memory = true;
+				return;
+			}
+			ctx->results = results;
+			ctx->results_size = size;
+		}
+		ctx->results[n] = name_off;
 	}
+	*num_results = n + 1;
+}
+
+static inline bool is_chunk_stopped(const search_thread_context_t *ctx)
+{
+	return ctx->stop_chunk && ctx->chunk >= __atomic_load_n(ctx->stop_chunk, __ATOMIC_RELAXED);
+}
+
+static int do_match_str(const char *haystack, const compare_query_t *comquery, bool icase)
+{
+	return find_str(haystack, (const char *)comquery->query, comquery->query_len, icase) ? 0 : 1;
+}
+
+// the readings of the words are matched in full or by their first letters, and the polyphones by
+// any of their readings, see match_pinyin_tokens
+static int match_str_pinyin(const char *tokens, void *query)
+{
+	compare_query_t *comquery = (compare_query_t *)query;
+	return comquery->pinyin && match_pinyin_tokens(tokens, comquery->pinyin) ? 0 : 1;
 }
 
 static int match_str(const char *name, void *query)
@@ -1147,17 +4729,15 @@ static int match_str(const char *name, void *query)
 	compare_query_t *comquery = (compare_query_t *)query; // do not check it at here, make sure it fast.
 
 	// do string compare with whether ignore up down char or not.
-	int notmatch = do_match_str(name, (char *)(comquery->query), comquery->icase);
+	int notmatch = do_match_str(name, comquery, comquery->icase && !comquery->folded);
 	// if not match the query, then check it whether need to convert the name string.
 	if (notmatch) {
 		// check language support first and then parse the words as the compare string.
-		if (comquery->lang & LANG_PINYIN) {
+		if ((comquery->lang & LANG_PINYIN) && comquery->pinyin) {
 			// try to convert chinese to pinyin and compare with name
-			char *pinyin = cat_pinyin(name);
-			if (pinyin != NULL) {
-				notmatch = do_match_str(pinyin, (char *)(comquery->query), comquery->icase);
-				free(pinyin);
-			}
+			char tokens[MAX_PINYIN_TOKENS_LEN];
+			if (get_pinyin_tokens(name, tokens))
+				notmatch = match_str_pinyin(tokens, query);
 		}
 	}
 	return notmatch;
@@ -1184,88 +4764,310 @@ static int is_regex (const char *query)
     return (strpbrk(query, regex_chars) != NULL);
 }
 
-static int do_regex(pcre2_code *regex, PCRE2_SPTR haystack)
+// a compiled pattern, shared by the searches with it until it falls out of the cache
+typedef struct __regex_entry__ {
+	char *pattern;
+	uint32_t options;
+	pcre2_code *code;
+	// what every match contains (see get_regex_literal), the names without it are not matched
+	char literal[NAME_MAX + 1];
+	size_t literal_len;
+	// the searches using it, it is only replaced when there are none
+	uint32_t refs;
+	uint64_t last_use;
+	// not in the cache, freed by put_regex
+	bool uncached;
+} regex_entry;
+
+// the search service keeps searching the same pattern, once for every piece of a request and again
+// when the user types on. the patterns are compiled (with jit if it is supported) once for all of them.
+#define REGEX_CACHE_SIZE 16
+
+static regex_entry regex_cache[REGEX_CACHE_SIZE];
+static uint64_t regex_clock;
+static pthread_mutex_t regex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pcre2_code *compile_regex(const char *pattern, uint32_t options)
+{
+	int errornumber;
+	PCRE2_SIZE erroffset;
+	pcre2_code *code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED, options, &errornumber, &erroffset, NULL);
+	// the interpreter still matches it if jit is not supported
+	if (code)
+		pcre2_jit_compile(code, PCRE2_JIT_COMPLETE);
+	return code;
+}
+
+// the compiled pattern from the cache, or 0 if it doesn't compile. release it with put_regex
+static regex_entry *get_regex(const char *pattern, uint32_t options)
+{
+	pthread_mutex_lock(&regex_lock);
+	regex_entry *victim = 0;
+	for (uint32_t i = 0; i < REGEX_CACHE_SIZE; i++)
+	{
+		regex_entry *entry = &regex_cache[i];
+		if (entry->code && entry->options == options && strcmp(entry->pattern, pattern) == 0)
+		{
+			entry->refs++;
+			entry->last_use = ++regex_clock;
+			pthread_mutex_unlock(&regex_lock);
+			return entry;
+		}
+		if (entry->refs == 0 && (victim == 0 || entry->last_use < victim->last_use))
+			victim = entry;
+	}
+	pthread_mutex_unlock(&regex_lock);
+
+	// compiled without the lock, another search may compile the same pattern meanwhile
+	pcre2_code *code = compile_regex(pattern, options);
+	char *copy = code ? strdup(pattern) : 0;
+	if (copy == 0)
+	{
+		pcre2_code_free(code);
+		return 0;
+	}
+
+	pthread_mutex_lock(&regex_lock);
+	// the least recently used entry may have been taken since
+	if (victim && victim->refs)
+		victim = 0;
+	for (uint32_t i = 0; victim == 0 && i < REGEX_CACHE_SIZE; i++)
+		if (regex_cache[i].refs == 0 && (victim == 0 || regex_cache[i].last_use < victim->last_use))
+			victim = &regex_cache[i];
+
+	regex_entry *entry = victim;
+	if (entry)
+	{
+		free(entry->pattern);
+		pcre2_code_free(entry->code);
+	}
+	else
+	{
+		entry = calloc(1, sizeof(regex_entry));
+		if (entry == 0)
+		{
+			pthread_mutex_unlock(&regex_lock);
+			free(copy);
+			pcre2_code_free(code);
+			return 0;
+		}
+		entry->uncached = true;
+	}
+	entry->pattern = copy;
+	entry->options = options;
+	entry->code = code;
+	entry->literal_len = get_regex_literal(pattern, entry->literal, sizeof(entry->literal));
+	entry->refs = 1;
+	entry->last_use = ++regex_clock;
+	pthread_mutex_unlock(&regex_lock);
+	return entry;
+}
+
+static void put_regex(regex_entry *entry)
+{
+	pthread_mutex_lock(&regex_lock);
+	entry->refs--;
+	pthread_mutex_unlock(&regex_lock);
+	if (entry->uncached)
+	{
+		free(entry->pattern);
+		pcre2_code_free(entry->code);
+		free(entry);
+	}
+}
+
+// what a thread needs to match any pattern, made once per thread: match data of one pair is enough
+// to tell a match, and the jit stack lets deeply nested patterns match beyond the default 32 KB
+typedef struct __regex_matcher__ {
+	pcre2_match_data *match_data;
+	pcre2_match_context *context;
+	pcre2_jit_stack *jit_stack;
+} regex_matcher;
+
+static pthread_key_t regex_matcher_key;
+static pthread_once_t regex_matcher_once = PTHREAD_ONCE_INIT;
+static __thread regex_matcher *thread_matcher;
+
+static void free_regex_matcher(void *param)
+{
+	regex_matcher *matcher = (regex_matcher *)param;
+	pcre2_match_data_free(matcher->match_data);
+	pcre2_match_context_free(matcher->context);
+	pcre2_jit_stack_free(matcher->jit_stack);
+	free(matcher);
+}
+
+static void init_regex_matcher_key(void)
+{
+	pthread_key_create(&regex_matcher_key, free_regex_matcher);
+}
+
+static regex_matcher *get_regex_matcher(void)
+{
+	if (thread_matcher)
+		return thread_matcher;
+
+	pthread_once(&regex_matcher_once, init_regex_matcher_key);
+	regex_matcher *matcher = calloc(1, sizeof(regex_matcher));
+	if (matcher == 0)
+		return 0;
+
+	matcher->match_data = pcre2_match_data_create(1, NULL);
+	matcher->context = pcre2_match_context_create(NULL);
+	matcher->jit_stack = pcre2_jit_stack_create(32 * 1024, 512 * 1024, NULL);
+	if (matcher->match_data == 0 || matcher->context == 0)
+	{
+		free_regex_matcher(matcher);
+		return 0;
+	}
+	if (matcher->jit_stack)
+		pcre2_jit_stack_assign(matcher->context, NULL, matcher->jit_stack);
+
+	pthread_setspecific(regex_matcher_key, matcher);
+	thread_matcher = matcher;
+	return matcher;
+}
+
+static int do_regex(const regex_entry *regex, const char *haystack)
+{
+	// the literal is matched ignoring case like the pattern, the regex only runs on the names with it
+	if (regex->literal_len && find_str(haystack, regex->literal, regex->literal_len, regex->options & PCRE2_CASELESS) == 0)
+		return 1;
+
+	regex_matcher *matcher = get_regex_matcher();
+	if (matcher == 0)
+		return 1;
+
+	// 0 means the match didn't fit into the match data, it is a match still
+	return pcre2_match(regex->code, (PCRE2_SPTR)haystack, PCRE2_ZERO_TERMINATED, 0, 0, matcher->match_data,
+		matcher->context) >= 0 ? 0 : 1;
+}
+
+// a regex is matched with the first letters and the full pinyin of the first readings, cat like cat_pinyin
+static int pcre_regex_pinyin(const char *tokens, void *query)
 {
-	PCRE2_SIZE haystack_len = strlen((const char *)haystack);
-	pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(regex, NULL);
-	
-	return pcre2_match(regex, haystack, haystack_len, 0, 0, match_data, NULL) >= 0 ? 0 : 1;
+	compare_query_t *comquery = (compare_query_t *)query;
+	char pinyin[MAX_CAT_PINYIN_LEN];
+	format_pinyin_tokens(tokens, pinyin);
+	return do_regex((const regex_entry *)(comquery->query), pinyin);
 }
 
 static int pcre_regex(const char *name, void *query)
 {
 	compare_query_t *comquery = (compare_query_t *)query;
-	pcre2_code *regex = (pcre2_code *)(comquery->query);
-	PCRE2_SPTR name_ptr = (PCRE2_SPTR)name;
+	const regex_entry *regex = (const regex_entry *)(comquery->query);
 
-	int notmatch = do_regex(regex, name_ptr);
+	int notmatch = do_regex(regex, name);
 	if (notmatch) {
 		if (comquery->lang & LANG_PINYIN) {
-			char *pinyin = cat_pinyin(name);
-			if (pinyin != NULL) {
-				PCRE2_SPTR pinyin_ptr = (PCRE2_SPTR)pinyin;
-				notmatch = do_regex(regex, pinyin_ptr);
-				free(pinyin);
-			}
+			char tokens[MAX_PINYIN_TOKENS_LEN];
+			if (get_pinyin_tokens(name, tokens))
+				notmatch = pcre_regex_pinyin(tokens, query);
 		}
 	}
 	return notmatch;
 }
 
+static int glob_match(const char *name, void *query)
+{
+	compare_query_t *comquery = (compare_query_t *)query;
+	return match_glob((const glob_pattern *)(comquery->query), name) ? 0 : 1;
+}
+
+static int keywords_match(const char *name, void *query)
+{
+	compare_query_t *comquery = (compare_query_t *)query;
+	return match_keywords((const keyword_query *)(comquery->query), name) ? 0 : 1;
+}
+
+// whether the name of a record matches the query, a dictionary entry is only compared once per query
+static inline int match_name(search_thread_context_t *ctx, const char *record, const char *name)
+{
+	const fs_dict *dict = ctx->fsbuf->dict;
+	if (*record != NAME_REF || ctx->dict_matches == 0 || is_front_coded(record))
+		return (*ctx->compara_fn)(name, ctx->query) == 0;
+
+	uint32_t id = decode_ref(record);
+	if (id >= dict->count)
+		return (*ctx->compara_fn)(name, ctx->query) == 0;
+
+	// the threads may compare the same entry at once, they get the same result
+	uint8_t match = __atomic_load_n(&ctx->dict_matches[id], __ATOMIC_RELAXED);
+	if (match == 0)
+	{
+		match = (*ctx->compara_fn)((ctx->folded ? dict->folded : dict->names) + dict->offs[id], ctx->query) == 0 ? 2 : 1;
+		__atomic_store_n(&ctx->dict_matches[id], match, __ATOMIC_RELAXED);
+	}
+	return match == 2;
+}
+
+// whether the pinyin tokens of the name at name_off match the query, if the name has chinese words.
+// the names are visited in order, *pos follows them through the pinyin table.
+static inline int match_pinyin(search_thread_context_t *ctx, uint32_t name_off, uint32_t *pos)
+{
+	const pinyin_table *table = ctx->pinyins;
+	if (table == 0)
+		return 0;
+
+	while (*pos < table->count && table->entries[*pos].name_off < name_off)
+		(*pos)++;
+	return *pos < table->count && table->entries[*pos].name_off == name_off &&
+		(*ctx->pinyin_fn)(table->pool + table->entries[*pos].pinyin_off, ctx->query) == 0;
+}
+
 static void *search_thread(void * user_data)
 {
 	search_thread_context_t *ctx = (search_thread_context_t *)user_data;
-	if (ctx == NULL || ctx->results == NULL)
+	if (ctx == NULL)
 		return NULL;
 
 	const uint32_t start = ctx->start_pos;
 	const uint32_t end = ctx->end_pos;
-	const uint32_t save_results = ctx->req_results;
-	uint32_t *results = ctx->results;
 	fs_buf *fsbuf = ctx->fsbuf;
-	comparator_fn compara_fn = ctx->compara_fn;
 	const int max_count = ctx->max_count;
 	const bool limit_count = max_count > 0 ? true : false;
+	name_cursor cursor;
+	if (ctx->folded)
+		init_fold_cursor(&cursor, fsbuf);
+	else
+		init_name_cursor(&cursor, fsbuf);
+
+	uint32_t pinyin_pos = ctx->pinyins ? find_pinyin(ctx->pinyins, start) : 0;
 
 	uint32_t num_results = 0;
-	for (uint32_t name_off = start; name_off < end;) {
-		char *name = fsbuf->head + name_off;
+	uint32_t name_off = start;
+	while (name_off < end) {
+		char *name = fs_ptr(fsbuf, name_off);
 		// skip these empty name(a end flag of directory) in this search index.
-		if (*name == 0 || strlen(name) < 1) {
+		if (*name == 0) {
 			name_off = next_name(fsbuf, name_off);
 			continue;
 		}
 
-		if (*name != 0 && (*compara_fn)(name, ctx->query) == 0) {
-			if (num_results < save_results)
-				results[num_results] = name_off; // save this offset as result.
-			num_results++;
-		}
+		if (*name != 0 && (match_name(ctx, name, get_cursor_name(&cursor, name_off)) ||
+						   match_pinyin(ctx, name_off, &pinyin_pos)))
+			save_result(ctx, &num_results, name_off);
 		name_off = next_name(fsbuf, name_off);
 
-		if (limit_count && num_results >= max_count) {
-			// if current result count equal to request max_count, break and update the start_pos as next search offset.
-			ctx->start_pos = name_off;
+		// if current result count equal to request max_count, break, or if the chunks before have them already
+		if (limit_count && (num_results >= max_count || is_chunk_stopped(ctx)))
 			break;
-		}
 	}
-	// save the total number.
+	// save the total number, and update the start_pos as next search offset.
 	ctx->num_results = num_results;
+	ctx->start_pos = name_off;
 	return NULL;
 }
 
 static void *rulesearch_thread(void * user_data)
 {
 	search_thread_context_t *ctx = (search_thread_context_t *)user_data;
-	if (ctx == NULL || ctx->results == NULL || ctx->search_rules == NULL)
+	if (ctx == NULL || ctx->search_rules == NULL)
 		return NULL;
 
 	const uint32_t start = ctx->start_pos;
 	const uint32_t end = ctx->end_pos;
-	const uint32_t save_results = ctx->req_results;
-	uint32_t *results = ctx->results;
 	fs_buf *fsbuf = ctx->fsbuf;
-	comparator_fn compara_fn = ctx->compara_fn;
 	search_rule *rule = ctx->search_rules;
 
 	search_rule *ex_rule = NULL;
@@ -1281,12 +5083,18 @@ static void *rulesearch_thread(void * user_data)
 	*/
 	struct jump_off *jump_list = NULL;
 	struct jump_off *list_p = NULL;
+	// the rules check the names as they are, the query is matched with the folded ones if folded
+	name_cursor cursor, fold_cursor;
+	init_name_cursor(&cursor, fsbuf);
+	init_fold_cursor(&fold_cursor, fsbuf);
+	uint32_t pinyin_pos = ctx->pinyins ? find_pinyin(ctx->pinyins, start) : 0;
 
 	uint32_t num_results = 0;
-	for (uint32_t name_off = start; name_off < end;) {
-		char *name = fsbuf->head + name_off;
+	uint32_t name_off = start;
+	while (name_off < end) {
+		char *name = fs_ptr(fsbuf, name_off);
 		// skip these empty name(a end flag of directory) in this search index.
-		if (*name == 0 || strlen(name) < 1) {
+		if (*name == 0) {
 			name_off = next_name(fsbuf, name_off);
 			continue;
 		}
@@ -1294,6 +5102,9 @@ static void *rulesearch_thread(void * user_data)
 		if (should_jump(jump_list, name_off, &name_off) == 0)
 			continue;
 
+		char *record = name;
+		name = (char *)get_cursor_name(&cursor, name_off);
+
 		// check exclude rule for directory and save to jump list.
 		if (rule_val & EXCLUDE_RULE)
 		{
@@ -1315,50 +5126,40 @@ static void *rulesearch_thread(void * user_data)
 			}
 		}
 
-		if (*name != 0 && (*compara_fn)(name, ctx->query) == 0) {
+		if (*name != 0 && (match_name(ctx, record, ctx->folded ? get_cursor_name(&fold_cursor, name_off) : name) ||
+						   match_pinyin(ctx, name_off, &pinyin_pos))) {
 			// no any result filter rule has been define.
 			if (rule_val <= SEARCH_RULE) {
-				if (num_results < save_results)
-					results[num_results] = name_off; // save this offset as result.
-				num_results++;
+				save_result(ctx, &num_results, name_off);
 			} else {
 				// the result should be included
 				if (rule_val & INCLUDE_RULE) {
 					if (check_name(fsbuf, name, in_rule) == 0) {
 						if (rule_val & EXCLUDE_RULE) {
 							// for both include and exclude
-							if (check_name(fsbuf, name, ex_rule) != 0) {
-								if (num_results < save_results)
-									results[num_results] = name_off; // save this offset as result.
-								num_results++;
-							}
+							if (check_name(fsbuf, name, ex_rule) != 0)
+								save_result(ctx, &num_results, name_off);
 						} else {
 							// for include only
-							if (num_results < save_results)
-								results[num_results] = name_off; // save this offset as result.
-							num_results++;
+							save_result(ctx, &num_results, name_off);
 						}
 					}
 				} else if (rule_val & EXCLUDE_RULE) {
 					// for exclude only
-					if (check_name(fsbuf, name, ex_rule) != 0) {
-						if (num_results < save_results)
-							results[num_results] = name_off; // save this offset as result.
-						num_results++;
-					}
+					if (check_name(fsbuf, name, ex_rule) != 0)
+						save_result(ctx, &num_results, name_off);
 				}
 			}
 		}
 		name_off = next_name(fsbuf, name_off);
 
-		if (limit_count && num_results >= max_count) {
-			// if current result count equal to request max_count, break and update the start_pos as next search offset.
-			ctx->start_pos = name_off;
+		// if current result count equal to request max_count, break, or if the chunks before have them already
+		if (limit_count && (num_results >= max_count || is_chunk_stopped(ctx)))
 			break;
-		}
 	}
-	// save the total number.
+	// save the total number, and update the start_pos as next search offset, a jump may go past the end.
 	ctx->num_results = num_results;
+	ctx->start_pos = MIN(name_off, end);
 
 	// free the whole jump list
 	while (jump_list != NULL) {
@@ -1382,6 +5183,89 @@ static void *rulesearch_thread(void * user_data)
 	return NULL;
 }
 
+// offset of the first record at or after off. names can't be found by scanning from an arbitrary
+// offset, so descend from the root block into the subtree holding off instead.
+static uint32_t get_record_offset(fs_buf *fsbuf, uint32_t off)
+{
+	uint32_t block_off = fsbuf->first_name_off;
+	if (off <= block_off || off >= fsbuf->tail)
+		return MIN(MAX(off, block_off), fsbuf->tail);
+
+	while (1)
+	{
+		// the subtree holding off is the one with the last kids offset not after off
+		uint32_t name_off = block_off, subtree_off = 0;
+		while (name_off < fsbuf->tail && *fs_ptr(fsbuf, name_off))
+		{
+			if (name_off >= off)
+				return name_off;
+
+			uint32_t kids_off = get_kids_offset(fsbuf, name_off);
+			if (kids_off && kids_off <= off && kids_off > subtree_off)
+				subtree_off = kids_off;
+			name_off = next_name(fsbuf, name_off);
+		}
+		if (name_off >= off || name_off >= fsbuf->tail)
+			return name_off;
+
+		if (subtree_off == 0)
+		{
+			// off is in the paddings after this block
+			do
+				name_off = next_name(fsbuf, name_off);
+			while (name_off < off);
+			return name_off;
+		}
+		block_off = subtree_off;
+	}
+}
+
+// where the chunk starts, the chunks meet at records
+static uint32_t get_chunk_offset(const search_chunks_t *chunks, uint32_t chunk)
+{
+	if (chunk == 0)
+		return chunks->start_off;
+	if (chunk >= chunks->count)
+		return chunks->end_off;
+	return MIN(get_record_offset(chunks->fsbuf, chunks->start_off + chunk * chunks->size), chunks->end_off);
+}
+
+// the chunks before the first one not done are not searched again, stop the search after them once
+// they have max_count results
+static void set_chunk_done(search_chunks_t *chunks, uint32_t chunk)
+{
+	pthread_mutex_lock(&chunks->lock);
+	chunks->done[chunk] = true;
+	while (chunks->done_count < chunks->stop && chunks->done[chunks->done_count]) {
+		chunks->done_results += chunks->contexts[chunks->done_count]->num_results;
+		chunks->done_count++;
+		if (chunks->done_results >= chunks->max_count) {
+			__atomic_store_n(&chunks->stop, chunks->done_count, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&chunks->lock);
+}
+
+static void *search_chunks_thread(void *user_data)
+{
+	search_chunks_t *chunks = (search_chunks_t *)user_data;
+	while (1) {
+		uint32_t chunk = __atomic_fetch_add(&chunks->next, 1, __ATOMIC_RELAXED);
+		if (chunk >= chunks->count || chunk >= __atomic_load_n(&chunks->stop, __ATOMIC_RELAXED))
+			break;
+
+		search_thread_context_t *ctx = chunks->contexts[chunk];
+		ctx->start_pos = get_chunk_offset(chunks, chunk);
+		ctx->end_pos = get_chunk_offset(chunks, chunk + 1);
+		if (ctx->start_pos < ctx->end_pos)
+			(*chunks->search_fn)(ctx);
+		if (chunks->max_count > 0)
+			set_chunk_done(chunks, chunk);
+	}
+	return NULL;
+}
+
 __attribute__((visibility("default"))) void parallelsearch_files(fs_buf *fsbuf, uint32_t *start_off, uint32_t end_off, uint32_t *results, uint32_t *count,
 							search_rule *rule, const char *query)
 {
@@ -1396,6 +5280,9 @@ __attribute__((visibility("default"))) void parallelsearch_files(fs_buf *fsbuf,
 	int icase = atoi(get_rule_value(rule, RULE_SEARCH_ICASE));
 	int max_count = atoi(get_rule_value(rule, RULE_SEARCH_MAX_COUNT));
 	int pinyin_enable = atoi(get_rule_value(rule, RULE_SEARCH_PINYIN));
+	int glob_enable = atoi(get_rule_value(rule, RULE_SEARCH_GLOB));
+	// a glob is matched as it is, with its spaces
+	int keywords_enable = glob_enable > 0 ? 0 : atoi(get_rule_value(rule, RULE_SEARCH_KEYWORDS));
 
 	// init the compare query struct, which includes keyword, icase and language support.
 	compare_query_t *comquery = calloc(1, sizeof(compare_query_t));
@@ -1405,113 +5292,183 @@ __attribute__((visibility("default"))) void parallelsearch_files(fs_buf *fsbuf,
 	}
 
 	comquery->icase = icase > 0;
-	if (pinyin_enable > 0) {
+	if (pinyin_enable > 0 && glob_enable <= 0 && keywords_enable <= 0) {
 		comquery->lang = LANG_PINYIN;
 	} else {
 		comquery->lang = LANG_NONE;
 	}
 
-	const bool is_reg = reg_enable && is_regex(query);
+	const bool is_reg = reg_enable && glob_enable <= 0 && keywords_enable <= 0 && is_regex(query);
 
-	pcre2_code *regex = NULL;
+	// compiled once for all the searches of the same pattern, see get_regex
+	regex_entry *regex = is_reg ? get_regex(query, PCRE2_CASELESS) : NULL;
 
-	if (is_reg) {
-		int errornumber;
-		PCRE2_SIZE erroffset;
-
-		regex = pcre2_compile((PCRE2_SPTR)query, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &errornumber, &erroffset, NULL);
-	}
-	
 	if (regex) {
 		comquery->query = (void*)regex;
 	} else {
 		comquery->query = (void*)query;
+		comquery->query_len = strlen(query);
+	}
+
+	// a folded fs_buf matches the folded query with its folded names, which ignores the case of
+	// every letter folding covers and not just ASCII, without folding the names again
+	char *folded_query = NULL;
+	if (!regex && comquery->icase && fsbuf->fold) {
+		folded_query = malloc(comquery->query_len + 1);
+		if (folded_query) {
+			fold_utf8(folded_query, query, comquery->query_len + 1);
+			comquery->query = (void*)folded_query;
+			comquery->folded = true;
+		}
+	}
+
+	// the glob is compiled into masks for the names once, it is folded above like a plain query if the names are
+	glob_pattern *glob = NULL;
+	if (glob_enable > 0) {
+		glob = malloc(sizeof(glob_pattern));
+		if (glob == NULL) {
+			free(folded_query);
+			free(comquery);
+			pthread_rwlock_unlock(&fsbuf->lock);
+			return;
+		}
+		compile_glob(glob, (const char *)comquery->query, comquery->icase && !comquery->folded);
+		comquery->query = (void*)glob;
+	}
+
+	// all the terms are matched in one pass over each name, a query with too many of them is matched as it is
+	keyword_query *keywords = NULL;
+	if (keywords_enable > 0) {
+		keywords = malloc(sizeof(keyword_query));
+		int r = keywords ? compile_keywords(keywords, (const char *)comquery->query, comquery->icase && !comquery->folded) : 1;
+		if (r == 1) {
+			free(keywords);
+			free(folded_query);
+			free(comquery);
+			pthread_rwlock_unlock(&fsbuf->lock);
+			return;
+		}
+		if (r == 0) {
+			comquery->query = (void*)keywords;
+		} else {
+			free(keywords);
+			keywords = NULL;
+		}
+	}
+
+	// the tokens are matched with the query compiled once, a query too long for them only matches the names
+	pinyin_query *pinyin = NULL;
+	if (!regex && (comquery->lang & LANG_PINYIN)) {
+		pinyin = malloc(sizeof(pinyin_query));
+		if (pinyin && init_pinyin_query(pinyin, (const char *)comquery->query, comquery->query_len, comquery->icase) == 0)
+			comquery->pinyin = pinyin;
 	}
 
+	// the pinyin of the names is looked up in the table if there is one, the names aren't converted then
+	const pinyin_table *pinyins = comquery->lang & LANG_PINYIN ? fsbuf->pinyins : NULL;
+	if (pinyins)
+		comquery->lang = LANG_NONE;
+
+	// an entry of the dictionary is compared once for all the records naming it
+	uint8_t *dict_matches = fsbuf->dict ? calloc(fsbuf->dict->count, 1) : 0;
+
 	const bool is_rule = (rule != NULL) ? 1 : 0;
 	// define the min range which lenght less than max_count * name_max, it should plus one because it includes tags.
 	// support dlnfs, the name_max will be 256*3, define it as 1024
 	const uint32_t min_range = (*count + 1) * 1024;
 	//it only need one thread if this is a short range.
 	const uint32_t num_threads = (min_off - s_off) <= min_range ? 1 : fsearch_thread_pool_get_num_threads(search_pool);
-	const uint32_t num_items_per_thread = MAX((min_off - s_off) / num_threads, 1);
 
-	search_thread_context_t *thread_data[num_threads];
-	memset(thread_data, 0, num_threads * sizeof(search_thread_context_t *));
+	// a folder excluded by the rules is only passed over in the chunk that has its name, so they keep a
+	// chunk per thread as it used to be
+	bool has_exclude = false;
+	for (search_rule *r = rule; r; r = r->next)
+		has_exclude |= r->flag >= RULE_EXCLUDE_SUB_S && r->flag <= RULE_EXCLUDE_PATH;
+	uint32_t num_chunks = num_threads;
+	if (num_threads > 1 && !has_exclude)
+		num_chunks = MAX(MIN(num_threads * SEARCH_CHUNKS_PER_THREAD, (min_off - s_off) / SEARCH_CHUNK_SIZE), num_threads);
 
 	const uint32_t max_results = *count;
 	const bool limit_results = max_count > 0 ? true : false;
 
-	uint32_t start_pos = s_off;
-	// get intact name and set its offset as end pos of this piece
-	uint32_t end_pos = start_pos + num_items_per_thread;
-	if (end_pos >= min_off) {
-		end_pos = min_off; // make sure the end pos within tail or search end offset
-	} else {
-		end_pos = next_name(fsbuf, end_pos);
-	}
-
-	bool error_occur = false; // mark error occured by something.
-	GList *temp = fsearch_thread_pool_get_threads(search_pool);
-	for (uint32_t i = 0; i < num_threads; i++) {
-		thread_data[i] = search_thread_context_new(fsbuf,
-				regex ? pcre_regex : match_str,
+	search_chunks_t chunks = {
+		.fsbuf = fsbuf,
+		.search_fn = is_rule ? rulesearch_thread : search_thread,
+		.contexts = calloc(num_chunks, sizeof(search_thread_context_t *)),
+		.count = num_chunks,
+		.start_off = s_off,
+		.end_off = min_off,
+		.size = MAX((min_off - s_off) / num_chunks, 1),
+		.max_count = max_count,
+		.stop = num_chunks,
+		.done = calloc(num_chunks, sizeof(bool)),
+	};
+	pthread_mutex_init(&chunks.lock, NULL);
+
+	bool error_occur = chunks.contexts == NULL || chunks.done == NULL; // mark error occured by something.
+	for (uint32_t i = 0; !error_occur && i < num_chunks; i++) {
+		// the chunk is placed by the thread taking it
+		search_thread_context_t *ctx = search_thread_context_new(fsbuf,
+				glob ? glob_match : keywords ? keywords_match : regex ? pcre_regex : match_str,
 				(void*)comquery,
 				rule,
 				max_results,
-				start_pos,
-				i == num_threads - 1 ? min_off : end_pos,
+				s_off,
+				min_off,
 				max_count);
-		if (thread_data[i] == NULL) {
-			printf("error occur -> create thread_data[%u] for [%u, %u] FAILED!\n", i, start_pos, end_pos);
+		if (ctx == NULL) {
+			printf("error occur -> create thread_data[%u] for [%u, %u] FAILED!\n", i, s_off, min_off);
 			error_occur = true;
 			break;
 		}
+		ctx->dict_matches = dict_matches;
+		ctx->folded = comquery->folded;
+		ctx->pinyins = pinyins;
+		ctx->pinyin_fn = regex ? pcre_regex_pinyin : match_str_pinyin;
+		ctx->chunk = i;
+		ctx->stop_chunk = limit_results ? &chunks.stop : NULL;
+		chunks.contexts[i] = ctx;
+	}
 
-		fsearch_thread_pool_push_data(search_pool, temp, is_rule ? rulesearch_thread : search_thread, thread_data[i]);
-		temp = temp->next;
-
-		// start with next name which near by current end pos.
-		start_pos = next_name(fsbuf, end_pos);
-		// get next piece end pos.
-		end_pos += num_items_per_thread;
-		if (end_pos > min_off) {
-			end_pos = min_off; // make sure the end pos within tail or search end offset
-		} else {
-			end_pos = next_name(fsbuf, end_pos);
+	if (!error_occur) {
+		GList *temp = fsearch_thread_pool_get_threads(search_pool);
+		for (uint32_t i = 0; i < MIN(num_threads, num_chunks) && temp; i++) {
+			fsearch_thread_pool_push_data(search_pool, temp, search_chunks_thread, &chunks);
+			temp = temp->next;
 		}
-		if (start_pos >= end_pos) {
-			//not need more thread, refresh actual thread number.
-			// printf("no more need -> total thread:%u\n", i + 1);
-			break;
+		// wait for all threads finished
+		temp = fsearch_thread_pool_get_threads(search_pool);
+		while (temp) {
+			fsearch_thread_pool_wait_for_thread(search_pool, temp);
+			temp = temp->next;
 		}
 	}
-	// wait for all threads finished
-	temp = fsearch_thread_pool_get_threads(search_pool);
-	while (temp) {
-		fsearch_thread_pool_wait_for_thread(search_pool, temp);
-		temp = temp->next;
-	}
 	pthread_rwlock_unlock(&fsbuf->lock);
 
 	if (regex)
-		pcre2_code_free(regex);
+		put_regex(regex);
 	if (comquery)
 		free(comquery);
+	free(folded_query);
+	free(glob);
+	if (keywords) {
+		free_keywords(keywords);
+		free(keywords);
+	}
+	free(pinyin);
+	free(dict_matches);
 
 	// append the results into request number of result array.
 	uint32_t total_results = 0;
 	uint32_t pos = 0;
 	bool limit_return = false;
-	for (uint32_t i = 0; i < num_threads; i++) {
-		search_thread_context_t *ctx = thread_data[i];
-		if (!ctx) {
-			break;
-		}
+	for (uint32_t i = 0; !error_occur && i < num_chunks; i++) {
+		search_thread_context_t *ctx = chunks.contexts[i];
+		error_occur = ctx->no_memory;
 		// get total number of entries found
 		total_results += ctx->num_results;
 		if (limit_results && total_results >= max_count) {
-			// if max_count has reached in current thread, mark next seach offset which would expect.
+			// if max_count has reached in current chunk, mark next seach offset which would expect.
 			min_off = ctx->start_pos;
 			limit_return = true;
 		}
@@ -1525,21 +5482,13 @@ __attribute__((visibility("default"))) void parallelsearch_files(fs_buf *fsbuf,
 				pos++;
 			} else {
 				if (limit_return && total_results > max_count) {
-					// cut the next offset in this thread result as next search start pos.
+					// cut the next offset in this chunk result as next search start pos.
 					min_off = ctx->results[j];
 					total_results = max_count;
 				}
 				break;
 			}
 		}
-		if (ctx->results) {
-			g_free (ctx->results);
-			ctx->results = NULL;
-		}
-		if (ctx) {
-			g_free (ctx);
-			ctx = NULL;
-		}
 
 		if (limit_return) {
 			// return now if user sets max_count > 0
@@ -1547,6 +5496,16 @@ __attribute__((visibility("default"))) void parallelsearch_files(fs_buf *fsbuf,
 		}
 	}
 
+	for (uint32_t i = 0; chunks.contexts && i < num_chunks; i++) {
+		if (chunks.contexts[i]) {
+			free(chunks.contexts[i]->results);
+			g_free(chunks.contexts[i]);
+		}
+	}
+	free(chunks.contexts);
+	free(chunks.done);
+	pthread_mutex_destroy(&chunks.lock);
+
 	// return the found entries and update start_off
 	*count = total_results;
 	*start_off = error_occur? s_off : min_off; // start offset not changed if error. maybe search again.
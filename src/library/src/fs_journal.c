@@ -0,0 +1,281 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "fs_journal.h"
+#include "utils.h"
+
+#define JOURNAL_VERSION 1
+#define MAX_RECORD_SIZE (sizeof(journal_record) + PATH_MAX * 2)
+
+// Linear File Tree Journal
+static const char journal_magic[] = "LFTJ";
+
+// the journal only applies to the base image it was started on
+typedef struct __journal_header__ {
+	char magic[4];
+	uint32_t version;
+	uint64_t base_ino;
+	uint64_t base_size;
+} journal_header;
+
+typedef struct __journal_record__ {
+	// size of the whole record, including this header
+	uint32_t size;
+	// checksum of the bytes after this field, detects records torn by a crash
+	uint32_t checksum;
+	uint8_t op;
+	uint8_t is_dir;
+	// path length, including the terminating '\0', dst_path follows path for renames
+	uint16_t path_len;
+} journal_record;
+
+struct __fs_journal__ {
+	int fd;
+	uint32_t size;
+};
+
+typedef int (*record_fn)(journal_record *record, char *path, char *dst_path, void *param);
+
+static uint32_t fnv1a(const char *data, uint32_t size)
+{
+	uint32_t hash = 2166136261u;
+	for (uint32_t i = 0; i < size; i++) {
+		hash ^= (uint8_t)data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int make_header(journal_header *header, const char *lft_file)
+{
+	struct stat st;
+	if (stat(lft_file, &st) != 0)
+		return 1;
+
+	memset(header, 0, sizeof(journal_header));
+	memcpy(header->magic, journal_magic, sizeof(header->magic));
+	header->version = JOURNAL_VERSION;
+	header->base_ino = st.st_ino;
+	header->base_size = st.st_size;
+	return 0;
+}
+
+static int check_header(int fd, const char *lft_file)
+{
+	journal_header header, expected;
+	if (make_header(&expected, lft_file) != 0)
+		return 1;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return 2;
+
+	return memcmp(&header, &expected, sizeof(header)) == 0 ? 0 : 3;
+}
+
+// walk the intact records, return the offset right after the last one
+static off_t scan_records(int fd, record_fn fn, void *param, uint32_t *count)
+{
+	char *buf = malloc(MAX_RECORD_SIZE);
+	if (buf == 0)
+		return -1;
+
+	off_t off = sizeof(journal_header);
+	*count = 0;
+	while (1) {
+		journal_record *record = (journal_record *)buf;
+		if (pread(fd, record, sizeof(journal_record), off) != sizeof(journal_record))
+			break;
+
+		if (record->size <= sizeof(journal_record) || record->size > MAX_RECORD_SIZE ||
+			record->path_len == 0 || record->path_len > record->size - sizeof(journal_record))
+			break;
+
+		uint32_t body_size = record->size - sizeof(journal_record);
+		if (pread(fd, buf + sizeof(journal_record), body_size, off + sizeof(journal_record)) != body_size)
+			break;
+
+		if (fnv1a(buf + 2 * sizeof(uint32_t), record->size - 2 * sizeof(uint32_t)) != record->checksum)
+			break;
+
+		char *path = buf + sizeof(journal_record), *dst_path = path + record->path_len;
+		if (path[record->path_len - 1] != 0 || (body_size > record->path_len && buf[record->size - 1] != 0))
+			break;
+
+		if (fn && fn(record, path, body_size > record->path_len ? dst_path : 0, param) != 0)
+			break;
+
+		off += record->size;
+		*count = *count + 1;
+	}
+
+	free(buf);
+	return off;
+}
+
+static int write_header(int fd, const char *lft_file)
+{
+	journal_header header;
+	if (make_header(&header, lft_file) != 0)
+		return 1;
+
+	if (ftruncate(fd, 0) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+		return 2;
+
+	return fdatasync(fd) == 0 ? 0 : 3;
+}
+
+__attribute__((visibility("default"))) int open_fs_journal(fs_journal **pjournal, const char *filename, const char *lft_file)
+{
+	int fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return 1;
+
+	off_t end = 0;
+	uint32_t count = 0;
+	if (check_header(fd, lft_file) == 0) {
+		// cut a torn record off, otherwise new records would be appended after it and never be replayed
+		end = scan_records(fd, 0, 0, &count);
+		if (end < 0 || ftruncate(fd, end) != 0) {
+			close(fd);
+			return 2;
+		}
+	} else {
+		if (write_header(fd, lft_file) != 0) {
+			close(fd);
+			return 3;
+		}
+		end = sizeof(journal_header);
+	}
+
+	fs_journal *journal = malloc(sizeof(fs_journal));
+	if (journal == 0) {
+		close(fd);
+		return 4;
+	}
+
+	journal->fd = fd;
+	journal->size = end;
+	*pjournal = journal;
+	dbg_msg("journal %s opened, records: %u, size: %'ld\n", filename, count, end);
+	return 0;
+}
+
+__attribute__((visibility("default"))) void close_fs_journal(fs_journal *journal)
+{
+	if (journal == 0)
+		return;
+
+	close(journal->fd);
+	free(journal);
+}
+
+__attribute__((visibility("default"))) int append_fs_journal(fs_journal *journal, uint8_t op, const char *path, const char *dst_path, int is_dir)
+{
+	size_t path_len = strlen(path) + 1, dst_len = op == FS_JOURNAL_RENAME ? strlen(dst_path) + 1 : 0;
+	if (path_len > PATH_MAX || dst_len > PATH_MAX)
+		return 1;
+
+	uint32_t size = sizeof(journal_record) + path_len + dst_len;
+	char buf[size];
+	journal_record *record = (journal_record *)buf;
+	record->size = size;
+	record->op = op;
+	record->is_dir = is_dir ? 1 : 0;
+	record->path_len = path_len;
+	memcpy(buf + sizeof(journal_record), path, path_len);
+	if (dst_len)
+		memcpy(buf + sizeof(journal_record) + path_len, dst_path, dst_len);
+	record->checksum = fnv1a(buf + 2 * sizeof(uint32_t), size - 2 * sizeof(uint32_t));
+
+	if (write(journal->fd, buf, size) != size)
+		return 2;
+
+	journal->size += size;
+	return 0;
+}
+
+__attribute__((visibility("default"))) int sync_fs_journal(fs_journal *journal)
+{
+	return fdatasync(journal->fd) == 0 ? 0 : 1;
+}
+
+__attribute__((visibility("default"))) int reset_fs_journal(fs_journal *journal, const char *lft_file)
+{
+	if (write_header(journal->fd, lft_file) != 0)
+		return 1;
+
+	journal->size = sizeof(journal_header);
+	return 0;
+}
+
+__attribute__((visibility("default"))) uint32_t get_fs_journal_size(fs_journal *journal)
+{
+	return journal->size;
+}
+
+typedef struct __replay_state__ {
+	fs_buf *fsbuf;
+	int incomplete;
+} replay_state;
+
+static int replay_record(journal_record *record, char *path, char *dst_path, void *param)
+{
+	replay_state *state = (replay_state *)param;
+	fs_buf *fsbuf = state->fsbuf;
+	fs_change changes[10];
+	uint32_t change_count = 10;
+	int r = 0;
+
+	// the journal only holds changes that were applied successfully, so EXISTS/NO_PATH
+	// here just mean the base image already had them
+	switch (record->op) {
+	case FS_JOURNAL_INSERT:
+		r = insert_path(fsbuf, path, record->is_dir, changes);
+		break;
+	case FS_JOURNAL_REMOVE:
+		r = remove_path(fsbuf, path, changes, &change_count);
+		break;
+	case FS_JOURNAL_RENAME:
+		if (dst_path == 0)
+			return state->incomplete = 1;
+		r = rename_path(fsbuf, path, dst_path, changes, &change_count);
+		break;
+	default:
+		return state->incomplete = 1;
+	}
+
+	// out of memory, stop here and let the caller save a new base image
+	if (r == ERR_NO_MEM)
+		return state->incomplete = 1;
+	return 0;
+}
+
+__attribute__((visibility("default"))) int replay_fs_journal(fs_buf *fsbuf, const char *filename, const char *lft_file, uint32_t *count)
+{
+	*count = 0;
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+
+	if (check_header(fd, lft_file) != 0) {
+		close(fd);
+		return 2;
+	}
+
+	replay_state state = { fsbuf, 0 };
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	off_t end = scan_records(fd, replay_record, &state, count);
+	close(fd);
+	if (end < 0)
+		return 3;
+	return state.incomplete ? 4 : 0;
+}
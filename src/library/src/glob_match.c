@@ -0,0 +1,170 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "glob_match.h"
+#include "strmatch.h"
+
+// the trailing bytes of a UTF-8 char, 10xxxxxx
+static inline bool is_trail(unsigned char c)
+{
+	return (c & 0xC0) == 0x80;
+}
+
+static inline bool is_letter(unsigned char c)
+{
+	return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+}
+
+static void add_byte(glob_pattern *glob, unsigned char c, uint64_t bit)
+{
+	glob->masks[c] |= bit;
+	if (glob->icase && is_letter(c))
+		glob->masks[c ^ 0x20] |= bit;
+}
+
+// read the set at p (its '[') into chars and return the end of it. 0 if the set is not closed, or
+// has chars beyond ASCII or classes like [:digit:].
+static const char *parse_set(const char *p, bool chars[128], bool *negate, int icase)
+{
+	const char *q = p + 1;
+	*negate = *q == '!' || *q == '^';
+	if (*negate)
+		q++;
+
+	memset(chars, 0, 128 * sizeof(bool));
+	// a ']' right at the start is one of the chars
+	bool first = true;
+	while (*q && (*q != ']' || first)) {
+		first = false;
+		if (q[0] == '[' && (q[1] == ':' || q[1] == '=' || q[1] == '.'))
+			return 0;
+
+		if (*q == '\\' && q[1])
+			q++;
+		unsigned char lo = *q++, hi = lo;
+		if (q[0] == '-' && q[1] && q[1] != ']') {
+			q++;
+			if (q[0] == '[' && (q[1] == ':' || q[1] == '=' || q[1] == '.'))
+				return 0;
+			if (*q == '\\' && q[1])
+				q++;
+			hi = *q++;
+		}
+		if (lo >= 0x80 || hi >= 0x80)
+			return 0;
+		// the ends of a range are lower case if icase, as in the folded glob
+		if (icase) {
+			lo = is_letter(lo) ? lo | 0x20 : lo;
+			hi = is_letter(hi) ? hi | 0x20 : hi;
+		}
+		for (unsigned c = lo; c <= hi; c++)
+			chars[c] = true;
+	}
+	return *q ? q + 1 : 0;
+}
+
+__attribute__((visibility("default"))) void compile_glob(glob_pattern *glob, const char *pattern, int icase)
+{
+	memset(glob, 0, sizeof(glob_pattern));
+	glob->icase = icase;
+
+	// the run of plain chars that ends at p, and the number of chars before p
+	const char *run = pattern;
+	uint32_t k = 0;
+	const char *p = pattern;
+	while (1) {
+		bool plain = *p && *p != '*' && *p != '?' && *p != '[';
+		if (!plain && (size_t)(p - run) > glob->literal_len) {
+			glob->literal_len = p - run;
+			memcpy(glob->literal, run, glob->literal_len);
+		}
+		if (*p == 0)
+			break;
+
+		if (*p == '*') {
+			glob->stars |= 1ULL << k;
+			run = ++p;
+			continue;
+		}
+		if (k == MAX_GLOB_CHARS) {
+			glob->fallback = pattern;
+			return;
+		}
+
+		uint64_t bit = 1ULL << (k + 1);
+		if (*p == '?') {
+			for (unsigned c = 1; c < 256; c++)
+				if (!is_trail(c))
+					glob->masks[c] |= bit;
+			glob->trails |= bit;
+			run = ++p;
+		} else if (*p == '[') {
+			bool chars[128], negate;
+			const char *end = parse_set(p, chars, &negate, icase);
+			if (end == 0) {
+				glob->fallback = pattern;
+				return;
+			}
+			// a letter is in the set if its lower case is, as with the folded glob and names
+			if (icase)
+				for (unsigned c = 'A'; c <= 'Z'; c++)
+					chars[c] = chars[c | 0x20];
+			for (unsigned c = 1; c < 128; c++)
+				if (chars[c] != negate)
+					glob->masks[c] |= bit;
+			// out of a set of ASCII chars is any char beyond it too
+			if (negate) {
+				for (unsigned c = 0xC0; c < 256; c++)
+					glob->masks[c] |= bit;
+				glob->trails |= bit;
+			}
+			run = p = end;
+		} else if (*p == '\\' && p[1]) {
+			// the escaped char starts a new run, as the '\' is not part of the name
+			if ((size_t)(p - run) > glob->literal_len) {
+				glob->literal_len = p - run;
+				memcpy(glob->literal, run, glob->literal_len);
+			}
+			add_byte(glob, p[1], bit);
+			run = p + 1;
+			p += 2;
+		} else if (*p == '\\') {
+			// a glob ending with a lone '\' is broken, it matches nothing like with fnmatch
+			glob->match = 0;
+			return;
+		} else {
+			add_byte(glob, *p, bit);
+			p++;
+		}
+		k++;
+	}
+	glob->match = 1ULL << k;
+}
+
+__attribute__((visibility("default"))) int match_glob(const glob_pattern *glob, const char *name)
+{
+	// most names don't have the literal, they are passed over without stepping through them
+	if (glob->literal_len && find_str(name, glob->literal, glob->literal_len, glob->icase) == 0)
+		return 0;
+
+	if (glob->fallback)
+		return fnmatch(glob->fallback, name, glob->icase ? FNM_CASEFOLD : 0) == 0;
+
+	uint64_t state = 1;
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+		uint64_t loops = glob->stars | (is_trail(*p) ? glob->trails : 0);
+		state = ((state << 1) & glob->masks[*p]) | (state & loops);
+		if (state == 0)
+			return 0;
+	}
+	return (state & glob->match) != 0;
+}
@@ -0,0 +1,242 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyword_match.h"
+#include "strmatch.h"
+
+typedef struct __keyword_term__ {
+	const char *text;
+	size_t len;
+} keyword_term;
+
+static inline bool is_upper(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z';
+}
+
+// the id of the term, added if it is new. -1 if there are too many terms
+static int add_term(keyword_term *terms, uint32_t *term_count, const char *text, size_t len)
+{
+	for (uint32_t i = 0; i < *term_count; i++)
+		if (terms[i].len == len && memcmp(terms[i].text, text, len) == 0)
+			return i;
+	if (*term_count == MAX_KEYWORDS)
+		return -1;
+
+	terms[*term_count].text = text;
+	terms[*term_count].len = len;
+	return (*term_count)++;
+}
+
+static bool has_group(const keyword_query *keywords, uint64_t group)
+{
+	for (uint32_t i = 0; i < keywords->group_count; i++)
+		if (keywords->groups[i] == group)
+			return true;
+	return false;
+}
+
+// split the query into the groups of terms, which are copied to pool without their quotes.
+// return 2 if there are too many terms or groups.
+static int parse_keywords(keyword_query *keywords, const char *query, char *pool, keyword_term *terms,
+	uint32_t *term_count)
+{
+	const char *p = query;
+	// whether the next term is joined to the group before it by a '|', and the group is after a '-'
+	bool join = false, negate = false;
+	uint64_t group = 0;
+	while (1) {
+		while (*p == ' ')
+			p++;
+		if (*p == '|') {
+			join = true;
+			p++;
+			continue;
+		}
+		if (!join || *p == 0) {
+			// the group before is complete, a group without any term or the same as one before is left out
+			if (group && negate)
+				keywords->excluded |= group;
+			else if (group && !has_group(keywords, group)) {
+				if (keywords->group_count == MAX_KEYWORDS)
+					return 2;
+				keywords->groups[keywords->group_count++] = group;
+			}
+			group = 0;
+			if (*p == 0)
+				break;
+
+			negate = p[0] == '-' && p[1] && p[1] != ' ' && p[1] != '|';
+			if (negate)
+				p++;
+		}
+		join = false;
+
+		// the term ends at a space or a '|' out of quotes
+		char *text = pool;
+		bool quoted = false;
+		while (*p && (quoted || (*p != ' ' && *p != '|'))) {
+			if (*p == '"')
+				quoted = !quoted;
+			else
+				*pool++ = keywords->icase && is_upper(*p) ? *p | 0x20 : *p;
+			p++;
+		}
+		if (pool == text)
+			continue;
+
+		int id = add_term(terms, term_count, text, pool - text);
+		if (id < 0)
+			return 2;
+		group |= 1ULL << id;
+	}
+	return 0;
+}
+
+// the trie of the terms, then the automaton: a byte that doesn't go on in the trie goes on from the
+// longest suffix that is in it, whose terms are found too
+static int build_keywords(keyword_query *keywords, const keyword_term *terms, uint32_t term_count)
+{
+	uint32_t bytes = 0;
+	for (uint32_t i = 0; i < term_count; i++) {
+		bytes += terms[i].len;
+		for (size_t j = 0; j < terms[i].len; j++)
+			keywords->classes[(unsigned char)terms[i].text[j]] = 1;
+	}
+	if (bytes >= MAX_KEYWORD_STATES)
+		return 2;
+
+	// the bytes of no term share class 0, and upper case letters are in those of their lower case if icase
+	uint32_t classes = 1;
+	for (unsigned c = 0; c < 256; c++)
+		if (keywords->classes[c])
+			keywords->classes[c] = classes++;
+	if (keywords->icase)
+		for (unsigned c = 'A'; c <= 'Z'; c++)
+			keywords->classes[c] = keywords->classes[c | 0x20];
+	keywords->class_count = classes;
+
+	uint32_t *next = calloc((bytes + 1) * classes, sizeof(uint32_t));
+	uint64_t *found = calloc(bytes + 1, sizeof(uint64_t));
+	uint32_t *fail = calloc(bytes + 1, sizeof(uint32_t));
+	uint32_t *queue = calloc(bytes + 1, sizeof(uint32_t));
+	if (next == 0 || found == 0 || fail == 0 || queue == 0) {
+		free(next);
+		free(found);
+		free(fail);
+		free(queue);
+		return 1;
+	}
+
+	// 0 is the root, no edge of the trie goes back to it
+	uint32_t states = 1;
+	for (uint32_t i = 0; i < term_count; i++) {
+		uint32_t state = 0;
+		for (size_t j = 0; j < terms[i].len; j++) {
+			uint32_t *edge = &next[state * classes + keywords->classes[(unsigned char)terms[i].text[j]]];
+			if (*edge == 0)
+				*edge = states++;
+			state = *edge;
+		}
+		found[state] |= 1ULL << i;
+	}
+
+	// breadth first, so that the suffix a state fails to is complete before it
+	uint32_t head = 0, tail = 0;
+	for (uint32_t c = 0; c < classes; c++)
+		if (next[c])
+			queue[tail++] = next[c];
+	while (head < tail) {
+		uint32_t state = queue[head++];
+		found[state] |= found[fail[state]];
+		for (uint32_t c = 0; c < classes; c++) {
+			uint32_t *edge = &next[state * classes + c];
+			if (*edge) {
+				fail[*edge] = next[fail[state] * classes + c];
+				queue[tail++] = *edge;
+			} else {
+				*edge = next[fail[state] * classes + c];
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < states * classes; i++)
+		next[i] = next[i] * classes << 1 | (found[next[i]] != 0);
+	free(fail);
+	free(queue);
+
+	keywords->next = next;
+	keywords->found = found;
+	keywords->state_count = states;
+	return 0;
+}
+
+__attribute__((visibility("default"))) int compile_keywords(keyword_query *keywords, const char *query, int icase)
+{
+	memset(keywords, 0, sizeof(keyword_query));
+	keywords->icase = icase;
+
+	keyword_term terms[MAX_KEYWORDS];
+	uint32_t term_count = 0;
+	char *pool = malloc(strlen(query) + 1);
+	if (pool == 0)
+		return 1;
+
+	int r = parse_keywords(keywords, query, pool, terms, &term_count);
+	if (r == 0)
+		r = build_keywords(keywords, terms, term_count);
+
+	// the longest term that every match has, e.g. invoice for invoice 2023|2024 -draft
+	for (uint32_t i = 0; r == 0 && i < keywords->group_count; i++) {
+		uint64_t group = keywords->groups[i];
+		if (group & (group - 1))
+			continue;
+		const keyword_term *term = &terms[__builtin_ctzll(group)];
+		if (term->len > keywords->literal_len && term->len < sizeof(keywords->literal)) {
+			memcpy(keywords->literal, term->text, term->len);
+			keywords->literal[term->len] = 0;
+			keywords->literal_len = term->len;
+		}
+	}
+	free(pool);
+	if (r != 0)
+		free_keywords(keywords);
+	return r;
+}
+
+__attribute__((visibility("default"))) void free_keywords(keyword_query *keywords)
+{
+	free(keywords->next);
+	free(keywords->found);
+	keywords->next = 0;
+	keywords->found = 0;
+}
+
+__attribute__((visibility("default"))) int match_keywords(const keyword_query *keywords, const char *name)
+{
+	if (keywords->literal_len && find_str(name, keywords->literal, keywords->literal_len, keywords->icase) == 0)
+		return 0;
+
+	const uint32_t *next = keywords->next;
+	const uint8_t *classes = keywords->classes;
+	uint64_t found = 0;
+	uint32_t state = 0;
+	for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+		state = next[(state >> 1) + classes[*p]];
+		if (state & 1) {
+			found |= keywords->found[(state >> 1) / keywords->class_count];
+			if (found & keywords->excluded)
+				return 0;
+		}
+	}
+
+	for (uint32_t i = 0; i < keywords->group_count; i++)
+		if ((found & keywords->groups[i]) == 0)
+			return 0;
+	return 1;
+}
@@ -0,0 +1,186 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "regex_literal.h"
+
+// the escapes of one char out of a set, and those matching no char at all
+#define CLASS_ESCAPES		"dDwWsShHvVR"
+#define ASSERTION_ESCAPES	"bBAzZG"
+
+static inline bool is_alnum(char c)
+{
+	return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+// the end of the class at p (its '['), or 0 if it is not closed
+static const char *skip_class(const char *p)
+{
+	p++;
+	if (*p == '^')
+		p++;
+	// a ']' right at the start is one of the chars
+	if (*p == ']')
+		p++;
+	while (*p && *p != ']') {
+		if (*p == '\\') {
+			if (p[1] == 0 || p[1] == 'Q')
+				return 0;
+			p += 2;
+			continue;
+		}
+		if (p[0] == '[' && p[1] == ':') {
+			const char *end = strstr(p + 2, ":]");
+			if (end) {
+				p = end + 2;
+				continue;
+			}
+		}
+		p++;
+	}
+	return *p ? p + 1 : 0;
+}
+
+// the end of the group at p (its '('), or 0 if it is not closed
+static const char *skip_group(const char *p)
+{
+	int depth = 0;
+	while (*p) {
+		if (*p == '\\') {
+			if (p[1] == 0 || p[1] == 'Q')
+				return 0;
+			p += 2;
+			continue;
+		}
+		if (*p == '[') {
+			p = skip_class(p);
+			if (p == 0)
+				return 0;
+			continue;
+		}
+		if (*p == '(') {
+			// a comment may hold any char
+			if (p[1] == '?' && p[2] == '#')
+				return 0;
+			depth++;
+		} else if (*p == ')' && --depth == 0) {
+			return p + 1;
+		}
+		p++;
+	}
+	return 0;
+}
+
+// the end of the quantifier at p and the least times it repeats, or 0 if there is none
+static const char *skip_quantifier(const char *p, unsigned *min)
+{
+	if (*p == '*' || *p == '?' || *p == '+') {
+		*min = *p == '+';
+		p++;
+	} else if (*p == '{') {
+		const char *q = p + 1;
+		*min = 0;
+		while (*q >= '0' && *q <= '9')
+			*min = *min * 10 + (*q++ - '0');
+		bool has_min = q > p + 1, has_max = false;
+		if (*q == ',') {
+			q++;
+			has_max = *q >= '0' && *q <= '9';
+			while (*q >= '0' && *q <= '9')
+				q++;
+		}
+		// {,n} is a quantifier in the newer versions, and literal in the older ones
+		if (*q != '}' || (!has_min && !has_max))
+			return 0;
+		p = q + 1;
+	} else {
+		return 0;
+	}
+	// lazy or possessive
+	if (*p == '?' || *p == '+')
+		p++;
+	return p;
+}
+
+// keep the run in literal if it is the longest so far
+static inline void end_run(const char *run, size_t *len, char *literal, size_t *best)
+{
+	if (*len > *best) {
+		*best = *len;
+		memcpy(literal, run, *len);
+		literal[*len] = 0;
+	}
+	*len = 0;
+}
+
+__attribute__((visibility("default"))) size_t get_regex_literal(const char *pattern, char *literal, size_t size)
+{
+	if (size == 0)
+		return 0;
+
+	// the literal chars every match has one after another at this point, cut short at size bytes
+	char run[size];
+	size_t len = 0, best = 0;
+	*literal = 0;
+
+	for (const char *p = pattern; *p;) {
+		int c = -1;
+		switch (*p) {
+		case '\\':
+			if (p[1] == 0)
+				return 0;
+			if (!is_alnum(p[1]))
+				c = (unsigned char)p[1];
+			else if (strchr(CLASS_ESCAPES ASSERTION_ESCAPES, p[1]) == 0)
+				return 0;
+			p += 2;
+			break;
+		case '[':
+			p = skip_class(p);
+			if (p == 0)
+				return 0;
+			break;
+		case '(':
+			// groups are passed over, but not the ones changing the options, nor the verbs
+			if (p[1] == '*' || (p[1] == '?' && strchr(":=!<>|P'", p[2]) == 0))
+				return 0;
+			p = skip_group(p);
+			if (p == 0)
+				return 0;
+			break;
+		case ')':
+			return 0;
+		case '|':
+			// what the alternatives have in common is not worked out
+			*literal = 0;
+			return 0;
+		case '.':
+		case '^':
+		case '$':
+		case '{':
+		case '*':
+		case '+':
+		case '?':
+			p++;
+			break;
+		default:
+			c = (unsigned char)*p++;
+			break;
+		}
+
+		unsigned min = 1;
+		const char *end = skip_quantifier(p, &min);
+		if (end)
+			p = end;
+		if (c >= 0 && min > 0 && len < size - 1)
+			run[len++] = c;
+		// the run only goes on through the literal chars matched once
+		if (c < 0 || end)
+			end_run(run, &len, literal, &best);
+	}
+	end_run(run, &len, literal, &best);
+	return best;
+}
@@ -0,0 +1,277 @@
+// SPDX-FileCopyrightText: 2024 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNEL
+#elif defined(__loongarch64) && defined(__loongarch_sx)
+// LSX code needs the compiler to target it (-mlsx), the kernel is still only used if the cpu has it
+#include <lsxintrin.h>
+#include <sys/auxv.h>
+#define HAVE_LSX_KERNEL
+#endif
+
+#include "strmatch.h"
+
+// the vector kernels load whole blocks, past the terminator of the haystack too. that is safe as
+// long as the loads stay in the page the block starts in, the blocks that would reach into the
+// next page are left to the scalar kernel.
+#define PAGE_SIZE_MIN	4096
+
+#ifndef HWCAP_LOONGARCH_LSX
+#define HWCAP_LOONGARCH_LSX	(1 << 4)
+#endif
+
+typedef const char* (*find_str_fn)(const char* haystack, const char* needle, size_t needle_len, int icase);
+
+static inline int crosses_page(const char* p, size_t size)
+{
+	return (uintptr_t)p % PAGE_SIZE_MIN + size > PAGE_SIZE_MIN;
+}
+
+static inline char other_case(char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 'A';
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	return c;
+}
+
+// whether the size bytes at p match needle, the terminator never does
+__attribute__((no_sanitize_address))
+static inline int equal_str(const char* p, const char* needle, size_t size, int icase)
+{
+	for (size_t i = 0; i < size; i++)
+		if (p[i] != needle[i] && (!icase || p[i] != other_case(needle[i])))
+			return 0;
+	return 1;
+}
+
+// the first of the windows starting at block that match needle. a window is a candidate if its
+// first and last bytes match the ones of needle, the candidates are the bits of hits, one for
+// every byte or every 1 << shift bits
+__attribute__((no_sanitize_address))
+static inline const char* check_windows(const char* block, uint64_t hits, int shift, const char* needle, size_t needle_len, int icase)
+{
+	for (; hits; hits &= hits - 1) {
+		const char* p = block + (__builtin_ctzll(hits) >> shift);
+		if (needle_len <= 2 || equal_str(p + 1, needle + 1, needle_len - 2, icase))
+			return p;
+	}
+	return 0;
+}
+
+static const char* find_str_scalar(const char* haystack, const char* needle, size_t needle_len, int icase)
+{
+	return icase ? strcasestr(haystack, needle) : strstr(haystack, needle);
+}
+
+static int always_supported(void)
+{
+	return 1;
+}
+
+// every kernel compares a block of windows at once: the block at s against the first byte of
+// needle and the block at s + needle_len - 1 against its last byte. the terminator is looked for
+// in the first block, the windows starting after it are dropped and the search ends there.
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2"), no_sanitize_address))
+static const char* find_str_avx2(const char* haystack, const char* needle, size_t needle_len, int icase)
+{
+	const char f = needle[0], l = needle[needle_len - 1];
+	const __m256i first0 = _mm256_set1_epi8(f), first1 = _mm256_set1_epi8(icase ? other_case(f) : f);
+	const __m256i last0 = _mm256_set1_epi8(l), last1 = _mm256_set1_epi8(icase ? other_case(l) : l);
+	const __m256i zero = _mm256_setzero_si256();
+
+	for (const char* s = haystack;; s += sizeof(__m256i)) {
+		if (crosses_page(s, sizeof(__m256i) + needle_len - 1))
+			return find_str_scalar(s, needle, needle_len, icase);
+
+		const __m256i first = _mm256_loadu_si256((const __m256i*)s);
+		const __m256i last = _mm256_loadu_si256((const __m256i*)(s + needle_len - 1));
+		uint32_t ends = _mm256_movemask_epi8(_mm256_cmpeq_epi8(first, zero));
+		uint32_t hits = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(first, first0), _mm256_cmpeq_epi8(first, first1)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(last, last0), _mm256_cmpeq_epi8(last, last1))));
+
+		const char* p = check_windows(s, hits & ((ends & -ends) - 1), 0, needle, needle_len, icase);
+		if (p || ends)
+			return p;
+	}
+}
+
+__attribute__((target("sse2"), no_sanitize_address))
+static const char* find_str_sse2(const char* haystack, const char* needle, size_t needle_len, int icase)
+{
+	const char f = needle[0], l = needle[needle_len - 1];
+	const __m128i first0 = _mm_set1_epi8(f), first1 = _mm_set1_epi8(icase ? other_case(f) : f);
+	const __m128i last0 = _mm_set1_epi8(l), last1 = _mm_set1_epi8(icase ? other_case(l) : l);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (const char* s = haystack;; s += sizeof(__m128i)) {
+		if (crosses_page(s, sizeof(__m128i) + needle_len - 1))
+			return find_str_scalar(s, needle, needle_len, icase);
+
+		const __m128i first = _mm_loadu_si128((const __m128i*)s);
+		const __m128i last = _mm_loadu_si128((const __m128i*)(s + needle_len - 1));
+		uint32_t ends = _mm_movemask_epi8(_mm_cmpeq_epi8(first, zero));
+		uint32_t hits = _mm_movemask_epi8(_mm_and_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(first, first0), _mm_cmpeq_epi8(first, first1)),
+			_mm_or_si128(_mm_cmpeq_epi8(last, last0), _mm_cmpeq_epi8(last, last1))));
+
+		const char* p = check_windows(s, hits & ((ends & -ends) - 1), 0, needle, needle_len, icase);
+		if (p || ends)
+			return p;
+	}
+}
+
+static int avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+// 4 bits for every byte of v
+static inline uint64_t neon_mask(uint8x16_t v)
+{
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0);
+}
+
+__attribute__((no_sanitize_address))
+static const char* find_str_neon(const char* haystack, const char* needle, size_t needle_len, int icase)
+{
+	const char f = needle[0], l = needle[needle_len - 1];
+	const uint8x16_t first0 = vdupq_n_u8(f), first1 = vdupq_n_u8(icase ? other_case(f) : f);
+	const uint8x16_t last0 = vdupq_n_u8(l), last1 = vdupq_n_u8(icase ? other_case(l) : l);
+
+	for (const char* s = haystack;; s += sizeof(uint8x16_t)) {
+		if (crosses_page(s, sizeof(uint8x16_t) + needle_len - 1))
+			return find_str_scalar(s, needle, needle_len, icase);
+
+		const uint8x16_t first = vld1q_u8((const uint8_t*)s);
+		const uint8x16_t last = vld1q_u8((const uint8_t*)s + needle_len - 1);
+		uint64_t ends = neon_mask(vceqzq_u8(first));
+		uint64_t hits = neon_mask(vandq_u8(vorrq_u8(vceqq_u8(first, first0), vceqq_u8(first, first1)),
+										   vorrq_u8(vceqq_u8(last, last0), vceqq_u8(last, last1))));
+
+		// one bit for every byte is enough
+		hits &= ((ends & -ends) - 1) & 0x8888888888888888ull;
+		const char* p = check_windows(s, hits, 2, needle, needle_len, icase);
+		if (p || ends)
+			return p;
+	}
+}
+#endif
+
+#ifdef HAVE_LSX_KERNEL
+// a bit for every byte of v
+static inline uint32_t lsx_mask(__m128i v)
+{
+	return __lsx_vpickve2gr_wu(__lsx_vmskltz_b(v), 0);
+}
+
+__attribute__((no_sanitize_address))
+static const char* find_str_lsx(const char* haystack, const char* needle, size_t needle_len, int icase)
+{
+	const char f = needle[0], l = needle[needle_len - 1];
+	const __m128i first0 = __lsx_vreplgr2vr_b(f), first1 = __lsx_vreplgr2vr_b(icase ? other_case(f) : f);
+	const __m128i last0 = __lsx_vreplgr2vr_b(l), last1 = __lsx_vreplgr2vr_b(icase ? other_case(l) : l);
+
+	for (const char* s = haystack;; s += sizeof(__m128i)) {
+		if (crosses_page(s, sizeof(__m128i) + needle_len - 1))
+			return find_str_scalar(s, needle, needle_len, icase);
+
+		const __m128i first = __lsx_vld((void*)s, 0);
+		const __m128i last = __lsx_vld((void*)(s + needle_len - 1), 0);
+		uint32_t ends = lsx_mask(__lsx_vseqi_b(first, 0));
+		uint32_t hits = lsx_mask(__lsx_vand_v(__lsx_vor_v(__lsx_vseq_b(first, first0), __lsx_vseq_b(first, first1)),
+											  __lsx_vor_v(__lsx_vseq_b(last, last0), __lsx_vseq_b(last, last1))));
+
+		const char* p = check_windows(s, hits & ((ends & -ends) - 1), 0, needle, needle_len, icase);
+		if (p || ends)
+			return p;
+	}
+}
+
+static int lsx_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_LOONGARCH_LSX) != 0;
+}
+#endif
+
+// fastest first
+static const struct {
+	const char* name;
+	find_str_fn fn;
+	int (*supported)(void);
+} kernels[] = {
+#ifdef HAVE_X86_KERNELS
+	{ "avx2", find_str_avx2, avx2_supported },
+	{ "sse2", find_str_sse2, sse2_supported },
+#endif
+#ifdef HAVE_NEON_KERNEL
+	{ "neon", find_str_neon, always_supported },
+#endif
+#ifdef HAVE_LSX_KERNEL
+	{ "lsx", find_str_lsx, lsx_supported },
+#endif
+	{ "scalar", find_str_scalar, always_supported },
+};
+
+#define KERNEL_COUNT	(sizeof(kernels) / sizeof(kernels[0]))
+
+static uint32_t kernel_index = KERNEL_COUNT - 1;
+
+__attribute__((constructor)) static void init_find_str(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+#endif
+	for (uint32_t i = 0; i < KERNEL_COUNT; i++) {
+		if (kernels[i].supported()) {
+			kernel_index = i;
+			break;
+		}
+	}
+}
+
+__attribute__((visibility("default"))) const char* find_str(const char* haystack, const char* needle, size_t needle_len, int icase)
+{
+	if (needle_len == 0)
+		return haystack;
+	return kernels[kernel_index].fn(haystack, needle, needle_len, icase);
+}
+
+__attribute__((visibility("default"))) const char* get_find_str_kernel(void)
+{
+	return kernels[kernel_index].name;
+}
+
+__attribute__((visibility("default"))) int set_find_str_kernel(const char* name)
+{
+	for (uint32_t i = 0; i < KERNEL_COUNT; i++) {
+		if (strcmp(kernels[i].name, name) == 0 && kernels[i].supported()) {
+			kernel_index = i;
+			return 0;
+		}
+	}
+	return 1;
+}
@@ -76,6 +76,92 @@ int write_file(int fd, char* head, uint32_t size)
 	return 0;
 }
 
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	return rotl64(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64 of the xxHash family, for little endian archs
+uint64_t xxhash64(const void* data, size_t size, uint64_t seed)
+{
+	const uint8_t *p = data, *end = p + size;
+	uint64_t h;
+
+	if (size >= 32) {
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2, v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed, v4 = seed - XXH_PRIME64_1;
+		do {
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+
+	h += size;
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= read32(p) * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
 // 将搜索路径转换为挂载路径
 
 GList *get_bind_mountpoints(const dev_t target_dev)
@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <sys/statvfs.h>
 #include <dirent.h>
 #include <limits.h>
 
@@ -21,11 +22,21 @@
 #define EMPTY_DIR		0
 #define NONEMPTY_DIR	1
 #define CANCELLED		2
+#define NO_SPACE		3
+
+#define DISK_BY_UUID	"/dev/disk/by-uuid"
 
 #ifndef MAX_PARTS
 #define MAX_PARTS		256
 #endif
 
+// bytes a file takes in a fs_buf on average: its name, tag and a share of its parent tag
+#define AVG_NAME_SIZE	24
+#define MIN_CAPACITY	(2 << 20)
+#define MAX_CAPACITY	(256 << 20)
+// for file systems that don't count inodes, e.g. btrfs
+#define DEF_CAPACITY	(16 << 20)
+
 typedef struct __progress_report__ {
 	uint32_t file_count;
 	uint32_t dir_count;
@@ -38,6 +49,8 @@ typedef struct __partition_filter__ {
 	int merge_partition;
 	int partition_count;
 	partition* partitions;
+	// folders left empty, ends with a null pointer
+	const char* const* excludes;
 } partition_filter;
 
 static int mounted_at(const char* mp, const char* root)
@@ -146,6 +159,44 @@ __attribute__((visibility("default"))) int get_partitions(int* part_count, parti
 	return 0;
 }
 
+__attribute__((visibility("default"))) uint32_t get_fs_buf_capacity(const char* root_path)
+{
+	struct statvfs st;
+	if (statvfs(root_path, &st) != 0 || st.f_files == 0)
+		return DEF_CAPACITY;
+
+	uint64_t size = (uint64_t)(st.f_files - st.f_ffree) * AVG_NAME_SIZE + strlen(root_path);
+	if (size < MIN_CAPACITY)
+		return MIN_CAPACITY;
+	return size > MAX_CAPACITY ? MAX_CAPACITY : size;
+}
+
+__attribute__((visibility("default"))) int get_fs_uuid(const char* path, char* uuid, uint32_t size)
+{
+	*uuid = 0;
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return 1;
+
+	DIR* dir = opendir(DISK_BY_UUID);
+	if (dir == 0)
+		return 1;
+
+	// the links are named by the uuids of the devices they point to
+	struct dirent* de = 0;
+	while ((de = readdir(dir)) != 0) {
+		struct stat dev_st;
+		if (fstatat(dirfd(dir), de->d_name, &dev_st, 0) != 0 || !S_ISBLK(dev_st.st_mode) || dev_st.st_rdev != st.st_dev)
+			continue;
+
+		if (strlen(de->d_name) < size)
+			strcpy(uuid, de->d_name);
+		break;
+	}
+	closedir(dir);
+	return 0;
+}
+
 static int get_path_partition(const char* path, int part_count, partition* sorted_parts)
 {
 	for (int i = part_count-1; i >= 0; i--)
@@ -159,6 +210,10 @@ static int should_skip_path(const char* path, partition_filter *pf)
 	if (is_special_mount_point(path, pf->partitions[pf->selected_partition].fs_type))
 		return 1;
 
+	for (const char* const* ex = pf->excludes; ex && *ex; ex++)
+		if (strcmp(path, *ex) == 0)
+			return 1;
+
 	if (pf->merge_partition)
 		return 0;
 
@@ -196,7 +251,10 @@ static int walkdir(const char* name, fs_buf* fsbuf, uint32_t parent_off, progres
 		if (de->d_type != DT_DIR && de->d_type != DT_REG && de->d_type != DT_LNK)
 			continue;
 
-		append_new_name(fsbuf, de->d_name, de->d_type == DT_DIR);
+		if (append_new_name(fsbuf, de->d_name, de->d_type == DT_DIR) != 0) {
+			closedir(dir);
+			return NO_SPACE;
+		}
 		if (de->d_type == DT_DIR)
 			pr->dir_count++;
 		else
@@ -213,7 +271,8 @@ static int walkdir(const char* name, fs_buf* fsbuf, uint32_t parent_off, progres
 
 	// set parent offset
 	uint32_t end = get_tail(fsbuf);
-	append_parent(fsbuf, parent_off);
+	if (append_parent(fsbuf, parent_off) != 0)
+		return NO_SPACE;
 
 	// loop thru siblings
 	uint32_t off = start;
@@ -230,21 +289,35 @@ static int walkdir(const char* name, fs_buf* fsbuf, uint32_t parent_off, progres
 		int result = walkdir(path, fsbuf, off, pr, pf);
 		if (result == EMPTY_DIR)
 			set_kids_off(fsbuf, off, 0);
-		else if (result == CANCELLED)
-			return CANCELLED;
+		else if (result != NONEMPTY_DIR)
+			return result;
 		off = next_name(fsbuf, off);
 	}
 	return NONEMPTY_DIR;
 }
 
-__attribute__((visibility("default"))) int build_fstree(fs_buf* fsbuf, int merge_partition, progress_callback_fn pcf, void* param)
+static void init_partition_filter(partition_filter *pf, const char* root)
+{
+	get_partitions(&pf->partition_count, pf->partitions);
+
+	if (pf->partition_count > MAX_PARTS) {
+		fprintf(stderr, "The number of partitions exceeds the upper limit: %d\n", MAX_PARTS);
+		abort();
+	}
+
+	pf->selected_partition = get_path_partition(root, pf->partition_count, pf->partitions);
+}
+
+__attribute__((visibility("default"))) int build_fstree_excluding(fs_buf* fsbuf, int merge_partition, const char* const* excludes,
+																 progress_callback_fn pcf, void* param)
 {
 	partition parts[MAX_PARTS];
 	partition_filter pf = {
 		.selected_partition = -1,
 		.merge_partition = merge_partition,
 		.partition_count = 0,
-		.partitions = parts
+		.partitions = parts,
+		.excludes = excludes
 	};
 	progress_report pr = {
 		.file_count = 0,
@@ -253,23 +326,104 @@ __attribute__((visibility("default"))) int build_fstree(fs_buf* fsbuf, int merge
 		.param = param
 	};
 
-	get_partitions(&pf.partition_count, parts);
-
-	if (pf.partition_count > MAX_PARTS) {
-		fprintf(stderr, "The number of partitions exceeds the upper limit: %d\n", MAX_PARTS);
-		abort();
-	}
-
 	const char *_root = get_root_path(fsbuf);
 	char *root = malloc(strlen(_root) + 1);
 
 	strcpy(root, _root);
 
-	pf.selected_partition = get_path_partition(root, pf.partition_count, parts);
+	init_partition_filter(&pf, root);
 
-	int ret = walkdir(root, fsbuf, 0, &pr, &pf) == CANCELLED;
+	int result = walkdir(root, fsbuf, 0, &pr, &pf);
+	int ret = result == CANCELLED ? 1 : (result == NO_SPACE ? 2 : 0);
 
 	free(root);
 
 	return ret;
 }
+
+__attribute__((visibility("default"))) int build_fstree(fs_buf* fsbuf, int merge_partition, progress_callback_fn pcf, void* param)
+{
+	return build_fstree_excluding(fsbuf, merge_partition, 0, pcf, param);
+}
+
+// insert the entries of folder name in one batch, then go into its subfolders
+static int rescan_dir(const char* name, fs_buf* fsbuf, partition_filter *pf)
+{
+	if (should_skip_path(name, pf))
+		return 0;
+
+	DIR* dir = opendir(name);
+	if (0 == dir)
+		return 0;
+
+	fs_op* ops = 0;
+	uint32_t count = 0, capacity = 0;
+	int result = 0;
+	struct dirent* de = 0;
+	while ((de = readdir(dir)) != 0) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		if (de->d_type != DT_DIR && de->d_type != DT_REG && de->d_type != DT_LNK)
+			continue;
+
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			fs_op* p = realloc(ops, capacity * sizeof(fs_op));
+			if (p == 0) {
+				result = NO_SPACE;
+				break;
+			}
+			ops = p;
+		}
+
+		char *path = malloc(strlen(name) + strlen(de->d_name) + 2);
+		if (path == 0) {
+			result = NO_SPACE;
+			break;
+		}
+		sprintf(path, name[strlen(name)-1] == '/' ? "%s%s" : "%s/%s", name, de->d_name);
+		ops[count++] = (fs_op){ .op = FS_OP_INSERT, .is_dir = de->d_type == DT_DIR, .path = path };
+	}
+	closedir(dir);
+
+	int* results = result == 0 && count ? malloc(count * sizeof(int)) : 0;
+	if (results) {
+		apply_fs_changes(fsbuf, ops, count, results);
+		// a folder found in fsbuf may still miss some of its files
+		for (uint32_t i = 0; i < count && result == 0; i++) {
+			if (results[i] == ERR_NO_MEM)
+				result = NO_SPACE;
+			else if (ops[i].is_dir && (results[i] == 0 || results[i] == ERR_PATH_EXISTS))
+				result = rescan_dir(ops[i].path, fsbuf, pf);
+		}
+	} else if (count) {
+		result = NO_SPACE;
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+		free((char*)ops[i].path);
+	free(ops);
+	free(results);
+	return result;
+}
+
+__attribute__((visibility("default"))) int rescan_fstree_excluding(fs_buf* fsbuf, const char* path, const char* const* excludes)
+{
+	partition parts[MAX_PARTS];
+	partition_filter pf = {
+		.selected_partition = -1,
+		.merge_partition = 0,
+		.partition_count = 0,
+		.partitions = parts,
+		.excludes = excludes
+	};
+
+	init_partition_filter(&pf, get_root_path(fsbuf));
+	return rescan_dir(path, fsbuf, &pf) == NO_SPACE ? 2 : 0;
+}
+
+__attribute__((visibility("default"))) int rescan_fstree(fs_buf* fsbuf, const char* path)
+{
+	return rescan_fstree_excluding(fsbuf, path, 0);
+}
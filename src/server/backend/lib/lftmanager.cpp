@@ -11,6 +11,7 @@
 
 extern "C" {
 #include "fs_buf.h"
+#include "fs_journal.h"
 #include "walkdir.h"
 #include "resourceutil .h"
 #include "utils.h"
@@ -47,6 +48,17 @@ Q_LOGGING_CATEGORY(logC, "anything.changes.manager", DEFAULT_MSG_TYPE)
 #define DEFAULT_RESULT_COUNT 100
 // set default timeout(ms) for search function return.
 #define DEFAULT_TIMEOUT 200
+// 日志超过此大小(或超过buf大小的1/4)时重新保存整个lft文件
+#define JOURNAL_COMPACT_SIZE (16 * 1024 * 1024)
+// lft文件中损坏的目录超过此数量时重新生成整个索引
+#define MAX_BROKEN_DIRS 256
+// 文件名至少出现这么多次才会放入共享字典
+#define INTERN_MIN_COUNT 4
+// 搜索每字节名称的大致开销, 以复制一字节为1 (单线程实测子串/通配符/关键词约5, 正则约7,
+// 但随表达式可能高出许多, 有拼音表时拼音约25)
+#define SEARCH_BYTE_COST 5
+#define REGEX_BYTE_COST 16
+#define PINYIN_BYTE_COST 25
 
 static QString _getCacheDir()
 {
@@ -108,6 +120,10 @@ typedef QMap<QString, QFutureWatcher<fs_buf*>*> FSJobWatcherMap;
 Q_GLOBAL_STATIC(FSJobWatcherMap, _global_fsWatcherMap)
 typedef QSet<fs_buf*> FSBufList;
 Q_GLOBAL_STATIC(FSBufList, _global_fsBufDirtyList)
+typedef QMap<fs_buf*, fs_journal*> FSJournalMap;
+Q_GLOBAL_STATIC(FSJournalMap, _global_fsJournalMap)
+typedef QList<QPair<QByteArray, QByteArray>> FSActionList;
+Q_GLOBAL_STATIC(FSActionList, _global_pendingActions)
 Q_GLOBAL_STATIC_WITH_ARGS(QSettings, _global_settings, (_getCacheDir() + "/config.ini", QSettings::IniFormat))
 
 static QSet<fs_buf*> fsBufList()
@@ -123,8 +139,53 @@ static QSet<fs_buf*> fsBufList()
 #endif
 }
 
+static QString getJournalFile(const QString &lft_file)
+{
+    return lft_file + ".journal";
+}
+
+// 以lft文件为基准打开(或清空)对应的日志, 之后的改动只追加到日志中
+static void openJournal(fs_buf *buf, const QString &lft_file)
+{
+    const QByteArray &base_file = lft_file.toLocal8Bit();
+    fs_journal *journal = _global_fsJournalMap->value(buf);
+
+    if (journal) {
+        if (reset_fs_journal(journal, base_file.constData()) == 0)
+            return;
+
+        _global_fsJournalMap->remove(buf);
+        close_fs_journal(journal);
+        journal = nullptr;
+    }
+
+    if (open_fs_journal(&journal, getJournalFile(lft_file).toLocal8Bit().constData(), base_file.constData()) == 0) {
+        _global_fsJournalMap->insert(buf, journal);
+    } else {
+        nWarning() << "[LFT] Failed on open journal of:" << lft_file;
+    }
+}
+
+static void closeJournal(fs_buf *buf)
+{
+    if (!_global_fsJournalMap.exists())
+        return;
+
+    if (fs_journal *journal = _global_fsJournalMap->take(buf)) {
+        sync_fs_journal(journal);
+        close_fs_journal(journal);
+    }
+}
+
 static void clearFsBufMap()
 {
+    if (_global_fsJournalMap.exists()) {
+        for (fs_journal *journal : _global_fsJournalMap->values())
+            close_fs_journal(journal);
+
+        _global_fsJournalMap->clear();
+    }
+
     for (fs_buf *buf : fsBufList()) {
         if (buf)
             free_fs_buf(buf);
@@ -149,6 +210,17 @@ static void markLFTFileToDirty(fs_buf *buf)
     _global_fsBufDirtyList->insert(buf);
 }
 
+// 记录改动到日志中, 无法记录时标记为脏文件
+static void journalLFTFileChange(fs_buf *buf, uint8_t op, const QByteArray &path, const QByteArray &dst_path, bool is_dir)
+{
+    fs_journal *journal = _global_fsJournalMap->value(buf);
+
+    if (journal && append_fs_journal(journal, op, path.constData(), dst_path.constData(), is_dir) == 0)
+        return;
+
+    markLFTFileToDirty(buf);
+}
+
 // 删除脏文件
 static bool doLFTFileToDirty(fs_buf *buf)
 {
@@ -156,12 +228,29 @@ static bool doLFTFileToDirty(fs_buf *buf)
 
     nDebug() << lft_file;
 
+    closeJournal(buf);
+
     if (lft_file.isEmpty())
         return false;
 
+    QFile::remove(getJournalFile(lft_file));
+
     return QFile::remove(lft_file);
 }
 
+// 保存buf到lft文件, 成功后清空日志
+static bool saveLFTFile(fs_buf *buf, const QString &lft_file)
+{
+    if (save_fs_buf(buf, lft_file.toLocal8Bit().constData()) != 0)
+        return false;
+
+    // 从脏列表中移除
+    _global_fsBufDirtyList->remove(buf);
+    openJournal(buf, lft_file);
+
+    return true;
+}
+
 static void cleanDirtyLFTFiles()
 {
     if (!_global_fsBufDirtyList.exists())
@@ -180,10 +269,8 @@ LFTManager::~LFTManager()
     cpu_monitor_thread->wait();
     delete cpu_monitor_thread;
 
-    sync();
+    _syncAll();
     clearFsBufMap();
-    // 删除剩余脏文件(可能是sync失败)
-    cleanDirtyLFTFiles();
 }
 
 LFTManager *LFTManager::instance()
@@ -227,19 +314,6 @@ QByteArray LFTManager::setCodecNameForLocale(const QByteArray &codecName)
 #endif
 }
 
-void LFTManager::onFileChanged(QList<QPair<QByteArray, QByteArray>> &actionList)
-{
-    for(QPair<QByteArray, QByteArray> action: actionList) {
-        if (action.first.startsWith(INSERT_ACTION)) {
-            _global_lftmanager->insertFileToLFTBuf(action.second);
-        } else if (action.first.startsWith(REMOVE_ACTION)) {
-            _global_lftmanager->removeFileFromLFTBuf(action.second);
-        } else {
-            _global_lftmanager->renameFileOfLFTBuf(action.first, action.second);
-        }
-    }
-}
-
 struct FSBufDeleter
 {
     static inline void cleanup(fs_buf *pointer)
@@ -275,14 +349,43 @@ static bool checkFSBuf(fs_buf *buf)
     return get_tail(buf) != first_name(buf);
 }
 
-static fs_buf *buildFSBuf(QFutureWatcherBase *futureWatcher, const QString &path)
+// 转为build_fstree_excluding使用的以nullptr结尾的数组, 使用期间paths需保持有效
+static QVector<const char*> toExcludeArray(const QByteArrayList &paths)
 {
-    fs_buf *buf = new_fs_buf(1 << 24, path.toLocal8Bit().constData());
+    QVector<const char*> array;
+
+    for (const QByteArray &path : paths)
+        array << path.constData();
+    array << nullptr;
+
+    return array;
+}
+
+// excludes为path下的分片, 它们由各自的fs_buf索引, 此处留空
+static fs_buf *buildFSBuf(QFutureWatcherBase *futureWatcher, const QString &path, const QByteArrayList &excludes)
+{
+    const QVector<const char*> &exclude_array = toExcludeArray(excludes);
+    // 按分区已用的inode数估算初始大小, 不足时会自动增长
+    uint32_t capacity = get_fs_buf_capacity(path.toLocal8Bit().constData());
+    fs_buf *buf = new_fs_buf(capacity, path.toLocal8Bit().constData());
 
     if (!buf)
         return buf;
 
-    if (build_fstree(buf, false, handle_build_fs_buf_progress, futureWatcher) != 0) {
+    int r = build_fstree_excluding(buf, false, exclude_array.constData(), handle_build_fs_buf_progress, futureWatcher);
+    // 索引超过了1G的上限，使用宽格式重新建立
+    if (r == 2) {
+        free_fs_buf(buf);
+        nWarning() << "[LFT] Fs buffer is full, rebuild it in wide format: " << path;
+
+        buf = new_wide_fs_buf(capacity, path.toLocal8Bit().constData());
+        if (!buf)
+            return buf;
+
+        r = build_fstree_excluding(buf, false, exclude_array.constData(), handle_build_fs_buf_progress, futureWatcher);
+    }
+
+    if (r != 0) {
         free_fs_buf(buf);
 
         nWarning() << "[LFT] Failed on build fs buffer of path: " << path;
@@ -298,13 +401,63 @@ static fs_buf *buildFSBuf(QFutureWatcherBase *futureWatcher, const QString &path
         return nullptr;
     }
 
+    // 按需把重复出现的文件名(如node_modules、源码树中的副本)放入共享字典, 节省不够多时不做处理
+    if (_global_settings->value("internNames", false).toBool() && intern_fs_buf(buf, INTERN_MIN_COUNT) != 0)
+        nWarning() << "[LFT] Failed on intern fs buffer of path: " << path;
+
+    // 按需让同一目录下前缀相同的文件名(如IMG_20240101_xxx.jpg)只保存与前一个兄弟不同的部分
+    if (_global_settings->value("frontCodeNames", false).toBool() && front_code_fs_buf(buf) != 0)
+        nWarning() << "[LFT] Failed on front code fs buffer of path: " << path;
+
+    // 按需保存大小写折叠后的文件名(会多占用与数据等量的内存), 忽略大小写的搜索直接按字节比较, 并支持非ASCII字母
+    if (_global_settings->value("foldNames", false).toBool() && fold_fs_buf(buf) != 0)
+        nWarning() << "[LFT] Failed on fold fs buffer of path: " << path;
+
+    // 为大目录建立子项索引, 加快路径查找和搜索结果的路径拼接
+    build_kids_indexes(buf);
+
+    // 预先生成含中文文件名的拼音表, 拼音搜索不再逐个转换文件名
+    if (build_pinyin_table(buf) != 0)
+        nWarning() << "[LFT] Failed on build pinyin table of path: " << path;
+
     return buf;
 }
 
+static QString joinPath(QString dir, const QString &relative_path)
+{
+    if (!dir.endsWith('/'))
+        dir.append('/');
+
+    return dir + (relative_path.startsWith('/') ? relative_path.mid(1) : relative_path);
+}
+
+// 分片在分区的每个挂载点下的路径, mount_paths的第一个为分片所在的挂载点
+static QStringList getShardEquivalentPaths(const QStringList &mount_paths, const QString &shard)
+{
+    QStringList paths;
+
+    for (const QString &mount_path : mount_paths)
+        paths << joinPath(mount_path, shard.mid(mount_paths.first().size()));
+
+    return paths;
+}
+
 static QString getLFTFileByPath(const QString &path, bool autoIndex)
 {
     QByteArray lft_file_name = LFTDiskTool::pathToSerialUri(path);
 
+    // 分片不是挂载点, 使用挂载点的uri加上分片的相对路径, 这样fromSerialUri也能得到它的路径
+    if (lft_file_name.isEmpty()) {
+        const QString &mount_point = deepin_anything_server::MountCacher::instance()->findMountPointByPath(path);
+
+        if (!mount_point.isEmpty() && mount_point != path) {
+            const QByteArray &mount_uri = LFTDiskTool::pathToSerialUri(mount_point);
+
+            if (!mount_uri.isEmpty())
+                lft_file_name = joinPath(QString::fromLocal8Bit(mount_uri), path.mid(mount_point.size())).toLocal8Bit();
+        }
+    }
+
     if (lft_file_name.isEmpty())
         return QString();
 
@@ -319,6 +472,72 @@ static QString getLFTFileByPath(const QString &path, bool autoIndex)
     return cache_path + "/" + QString::fromLocal8Bit(lft_file_name.toPercentEncoding(":", "/").constData());
 }
 
+// 自动索引的分区按这些目录拆分为多个分片, 每个分片有自己的fs_buf、lft文件和日志,
+// 一个分片中的改动不会阻塞其它分片上的搜索. 以 /* 结尾时表示此目录下的每个子目录
+static QStringList getShardPaths(const QString &root)
+{
+    const QStringList &patterns = _global_settings->value("shardPaths", QStringList {"/*"}).toStringList();
+    const QString &mount_point = deepin_anything_server::MountCacher::instance()->findMountPointByPath(root);
+    const QString &prefix = root.endsWith('/') ? root : root + '/';
+    struct stat root_stat;
+    QStringList shards;
+
+    if (mount_point.isEmpty() || lstat(root.toLocal8Bit().constData(), &root_stat) != 0)
+        return shards;
+
+    for (QString pattern : patterns) {
+        QStringList paths;
+
+        if (pattern.endsWith("/*")) {
+            pattern.chop(2);
+            QDir dir(pattern.isEmpty() ? "/" : pattern);
+
+            for (const QString &name : dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden | QDir::NoSymLinks))
+                paths << dir.filePath(name);
+        } else {
+            paths << pattern;
+        }
+
+        for (const QString &path : paths) {
+            struct stat path_stat;
+
+            // 只拆分此分区中的目录, 其它分区的挂载点本来就不会被扫描
+            if (!path.startsWith(prefix) || path.size() == prefix.size() || shards.contains(path)
+                    || lstat(path.toLocal8Bit().constData(), &path_stat) != 0 || !S_ISDIR(path_stat.st_mode)
+                    || path_stat.st_dev != root_stat.st_dev
+                    || deepin_anything_server::MountCacher::instance()->findMountPointByPath(path) != mount_point) {
+                continue;
+            }
+
+            shards << path;
+        }
+    }
+
+    return shards;
+}
+
+// 扫描root时要跳过的分片: 已配置的和已加载的(配置可能已改变)
+static QByteArrayList getShardExcludes(QString root)
+{
+    if (root.size() > 1 && root.endsWith('/'))
+        root.chop(1);
+
+    const QString &prefix = root.endsWith('/') ? root : root + '/';
+    QByteArrayList excludes;
+
+    for (const QString &path : getShardPaths(root))
+        excludes << path.toLocal8Bit();
+
+    if (_global_fsBufMap.exists()) {
+        for (const QString &path : _global_fsBufMap->keys()) {
+            if (path.size() > prefix.size() && path.startsWith(prefix) && !excludes.contains(path.toLocal8Bit()))
+                excludes << path.toLocal8Bit();
+        }
+    }
+
+    return excludes;
+}
+
 static bool allowablePath(LFTManager *manager, const QString &path)
 {
     QString mountPoint = deepin_anything_server::MountCacher::instance()->findMountPointByPath(path);
@@ -369,6 +588,7 @@ static void removeBuf(fs_buf *buf, bool &removeLFTFile)
         removeLFTFile = doLFTFileToDirty(buf);
     }
 
+    closeJournal(buf);
     _global_fsBufDirtyList->remove(buf);
     _global_fsBufToFileMap->remove(buf);
     free_fs_buf(buf);
@@ -401,10 +621,6 @@ bool LFTManager::addPath(QString path, bool autoIndex)
         return false;
     }
 
-    QFutureWatcher<fs_buf*> *watcher = new QFutureWatcher<fs_buf*>(this);
-    // 保存任务是否由自动索引触发的
-    watcher->setProperty("_d_autoIndex", autoIndex);
-
     // 此路径对应的设备可能被挂载到多个位置
     const QByteArrayList &path_list = LFTDiskTool::fromSerialUri(serial_uri);
 
@@ -415,60 +631,20 @@ bool LFTManager::addPath(QString path, bool autoIndex)
         return false;
     path = path_list.first();
 
-    // 保存信息，用于判断索引是否正在构建
-    for (const QByteArray &path_raw : path_list) {
-        const QString &path = QString::fromLocal8Bit(path_raw.constData());
-
-        (*_global_fsWatcherMap)[path] = watcher;
-    }
-
-    connect(watcher, &QFutureWatcher<fs_buf*>::finished, this, [this, path_list, path, watcher, autoIndex] {
-        fs_buf *buf = !watcher->isCanceled() ? watcher->result() : nullptr;
-
-        // 已被取消构建或构建的结果不再需要时则忽略生成结果
-        if (!_global_fsWatcherMap->contains(path) || (autoIndex && buf && !allowableBuf(this, buf))) {
-            nWarning() << "[LFT] Discarded index data of path:" << path;
-
-            free_fs_buf(buf);
-            buf = nullptr;
-        }
-
-        for (const QByteArray &path_raw : path_list) {
-            const QString &path = QString::fromLocal8Bit(path_raw.constData());
-
-            if (buf) {
-                // 清理旧数据
-                if (fs_buf *old_buf = _global_fsBufMap->value(path)) {
-                    bool removeFile = false;
-                    removeBuf(old_buf, removeFile);
-                }
-
-                (*_global_fsBufMap)[path] = buf;
-                // 新加入的buf要添加到脏列表
-                markLFTFileToDirty(buf);
-            }
-
-            _global_fsWatcherMap->remove(path);
-            building_paths.removeOne(path);
-
-            Q_EMIT addPathFinished(path, buf);
-        }
+    QStringList paths;
 
-        if (buf) {
-            _global_fsBufToFileMap->insert(buf, getLFTFileByPath(path, autoIndex));
-        }
+    for (const QByteArray &path_raw : path_list)
+        paths << QString::fromLocal8Bit(path_raw.constData());
 
-        watcher->deleteLater();
+    // 自动索引的分区拆分为多个分片, 分别建立索引
+    const QStringList &shards = autoIndex ? getShardPaths(path) : QStringList();
 
-        if (building_paths.isEmpty()) {
-            Q_EMIT buildFinished();
-        }
-    });
+    nDebug() << "Shards:" << shards;
 
-    QFuture<fs_buf*> result = QtConcurrent::run(buildFSBuf, watcher, path.endsWith('/') ? path : path + "/");
-    building_paths.append(path);
+    _buildPath(path, paths, autoIndex, shards);
 
-    watcher->setFuture(result);
+    for (const QString &shard : shards)
+        _buildPath(shard, getShardEquivalentPaths(paths, shard), autoIndex, shards);
 
     return true;
 }
@@ -509,6 +685,17 @@ bool LFTManager::removePath(const QString &path)
     return false;
 }
 
+// path所在的分片: 挂载点到path之间最深的已加载或正在构建的路径, 没有时为挂载点本身
+static QString getShardByPath(const QString &path, const QString &mountPoint)
+{
+    for (QString shard = path; shard.size() > mountPoint.size(); shard.truncate(shard.lastIndexOf('/'))) {
+        if (_global_fsBufMap->contains(shard) || _global_fsWatcherMap->contains(shard))
+            return shard;
+    }
+
+    return mountPoint;
+}
+
 // 返回path对应的fs_buf对象，且将path转成为相对于fs_buf root_path的路径
 static QPair<QString, fs_buf*> getFsBufByPath(const QString &path)
 {
@@ -554,11 +741,14 @@ static QPair<QString, fs_buf*> getFsBufByPath(const QString &path)
             mountPoint = "/sysroot";
     }
 
+    // 分区拆分为多个分片时, 文件属于它所在的最深的分片
+    const QString &shard = getShardByPath(path, mountPoint);
+
     QPair<QString, fs_buf*> buf_pair;
-    fs_buf *buf = _global_fsBufMap->value(mountPoint);
+    fs_buf *buf = _global_fsBufMap->value(shard);
     if (buf) {
         // path相对于此fs_buf root_path的路径
-        QString new_path = path.mid(mountPoint.size());
+        QString new_path = path.mid(shard.size());
 
         // 移除多余的 / 字符
         if (new_path.startsWith("/"))
@@ -577,6 +767,138 @@ static QPair<QString, fs_buf*> getFsBufByPath(const QString &path)
     return buf_pair;
 }
 
+// 分片的索引建好之前, 父级buf中可能已有它的内容(如刚配置的分片), 清空它, 之后由分片负责
+static void detachShard(const QString &path)
+{
+    auto buf_pair = getFsBufByPath(path);
+    fs_buf *buf = buf_pair.second;
+
+    if (!buf || buf == _global_fsBufMap->value(path))
+        return;
+
+    const QByteArray &shard_path = buf_pair.first.toLocal8Bit();
+    uint32_t path_off = 0, start_off = 0, end_off = 0;
+    get_path_range(buf, shard_path.constData(), &path_off, &start_off, &end_off);
+
+    if (path_off == 0 || start_off == 0)
+        return;
+
+    nDebug() << "detach shard:" << path << "from:" << get_root_path(buf);
+
+    fs_change changes[10];
+    uint32_t change_count = 10;
+    fs_change change;
+
+    if (remove_path(buf, shard_path.constData(), changes, &change_count) == 0) {
+        journalLFTFileChange(buf, FS_JOURNAL_REMOVE, shard_path, QByteArray(), true);
+
+        if (insert_path(buf, shard_path.constData(), true, &change) == 0)
+            journalLFTFileChange(buf, FS_JOURNAL_INSERT, shard_path, QByteArray(), true);
+
+        trim_fs_buf(buf);
+    }
+}
+
+// 分区重新建立索引后, 删除不再属于分片配置的旧分片, 它们的内容已在分区的索引中
+static void removeStaleShards(const QString &mountPoint, const QStringList &shards)
+{
+    const QString &prefix = mountPoint.endsWith('/') ? mountPoint : mountPoint + '/';
+
+    for (const QString &path : _global_fsBufMap->keys()) {
+        fs_buf *buf = _global_fsBufMap->value(path);
+
+        if (!buf || !path.startsWith(prefix) || shards.contains(path)
+                || !_global_fsBufToFileMap->value(buf).endsWith(".LFT")
+                || deepin_anything_server::MountCacher::instance()->findMountPointByPath(path) != mountPoint) {
+            continue;
+        }
+
+        nDebug() << "remove stale shard:" << path;
+
+        bool removeFile = true;
+        removeBuf(buf, removeFile);
+    }
+}
+
+// 在后台建立path的索引, path_list为它的所有等价路径. shards为所在分区的分片, path下的分片不会被扫描
+void LFTManager::_buildPath(const QString &path, const QStringList &path_list, bool autoIndex, const QStringList &shards)
+{
+    // 已在构建中, 如分区重建时它的分片还未建好
+    if (_global_fsWatcherMap->contains(path))
+        return;
+
+    const QString &root = path.endsWith('/') ? path : path + "/";
+    QByteArrayList excludes;
+
+    for (const QString &shard : shards) {
+        if (shard.startsWith(root))
+            excludes << shard.toLocal8Bit();
+    }
+
+    QFutureWatcher<fs_buf*> *watcher = new QFutureWatcher<fs_buf*>(this);
+    // 保存任务是否由自动索引触发的
+    watcher->setProperty("_d_autoIndex", autoIndex);
+
+    // 保存信息，用于判断索引是否正在构建
+    for (const QString &path : path_list)
+        (*_global_fsWatcherMap)[path] = watcher;
+
+    connect(watcher, &QFutureWatcher<fs_buf*>::finished, this, [this, path_list, path, watcher, autoIndex, shards] {
+        fs_buf *buf = !watcher->isCanceled() ? watcher->result() : nullptr;
+
+        // 已被取消构建或构建的结果不再需要时则忽略生成结果
+        if (!_global_fsWatcherMap->contains(path) || (autoIndex && buf && !allowableBuf(this, buf))) {
+            nWarning() << "[LFT] Discarded index data of path:" << path;
+
+            free_fs_buf(buf);
+            buf = nullptr;
+        }
+
+        for (const QString &path : path_list)
+            _global_fsWatcherMap->remove(path);
+
+        if (buf) {
+            if (shards.contains(path))
+                detachShard(path);
+            else if (autoIndex)
+                removeStaleShards(path, shards);
+        }
+
+        for (const QString &path : path_list) {
+            if (buf) {
+                // 清理旧数据
+                if (fs_buf *old_buf = _global_fsBufMap->value(path)) {
+                    bool removeFile = false;
+                    removeBuf(old_buf, removeFile);
+                }
+
+                (*_global_fsBufMap)[path] = buf;
+                // 新加入的buf要添加到脏列表
+                markLFTFileToDirty(buf);
+            }
+
+            building_paths.removeOne(path);
+
+            Q_EMIT addPathFinished(path, buf);
+        }
+
+        if (buf) {
+            _global_fsBufToFileMap->insert(buf, getLFTFileByPath(path, autoIndex));
+        }
+
+        watcher->deleteLater();
+
+        if (building_paths.isEmpty()) {
+            Q_EMIT buildFinished();
+        }
+    });
+
+    QFuture<fs_buf*> result = QtConcurrent::run(buildFSBuf, watcher, root, excludes);
+    building_paths.append(path);
+
+    watcher->setFuture(result);
+}
+
 bool LFTManager::hasLFT(const QString &path) const
 {
     QStringList mountPoints = allPath();
@@ -645,6 +967,123 @@ QStringList LFTManager::hasLFTSubdirectories(QString path) const
     return list;
 }
 
+// 校验刚加载的lft文件的各数据块, 剪除损坏的部分并重新扫描它们所在的目录, 再回放日志. 它逐块读取整个文件,
+// 在后台执行. 损坏过多需要重新生成时返回nullptr, 需要以当前数据重新保存lft文件时置dirty
+static fs_buf *verifyFSBuf(fs_buf *buf, const QString &lft_file, const QByteArrayList &excludes, bool *dirty)
+{
+    uint32_t broken_dirs[MAX_BROKEN_DIRS], broken_count = MAX_BROKEN_DIRS;
+    int check_r = check_fs_buf(buf, broken_dirs, &broken_count);
+
+    if (check_r >= 2) {
+        nWarning() << "[LFT] Too much broken data, rebuild:" << lft_file << ", result:" << check_r;
+        return nullptr;
+    }
+
+    // 日志回放会移动数据, 先记下这些目录的路径
+    QByteArrayList broken_paths;
+
+    for (uint32_t i = 0; i < broken_count; i++) {
+        char tmp_path[PATH_MAX] = {0};
+        broken_paths << QByteArray(get_path_by_name_off(buf, broken_dirs[i], tmp_path, sizeof(tmp_path)));
+    }
+
+    build_kids_indexes(buf);
+
+    // 回放lft文件保存之后记录的改动
+    const QString &journal_file = getJournalFile(lft_file);
+    uint32_t journal_count = 0;
+
+    if (QFile::exists(journal_file)) {
+        int r = replay_fs_journal(buf, journal_file.toLocal8Bit().constData(),
+                                  lft_file.toLocal8Bit().constData(), &journal_count);
+
+        nDebug() << "replay journal:" << journal_file << ", result:" << r << ", count:" << journal_count;
+
+        // 日志未能完整回放时, 以当前数据重新保存lft文件
+        if (r == 4)
+            *dirty = true;
+    }
+
+    if (!broken_paths.isEmpty()) {
+        nWarning() << "[LFT] Rescan broken dirs of:" << lft_file << broken_paths;
+
+        // 跳过分片, 它们的内容不在此buf中
+        const QVector<const char*> &exclude_array = toExcludeArray(excludes);
+
+        for (const QByteArray &path : broken_paths)
+            rescan_fstree_excluding(buf, path.constData(), exclude_array.constData());
+
+        *dirty = true;
+    }
+
+    return buf;
+}
+
+// 在后台校验lft文件, 完成后才以path_list中的路径加入buf, 期间这些路径视为正在建立索引.
+// 损坏过多时重新生成索引, autoIndex同addPath
+void LFTManager::_loadPath(void *vbuf, const QString &lft_file, const QStringList &path_list, bool autoIndex)
+{
+    fs_buf *buf = static_cast<fs_buf*>(vbuf);
+    const QString &root = QString::fromLocal8Bit(get_root_path(buf));
+    const QByteArrayList &excludes = getShardExcludes(root);
+    QSharedPointer<bool> dirty(new bool(false));
+    QFutureWatcher<fs_buf*> *watcher = new QFutureWatcher<fs_buf*>(this);
+    // 区别于建立索引的任务, 分区卸载时取消
+    watcher->setProperty("_d_loading", true);
+
+    for (const QString &path : path_list)
+        (*_global_fsWatcherMap)[path] = watcher;
+
+    connect(watcher, &QFutureWatcher<fs_buf*>::finished, this, [this, buf, lft_file, path_list, root, autoIndex, dirty, watcher] {
+        // 已被取消加载(如分区已卸载)时丢弃
+        bool discarded = !_global_fsWatcherMap->contains(path_list.first());
+        bool verified = !discarded && !watcher->isCanceled() && watcher->result();
+
+        for (const QString &path : path_list) {
+            if (_global_fsWatcherMap->value(path) == watcher)
+                _global_fsWatcherMap->remove(path);
+        }
+
+        if (discarded)
+            nWarning() << "[LFT] Discarded index data of file:" << lft_file;
+        else if (!verified)
+            addPath(root, autoIndex);
+
+        if (verified) {
+            for (const QString &path : path_list) {
+                // 清理旧的buf
+                if (fs_buf *old_buf = _global_fsBufMap->value(path)) {
+                    bool removeFile = false;
+                    removeBuf(old_buf, removeFile);
+                }
+
+                (*_global_fsBufMap)[path] = buf;
+            }
+
+            _global_fsBufToFileMap->insert(buf, lft_file);
+            openJournal(buf, lft_file);
+
+            if (*dirty)
+                markLFTFileToDirty(buf);
+        } else {
+            free_fs_buf(buf);
+        }
+
+        watcher->deleteLater();
+
+        // 应用校验期间暂存的改动
+        if (--loading_count == 0 && !_global_pendingActions->isEmpty()) {
+            QList<QPair<QByteArray, QByteArray>> actions;
+
+            actions.swap(*_global_pendingActions);
+            onFileChanged(actions);
+        }
+    });
+
+    loading_count++;
+    watcher->setFuture(QtConcurrent::run(verifyFSBuf, buf, lft_file, excludes, dirty.data()));
+}
+
 // 重新从磁盘加载lft文件
 QStringList LFTManager::refresh(const QByteArray &serialUriFilter)
 {
@@ -656,6 +1095,7 @@ QStringList LFTManager::refresh(const QByteArray &serialUriFilter)
     const QString &cache_path = cacheDir();
     QDirIterator dir_iterator(cache_path, {"*.lft", "*.LFT"});
     QStringList path_list;
+    QList<QByteArrayList> auto_path_lists;
 
     while (dir_iterator.hasNext()) {
         const QString &lft_file = dir_iterator.next();
@@ -678,9 +1118,30 @@ QStringList LFTManager::refresh(const QByteArray &serialUriFilter)
             continue;
         }
 
+        // 文件头损坏, 或分区已被重新格式化(uuid不同)时, 重新生成索引
+        fs_buf_info info;
+        int info_r = read_fs_buf_info(lft_file.toLocal8Bit().constData(), &info);
+        char fs_uuid[sizeof(info.fs_uuid)];
+
+        if (info_r == 0 && info.fs_uuid[0]) {
+            get_fs_uuid(pathList.first().constData(), fs_uuid, sizeof(fs_uuid));
+        }
+
+        if (info_r == 8 || (info_r == 0 && info.fs_uuid[0] && fs_uuid[0] && strcmp(info.fs_uuid, fs_uuid) != 0)) {
+            nWarning() << "[LFT] Broken header or file system changed, rebuild:" << lft_file;
+            addPath(QString::fromLocal8Bit(pathList.first()), dir_iterator.fileName().endsWith(".lft"));
+            continue;
+        }
+
+        nDebug() << "lft file version:" << info.version << ", generation:" << info.generation << ", build time:" << info.build_time;
+
+        // 正在后台加载或建立索引
+        if (_global_fsWatcherMap->contains(QString::fromLocal8Bit(pathList.first())))
+            continue;
+
         fs_buf *buf = nullptr;
 
-        if (load_fs_buf(&buf, lft_file.toLocal8Bit().constData()) != 0) {
+        if (map_fs_buf(&buf, lft_file.toLocal8Bit().constData()) != 0) {
             nWarning() << "[LFT] Failed on load:" << lft_file;
             continue;
         }
@@ -699,21 +1160,36 @@ QStringList LFTManager::refresh(const QByteArray &serialUriFilter)
             continue;
         }
 
-        for (const QByteArray &path_raw : pathList) {
-            const QString path = QString::fromLocal8Bit(path_raw.constData());
+        QStringList paths;
 
-            path_list << path;
+        for (const QByteArray &path_raw : pathList)
+            paths << QString::fromLocal8Bit(path_raw.constData());
 
-            // 清理旧的buf
-            if (fs_buf *buf = _global_fsBufMap->value(path)) {
-                bool removeFile = false;
-                removeBuf(buf, removeFile);
-            }
+        path_list << paths;
 
-            (*_global_fsBufMap)[path] = buf;
-        }
+        // 各数据块在后台校验, 启动时只检查文件头
+        _loadPath(buf, lft_file, paths, dir_iterator.fileName().endsWith(".lft"));
+
+        if (lft_file.endsWith(".LFT"))
+            auto_path_lists << pathList;
+    }
+
+    // 新配置的分片还没有索引数据时为它建立索引, 父级buf中它的内容在建好后清除
+    for (const QByteArrayList &path_list_raw : auto_path_lists) {
+        QStringList paths;
+
+        for (const QByteArray &path_raw : path_list_raw)
+            paths << QString::fromLocal8Bit(path_raw.constData());
+
+        if (deepin_anything_server::MountCacher::instance()->findMountPointByPath(paths.first()) != paths.first())
+            continue;
 
-        _global_fsBufToFileMap->insert(buf, lft_file);
+        const QStringList &shards = getShardPaths(paths.first());
+
+        for (const QString &shard : shards) {
+            if (!_global_fsBufMap->contains(shard))
+                _buildPath(shard, getShardEquivalentPaths(paths, shard), true, shards);
+        }
     }
 
     return path_list;
@@ -770,11 +1246,9 @@ QStringList LFTManager::sync(const QString &mountPoint)
             continue;
         }
 
-        if (save_fs_buf(buf, lft_file.toLocal8Bit().constData()) == 0) {
+        if (saveLFTFile(buf, lft_file)) {
             saved_buf_list.append(buf);
             path_list << buf_begin.key();
-            // 从脏列表中移除
-            _global_fsBufDirtyList->remove(buf);
         } else {
             path_list << QString("Failed: \"%1\"->\"%2\"").arg(buf_begin.key()).arg(lft_file);
 
@@ -813,25 +1287,18 @@ enum SearchError
     NOFOUND_INDEX,
     BUILDING_INDEX,
     EMPTY_DIR,
-    INVALID_RE
+    INVALID_RE,
+    NO_MEMORY
 };
 
-QStringList LFTManager::insertFileToLFTBuf(const QByteArray &file)
+// 获取文件所属的buf及文件在buf中的路径, 索引正在构建时等待构建完成
+static fs_buf *getFsBufOfChange(const QByteArray &file, QString &mount_path)
 {
-    if (!checkAuthorization())
-        return QStringList();
-
-    cDebug() << file;
-
     auto buff_pair = getFsBufByPath(QString::fromLocal8Bit(file.constData()));
-    QStringList root_path_list;
 
-    QString mount_path = buff_pair.first;
+    mount_path = buff_pair.first;
     if (mount_path.isEmpty())
-        return root_path_list;
-
-    QFileInfo info(QString::fromLocal8Bit(file.constData()));
-    bool is_dir = info.isDir();
+        return nullptr;
 
     fs_buf *buf = buff_pair.second;
     // 有可能索引正在构建
@@ -845,19 +1312,167 @@ QStringList LFTManager::insertFileToLFTBuf(const QByteArray &file)
             watcher->waitForFinished();
             buf = watcher->result();
         }
+    }
 
-        if (!buf)
-            return root_path_list;
+    return buf;
+}
+
+// 一个文件变动事件在buf中对应的操作
+struct LFTChange
+{
+    uint8_t op;
+    bool is_dir;
+    // 插入的目录是从其它分片移过来的, 需要扫描它的内容
+    bool rescan;
+    QByteArray path;
+    QByteArray dst_path;
+};
+
+// 将事件转换为所属buf的操作, 添加到changes中. 事件不属于任何buf时不添加
+static void getLFTChanges(const QPair<QByteArray, QByteArray> &action, QList<QPair<fs_buf*, LFTChange>> &changes)
+{
+    QString mount_path;
+    fs_buf *buf = getFsBufOfChange(action.second, mount_path);
+
+    if (!buf)
+        return;
+
+    LFTChange change;
+    change.is_dir = false;
+    change.rescan = false;
+    change.path = mount_path.toLocal8Bit();
+
+    QString src_path;
+    fs_buf *src_buf = nullptr;
+
+    if (action.first.startsWith(INSERT_ACTION)) {
+        change.op = FS_OP_INSERT;
+        change.is_dir = QFileInfo(QString::fromLocal8Bit(action.second.constData())).isDir();
+    } else if (action.first.startsWith(REMOVE_ACTION)) {
+        change.op = FS_OP_REMOVE;
+    } else if ((src_buf = getFsBufOfChange(action.first, src_path)) && src_buf != buf) {
+        // 跨分片的重命名, 从原来的分片中删除, 插入到新的分片中
+        changes << qMakePair(src_buf, LFTChange {FS_OP_REMOVE, false, false, src_path.toLocal8Bit(), QByteArray()});
+
+        change.op = FS_OP_INSERT;
+        change.is_dir = QFileInfo(QString::fromLocal8Bit(action.second.constData())).isDir();
+        change.rescan = change.is_dir;
+    } else {
+        // newFile相对于此buf的路径
+        int valid_suffix_size = change.path.size() - strlen(get_root_path(buf));
+        int invalid_prefix_size = action.second.size() - valid_suffix_size;
+
+        change.op = FS_OP_RENAME;
+        change.dst_path = change.path;
+        change.path = QByteArray(get_root_path(buf)).append(action.first.mid(invalid_prefix_size));
     }
 
+    changes << qMakePair(buf, change);
+}
+
+void LFTManager::onFileChanged(QList<QPair<QByteArray, QByteArray>> &actionList)
+{
+    // lft文件在后台校验期间暂存改动, 待其加入后再按顺序应用, 以免先于日志中的改动或被丢弃
+    if (instance()->loading_count > 0) {
+        _global_pendingActions->append(actionList);
+        return;
+    }
+
+    // 按所属的buf分组, 同一个buf的改动在一次加锁中应用, 连续插入同一目录的文件只需移动一次数据
+    QList<fs_buf*> buf_list;
+    QMap<fs_buf*, QVector<LFTChange>> changes_map;
+
+    QList<QPair<fs_buf*, LFTChange>> change_list;
+
+    for (const QPair<QByteArray, QByteArray> &action : actionList)
+        getLFTChanges(action, change_list);
+
+    for (const QPair<fs_buf*, LFTChange> &change : change_list) {
+        if (!changes_map.contains(change.first))
+            buf_list << change.first;
+        changes_map[change.first].append(change.second);
+    }
+
+    for (fs_buf *buf : buf_list) {
+        const QVector<LFTChange> &changes = changes_map[buf];
+        QVector<fs_op> ops(changes.size());
+        QVector<int> results(changes.size());
+
+        for (int i = 0; i < changes.size(); ++i) {
+            const LFTChange &change = changes.at(i);
+
+            ops[i].op = change.op;
+            ops[i].is_dir = change.is_dir;
+            ops[i].path = change.path.constData();
+            ops[i].dst_path = change.op == FS_OP_RENAME ? change.dst_path.constData() : nullptr;
+        }
+
+        cDebug() << "apply changes:" << changes.size() << ", root:" << get_root_path(buf);
+
+        apply_fs_changes(buf, ops.constData(), ops.size(), results.data());
+
+        bool removed = false;
+        for (int i = 0; i < changes.size(); ++i) {
+            const LFTChange &change = changes.at(i);
+            int r = results.at(i);
+
+            if (r == 0) {
+                removed = removed || change.op == FS_OP_REMOVE;
+                // buf内容已改动，记录到日志
+                uint8_t journal_op = change.op == FS_OP_INSERT ? FS_JOURNAL_INSERT
+                                     : (change.op == FS_OP_REMOVE ? FS_JOURNAL_REMOVE : FS_JOURNAL_RENAME);
+                journalLFTFileChange(buf, journal_op, change.path, change.dst_path, change.is_dir);
+
+                // 扫描到的内容未记录到日志中, 需要重新保存lft文件
+                if (change.rescan) {
+                    const QByteArrayList &excludes = getShardExcludes(QString::fromLocal8Bit(get_root_path(buf)));
+
+                    rescan_fstree_excluding(buf, change.path.constData(), toExcludeArray(excludes).constData());
+                    markLFTFileToDirty(buf);
+                }
+            } else if (r == ERR_NO_MEM) {
+                cWarning() << "Failed(No Memory):" << change.path << change.dst_path;
+            } else if (r == ERR_PATH_EXISTS) {
+                /* 由于事件合并的原因, 会经常导致报告此类错误. 由于它不属于程序问题, 特此降低日志等级 */
+                cDebug() << "Failed(Path Exists):" << change.path;
+            } else if (change.op == FS_OP_INSERT) {
+                cDebug() << "Failed:" << change.path << ", result:" << r;
+            } else {
+                cWarning() << "Failed:" << change.path << change.dst_path << ", result:" << r;
+            }
+        }
+
+        // 删除大目录后归还多余的内存
+        if (removed)
+            trim_fs_buf(buf);
+    }
+}
+
+QStringList LFTManager::insertFileToLFTBuf(const QByteArray &file)
+{
+    if (!checkAuthorization())
+        return QStringList();
+
+    cDebug() << file;
+
+    QStringList root_path_list;
+    QString mount_path;
+    fs_buf *buf = getFsBufOfChange(file, mount_path);
+
+    if (!buf)
+        return root_path_list;
+
+    QFileInfo info(QString::fromLocal8Bit(file.constData()));
+    bool is_dir = info.isDir();
+
     cDebug() << "do insert:" << mount_path;
 
     fs_change change;
     int r = insert_path(buf, mount_path.toLocal8Bit().constData(), is_dir, &change);
 
     if (r == 0) {
-        // buf内容已改动，标记删除对应的lft文件
-        markLFTFileToDirty(buf);
+        // buf内容已改动，记录到日志
+        journalLFTFileChange(buf, FS_JOURNAL_INSERT, mount_path.toLocal8Bit(), QByteArray(), is_dir);
         root_path_list << QString::fromLocal8Bit(get_root_path(buf));
     } else {
         if (r == ERR_NO_MEM) {
@@ -880,30 +1495,13 @@ QStringList LFTManager::removeFileFromLFTBuf(const QByteArray &file)
 
     cDebug() << file;
 
-    auto buff_pair = getFsBufByPath(QString::fromLocal8Bit(file.constData()));
     QStringList root_path_list;
+    QString mount_path;
+    fs_buf *buf = getFsBufOfChange(file, mount_path);
 
-    QString mount_path = buff_pair.first;
-    if (mount_path.isEmpty())
+    if (!buf)
         return root_path_list;
 
-    fs_buf *buf = buff_pair.second;
-    // 有可能索引正在构建
-    if (!buf) {
-        cDebug() << "index buinding";
-
-        // 正在构建索引时需要等待
-        if (QFutureWatcher<fs_buf*> *watcher = _global_fsWatcherMap->value(mount_path)) {
-            cDebug() << "will be wait build finished";
-
-            watcher->waitForFinished();
-            buf = watcher->result();
-        }
-
-        if (!buf)
-            return root_path_list;
-    }
-
     cDebug() << "do remove:" << mount_path;
 
     fs_change changes[10];
@@ -911,8 +1509,9 @@ QStringList LFTManager::removeFileFromLFTBuf(const QByteArray &file)
     int r = remove_path(buf, mount_path.toLocal8Bit().constData(), changes, &count);
 
     if (r == 0) {
-        // buf内容已改动，标记删除对应的lft文件
-        markLFTFileToDirty(buf);
+        // buf内容已改动，记录到日志
+        journalLFTFileChange(buf, FS_JOURNAL_REMOVE, mount_path.toLocal8Bit(), QByteArray(), false);
+        trim_fs_buf(buf);
         root_path_list << QString::fromLocal8Bit(get_root_path(buf));
     } else {
         if (r == ERR_NO_MEM) {
@@ -932,28 +1531,29 @@ QStringList LFTManager::renameFileOfLFTBuf(const QByteArray &oldFile, const QByt
 
     cDebug() << oldFile << newFile;
 
-    auto buff_pair = getFsBufByPath(QString::fromLocal8Bit(newFile.constData()));
     QStringList root_path_list;
+    QString mount_path;
+    fs_buf *buf = getFsBufOfChange(newFile, mount_path);
 
-    QString mount_path = buff_pair.first;
-    if (mount_path.isEmpty())
+    if (!buf)
         return root_path_list;
 
-    fs_buf *buf = buff_pair.second;
-    // 有可能索引正在构建
-    if (!buf) {
-        cDebug() << "index buinding";
+    QString old_mount_path;
+    fs_buf *old_buf = getFsBufOfChange(oldFile, old_mount_path);
 
-        // 正在构建索引时需要等待
-        if (QFutureWatcher<fs_buf*> *watcher = _global_fsWatcherMap->value(mount_path)) {
-            cDebug() << "will be wait build finished";
+    // 跨分片的重命名, 从原来的分片中删除, 插入到新的分片中并扫描目录的内容
+    if (old_buf && old_buf != buf) {
+        removeFileFromLFTBuf(oldFile);
+        root_path_list = insertFileToLFTBuf(newFile);
 
-            watcher->waitForFinished();
-            buf = watcher->result();
+        if (!root_path_list.isEmpty() && QFileInfo(QString::fromLocal8Bit(newFile.constData())).isDir()) {
+            const QByteArrayList &excludes = getShardExcludes(QString::fromLocal8Bit(get_root_path(buf)));
+
+            rescan_fstree_excluding(buf, mount_path.toLocal8Bit().constData(), toExcludeArray(excludes).constData());
+            markLFTFileToDirty(buf);
         }
 
-        if (!buf)
-            return root_path_list;
+        return root_path_list;
     }
 
     fs_change changes[10];
@@ -971,8 +1571,8 @@ QStringList LFTManager::renameFileOfLFTBuf(const QByteArray &oldFile, const QByt
     int r = rename_path(buf, old_file_new_path.constData(), new_file_new_path.constData(), changes, &change_count);
 
     if (r == 0) {
-        // buf内容已改动，标记删除对应的lft文件
-        markLFTFileToDirty(buf);
+        // buf内容已改动，记录到日志
+        journalLFTFileChange(buf, FS_JOURNAL_RENAME, old_file_new_path, new_file_new_path, false);
         root_path_list << QString::fromLocal8Bit(get_root_path(buf));
     } else {
         if (r == ERR_NO_MEM) {
@@ -1096,7 +1696,7 @@ static QStringList removeLFTFiles(const QByteArray &serialUriFilter = QByteArray
 
     const QString &cache_path = LFTManager::cacheDir();
     //只处理自动生成的索引文件
-    QDirIterator dir_iterator(cache_path, {"*.LFT"});
+    QDirIterator dir_iterator(cache_path, {"*.LFT", "*.LFT.journal"});
     QStringList path_list;
 
     while (dir_iterator.hasNext()) {
@@ -1208,7 +1808,30 @@ void LFTManager::_syncAll()
 {
     nDebug() << "Timing synchronization data";
 
-    sync();
+    if (_global_fsBufMap.exists() && QDir::home().mkpath(cacheDir())) {
+        for (fs_buf *buf : fsBufList()) {
+            const QString &lft_file = buf ? _global_fsBufToFileMap->value(buf) : QString();
+
+            if (lft_file.isEmpty())
+                continue;
+
+            fs_journal *journal = _global_fsJournalMap->value(buf);
+
+            // 改动已记录在日志中时只需刷新日志, 日志过大时才重新保存整个lft文件
+            if (journal && !_global_fsBufDirtyList->contains(buf)) {
+                uint32_t journal_size = get_fs_journal_size(journal);
+
+                if (journal_size < JOURNAL_COMPACT_SIZE && journal_size < get_tail(buf) / 4) {
+                    sync_fs_journal(journal);
+                    continue;
+                }
+            }
+
+            if (!saveLFTFile(buf, lft_file))
+                nWarning() << "[LFT] Failed on save:" << get_root_path(buf) << "->" << lft_file;
+        }
+    }
+
     // 清理sync失败的脏文件
     cleanDirtyLFTFiles();
 }
@@ -1398,6 +2021,16 @@ void LFTManager::onMountRemoved(const QString &blockDevicePath, const QByteArray
     const QString &mount_root = QString::fromLocal8Bit(mountPoint.constData());
 //    const QByteArray &serial_uri = LFTDiskTool::pathToSerialUri(mount_root);
 
+    const QString &prefix = mount_root.endsWith('/') ? mount_root : mount_root + '/';
+
+    // 还在后台校验的lft文件
+    for (const QString &path : _global_fsWatcherMap->keys()) {
+        QFutureWatcher<fs_buf*> *watcher = _global_fsWatcherMap->value(path);
+
+        if (watcher && watcher->property("_d_loading").toBool() && (path + '/').startsWith(prefix))
+            cancelBuild(path);
+    }
+
     for (const QString &path : hasLFTSubdirectories(mount_root)) {
         auto index = _global_fsBufMap->find(path);
 
@@ -1443,7 +2076,42 @@ void LFTManager::onFSRemoved(const QString &blockDevicePath)
     }
 }
 
-int LFTManager::_prepareBuf(quint32 *startOffset, quint32 *endOffset, const QString &path, void **buf, QString *newpath) const
+// 之后的改动会同步更新拼音表, 它只需生成一次
+static void preparePinyinTable(fs_buf *buf)
+{
+    if (buf && !has_pinyin_table(buf) && build_pinyin_table(buf) != 0)
+        nWarning() << "[LFT] Failed on build pinyin table of path:" << get_root_path(buf);
+}
+
+quint32 LFTManager::_searchByteCost(const QStringList &rules) const
+{
+    quint32 value = 0;
+
+    if (_getRuleArgs(rules, RULE_SEARCH_PINYIN, value) && value > 0)
+        return PINYIN_BYTE_COST;
+    if (_getRuleArgs(rules, RULE_SEARCH_REGX, value) && value > 0
+            && !(_getRuleArgs(rules, RULE_SEARCH_GLOB, value) && value > 0)
+            && !(_getRuleArgs(rules, RULE_SEARCH_KEYWORDS, value) && value > 0))
+        return REGEX_BYTE_COST;
+
+    return SEARCH_BYTE_COST;
+}
+
+// 在读锁下搜索时, 改动要等待搜索结束; 在快照上搜索时, 快照之后的第一次改动要复制整个buf
+// (连同缺页约为复制开销的2倍). 预计的搜索开销(区间大小乘以每字节开销, 由各线程分担)超过复制时才取快照.
+// 设置了snapshotSearchCost(以复制的字节数计)时以它为阈值, 如设为1则总是在快照上搜索
+static bool needSnapshot(fs_buf *buf, quint32 range, quint32 byte_cost)
+{
+    quint64 cost = quint64(range) * byte_cost / quint64(qMax(QThread::idealThreadCount(), 1));
+    quint64 threshold = _global_settings->value("snapshotSearchCost", 0).toULongLong();
+
+    if (threshold == 0)
+        threshold = 2 * quint64(get_tail(buf));
+
+    return cost > threshold;
+}
+
+int LFTManager::_prepareBuf(quint32 *startOffset, quint32 *endOffset, const QString &path, quint32 byteCost, void **buf, QString *newpath, bool *snapshot) const
 {
     auto buff_pair = getFsBufByPath(path);
 
@@ -1458,8 +2126,10 @@ int LFTManager::_prepareBuf(quint32 *startOffset, quint32 *endOffset, const QStr
     // new_path 为搜索路径在fs_buf中对应的路径
     *newpath = QString(buff_pair.first);
 
-    if (*startOffset == 0 || *endOffset == 0) {
-        // 未指定有效的搜索区间时, 根据路径获取
+    // 未指定有效的搜索区间时, 根据路径获取
+    bool by_path = *startOffset == 0 || *endOffset == 0;
+
+    if (by_path) {
         uint32_t path_offset = 0;
         uint32_t start_off, end_off = 0;
         get_path_range(fs_buf, newpath->toLocal8Bit().constData(), &path_offset, &start_off, &end_off);
@@ -1473,6 +2143,31 @@ int LFTManager::_prepareBuf(quint32 *startOffset, quint32 *endOffset, const QStr
     if (*startOffset == 0)
         return EMPTY_DIR;
 
+    // 开销大的搜索在快照上进行, 搜索期间的文件变化不用等待搜索结束, 也不会改变搜索结果的偏移.
+    // 其余的搜索比复制buf更快结束, 直接在读锁下搜索
+    *snapshot = needSnapshot(fs_buf, *endOffset - *startOffset, byteCost);
+
+    if (*snapshot) {
+        fs_buf = snapshot_fs_buf(fs_buf);
+        if (!fs_buf)
+            return NO_MEMORY;
+
+        // 取得快照之前buf可能已改动
+        if (by_path) {
+            uint32_t path_offset = 0;
+            uint32_t start_off, end_off = 0;
+            get_path_range(fs_buf, newpath->toLocal8Bit().constData(), &path_offset, &start_off, &end_off);
+
+            if (start_off == 0) {
+                free_fs_buf(fs_buf);
+                return EMPTY_DIR;
+            }
+
+            *startOffset = start_off;
+            *endOffset = end_off;
+        }
+    }
+
     *buf = fs_buf;
 
     return SUCCESS;
@@ -1591,6 +2286,38 @@ QStringList LFTManager::_setRulesByDefault(const QStringList &rules, quint32 sta
     return nRules;
 }
 
+// 一段要搜索的区间, base为它在各段依次相接后的偏移量中的起点
+struct SearchSegment
+{
+    fs_buf *buf;
+    quint32 start;
+    quint32 end;
+    quint32 base;
+    // buf为快照, 搜索完后释放
+    bool snapshot;
+};
+
+// path下属于同一分区的分片, 它们不在path所在的buf中
+static QStringList getShardsUnderPath(const QString &path)
+{
+    QStringList shards;
+
+    if (!_global_fsBufMap.exists())
+        return shards;
+
+    const QString &prefix = path.endsWith('/') ? path : path + '/';
+    const QString &mount_point = deepin_anything_server::MountCacher::instance()->findMountPointByPath(path, true);
+
+    for (auto i = _global_fsBufMap->constBegin(); i != _global_fsBufMap->constEnd(); ++i) {
+        if (i.key().size() > prefix.size() && i.key().startsWith(prefix)
+                && deepin_anything_server::MountCacher::instance()->findMountPointByPath(i.key(), true) == mount_point) {
+            shards << i.key();
+        }
+    }
+
+    return shards;
+}
+
 QStringList LFTManager::_enterSearch(const QString &opath, const QString &keyword, const QStringList &rules,
                    quint32 &startOffsetReturn, quint32 &endOffsetReturn) const
 {
@@ -1612,9 +2339,27 @@ QStringList LFTManager::_enterSearch(const QString &opath, const QString &keywor
     path = convertPathIntoMountPoint(mountPoints, path);
     nInfo() << maxCount << startOffset << endOffset << path << keyword << rules;
 
+    // 路径下的分片接在路径所在的buf之后搜索, 偏移量为各段区间依次相接后的位置,
+    // 此时先取得路径在所在buf中的区间
+    const QStringList &shards = getShardsUnderPath(path);
+    quint32 requestStart = startOffset;
+    quint32 requestEnd = endOffset;
+
+    if (!shards.isEmpty())
+        startOffset = endOffset = 0;
+
+    // 拼音表不随lft文件保存, 第一次拼音搜索前才生成, 加载时不必逐个转换文件名
+    quint32 pinyin = 0;
+    bool use_pinyin = _getRuleArgs(rules, RULE_SEARCH_PINYIN, pinyin) && pinyin > 0;
+
+    if (use_pinyin)
+        preparePinyinTable(getFsBufByPath(path).second);
+
     void *buf = nullptr;
     QString newpath;
-    int buf_ok = _prepareBuf(&startOffset, &endOffset, path, &buf, &newpath);
+    bool snapshot = false;
+    quint32 byte_cost = _searchByteCost(rules);
+    int buf_ok = _prepareBuf(&startOffset, &endOffset, path, byte_cost, &buf, &newpath, &snapshot);
     if (buf_ok != 0) {
         if (buf_ok == NOFOUND_INDEX)
             sendErrorReply(QDBusError::InvalidArgs, "Not found the index data");
@@ -1622,29 +2367,88 @@ QStringList LFTManager::_enterSearch(const QString &opath, const QString &keywor
             sendErrorReply(QDBusError::InternalError, "Index is being generated");
         if (buf_ok == EMPTY_DIR) // 说明目录为空
             nDebug() << "Empty directory:" << newpath;
+        if (buf_ok == NO_MEMORY)
+            sendErrorReply(QDBusError::NoMemory, "Failed to take a snapshot of the index data");
         return QStringList();
     }
 
+    QList<SearchSegment> segments;
+    segments << SearchSegment {static_cast<fs_buf*>(buf), startOffset, endOffset, startOffset, snapshot};
+
+    for (const QString &shard : shards) {
+        fs_buf *shard_buf = getFsBufByPath(shard).second;
+        const SearchSegment &last = segments.last();
+        quint64 base = quint64(last.base) + last.end - last.start;
+
+        if (use_pinyin)
+            preparePinyinTable(shard_buf);
+
+        if (!shard_buf)
+            continue;
+
+        bool shard_snapshot = needSnapshot(shard_buf, get_tail(shard_buf) - first_name(shard_buf), byte_cost);
+
+        if (shard_snapshot && (shard_buf = snapshot_fs_buf(shard_buf)) == nullptr)
+            continue;
+
+        // 偏移量只有32位, 放不下的分片不再搜索
+        if (base + get_tail(shard_buf) - first_name(shard_buf) > UINT32_MAX) {
+            nWarning() << "[LFT] Too much data to search in shard:" << shard;
+            if (shard_snapshot)
+                free_fs_buf(shard_buf);
+            break;
+        }
+
+        segments << SearchSegment {shard_buf, first_name(shard_buf), get_tail(shard_buf), quint32(base), shard_snapshot};
+    }
+
+    const SearchSegment &last = segments.last();
+    if (requestStart == 0 || requestEnd == 0 || shards.isEmpty()) {
+        requestStart = startOffset;
+        requestEnd = last.base + (last.end - last.start);
+    }
+
     QStringList list;
-    QList<uint32_t> offset_results;
 
     struct timeval s, e;
     gettimeofday(&s, nullptr);
 
     int total = 0;
-    // get the search result, note the @startOffset and @endOffset both are in and out, which will record the real searching offsets.
-    total += _doSearch(buf, maxCount, path, keyword, &startOffset, &endOffset, offset_results, rules);
+    quint32 limit = maxCount > 0 ? maxCount : DEFAULT_RESULT_COUNT;
+    char tmp_path[PATH_MAX] = {0};
+    bool reset_path = path != newpath;
+
+    for (const SearchSegment &segment : segments) {
+        quint32 segment_end = segment.base + (segment.end - segment.start);
+
+        if (requestStart >= requestEnd || quint32(list.size()) >= limit)
+            break;
+        if (segment_end <= requestStart || segment.base >= requestEnd)
+            continue;
+
+        QList<uint32_t> offset_results;
+        quint32 start = segment.start + (qMax(requestStart, segment.base) - segment.base);
+        quint32 end = segment.start + (qMin(requestEnd, segment_end) - segment.base);
+
+        // get the search result, note the @start and @end both are in and out, which will record the real searching offsets.
+        total += _doSearch(segment.buf, list.isEmpty() ? maxCount : limit - list.size(), path, keyword, &start, &end, offset_results, rules);
 
-    fs_buf *fsbuf = static_cast<fs_buf*>(buf);
-    if (fsbuf) {
-        char tmp_path[PATH_MAX] = {0};
-        bool reset_path = path != newpath;
         // get the full path by the file/dir name, and append to list.
         for(uint32_t offset : offset_results) {
-            const char *name_path = get_path_by_name_off(fsbuf, offset, tmp_path, sizeof(tmp_path));
+            const char *name_path = get_path_by_name_off(segment.buf, offset, tmp_path, sizeof(tmp_path));
             const QString &origin_path = QString::fromLocal8Bit(name_path);
             list.append(reset_path ? path + origin_path.mid(newpath.size()) : origin_path);
         }
+
+        // 此段未搜索完(结果已满或超时), 下次从这里继续
+        requestStart = segment.base + (start - segment.start);
+        if (start < end)
+            break;
+    }
+
+    for (const SearchSegment &segment : segments) {
+        if (segment.snapshot)
+            free_fs_buf(segment.buf);
     }
 
     gettimeofday(&e, nullptr);
@@ -1652,8 +2456,8 @@ QStringList LFTManager::_enterSearch(const QString &opath, const QString &keywor
     // set this log as special start, it may be used to take result from log.
     nInfo() << "anything-GOOD: found " << total << " entries for " << keyword << "in " << dur << " us\n";
 
-    startOffsetReturn = startOffset;
-    endOffsetReturn = endOffset;
+    startOffsetReturn = requestStart;
+    endOffsetReturn = requestEnd;
     return list;
 }
 
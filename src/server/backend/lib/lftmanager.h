@@ -85,6 +85,8 @@ private:
     QMutex cpu_monitor_quit;
     QThread *cpu_monitor_thread;
     QStringList building_paths;
+    // 正在后台校验的lft文件数
+    int loading_count = 0;
     bool _isAutoIndexPartition() const;
 
     void _cpuLimitCheck();
@@ -93,13 +95,16 @@ private:
     void _indexAllDelay();
     void _cleanAllIndex();
     void _addPathByPartition(const DBlockDevice *block);
+    void _buildPath(const QString &path, const QStringList &path_list, bool autoIndex, const QStringList &shards);
+    void _loadPath(void *vbuf, const QString &lft_file, const QStringList &path_list, bool autoIndex);
     void onMountAdded(const QString &blockDevicePath, const QByteArray &mountPoint);
     void onMountRemoved(const QString &blockDevicePath, const QByteArray &mountPoint);
     void onFSAdded(const QString &blockDevicePath);
     void onFSRemoved(const QString &blockDevicePath);
 
     // search related private implementations.
-    int _prepareBuf(quint32 *startOffset, quint32 *endOffset, const QString &path, void **buf, QString *newpath) const;
+    quint32 _searchByteCost(const QStringList &rules) const;
+    int _prepareBuf(quint32 *startOffset, quint32 *endOffset, const QString &path, quint32 byteCost, void **buf, QString *newpath, bool *snapshot) const;
     int _separateSearchArgs(const QStringList &rules, bool *useRegExp, quint32 *startOffset, quint32 *endOffset, qint64 *maxTime, qint64 *maxCount) const;
     bool _getRuleArgs(const QStringList &rules, int searchFlag, quint32 &valueReturn) const;
     bool _getRuleStrings(const QStringList &rules, int searchFlag, QStringList &valuesReturn) const;